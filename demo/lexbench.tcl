@@ -0,0 +1,61 @@
+# measure how fast the compiler reads sources shaped like the system
+# headers: comments, indented macro definitions and declarations, and
+# of sources expanding macros or declaring many identifiers.
+# usage: tclsh lexbench.tcl ?megabytes? ?runs?
+set auto_path [linsert $auto_path 0 ..]
+package require tcc
+
+set mb [expr {[llength $argv] > 0 ? [lindex $argv 0] : 4}]
+set runs [expr {[llength $argv] > 1 ? [lindex $argv 1] : 5}]
+
+# repeat the block returned by the script 'gen' until the source holds
+# 'mb' megabytes
+proc source_of {gen} {
+    set blocks {}
+    set len 0
+    for {set i 0} {$len < $::mb * 1048576} {incr i} {
+        lappend blocks [apply [list i $gen] $i]
+        incr len [string length [lindex $blocks end]]
+    }
+    return [join $blocks ""]
+}
+
+set comments [source_of {
+    return "/*\n * Tcl_GetStringFromObj --\n *\n *\tReturns the string\
+        representation of the object number $i, creating it from the\n *\
+        internal representation if there is none.\n *\n * Results:\n *\tA\
+        pointer to the bytes of the string.\n */\n\n// line comment $i\n"
+}]
+set defines [source_of {
+    return "#define TCL_STUB_MACRO_NUMBER_$i \\\n        \
+        (tclStubsPtr->tcl_GetStringFromObj_$i)\t/* $i */\n#define\
+        WINAPI_FUNCTION_NAME_$i    GetModuleFileNameW_$i\n"
+}]
+set macros [source_of {
+    return "#define ADD_${i}(a, b) ((a) + (b))\n#define MUL_${i}(a, b) ((a) *\
+        ADD_${i}(b, 1))\nint use_$i = MUL_${i}(ADD_${i}($i, 2), ADD_${i}(3, $i));\n"
+}]
+set decls [source_of {
+    return "extern int Tcl_GetStringFromObj_$i (void *objPtr,\n        \
+        int *lengthPtr, const char *nameOfTheArgument);\n"
+}]
+set idents [source_of {
+    return "int id_${i}_a, id_${i}_b, id_${i}_c = sizeof(id_${i}_a);\n"
+}]
+
+foreach name {comments defines decls macros idents} {
+    upvar 0 $name src
+    set best 0
+    for {set run 0} {$run < $runs} {incr run} {
+        tcc $::tcc::dir tcc1
+        set t [clock microseconds]
+        tcc1 compile $src
+        set t [expr {[clock microseconds] - $t}]
+        rename tcc1 {}
+        if {$best == 0 || $t < $best} {
+            set best $t
+        }
+    }
+    puts [format "%-8s %6.1f MB/s" $name \
+              [expr {[string length $src] / 1048576.0 / ($best / 1e6)}]]
+}
@@ -41,10 +41,7 @@ foreach def $defs {
     eval $t define [split $def =]
 }
 puts [time {
-foreach file [glob */*.c] {
-    puts $file
-    $t compile [read [open $file]]
-}
+$t add_files -jobs 4 {*}[glob */*.c]
 $t compile {
    #include "tcl.h"
     int init ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]){
@@ -212,11 +212,11 @@ static inline int get_reg_shift(TCCState *st)
 static int asm_parse_reg(TCCState *st)
 {
     int reg;
-    if (tok != '%')
+    if (st->tok != '%')
         goto error_32;
     next(st);
-    if (tok >= TOK_ASM_eax && tok <= TOK_ASM_edi) {
-        reg = tok - TOK_ASM_eax;
+    if (st->tok >= TOK_ASM_eax && st->tok <= TOK_ASM_edi) {
+        reg = st->tok - TOK_ASM_eax;
         next(st);
         return reg;
     } else {
@@ -233,15 +233,15 @@ static void parse_operand(TCCState *st, Operand *op)
     const char *p;
 
     indir = 0;
-    if (tok == '*') {
+    if (st->tok == '*') {
         next(st);
         indir = OP_INDIR;
     }
 
-    if (tok == '%') {
+    if (st->tok == '%') {
         next(st);
-        if (tok >= TOK_ASM_al && tok <= TOK_ASM_db7) {
-            reg = tok - TOK_ASM_al;
+        if (st->tok >= TOK_ASM_al && st->tok <= TOK_ASM_db7) {
+            reg = st->tok - TOK_ASM_al;
             op->type = 1 << (reg >> 3); /* WARNING: do not change constant order */
             op->reg = reg & 7;
             if ((op->type & OP_REG) && op->reg == TREG_EAX)
@@ -250,21 +250,21 @@ static void parse_operand(TCCState *st, Operand *op)
                 op->type |= OP_CL;
             else if (op->type == OP_REG16 && op->reg == TREG_EDX)
                 op->type |= OP_DX;
-        } else if (tok >= TOK_ASM_dr0 && tok <= TOK_ASM_dr7) {
+        } else if (st->tok >= TOK_ASM_dr0 && st->tok <= TOK_ASM_dr7) {
             op->type = OP_DB;
-            op->reg = tok - TOK_ASM_dr0;
-        } else if (tok >= TOK_ASM_es && tok <= TOK_ASM_gs) {
+            op->reg = st->tok - TOK_ASM_dr0;
+        } else if (st->tok >= TOK_ASM_es && st->tok <= TOK_ASM_gs) {
             op->type = OP_SEG;
-            op->reg = tok - TOK_ASM_es;
-        } else if (tok == TOK_ASM_st) {
+            op->reg = st->tok - TOK_ASM_es;
+        } else if (st->tok == TOK_ASM_st) {
             op->type = OP_ST;
             op->reg = 0;
             next(st);
-            if (tok == '(') {
+            if (st->tok == '(') {
                 next(st);
-                if (tok != TOK_PPNUM)
+                if (st->tok != TOK_PPNUM)
                     goto reg_error;
-                p = tokc.cstr->data;
+                p = st->tokc.cstr->data;
                 reg = p[0] - '0';
                 if ((unsigned)reg >= 8 || p[1] != '\0')
                     goto reg_error;
@@ -281,7 +281,7 @@ static void parse_operand(TCCState *st, Operand *op)
         }
         next(st);
     no_skip: ;
-    } else if (tok == '$') {
+    } else if (st->tok == '$') {
         /* constant value */
         next(st);
         asm_expr(st, &e);
@@ -302,7 +302,7 @@ static void parse_operand(TCCState *st, Operand *op)
         op->reg = -1;
         op->reg2 = -1;
         op->shift = 0;
-        if (tok != '(') {
+        if (st->tok != '(') {
             asm_expr(st, &e);
             op->e.v = e.v;
             op->e.sym = e.sym;
@@ -310,17 +310,17 @@ static void parse_operand(TCCState *st, Operand *op)
             op->e.v = 0;
             op->e.sym = NULL;
         }
-        if (tok == '(') {
+        if (st->tok == '(') {
             next(st);
-            if (tok != ',') {
+            if (st->tok != ',') {
                 op->reg = asm_parse_reg(st );
             }
-            if (tok == ',') {
+            if (st->tok == ',') {
                 next(st);
-                if (tok != ',') {
+                if (st->tok != ',') {
                     op->reg2 = asm_parse_reg(st );
                 } 
-                if (tok == ',') {
+                if (st->tok == ',') {
                     next(st);
                     op->shift = get_reg_shift(st);
                 }
@@ -337,7 +337,7 @@ static void parse_operand(TCCState *st, Operand *op)
 static void gen_expr32(TCCState *st, ExprValue *pe)
 {
     if (pe->sym)
-        greloc(st, cur_text_section, pe->sym, ind, R_386_32);
+        greloc(st, st->cur_text_section, pe->sym, st->ind, R_386_32);
     gen_le32(st, pe->v);
 }
 
@@ -347,20 +347,20 @@ static void gen_disp32(TCCState * st, ExprValue *pe)
     Sym *sym;
     sym = pe->sym;
     if (sym) {
-        if (sym->r == cur_text_section->sh_num) {
+        if (sym->r == st->cur_text_section->sh_num) {
             /* same section: we can output an absolute value. Note
                that the TCC compiler behaves differently here because
                it always outputs a relocation to ease (future) code
                elimination in the linker */
-            gen_le32(st, pe->v + (long)sym->next - ind - 4);
+            gen_le32(st, pe->v + (long)sym->next - st->ind - 4);
         } else {
-            greloc(st, cur_text_section, sym, ind, R_386_PC32);
+            greloc(st, st->cur_text_section, sym, st->ind, R_386_PC32);
             gen_le32(st, pe->v - 4);
         }
     } else {
         /* put an empty PC32 relocation */
-        put_elf_reloc(st, symtab_section, cur_text_section, 
-                      ind, R_386_PC32, 0);
+        put_elf_reloc(st, st->symtab_section, st->cur_text_section, 
+                      st->ind, R_386_PC32, 0);
         gen_le32(st, pe->v - 4);
     }
 }
@@ -431,13 +431,13 @@ static void asm_opcode(TCCState *st, int opcode)
     nb_ops = 0;
     has_seg_prefix = 0;
     for(;;) {
-        if (tok == ';' || tok == TOK_LINEFEED)
+        if (st->tok == ';' || st->tok == TOK_LINEFEED)
             break;
         if (nb_ops >= MAX_OPERANDS) {
             tcc_error(st, "incorrect number of operands");
         }
         parse_operand(st, pop);
-        if (tok == ':') {
+        if (st->tok == ':') {
            if (pop->type != OP_SEG || has_seg_prefix) {
                tcc_error(st, "incorrect prefix");
            }
@@ -451,7 +451,7 @@ static void asm_opcode(TCCState *st, int opcode)
         }
         pop++;
         nb_ops++;
-        if (tok != ',')
+        if (st->tok != ',')
             break;
         next(st);
     }
@@ -611,9 +611,9 @@ static void asm_opcode(TCCState *st, int opcode)
         sym = ops[0].e.sym;
         if (!sym)
             goto no_short_jump;
-        if (sym->r != cur_text_section->sh_num)
+        if (sym->r != st->cur_text_section->sh_num)
             goto no_short_jump;
-        jmp_disp = ops[0].e.v + (long)sym->next - ind - 2;
+        jmp_disp = ops[0].e.v + (long)sym->next - st->ind - 2;
         if (jmp_disp == (int8_t)jmp_disp) {
             /* OK to generate jump */
             is_short_jmp = 1;
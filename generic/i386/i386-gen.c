@@ -19,7 +19,7 @@
  */
 
 /* number of available registers */
-#define NB_REGS             4
+#define NB_REGS             16
 
 /* a register can belong to several classes. The classes must be
    sorted from more general to more precise (see gv2() code which does
@@ -30,25 +30,62 @@
 #define RC_ST0     0x0008 
 #define RC_ECX     0x0010
 #define RC_EDX     0x0020
+#define RC_EBX     0x0040
+#define RC_ESI     0x0080
+#define RC_EDI     0x0100
+#define RC_XMM     0x0200 /* sse2 float register */
 #define RC_IRET    RC_EAX /* function return: integer register */
 #define RC_LRET    RC_EDX /* function return: second integer register */
 #define RC_FRET    RC_ST0 /* function return: float register */
 
-/* pretty names for the registers */
+/* pretty names for the registers. The integer registers use their
+   hardware encoding, so st0 takes the slot of esp */
 enum {
     TREG_EAX = 0,
     TREG_ECX,
     TREG_EDX,
+    TREG_EBX,
     TREG_ST0,
+    TREG_ESI = 6,
+    TREG_EDI,
+    TREG_XMM0,
+    TREG_XMM7 = TREG_XMM0 + 7,
 };
 
 int reg_classes[NB_REGS] = {
     /* eax */ RC_INT | RC_EAX,
     /* ecx */ RC_INT | RC_ECX,
     /* edx */ RC_INT | RC_EDX,
+    /* ebx */ RC_INT | RC_EBX,
     /* st0 */ RC_FLOAT | RC_ST0,
+    /* ebp */ 0,
+    /* esi */ RC_INT | RC_ESI,
+    /* edi */ RC_INT | RC_EDI,
+    /* xmm0 */ RC_XMM,
+    /* xmm1 */ RC_XMM,
+    /* xmm2 */ RC_XMM,
+    /* xmm3 */ RC_XMM,
+    /* xmm4 */ RC_XMM,
+    /* xmm5 */ RC_XMM,
+    /* xmm6 */ RC_XMM,
+    /* xmm7 */ RC_XMM,
 };
 
+/* registers which must be preserved across calls. They are saved by
+   the prolog only if the function allocates them */
+static const uint8_t callee_saved_regs[3] = { TREG_EBX, TREG_ESI, TREG_EDI };
+
+/* register class of the floating point values of type 't'. With the
+   sse2 flag, float and double live in the xmm registers and only long
+   double uses the x87 stack */
+static int float_class(TCCState *st, int t)
+{
+    t &= VT_BTYPE;
+    if (st->sse2 && (t == VT_FLOAT || t == VT_DOUBLE))
+        return RC_XMM;
+    return RC_FLOAT;
+}
+
 /* return registers for function */
 #define REG_IRET TREG_EAX /* single word int return register */
 #define REG_LRET TREG_EDX /* second word return register (for long long) */
@@ -77,6 +114,7 @@ int reg_classes[NB_REGS] = {
 
 /* relocation type for 32 bit data relocation */
 #define R_DATA_32   R_386_32
+#define R_DATA_PTR  R_386_32
 #define R_JMP_SLOT  R_386_JMP_SLOT
 #define R_COPY      R_386_COPY
 
@@ -85,21 +123,17 @@ int reg_classes[NB_REGS] = {
 
 /******************************************************/
 
-static unsigned long func_sub_sp_offset;
-static unsigned long func_bound_offset;
-static int func_ret_sub;
-
 /* XXX: make it faster ? */
 void g(TCCState *st, int c)
 {
     int ind1;
 
-    if (!cur_text_section) return;
-    ind1 = ind + 1;
-    if (ind1 > cur_text_section->data_allocated)
-        section_realloc(st, cur_text_section, ind1);
-    cur_text_section->data[ind] = c;
-    ind = ind1;
+    if (!st->cur_text_section) return;
+    ind1 = st->ind + 1;
+    if (ind1 > st->cur_text_section->data_allocated)
+        section_realloc(st, st->cur_text_section, ind1);
+    st->cur_text_section->data[st->ind] = c;
+    st->ind = ind1;
 }
 
 void o(TCCState *st, unsigned int c)
@@ -119,21 +153,21 @@ void gen_le32(TCCState *st, int c)
 }
 
 /* output a symbol and patch all calls to it */
-void gsym_addr(int t, int a)
+void gsym_addr(TCCState *st, int t, int a)
 {
     int n, *ptr;
-    if (!cur_text_section) return;
+    if (!st->cur_text_section) return;
     while (t) {
-        ptr = (int *)(cur_text_section->data + t);
+        ptr = (int *)(st->cur_text_section->data + t);
         n = *ptr; /* next value */
         *ptr = a - t - 4;
         t = n;
     }
 }
 
-void gsym(int t)
+void gsym(TCCState *st, int t)
 {
-    gsym_addr(t, ind);
+    gsym_addr(st, t, st->ind);
 }
 
 /* psym is used to put an instruction with a data field which is a
@@ -145,14 +179,14 @@ static int oad(TCCState *st, int c, int s)
 {
     int ind1;
 
-    if (!cur_text_section) return 0;
+    if (!st->cur_text_section) return 0;
     o(st, c);
-    ind1 = ind + 4;
-    if (ind1 > cur_text_section->data_allocated)
-        section_realloc(st, cur_text_section, ind1);
-    *(int *)(cur_text_section->data + ind) = s;
-    s = ind;
-    ind = ind1;
+    ind1 = st->ind + 4;
+    if (ind1 > st->cur_text_section->data_allocated)
+        section_realloc(st, st->cur_text_section, ind1);
+    *(int *)(st->cur_text_section->data + st->ind) = s;
+    s = st->ind;
+    st->ind = ind1;
     return s;
 }
 
@@ -160,7 +194,7 @@ static int oad(TCCState *st, int c, int s)
 static void gen_addr32(TCCState *st, int r, Sym *sym, int c)
 {
     if (r & VT_SYM)
-        greloc(st, cur_text_section, sym, ind, R_386_32);
+        greloc(st, st->cur_text_section, sym, st->ind, R_386_32);
     gen_le32(st, c);
 }
 
@@ -188,10 +222,35 @@ static void gen_modrm(TCCState *st, int op_reg, int r, Sym *sym, int c)
 }
 
 
+/* move a float or double between st0 and an xmm register, through
+   the stack */
+static void gen_move_st0(TCCState *st, int r, int v, int t)
+{
+    int pfx, fop;
+
+    pfx = (t & VT_BTYPE) == VT_FLOAT ? 0xf3 : 0xf2;
+    fop = (t & VT_BTYPE) == VT_FLOAT ? 0xd9 : 0xdd;
+    o(st, 0x08ec83); /* sub $8, %esp */
+    if (r == TREG_ST0) {
+        g(st, pfx);
+        o(st, 0x110f); /* movs[sd] v, (%esp) */
+        o(st, 0x2404 + ((v & 7) << 3));
+        g(st, fop);
+        o(st, 0x2404); /* fld[sl] (%esp) */
+    } else {
+        g(st, fop);
+        o(st, 0x241c); /* fstp[sl] (%esp) */
+        g(st, pfx);
+        o(st, 0x100f); /* movs[sd] (%esp), r */
+        o(st, 0x2404 + ((r & 7) << 3));
+    }
+    o(st, 0x08c483); /* add $8, %esp */
+}
+
 /* load 'r' from value 'sv' */
 void load(TCCState *st, int r, SValue *sv)
 {
-    int v, t, ft, fc, fr;
+    int v, t, ft, fc, fr, pop;
     SValue v1;
 
     fr = sv->r;
@@ -200,19 +259,37 @@ void load(TCCState *st, int r, SValue *sv)
 
     v = fr & VT_VALMASK;
     if (fr & VT_LVAL) {
+        pop = 0;
         if (v == VT_LLOCAL) {
             v1.type.t = VT_INT;
             v1.r = VT_LOCAL | VT_LVAL;
             v1.c.ul = fc;
-            load(st, r, &v1);
-            fr = r;
+            if (reg_classes[r] & RC_INT) {
+                load(st, r, &v1);
+                fr = r;
+            } else {
+                /* float register: the address goes in eax, saved
+                   around the load */
+                o(st, 0x50); /* push %eax */
+                load(st, TREG_EAX, &v1);
+                fr = TREG_EAX;
+                pop = 1;
+            }
         }
         if ((ft & VT_BTYPE) == VT_FLOAT) {
-            o(st, 0xd9); /* flds */
-            r = 0;
+            if (r >= TREG_XMM0) {
+                o(st, 0x100ff3); /* movss */
+            } else {
+                o(st, 0xd9); /* flds */
+                r = 0;
+            }
         } else if ((ft & VT_BTYPE) == VT_DOUBLE) {
-            o(st, 0xdd); /* fldl */
-            r = 0;
+            if (r >= TREG_XMM0) {
+                o(st, 0x100ff2); /* movsd */
+            } else {
+                o(st, 0xdd); /* fldl */
+                r = 0;
+            }
         } else if ((ft & VT_BTYPE) == VT_LDOUBLE) {
             o(st, 0xdb); /* fldt */
             r = 5;
@@ -227,28 +304,45 @@ void load(TCCState *st, int r, SValue *sv)
         } else {
             o(st, 0x8b);     /* movl */
         }
-        gen_modrm(st, r, fr, sv->sym, fc);
+        gen_modrm(st, r & 7, fr, sv->sym, fc);
+        if (pop)
+            o(st, 0x58); /* pop %eax */
     } else {
         if (v == VT_CONST) {
             o(st, 0xb8 + r); /* mov $xx, r */
             gen_addr32(st, fr, sv->sym, fc);
         } else if (v == VT_LOCAL) {
+            st->func_addr_taken = 1;
             o(st, 0x8d); /* lea xxx(%ebp), r */
             gen_modrm(st, r, VT_LOCAL, sv->sym, fc);
         } else if (v == VT_CMP) {
             oad(st, 0xb8 + r, 0); /* mov $0, r */
-            o(st, 0x0f); /* setxx %br */
-            o(st, fc);
-            o(st, 0xc0 + r);
+            if (r < 4) {
+                o(st, 0x0f); /* setxx %br */
+                o(st, fc);
+                o(st, 0xc0 + r);
+            } else {
+                /* esi and edi have no byte form */
+                g(st, (fc - 0x20) ^ 1); /* jnxx after */
+                g(st, 0x01);
+                o(st, 0x40 + r); /* inc r */
+            }
         } else if (v == VT_JMP || v == VT_JMPI) {
             t = v & 1;
             oad(st, 0xb8 + r, t); /* mov $1, r */
             o(st, 0x05eb); /* jmp after */
-            gsym(fc);
+            gsym(st, fc);
             oad(st, 0xb8 + r, t ^ 1); /* mov $0, r */
         } else if (v != r) {
-            o(st, 0x89);
-            o(st, 0xc0 + r + v * 8); /* mov v, r */
+            if (r >= TREG_XMM0 && v >= TREG_XMM0) {
+                o(st, 0x280f); /* movaps v, r */
+                o(st, 0xc0 + (v & 7) + (r & 7) * 8);
+            } else if (r >= TREG_XMM0 || v >= TREG_XMM0) {
+                gen_move_st0(st, r, v, ft);
+            } else {
+                o(st, 0x89);
+                o(st, 0xc0 + r + v * 8); /* mov v, r */
+            }
         }
     }
 }
@@ -256,19 +350,29 @@ void load(TCCState *st, int r, SValue *sv)
 /* store register 'r' in lvalue 'v' */
 void store(TCCState *st, int r, SValue *v)
 {
-    int fr, bt, ft, fc;
+    int fr, bt, ft, fc, vr, xr;
 
     ft = v->type.t;
     fc = v->c.ul;
-    fr = v->r & VT_VALMASK;
+    vr = v->r;
+    fr = vr & VT_VALMASK;
     bt = ft & VT_BTYPE;
+    xr = -1;
     /* XXX: incorrect if float reg to reg */
     if (bt == VT_FLOAT) {
-        o(st, 0xd9); /* fsts */
-        r = 2;
+        if (r >= TREG_XMM0) {
+            o(st, 0x110ff3); /* movss */
+        } else {
+            o(st, 0xd9); /* fsts */
+            r = 2;
+        }
     } else if (bt == VT_DOUBLE) {
-        o(st, 0xdd); /* fstpl */
-        r = 2;
+        if (r >= TREG_XMM0) {
+            o(st, 0x110ff2); /* movsd */
+        } else {
+            o(st, 0xdd); /* fstpl */
+            r = 2;
+        }
     } else if (bt == VT_LDOUBLE) {
         o(st, 0xc0d9); /* fld %st(0) */
         o(st, 0xdb); /* fstpt */
@@ -276,17 +380,33 @@ void store(TCCState *st, int r, SValue *v)
     } else {
         if (bt == VT_SHORT)
             o(st, 0x66);
-        if (bt == VT_BYTE || bt == VT_BOOL)
+        if (bt == VT_BYTE || bt == VT_BOOL) {
+            if (r >= 4 &&
+                (fr == VT_CONST || fr == VT_LOCAL || (vr & VT_LVAL))) {
+                /* esi and edi have no byte form: exchange the value
+                   with a byte register not used by the address */
+                xr = r;
+                r = (fr == TREG_EAX) ? TREG_ECX : TREG_EAX;
+                o(st, 0x87); /* xchg xr, r */
+                o(st, 0xc0 + r + xr * 8);
+                if (fr == xr)
+                    vr = (vr & ~VT_VALMASK) | r;
+            }
             o(st, 0x88);
-        else
+        } else {
             o(st, 0x89);
+        }
     }
     if (fr == VT_CONST ||
         fr == VT_LOCAL ||
-        (v->r & VT_LVAL)) {
-        gen_modrm(st, r, v->r, v->sym, fc);
+        (vr & VT_LVAL)) {
+        gen_modrm(st, r & 7, vr, v->sym, fc);
     } else if (fr != r) {
-        o(st, 0xc0 + fr + r * 8); /* mov r, fr */
+        o(st, 0xc0 + (fr & 7) + (r & 7) * 8); /* mov r, fr */
+    }
+    if (xr >= 0) {
+        o(st, 0x87); /* xchg xr, r */
+        o(st, 0xc0 + r + xr * 8);
     }
 }
 
@@ -304,18 +424,18 @@ static void gadd_sp(TCCState *st, int val)
 static void gcall_or_jmp(TCCState *st, int is_jmp)
 {
     int r;
-    if ((vtop->r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
+    if ((st->vtop->r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
         /* constant case */
-        if (vtop->r & VT_SYM) {
+        if (st->vtop->r & VT_SYM) {
             /* relocation case */
-            greloc(st, cur_text_section, vtop->sym, 
-                   ind + 1, R_386_PC32);
+            greloc(st, st->cur_text_section, st->vtop->sym, 
+                   st->ind + 1, R_386_PC32);
         } else {
             /* put an empty PC32 relocation */
-            put_elf_reloc(st, symtab_section, cur_text_section, 
-                          ind + 1, R_386_PC32, 0);
+            put_elf_reloc(st, st->symtab_section, st->cur_text_section, 
+                          st->ind + 1, R_386_PC32, 0);
         }
-        oad(st, 0xe8 + is_jmp, vtop->c.ul - 4); /* call/jmp im */
+        oad(st, 0xe8 + is_jmp, st->vtop->c.ul - 4); /* call/jmp im */
     } else {
         /* otherwise, indirect call */
         r = gv(st, RC_INT);
@@ -327,18 +447,16 @@ static void gcall_or_jmp(TCCState *st, int is_jmp)
 static uint8_t fastcall_regs[3] = { TREG_EAX, TREG_EDX, TREG_ECX };
 static uint8_t fastcallw_regs[2] = { TREG_ECX, TREG_EDX };
 
-/* Generate function call. The function address is pushed first, then
-   all the parameters in call order. This functions pops all the
-   parameters and the function address. */
-void gfunc_call(TCCState *st, int nb_args)
+/* push the 'nb_args' parameters on top of the value stack and pop
+   them. Return their size on the stack. */
+static int gfunc_push_args(TCCState *st, int nb_args)
 {
-    int size, align, r, args_size, i, func_call;
-    Sym *func_sym;
-    
+    int size, align, r, rc, args_size, i;
+
     args_size = 0;
     for(i = 0;i < nb_args; i++) {
-        if ((vtop->type.t & VT_BTYPE) == VT_STRUCT) {
-            size = type_size(st, &vtop->type, &align);
+        if ((st->vtop->type.t & VT_BTYPE) == VT_STRUCT) {
+            size = type_size(st, &st->vtop->type, &align);
             /* align to stack align size */
             size = (size + 3) & ~3;
             /* allocate the necessary size on stack */
@@ -347,43 +465,65 @@ void gfunc_call(TCCState *st, int nb_args)
             r = get_reg(st, RC_INT);
             o(st, 0x89); /* mov %esp, r */
             o(st, 0xe0 + r);
-            vset(st, &vtop->type, r | VT_LVAL, 0);
+            vset(st, &st->vtop->type, r | VT_LVAL, 0);
             vswap(st);
             vstore(st);
             args_size += size;
-        } else if (is_float(st, vtop->type.t)) {
-            gv(st, RC_FLOAT); /* only one float register */
-            if ((vtop->type.t & VT_BTYPE) == VT_FLOAT)
+        } else if (is_float(st, st->vtop->type.t)) {
+            /* a value already in st0 is stored from there */
+            rc = float_class(st, st->vtop->type.t);
+            if ((st->vtop->r & (VT_VALMASK | VT_LVAL)) == TREG_ST0)
+                rc = RC_ST0;
+            r = gv(st, rc);
+            if ((st->vtop->type.t & VT_BTYPE) == VT_FLOAT)
                 size = 4;
-            else if ((vtop->type.t & VT_BTYPE) == VT_DOUBLE)
+            else if ((st->vtop->type.t & VT_BTYPE) == VT_DOUBLE)
                 size = 8;
             else
                 size = 12;
             oad(st, 0xec81, size); /* sub $xxx, %esp */
-            if (size == 12)
-                o(st, 0x7cdb);
-            else
-                o(st, 0x5cd9 + size - 4); /* fstp[s|l] 0(%esp) */
-            g(st, 0x24);
-            g(st, 0x00);
+            if (r >= TREG_XMM0) {
+                g(st, size == 4 ? 0xf3 : 0xf2);
+                o(st, 0x110f); /* movs[sd] r, (%esp) */
+                o(st, 0x2404 + ((r & 7) << 3));
+            } else {
+                if (size == 12)
+                    o(st, 0x7cdb);
+                else
+                    o(st, 0x5cd9 + size - 4); /* fstp[s|l] 0(%esp) */
+                g(st, 0x24);
+                g(st, 0x00);
+            }
             args_size += size;
         } else {
             /* simple type (currently always same size) */
             /* XXX: implicit cast ? */
             r = gv(st, RC_INT);
-            if ((vtop->type.t & VT_BTYPE) == VT_LLONG) {
+            if ((st->vtop->type.t & VT_BTYPE) == VT_LLONG) {
                 size = 8;
-                o(st, 0x50 + vtop->r2); /* push r */
+                o(st, 0x50 + st->vtop->r2); /* push r */
             } else {
                 size = 4;
             }
             o(st, 0x50 + r); /* push r */
             args_size += size;
         }
-        vtop--;
+        st->vtop--;
     }
+    return args_size;
+}
+
+/* Generate function call. The function address is pushed first, then
+   all the parameters in call order. This functions pops all the
+   parameters and the function address. */
+void gfunc_call(TCCState *st, int nb_args)
+{
+    int args_size, i, func_call;
+    Sym *func_sym;
+
+    args_size = gfunc_push_args(st, nb_args);
     save_regs(st, 0); /* save used temporary registers */
-    func_sym = vtop->type.ref;
+    func_sym = st->vtop->type.ref;
     func_call = func_sym->r;
     /* fast call case */
     if ((func_call >= FUNC_FASTCALL1 && func_call <= FUNC_FASTCALL3) ||
@@ -408,10 +548,72 @@ void gfunc_call(TCCState *st, int nb_args)
     gcall_or_jmp(st, 0);
     if (args_size && func_sym->r != FUNC_STDCALL)
         gadd_sp(st, args_size);
-    vtop--;
+    st->vtop--;
 }
 
-#define FUNC_PROLOG_SIZE 9
+/* room left for the register restores of a tail call */
+#define TAIL_RESTORE_SIZE 18
+
+/* Generate a function call in tail position as a jump: the parameters
+   replace those of the current function and its frame is released
+   first. Return 0 without generating any code if they do not fit in
+   the place of the parameters of the current function. */
+int gfunc_tail_call(TCCState *st, int nb_args)
+{
+    int size, align, args_size, i, bt;
+    Sym *func_sym;
+    TailCall *t;
+
+    func_sym = st->vtop[-nb_args].type.ref;
+    args_size = 0;
+    for(i = 0; i < nb_args; i++) {
+        bt = st->vtop[-i].type.t & VT_BTYPE;
+        if (bt == VT_STRUCT)
+            size = (type_size(st, &st->vtop[-i].type, &align) + 3) & ~3;
+        else if (bt == VT_LDOUBLE)
+            size = 12;
+        else if (bt == VT_DOUBLE || bt == VT_LLONG)
+            size = 8;
+        else
+            size = 4;
+        args_size += size;
+    }
+    if (func_sym->r == FUNC_STDCALL) {
+        if (args_size != st->func_ret_sub)
+            return 0;
+    } else if (func_sym->r != FUNC_CDECL || st->func_ret_sub ||
+               args_size > st->func_args_size) {
+        return 0;
+    }
+
+    gfunc_push_args(st, nb_args);
+    save_regs(st, 0);
+    /* the function pointer may be a parameter */
+    if ((st->vtop->r & (VT_VALMASK | VT_LVAL)) != VT_CONST)
+        gv(st, RC_ECX);
+    if ((st->nb_func_tail_calls & (st->nb_func_tail_calls - 1)) == 0)
+        st->func_tail_calls = arena_realloc(st, st->func_tail_calls,
+                                            st->nb_func_tail_calls * sizeof(TailCall),
+                                            (st->nb_func_tail_calls ? st->nb_func_tail_calls * 2 : 1) *
+                                            sizeof(TailCall));
+    t = &st->func_tail_calls[st->nb_func_tail_calls++];
+    t->start = st->ind;
+    for(i = 0; i < args_size; i += 4) {
+        o(st, 0x8f); /* pop xxx(%ebp) */
+        gen_modrm(st, 0, VT_LOCAL, NULL, 8 + i);
+    }
+    /* the callee saved registers used are only known by the epilog */
+    t->restore = st->ind;
+    for(i = 0; i < TAIL_RESTORE_SIZE; i++)
+        g(st, 0x90); /* nop */
+    o(st, 0xc9); /* leave */
+    t->jump = st->ind;
+    gcall_or_jmp(st, 1);
+    st->vtop--;
+    return 1;
+}
+
+#define FUNC_PROLOG_SIZE 12
 
 /* generate function prolog of type 't' */
 void gfunc_prolog(TCCState *st, CType *func_type)
@@ -425,7 +627,7 @@ void gfunc_prolog(TCCState *st, CType *func_type)
     sym = func_type->ref;
     func_call = sym->r;
     addr = 8;
-    loc = 0;
+    st->loc = 0;
     if (func_call >= FUNC_FASTCALL1 && func_call <= FUNC_FASTCALL3) {
         fastcall_nb_regs = func_call - FUNC_FASTCALL1 + 1;
         fastcall_regs_ptr = fastcall_regs;
@@ -438,14 +640,15 @@ void gfunc_prolog(TCCState *st, CType *func_type)
     }
     param_index = 0;
 
-    ind += FUNC_PROLOG_SIZE;
-    func_sub_sp_offset = ind;
+    st->ind += FUNC_PROLOG_SIZE;
+    st->func_sub_sp_offset = st->ind;
     /* if the function returns a structure, then add an
        implicit pointer parameter */
-    func_vt = sym->type;
-    if ((func_vt.t & VT_BTYPE) == VT_STRUCT) {
+    st->func_vt = sym->type;
+    if ((st->func_vt.t & VT_BTYPE) == VT_STRUCT) {
         /* XXX: fastcall case ? */
-        func_vc = addr;
+        st->func_vc = addr;
+        func_local(st, addr, 4, &st->int_type);
         addr += 4;
         param_index++;
     }
@@ -462,87 +665,151 @@ void gfunc_prolog(TCCState *st, CType *func_type)
 #endif
         if (param_index < fastcall_nb_regs) {
             /* save FASTCALL register */
-            loc -= 4;
+            st->loc -= 4;
             o(st, 0x89);     /* movl */
-            gen_modrm(st,fastcall_regs_ptr[param_index], VT_LOCAL, NULL, loc);
-            param_addr = loc;
+            gen_modrm(st,fastcall_regs_ptr[param_index], VT_LOCAL, NULL, st->loc);
+            param_addr = st->loc;
         } else {
             param_addr = addr;
             addr += size;
         }
+        func_local(st, param_addr, size, type);
         sym_push(st, sym->v & ~SYM_FIELD, type,
                  VT_LOCAL | VT_LVAL, param_addr);
         param_index++;
     }
-    func_ret_sub = 0;
+    st->func_ret_sub = 0;
     /* pascal type call ? */
     if (func_call == FUNC_STDCALL)
-        func_ret_sub = addr - 8;
+        st->func_ret_sub = addr - 8;
+    st->func_args_size = addr - 8;
+    st->func_tail_calls = NULL;
+    st->nb_func_tail_calls = 0;
 
     /* leave some room for bound checking code */
-    if (do_bounds_check) {
+    if (st->do_bounds_check) {
         oad(st, 0xb8, 0); /* lbound section pointer */
         oad(st, 0xb8, 0); /* call to function */
-        func_bound_offset = lbounds_section->data_offset;
+        st->func_bound_offset = st->lbounds_section->data_offset;
+    }
+}
+
+/* restore the callee saved registers pushed below the 'v' bytes of
+   locals */
+static void gfunc_restore_regs(TCCState *st, int v)
+{
+    int i, r, n;
+
+    n = 0;
+    for(i = 0; i < 3; i++) {
+        r = callee_saved_regs[i];
+        if (st->func_regs_used & (1 << r)) {
+            n += 4;
+            o(st, 0x8b); /* movl */
+            gen_modrm(st, r, VT_LOCAL, NULL, -v - n);
+        }
+    }
+}
+
+/* finish the tail call 't' once the function is compiled: restore the
+   callee saved registers before its jump, or call the function instead
+   if the frame may still be in use. The value it returns then goes to
+   the epilog through the code of the 'return' after the jump. */
+static void gtail_call_end(TCCState *st, TailCall *t, int v)
+{
+    int saved_ind;
+    unsigned char *p;
+
+    saved_ind = st->ind;
+    if (st->func_addr_taken) {
+        st->ind = t->start;
+        oad(st, 0xe9, t->jump - t->start - 5); /* jmp to the call */
+        p = st->cur_text_section->data + t->jump;
+        if (*p == 0xe9)
+            *p = 0xe8; /* call im */
+        else
+            p[1] ^= 0x30; /* call *r */
+    } else {
+        st->ind = t->restore;
+        gfunc_restore_regs(st, v);
     }
+    st->ind = saved_ind;
 }
 
 /* generate function epilog */
 void gfunc_epilog(TCCState *st)
 {
-    int v, saved_ind;
+    int v, saved_ind, i, r;
 
 #if 0
-    if (do_bounds_check && func_bound_offset != lbounds_section->data_offset) {
+    if (st->do_bounds_check && st->func_bound_offset != st->lbounds_section->data_offset) {
         int saved_ind;
         int *bounds_ptr;
         Sym *sym, *sym_data;
         /* add end of table info */
-        bounds_ptr = section_ptr_add(st,lbounds_section, sizeof(int));
+        bounds_ptr = section_ptr_add(st,st->lbounds_section, sizeof(int));
         *bounds_ptr = 0;
         /* generate bound local allocation */
-        saved_ind = ind;
-        ind = func_sub_sp_offset;
-        sym_data = get_sym_ref(st,&char_pointer_type, lbounds_section, 
-                               func_bound_offset, lbounds_section->data_offset);
-        greloc(st, cur_text_section, sym_data,
-               ind + 1, R_386_32);
+        saved_ind = st->ind;
+        st->ind = st->func_sub_sp_offset;
+        sym_data = get_sym_ref(st,&st->char_pointer_type, st->lbounds_section, 
+                               st->func_bound_offset, st->lbounds_section->data_offset);
+        greloc(st, st->cur_text_section, sym_data,
+               st->ind + 1, R_386_32);
         oad(st, 0xb8, 0); /* mov %eax, xxx */
-        sym = external_global_sym(st, TOK___bound_local_new, &func_old_type, 0);
-        greloc(st, cur_text_section, sym, 
-               ind + 1, R_386_PC32);
+        sym = external_global_sym(st, TOK___bound_local_new, &st->func_old_type, 0);
+        greloc(st, st->cur_text_section, sym, 
+               st->ind + 1, R_386_PC32);
         oad(st, 0xe8, -4);
-        ind = saved_ind;
+        st->ind = saved_ind;
         /* generate bound check local freeing */
         o(st, 0x5250); /* save returned value, if any */
-        greloc(st, cur_text_section, sym_data,
-               ind + 1, R_386_32);
+        greloc(st, st->cur_text_section, sym_data,
+               st->ind + 1, R_386_32);
         oad(st, 0xb8, 0); /* mov %eax, xxx */
-        sym = external_global_sym(st, TOK___bound_local_delete, &func_old_type, 0);
+        sym = external_global_sym(st, TOK___bound_local_delete, &st->func_old_type, 0);
         greloc(st, ur_text_section, sym, 
-               ind + 1, R_386_PC32);
+               st->ind + 1, R_386_PC32);
         oad(st, 0xe8, -4);
         o(st, 0x585a); /* restore returned value, if any */
     }
 #endif
+    /* keep the most used locals in the free callee saved registers */
+    if (st->optimize >= 2)
+        gen_promote(st);
+    /* align local size to word & save local variables */
+    v = (-st->loc + 3) & -4; 
+    for(i = 0; i < st->nb_func_tail_calls; i++)
+        gtail_call_end(st, &st->func_tail_calls[i], v);
+    gfunc_restore_regs(st, v);
     o(st, 0xc9); /* leave */
-    if (func_ret_sub == 0) {
+    if (st->func_ret_sub == 0) {
         o(st, 0xc3); /* ret */
     } else {
         o(st, 0xc2); /* ret n */
-        g(st, func_ret_sub);
-        g(st, func_ret_sub >> 8);
+        g(st, st->func_ret_sub);
+        g(st, st->func_ret_sub >> 8);
+    }
+    saved_ind = st->ind;
+    st->ind = st->func_sub_sp_offset - FUNC_PROLOG_SIZE;
+    /* the prolog is 9 bytes and a push per saved register: the function
+       starts after the bytes it does not use, unless the line numbers
+       were given relative to its start */
+    if (!st->do_debug) {
+        r = 9;
+        for(i = 0; i < 3; i++) {
+            if (st->func_regs_used & (1 << callee_saved_regs[i]))
+                r++;
+        }
+        while (st->ind < st->func_sub_sp_offset - r)
+            g(st, 0x90); /* nop, never run */
+        st->func_ind = st->ind;
     }
-    /* align local size to word & save local variables */
-    
-    v = (-loc + 3) & -4; 
-    saved_ind = ind;
-    ind = func_sub_sp_offset - FUNC_PROLOG_SIZE;
 #ifdef TCC_TARGET_PE
     if (v >= 4096) {
-        Sym *sym = external_global_sym(st, TOK___chkstk, &func_old_type, 0);
+        Sym *sym = external_global_sym(st, TOK___chkstk, &st->func_old_type, 0);
         oad(st, 0xe8, -4); /* call __chkstk, (does the stackframe too) */
-        greloc(st, cur_text_section, sym, ind-4, R_386_PC32);
+        greloc(st, st->cur_text_section, sym, st->ind-4, R_386_PC32);
     } else
 #endif
     {
@@ -550,7 +817,17 @@ void gfunc_epilog(TCCState *st)
         o(st, 0xec81);  /* sub esp, stacksize */
     }
     gen_le32(st, v);
-    ind = saved_ind;
+    for(i = 0; i < 3; i++) {
+        r = callee_saved_regs[i];
+        if (st->func_regs_used & (1 << r))
+            o(st, 0x50 + r); /* push r */
+    }
+    /* adjust to FUNC_PROLOG_SIZE */
+    while (st->ind < st->func_sub_sp_offset)
+        g(st, 0x90); /* nop */
+    st->ind = saved_ind;
+    if (st->optimize)
+        gen_peephole(st);
 }
 
 /* generate a jump to a label */
@@ -563,12 +840,12 @@ int gjmp(TCCState *st, int t)
 void gjmp_addr(TCCState *st, int a)
 {
     int r;
-    r = a - ind - 2;
+    r = a - st->ind - 2;
     if (r == (char)r) {
         g(st, 0xeb);
         g(st, r);
     } else {
-        oad(st, 0xe9, a - ind - 5);
+        oad(st, 0xe9, a - st->ind - 5);
     }
 }
 
@@ -577,33 +854,33 @@ int gtst(TCCState *st, int inv, int t)
 {
     int v, *p;
 
-    v = vtop->r & VT_VALMASK;
+    v = st->vtop->r & VT_VALMASK;
     if (v == VT_CMP) {
         /* fast case : can jump directly since flags are set */
         g(st, 0x0f);
-        t = psym(st, (vtop->c.i - 16) ^ inv, t);
+        t = psym(st, (st->vtop->c.i - 16) ^ inv, t);
     } else if (v == VT_JMP || v == VT_JMPI) {
         /* && or || optimization */
         if ((v & 1) == inv) {
             /* insert vtop->c jump list in t */
-            p = &vtop->c.i;
+            p = &st->vtop->c.i;
             while (*p != 0)
-                p = (int *)(cur_text_section->data + *p);
+                p = (int *)(st->cur_text_section->data + *p);
             *p = t;
-            t = vtop->c.i;
+            t = st->vtop->c.i;
         } else {
             t = gjmp(st, t);
-            gsym(vtop->c.i);
+            gsym(st, st->vtop->c.i);
         }
     } else {
-        if (is_float(st, vtop->type.t) || is_llong(st, vtop->type.t)) {
+        if (is_float(st, st->vtop->type.t) || is_llong(st, st->vtop->type.t)) {
             /* compare != 0 to get a 32-bit int for testing */
             vpushi(st, 0);
             gen_op(st, TOK_NE);
         }
-        if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+        if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
             /* constant jmp optimization */
-            if ((vtop->c.i != 0) != inv) 
+            if ((st->vtop->c.i != 0) != inv) 
                 t = gjmp(st,t);
         } else {
             v = gv(st, RC_INT);
@@ -613,10 +890,75 @@ int gtst(TCCState *st, int inv, int t)
             t = psym(st, 0x85 ^ inv, t);
         }
     }
-    vtop--;
+    st->vtop--;
     return t;
 }
 
+/* generate the division or modulo of vtop[-1] by the constant on top
+   of the stack as a multiplication by its magic number. Return 0 if
+   it must be done by div or idiv. */
+static int gen_divc(TCCState *st, int op)
+{
+    unsigned int d, m;
+    int s, k, is_signed, is_mod;
+
+    d = st->vtop->c.i;
+    is_signed = op != TOK_UDIV && op != TOK_UMOD;
+    is_mod = op == '%' || op == TOK_UMOD;
+    k = div_magic(d, is_signed, &m, &s);
+    if (!k)
+        return 0;
+    st->vtop--;
+    gv(st, RC_EAX);
+    save_reg(st, TREG_EDX);
+    /* the dividend is kept in %ecx if needed again */
+    if (is_mod || k == 2 || (is_signed && ((int)m ^ (int)d) < 0)) {
+        save_reg(st, TREG_ECX);
+        o(st, 0xc189); /* mov %eax, %ecx */
+    }
+    o(st, 0xba); /* mov $m, %edx */
+    gen_le32(st, m);
+    if (is_signed) {
+        o(st, 0xeaf7); /* imul %edx */
+        if (((int)m ^ (int)d) < 0)
+            o(st, (int)d < 0 ? 0xca29 : 0xca01); /* sub/add %ecx, %edx */
+        if (s) {
+            o(st, 0xfac1); /* sar $s, %edx */
+            g(st, s);
+        }
+        o(st, 0xd089); /* mov %edx, %eax */
+        o(st, 0x1fe8c1); /* shr $31, %eax */
+        o(st, 0xc201); /* add %eax, %edx */
+    } else {
+        o(st, 0xe2f7); /* mul %edx */
+        if (k == 2) {
+            o(st, 0xc889); /* mov %ecx, %eax */
+            o(st, 0xd029); /* sub %edx, %eax */
+            o(st, 0xe8d1); /* shr %eax */
+            o(st, 0xc201); /* add %eax, %edx */
+            s--;
+        }
+        if (s) {
+            o(st, 0xeac1); /* shr $s, %edx */
+            g(st, s);
+        }
+    }
+    if (is_mod) {
+        if (d == (char)d) {
+            o(st, 0xd26b); /* imul $d, %edx, %edx */
+            g(st, d);
+        } else {
+            o(st, 0xd269);
+            gen_le32(st, d);
+        }
+        o(st, 0xd129); /* sub %edx, %ecx */
+        st->vtop->r = TREG_ECX;
+    } else {
+        st->vtop->r = TREG_EDX;
+    }
+    return 1;
+}
+
 /* generate an integer binary operation */
 void gen_opi(TCCState *st, int op)
 {
@@ -627,12 +969,12 @@ void gen_opi(TCCState *st, int op)
     case TOK_ADDC1: /* add with carry generation */
         opc = 0;
     gen_op8:
-        if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+        if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
             /* constant case */
             vswap(st);
             r = gv(st, RC_INT);
             vswap(st);
-            c = vtop->c.i;
+            c = st->vtop->c.i;
             if (c == (char)c) {
                 /* XXX: generate inc and dec for smaller code ? */
                 o(st, 0x83);
@@ -644,15 +986,15 @@ void gen_opi(TCCState *st, int op)
             }
         } else {
             gv2(st, RC_INT, RC_INT);
-            r = vtop[-1].r;
-            fr = vtop[0].r;
+            r = st->vtop[-1].r;
+            fr = st->vtop[0].r;
             o(st, (opc << 3) | 0x01);
             o(st, 0xc0 + r + fr * 8); 
         }
-        vtop--;
+        st->vtop--;
         if (op >= TOK_ULT && op <= TOK_GT) {
-            vtop->r = VT_CMP;
-            vtop->c.i = op;
+            st->vtop->r = VT_CMP;
+            st->vtop->c.i = op;
         }
         break;
     case '-':
@@ -676,9 +1018,9 @@ void gen_opi(TCCState *st, int op)
         goto gen_op8;
     case '*':
         gv2(st, RC_INT, RC_INT);
-        r = vtop[-1].r;
-        fr = vtop[0].r;
-        vtop--;
+        r = st->vtop[-1].r;
+        fr = st->vtop[0].r;
+        st->vtop--;
         o(st, 0xaf0f); /* imul fr, r */
         o(st, 0xc0 + fr + r * 8);
         break;
@@ -692,23 +1034,23 @@ void gen_opi(TCCState *st, int op)
         opc = 7;
     gen_shift:
         opc = 0xc0 | (opc << 3);
-        if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+        if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
             /* constant case */
             vswap(st);
             r = gv(st, RC_INT);
             vswap(st);
-            c = vtop->c.i & 0x1f;
+            c = st->vtop->c.i & 0x1f;
             o(st, 0xc1); /* shl/shr/sar $xxx, r */
             o(st, opc | r);
             g(st, c);
         } else {
             /* we generate the shift in ecx */
             gv2(st, RC_INT, RC_ECX);
-            r = vtop[-1].r;
+            r = st->vtop[-1].r;
             o(st, 0xd3); /* shl/shr/sar %cl, r */
             o(st, opc | r);
         }
-        vtop--;
+        st->vtop--;
         break;
     case '/':
     case TOK_UDIV:
@@ -716,17 +1058,26 @@ void gen_opi(TCCState *st, int op)
     case '%':
     case TOK_UMOD:
     case TOK_UMULL:
+        if (op != TOK_UMULL &&
+            (st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST &&
+            gen_divc(st, op))
+            break;
         /* first operand must be in eax */
         /* XXX: need better constraint for second operand */
         gv2(st, RC_EAX, RC_ECX);
-        r = vtop[-1].r;
-        fr = vtop[0].r;
-        vtop--;
+        r = st->vtop[-1].r;
+        fr = st->vtop[0].r;
+        /* other values of the stack may still be in eax, like the low
+           word of a long long multiply, or in edx: save them */
+        st->vtop -= 2;
+        save_reg(st, TREG_EAX);
         save_reg(st, TREG_EDX);
+        st->vtop += 2;
+        st->vtop--;
         if (op == TOK_UMULL) {
             o(st, 0xf7); /* mul fr */
             o(st, 0xe0 + fr);
-            vtop->r2 = TREG_EDX;
+            st->vtop->r2 = TREG_EDX;
             r = TREG_EAX;
         } else {
             if (op == TOK_UDIV || op == TOK_UMOD) {
@@ -741,7 +1092,7 @@ void gen_opi(TCCState *st, int op)
             else
                 r = TREG_EAX;
         }
-        vtop->r = r;
+        st->vtop->r = r;
         break;
     default:
         opc = 7;
@@ -749,6 +1100,86 @@ void gen_opi(TCCState *st, int op)
     }
 }
 
+/* sse2 version of gen_opf() for float and double */
+static void gen_opf_sse2(TCCState *st, int op)
+{
+    int a, r, fr, ir, pfx, bt;
+
+    bt = st->vtop->type.t & VT_BTYPE;
+    pfx = bt == VT_FLOAT ? 0xf3 : 0xf2;
+    if (op >= TOK_ULT && op <= TOK_GT) {
+        gv2(st, RC_XMM, RC_XMM);
+        r = st->vtop[-1].r;
+        fr = st->vtop[0].r;
+        if (op == TOK_EQ || op == TOK_NE) {
+            /* cmpeq/cmpneq give a mask which is false when unordered
+               for TOK_EQ and true for TOK_NE */
+            g(st, pfx);
+            o(st, 0xc20f); /* cmps[sd] $xx, fr, r */
+            o(st, 0xc0 + (fr & 7) + (r & 7) * 8);
+            g(st, op == TOK_EQ ? 0 : 4);
+            ir = get_reg(st, RC_INT);
+            o(st, 0x7e0f66); /* movd r, ir */
+            o(st, 0xc0 + ir + (r & 7) * 8);
+            o(st, 0x85); /* test ir, ir */
+            o(st, 0xc0 + ir * 9);
+            op = TOK_NE;
+        } else {
+            /* 'above' conditions are false when unordered */
+            if (op == TOK_LT || op == TOK_LE) {
+                a = r;
+                r = fr;
+                fr = a;
+            }
+            if (bt == VT_DOUBLE)
+                g(st, 0x66);
+            o(st, 0x2e0f); /* ucomis[sd] fr, r */
+            o(st, 0xc0 + (fr & 7) + (r & 7) * 8);
+            if (op == TOK_LT || op == TOK_GT)
+                op = TOK_UGT;
+            else
+                op = TOK_UGE;
+        }
+        st->vtop--;
+        st->vtop->r = VT_CMP;
+        st->vtop->c.i = op;
+    } else {
+        switch(op) {
+        default:
+        case '+':
+            a = 0x58;
+            break;
+        case '-':
+            a = 0x5c;
+            break;
+        case '*':
+            a = 0x59;
+            break;
+        case '/':
+            a = 0x5e;
+            break;
+        }
+        if ((st->vtop->r & VT_LVAL) &&
+            (st->vtop->r & VT_VALMASK) != VT_LLOCAL) {
+            /* second operand from memory */
+            vswap(st);
+            r = gv(st, RC_XMM);
+            vswap(st);
+            g(st, pfx);
+            o(st, 0x0f | (a << 8)); /* adds[sd] mem, r (or sub, mul, div) */
+            gen_modrm(st, r & 7, st->vtop->r, st->vtop->sym, st->vtop->c.ul);
+        } else {
+            gv2(st, RC_XMM, RC_XMM);
+            r = st->vtop[-1].r;
+            fr = st->vtop[0].r;
+            g(st, pfx);
+            o(st, 0x0f | (a << 8)); /* adds[sd] fr, r (or sub, mul, div) */
+            o(st, 0xc0 + (fr & 7) + (r & 7) * 8);
+        }
+        st->vtop--;
+    }
+}
+
 /* generate a floating point operation 'v = t1 op t2' instruction. The
    two operands are guaranted to have the same floating point type */
 /* XXX: need to use ST1 too */
@@ -756,18 +1187,23 @@ void gen_opf(TCCState *st, int op)
 {
     int a, ft, fc, swapped, r;
 
+    if (float_class(st, st->vtop->type.t) == RC_XMM) {
+        gen_opf_sse2(st, op);
+        return;
+    }
+
     /* convert constants to memory references */
-    if ((vtop[-1].r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
+    if ((st->vtop[-1].r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
         vswap(st);
         gv(st, RC_FLOAT);
         vswap(st);
     }
-    if ((vtop[0].r & (VT_VALMASK | VT_LVAL)) == VT_CONST)
+    if ((st->vtop[0].r & (VT_VALMASK | VT_LVAL)) == VT_CONST)
         gv(st, RC_FLOAT);
 
     /* must put at least one value in the floating point register */
-    if ((vtop[-1].r & VT_LVAL) &&
-        (vtop[0].r & VT_LVAL)) {
+    if ((st->vtop[-1].r & VT_LVAL) &&
+        (st->vtop[0].r & VT_LVAL)) {
         vswap(st);
         gv(st, RC_FLOAT);
         vswap(st);
@@ -775,13 +1211,13 @@ void gen_opf(TCCState *st, int op)
     swapped = 0;
     /* swap the stack if needed so that t1 is the register and t2 is
        the memory reference */
-    if (vtop[-1].r & VT_LVAL) {
+    if (st->vtop[-1].r & VT_LVAL) {
         vswap(st);
         swapped = 1;
     }
     if (op >= TOK_ULT && op <= TOK_GT) {
         /* load on stack second operand */
-        load(st, TREG_ST0, vtop);
+        load(st, TREG_ST0, st->vtop);
         save_reg(st, TREG_EAX); /* eax is used by FP comparison code */
         if (op == TOK_GE || op == TOK_GT)
             swapped = !swapped;
@@ -805,13 +1241,13 @@ void gen_opf(TCCState *st, int op)
             o(st, 0x45c4f6); /* test $0x45, %ah */
             op = TOK_EQ;
         }
-        vtop--;
-        vtop->r = VT_CMP;
-        vtop->c.i = op;
+        st->vtop--;
+        st->vtop->r = VT_CMP;
+        st->vtop->c.i = op;
     } else {
         /* no memory reference possible for long double operations */
-        if ((vtop->type.t & VT_BTYPE) == VT_LDOUBLE) {
-            load(st, TREG_ST0, vtop);
+        if ((st->vtop->type.t & VT_BTYPE) == VT_LDOUBLE) {
+            load(st, TREG_ST0, st->vtop);
             swapped = !swapped;
         }
         
@@ -834,14 +1270,14 @@ void gen_opf(TCCState *st, int op)
                 a++;
             break;
         }
-        ft = vtop->type.t;
-        fc = vtop->c.ul;
+        ft = st->vtop->type.t;
+        fc = st->vtop->c.ul;
         if ((ft & VT_BTYPE) == VT_LDOUBLE) {
             o(st, 0xde); /* fxxxp %st, %st(1) */
             o(st, 0xc1 + (a << 3));
         } else {
             /* if saved lvalue, then we must reload it */
-            r = vtop->r;
+            r = st->vtop->r;
             if ((r & VT_VALMASK) == VT_LLOCAL) {
                 SValue v1;
                 r = get_reg(st, RC_INT);
@@ -856,9 +1292,9 @@ void gen_opf(TCCState *st, int op)
                 o(st, 0xdc);
             else
                 o(st, 0xd8);
-            gen_modrm(st, a, r, vtop->sym, fc);
+            gen_modrm(st, a, r, st->vtop->sym, fc);
         }
-        vtop--;
+        st->vtop--;
     }
 }
 
@@ -866,43 +1302,67 @@ void gen_opf(TCCState *st, int op)
    and 'long long' cases. */
 void gen_cvt_itof(TCCState *st, int t)
 {
+    int r, rr, bt;
+
+    bt = st->vtop->type.t & (VT_BTYPE | VT_UNSIGNED);
+    if (float_class(st, t) == RC_XMM &&
+        (bt & VT_BTYPE) != VT_LLONG && bt != (VT_INT | VT_UNSIGNED)) {
+        /* signed int to float/double */
+        r = gv(st, RC_INT);
+        rr = get_reg(st, RC_XMM);
+        g(st, (t & VT_BTYPE) == VT_FLOAT ? 0xf3 : 0xf2);
+        o(st, 0x2a0f); /* cvtsi2s[sd] r, rr */
+        o(st, 0xc0 + r + (rr & 7) * 8);
+        st->vtop->r = rr;
+        return;
+    }
     save_reg(st, TREG_ST0);
     gv(st, RC_INT);
-    if ((vtop->type.t & VT_BTYPE) == VT_LLONG) {
+    if ((st->vtop->type.t & VT_BTYPE) == VT_LLONG) {
         /* signed long long to float/double/long double (unsigned case
            is handled generically) */
-        o(st, 0x50 + vtop->r2); /* push r2 */
-        o(st, 0x50 + (vtop->r & VT_VALMASK)); /* push r */
+        o(st, 0x50 + st->vtop->r2); /* push r2 */
+        o(st, 0x50 + (st->vtop->r & VT_VALMASK)); /* push r */
         o(st, 0x242cdf); /* fildll (%esp) */
         o(st, 0x08c483); /* add $8, %esp */
-    } else if ((vtop->type.t & (VT_BTYPE | VT_UNSIGNED)) == 
+    } else if ((st->vtop->type.t & (VT_BTYPE | VT_UNSIGNED)) == 
                (VT_INT | VT_UNSIGNED)) {
         /* unsigned int to float/double/long double */
         o(st, 0x6a); /* push $0 */
         g(st, 0x00);
-        o(st, 0x50 + (vtop->r & VT_VALMASK)); /* push r */
+        o(st, 0x50 + (st->vtop->r & VT_VALMASK)); /* push r */
         o(st, 0x242cdf); /* fildll (%esp) */
         o(st, 0x08c483); /* add $8, %esp */
     } else {
         /* int to float/double/long double */
-        o(st, 0x50 + (vtop->r & VT_VALMASK)); /* push r */
+        o(st, 0x50 + (st->vtop->r & VT_VALMASK)); /* push r */
         o(st, 0x2404db); /* fildl (%esp) */
         o(st, 0x04c483); /* add $4, %esp */
     }
-    vtop->r = TREG_ST0;
+    st->vtop->r = TREG_ST0;
 }
 
 /* convert fp to int 't' type */
 /* XXX: handle long long case */
 void gen_cvt_ftoi(TCCState *st, int t)
 {
-    int r, r2, size;
+    int r, r2, xr, size;
     Sym *sym;
     CType ushort_type;
 
     ushort_type.t = VT_SHORT | VT_UNSIGNED;
 
-    gv(st, RC_FLOAT);
+    if (t == VT_INT && float_class(st, st->vtop->type.t) == RC_XMM) {
+        /* truncate without changing the control word */
+        xr = gv(st, RC_XMM);
+        r = get_reg(st, RC_INT);
+        g(st, (st->vtop->type.t & VT_BTYPE) == VT_FLOAT ? 0xf3 : 0xf2);
+        o(st, 0x2c0f); /* cvtts[sd]2si xr, r */
+        o(st, 0xc0 + (xr & 7) + r * 8);
+        st->vtop->r = r;
+        return;
+    }
+    gv(st, RC_ST0);
     if (t != VT_INT)
         size = 8;
     else 
@@ -911,8 +1371,8 @@ void gen_cvt_ftoi(TCCState *st, int t)
     o(st, 0x2dd9); /* ldcw xxx */
     sym = external_global_sym(st, TOK___tcc_int_fpu_control, 
                               &ushort_type, VT_LVAL);
-    greloc(st, cur_text_section, sym, 
-           ind, R_386_32);
+    greloc(st, st->cur_text_section, sym, 
+           st->ind, R_386_32);
     gen_le32(st, 0);
     
     oad(st, 0xec81, size); /* sub $xxx, %esp */
@@ -924,67 +1384,193 @@ void gen_cvt_ftoi(TCCState *st, int t)
     o(st, 0x2dd9); /* ldcw xxx */
     sym = external_global_sym(st, TOK___tcc_fpu_control, 
                               &ushort_type, VT_LVAL);
-    greloc(st, cur_text_section, sym, 
-           ind, R_386_32);
+    greloc(st, st->cur_text_section, sym, 
+           st->ind, R_386_32);
     gen_le32(st, 0);
 
     r = get_reg(st, RC_INT);
     o(st, 0x58 + r); /* pop r */
     if (size == 8) {
         if (t == VT_LLONG) {
-            vtop->r = r; /* mark reg as used */
+            st->vtop->r = r; /* mark reg as used */
             r2 = get_reg(st, RC_INT);
             o(st, 0x58 + r2); /* pop r2 */
-            vtop->r2 = r2;
+            st->vtop->r2 = r2;
         } else {
             o(st, 0x04c483); /* add $4, %esp */
         }
     }
-    vtop->r = r;
+    st->vtop->r = r;
 }
 
 /* convert from one floating point type to another */
 void gen_cvt_ftof(TCCState *st, int t)
 {
-    /* all we have to do on i386 is to put the float in a register */
-    gv(st, RC_FLOAT);
+    int r, bt;
+
+    bt = st->vtop->type.t & VT_BTYPE;
+    if (float_class(st, bt) == RC_XMM && float_class(st, t) == RC_XMM) {
+        r = gv(st, RC_XMM);
+        g(st, bt == VT_FLOAT ? 0xf3 : 0xf2);
+        o(st, 0x5a0f); /* cvtss2sd or cvtsd2ss */
+        o(st, 0xc0 + (r & 7) * 9);
+    } else {
+        /* all we have to do on x87 is to put the float in a register */
+        gv(st, RC_ST0);
+    }
+}
+
+/* emit 'op' with the register 'r' and the memory at offset 'c' of the
+   address 'sv', which is a constant, a local or a register */
+static void gen_mem_op(TCCState *st, int op, int r, SValue *sv, int c)
+{
+    int v;
+
+    v = sv->r & VT_VALMASK;
+    o(st, op);
+    if (v == VT_CONST || v == VT_LOCAL) {
+        gen_modrm(st, r, sv->r, sv->sym, sv->c.ul + c);
+    } else if (c == 0) {
+        g(st, (r << 3) | v);
+    } else if (c == (char)c) {
+        g(st, 0x40 | (r << 3) | v);
+        g(st, c);
+    } else {
+        oad(st, 0x80 | (r << 3) | v, c);
+    }
+}
+
+/* return true if the address 'sv' can be used by gen_mem_op as is */
+static int gen_mem_direct(SValue *sv)
+{
+    int v;
+
+    v = sv->r & (VT_VALMASK | VT_LVAL);
+    return v == VT_CONST || v == VT_LOCAL;
+}
+
+/* return a register for the bytes moved by gen_memcpy and gen_memzero,
+   other than those holding the addresses 'd' and 's' */
+static int gen_mem_reg(TCCState *st, SValue *d, SValue *s)
+{
+    int rc;
+
+    /* byte moves need eax, ecx or edx: one of them is always left */
+    rc = RC_EAX | RC_ECX | RC_EDX;
+    if ((d->r & VT_VALMASK) < VT_CONST)
+        rc &= ~reg_classes[d->r & VT_VALMASK];
+    if ((s->r & VT_VALMASK) < VT_CONST)
+        rc &= ~reg_classes[s->r & VT_VALMASK];
+    return get_reg(st, rc);
+}
+
+/* move 'n' bytes between the register 'r', or for 16 bytes the xmm
+   register 'x' if it is not -1, and offset 'c' of the address 'sv' */
+static int gen_mem_move(TCCState *st, int store, int r, int x,
+                        SValue *sv, int c, int n)
+{
+    if (n >= 16 && x >= 0) {
+        n = 16;
+        gen_mem_op(st, store ? 0x110f : 0x100f, x, sv, c); /* movups */
+    } else if (n >= 4) {
+        n = 4;
+        gen_mem_op(st, store ? 0x89 : 0x8b, r, sv, c);
+    } else if (n >= 2) {
+        n = 2;
+        gen_mem_op(st, store ? 0x8966 : 0x8b66, r, sv, c);
+    } else {
+        n = 1;
+        gen_mem_op(st, store ? 0x88 : 0x8a, r, sv, c);
+    }
+    return n;
+}
+
+/* copy 'size' bytes from the address on top of the value stack to the
+   address below it with moves through a register, and pop both */
+void gen_memcpy(TCCState *st, int size)
+{
+    int r, x, n, c;
+    SValue *d, *s;
+
+    d = st->vtop - 1;
+    s = st->vtop;
+    if (!gen_mem_direct(d) && !gen_mem_direct(s)) {
+        gv2(st, RC_INT, RC_INT);
+    } else if (!gen_mem_direct(d)) {
+        vswap(st);
+        gv(st, RC_INT);
+        vswap(st);
+    } else if (!gen_mem_direct(s)) {
+        gv(st, RC_INT);
+    }
+    r = gen_mem_reg(st, d, s);
+    x = -1;
+    if (st->sse2 && size >= 16)
+        x = get_reg(st, RC_XMM) & 7;
+    for(c = 0; c < size; c += n) {
+        n = gen_mem_move(st, 0, r, x, s, c, size - c);
+        gen_mem_move(st, 1, r, x, d, c, n);
+    }
+    st->vtop -= 2;
+}
+
+/* clear 'size' bytes at the address on top of the value stack with
+   stores of a zeroed register, and pop it */
+void gen_memzero(TCCState *st, int size)
+{
+    int r, x, n, c;
+
+    if (!gen_mem_direct(st->vtop))
+        gv(st, RC_INT);
+    r = gen_mem_reg(st, st->vtop, st->vtop);
+    o(st, 0x31); /* xor r, r */
+    g(st, 0xc0 + r * 9);
+    x = -1;
+    if (st->sse2 && size >= 16) {
+        x = get_reg(st, RC_XMM) & 7;
+        o(st, 0x570f); /* xorps x, x */
+        g(st, 0xc0 + x * 9);
+    }
+    for(c = 0; c < size; c += n)
+        n = gen_mem_move(st, 1, r, x, st->vtop, c, size - c);
+    st->vtop--;
 }
 
 /* computed goto support */
 void ggoto(TCCState *st)
 {
     gcall_or_jmp(st, 1);
-    vtop--;
+    st->vtop--;
 }
 
 /* bound check support functions */
 #if 0
 
 /* generate a bounded pointer addition */
-void gen_bounded_ptr_add()
+void gen_bounded_ptr_add(TCCState *st)
 {
     Sym *sym;
 
     /* prepare fast i386 function call (args in eax and edx) */
     gv2(st, RC_EAX, RC_EDX);
     /* save all temporary registers */
-    vtop -= 2;
+    st->vtop -= 2;
     save_regs(st, 0);
     /* do a fast function call */
-    sym = external_global_sym(st, TOK___bound_ptr_add, &func_old_type, 0);
-    greloc(cur_text_section, sym, 
-           ind + 1, R_386_PC32);
+    sym = external_global_sym(st, TOK___bound_ptr_add, &st->func_old_type, 0);
+    greloc(st->cur_text_section, sym, 
+           st->ind + 1, R_386_PC32);
     oad(0xe8, -4);
     /* returned pointer is in eax */
-    vtop++;
-    vtop->r = TREG_EAX | VT_BOUNDED;
+    st->vtop++;
+    st->vtop->r = TREG_EAX | VT_BOUNDED;
     /* address of bounding function call point */
-    vtop->c.ul = (cur_text_section->reloc->data_offset - sizeof(Elf32_Rel)); 
+    st->vtop->c.ul = (st->cur_text_section->reloc->data_offset - sizeof(Elf32_Rel)); 
 }
 
 /* patch pointer addition in vtop so that pointer dereferencing is
    also tested */
-void gen_bounded_ptr_deref(void)
+void gen_bounded_ptr_deref(TCCState *st)
 {
     int func;
     int size, align;
@@ -993,14 +1579,14 @@ void gen_bounded_ptr_deref(void)
 
     size = 0;
     /* XXX: put that code in generic part of tcc */
-    if (!is_float(st, vtop->type.t)) {
-        if (vtop->r & VT_LVAL_BYTE)
+    if (!is_float(st, st->vtop->type.t)) {
+        if (st->vtop->r & VT_LVAL_BYTE)
             size = 1;
-        else if (vtop->r & VT_LVAL_SHORT)
+        else if (st->vtop->r & VT_LVAL_SHORT)
             size = 2;
     }
     if (!size)
-        size = type_size(st, &vtop->type, &align);
+        size = type_size(st, &st->vtop->type, &align);
     switch(size) {
     case  1: func = TOK___bound_ptr_indir1; break;
     case  2: func = TOK___bound_ptr_indir2; break;
@@ -1016,8 +1602,8 @@ void gen_bounded_ptr_deref(void)
 
     /* patch relocation */
     /* XXX: find a better solution ? */
-    rel = (Elf32_Rel *)(cur_text_section->reloc->data + vtop->c.ul);
-    sym = external_global_sym(st, func, &func_old_type, 0);
+    rel = (Elf32_Rel *)(st->cur_text_section->reloc->data + st->vtop->c.ul);
+    sym = external_global_sym(st, func, &st->func_old_type, 0);
     if (!sym->c)
         put_extern_sym(sym, NULL, 0, 0);
     rel->r_info = ELF32_R_INFO(sym->c, ELF32_R_TYPE(rel->r_info));
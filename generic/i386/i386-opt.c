@@ -0,0 +1,761 @@
+/*
+ *  i386 peephole optimizer for TCC
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The code of a function is generated on the fly, so it contains
+   reloads of the value just stored, jumps to jumps or to the next
+   instruction and other leftovers. When optimizing, the epilog calls
+   gen_peephole() which decodes the instructions of the function,
+   simplifies them and writes them back with the jumps in their short
+   form when possible. The relocations and the code addresses in the
+   data section (switch tables) are moved with their instructions.
+   Functions with inline asm or label addresses are left alone.
+
+   From level 2, the locals and parameters that are only read and
+   written whole by 32 bit moves and whose address is never taken may
+   live in the callee saved registers the function leaves free. Before
+   the epilog is generated, gen_promote() gives the most used of them,
+   the accesses in loops counting more, a register and marks it as used
+   so that the prolog and epilog save it. gen_peephole() then turns the
+   accesses into register moves and loads the parameters at the end of
+   the prolog. */
+
+#define PI_LABEL 0x01 /* a jump or a code address leads to it */
+#define PI_RELOC 0x02 /* has a relocation: copied as is */
+#define PI_DEL   0x04 /* removed */
+#define PI_JMP   0x08 /* jmp inside the function */
+#define PI_JCC   0x10 /* conditional jump inside the function */
+#define PI_SHORT 0x20 /* jump with an 8 bit displacement */
+#define PI_CODE  0x40 /* replaced by 'code' */
+#define PI_RET   0x80 /* ret */
+
+/* longest code put in place of a jmp to the end of the function */
+#define PEEP_TAIL_MAX 8
+/* longest code put in place of an instruction */
+#define PEEP_CODE_MAX 24
+/* longest chain of jumps to jumps followed */
+#define PEEP_HOPS_MAX 8
+
+typedef struct PeepInsn {
+    int pos;                    /* offset in the function */
+    int npos;                   /* offset in the optimized function */
+    int target;                 /* jumps: index of the target */
+    unsigned char len;          /* length */
+    unsigned char nlen;         /* length in the optimized function */
+    unsigned char flags;        /* PI_xxx */
+    unsigned char cc;           /* condition of a conditional jump */
+    unsigned char code[PEEP_CODE_MAX]; /* replacement if PI_CODE */
+} PeepInsn;
+
+/* length of the modrm byte at 'p' and of the operand it describes */
+static int peep_modrm_len(const uint8_t *p)
+{
+    int mod = p[0] >> 6, rm = p[0] & 7, n = 1;
+
+    if (mod == 3)
+        return 1;
+    if (rm == 4) {
+        n++;
+        if (mod == 0 && (p[1] & 7) == 5)
+            n += 4;
+    } else if (mod == 0 && rm == 5) {
+        n += 4;
+    }
+    if (mod == 1)
+        n += 1;
+    else if (mod == 2)
+        n += 4;
+    return n;
+}
+
+/* length of the instruction at 'p', 0 if it is not one that the code
+   generator produces. '*modrm' is set to the offset of its modrm byte,
+   -1 if it has none. */
+static int peep_insn_len(const uint8_t *p, int *modrm)
+{
+    const uint8_t *q = p;
+    int op, imm = 4, extra = 0;
+
+    *modrm = -1;
+    for(;;) {
+        op = *q;
+        if (op == 0x66)
+            imm = 2;
+        else if (op != 0xf2 && op != 0xf3 && op != 0xf0)
+            break;
+        q++;
+    }
+    op = *q++;
+    if (op == 0x0f) {
+        op = *q++;
+        if (op >= 0x80 && op <= 0x8f)
+            return q - p + 4;
+        if ((op >= 0x70 && op <= 0x73) || op == 0xa4 || op == 0xac ||
+            op == 0xba || op == 0xc2 || op == 0xc6) {
+            extra = 1;
+            goto modrm;
+        }
+        if ((op >= 0x10 && op <= 0x17) || op == 0x1f ||
+            (op >= 0x28 && op <= 0x2f) || (op >= 0x40 && op <= 0x6f) ||
+            (op >= 0x74 && op <= 0x7f) || (op >= 0x90 && op <= 0x9f) ||
+            op == 0xa3 || op == 0xa5 || op == 0xab || op == 0xad ||
+            op == 0xaf || op == 0xb0 || op == 0xb1 || op == 0xb3 ||
+            (op >= 0xb6 && op <= 0xbf && op != 0xb8 && op != 0xb9 &&
+             op != 0xba) ||
+            op == 0xc0 || op == 0xc1 || (op >= 0xd0 && op <= 0xfe))
+            goto modrm;
+        if (op == 0x0b || op == 0x31 || op == 0xa2 || (op >= 0xc8 && op <= 0xcf))
+            return q - p;
+        return 0;
+    }
+    if (op < 0x40) {
+        if (op == 0x0f || op == 0x26 || op == 0x2e || op == 0x36 || op == 0x3e)
+            return 0;
+        switch(op & 7) {
+        case 4:
+            return q - p + 1;
+        case 5:
+            return q - p + imm;
+        case 6:
+        case 7:
+            return q - p;
+        default:
+            goto modrm;
+        }
+    }
+    if (op < 0x62 || (op >= 0x90 && op <= 0x99) || (op >= 0x9b && op <= 0x9f) ||
+        (op >= 0xa4 && op <= 0xa7) || (op >= 0xaa && op <= 0xaf) ||
+        op == 0xc3 || op == 0xc9 || op == 0xcc || op == 0xf4 || op == 0xf5 ||
+        (op >= 0xf8 && op <= 0xfd))
+        return q - p;
+    if ((op >= 0x70 && op <= 0x7f) || op == 0x6a || op == 0xa8 ||
+        (op >= 0xb0 && op <= 0xb7) || op == 0xcd || op == 0xeb)
+        return q - p + 1;
+    if (op == 0x68 || op == 0xa9 || (op >= 0xb8 && op <= 0xbf))
+        return q - p + imm;
+    if (op == 0xc2)
+        return q - p + 2;
+    if ((op >= 0xa0 && op <= 0xa3) || op == 0xe8 || op == 0xe9)
+        return q - p + 4;
+    if (op == 0x69 || op == 0x81 || op == 0xc7) {
+        extra = imm;
+    } else if (op == 0x6b || op == 0x80 || op == 0x82 || op == 0x83 ||
+               op == 0xc0 || op == 0xc1 || op == 0xc6) {
+        extra = 1;
+    } else if (op == 0xf6 || op == 0xf7) {
+        /* only test has an immediate */
+        if (((*q >> 3) & 7) < 2)
+            extra = op == 0xf6 ? 1 : imm;
+    } else if (!((op >= 0x84 && op <= 0x8f) || (op >= 0xd0 && op <= 0xd3) ||
+                 (op >= 0xd8 && op <= 0xdf) || op == 0xfe || op == 0xff)) {
+        return 0;
+    }
+ modrm:
+    *modrm = q - p;
+    return q - p + peep_modrm_len(q) + extra;
+}
+
+/* index of the first instruction at or after offset 'pos' */
+static int peep_find(PeepInsn *tab, int n, int pos)
+{
+    int lo = 0, hi = n, m;
+
+    while (lo < hi) {
+        m = (lo + hi) >> 1;
+        if (tab[m].pos < pos)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+/* index of the first instruction kept at or after 'i'. The entry after
+   the last instruction is always kept. */
+static int peep_live(PeepInsn *tab, int i)
+{
+    while (tab[i].flags & PI_DEL)
+        i++;
+    return i;
+}
+
+/* is 'p' a 32 bit move between a register and a local variable,
+   opcode 'op' being 0x89 for a store and 0x8b for a load */
+static int peep_is_local_mov(PeepInsn *p, const uint8_t *c, int op)
+{
+    int mod;
+
+    if (p->flags & (PI_RELOC | PI_CODE | PI_DEL) || c[0] != op)
+        return 0;
+    mod = c[1] >> 6;
+    return (c[1] & 7) == 5 && (mod == 1 || mod == 2);
+}
+
+/* a 'jmp' to 'tail' can be replaced by the instructions at 'tail' if
+   they return from the function in a few bytes. Return their length. */
+static int peep_tail_len(PeepInsn *tab, int tail)
+{
+    PeepInsn *p;
+    int len = 0;
+
+    for(;;) {
+        tail = peep_live(tab, tail);
+        p = &tab[tail];
+        if (p->flags & (PI_RELOC | PI_JMP | PI_JCC) || p->len == 0)
+            return 0;
+        len += (p->flags & PI_CODE) ? p->nlen : p->len;
+        if (len > PEEP_TAIL_MAX)
+            return 0;
+        if (p->flags & PI_RET)
+            return len;
+        tail++;
+    }
+}
+
+/* one pass of simplifications. Return non zero if something changed. */
+static int peep_simplify(PeepInsn *tab, int n, const uint8_t *code)
+{
+    PeepInsn *p, *q;
+    const uint8_t *c, *d;
+    int i, j, t, k, hops, len, changed = 0;
+
+    for(i = peep_live(tab, 0); i < n; i = j) {
+        p = &tab[i];
+        c = code + p->pos;
+        j = peep_live(tab, i + 1);
+        q = &tab[j];
+        d = code + q->pos;
+        if (!(p->flags & (PI_RELOC | PI_CODE))) {
+            /* nop, mov %r,%r, add $0,%esp and sub $0,%esp */
+            if ((p->len == 1 && c[0] == 0x90) ||
+                (p->len == 2 && (c[0] == 0x89 || c[0] == 0x8b) &&
+                 (c[1] >> 6) == 3 && ((c[1] >> 3) & 7) == (c[1] & 7)) ||
+                (p->len == 3 && c[0] == 0x83 && (c[1] == 0xc4 || c[1] == 0xec) &&
+                 c[2] == 0) ||
+                (p->len == 6 && c[0] == 0x81 && (c[1] == 0xc4 || c[1] == 0xec) &&
+                 *(int *)(c + 2) == 0)) {
+                p->flags |= PI_DEL;
+                changed = 1;
+                continue;
+            }
+            /* immediate operand of a register that fits in 8 bits */
+            if (p->len == 6 && c[0] == 0x81 && (c[1] >> 6) == 3 &&
+                *(int *)(c + 2) == (signed char)c[2]) {
+                p->code[0] = 0x83;
+                p->code[1] = c[1];
+                p->code[2] = c[2];
+                p->nlen = 3;
+                p->flags |= PI_CODE;
+                changed = 1;
+            }
+        }
+        /* store or load of a local followed by a load or store of the
+           same local */
+        if (j < n && !(q->flags & PI_LABEL) && p->len == q->len &&
+            (peep_is_local_mov(p, c, 0x89) || peep_is_local_mov(p, c, 0x8b)) &&
+            (peep_is_local_mov(q, d, 0x89) || peep_is_local_mov(q, d, 0x8b)) &&
+            (c[1] & 0xc7) == (d[1] & 0xc7) &&
+            !memcmp(c + 2, d + 2, p->len - 2)) {
+            if (((c[1] ^ d[1]) & 0x38) == 0) {
+                /* the register already holds the local, or the local
+                   the register */
+                q->flags |= PI_DEL;
+                changed = 1;
+                j = i;
+                continue;
+            } else if (d[0] == 0x8b) {
+                /* take the value from the register instead */
+                q->code[0] = 0x89;
+                q->code[1] = 0xc0 | (c[1] & 0x38) | ((d[1] >> 3) & 7);
+                q->nlen = 2;
+                q->flags |= PI_CODE;
+                changed = 1;
+            }
+        }
+        /* mov %r,%r2; mov %r2,%r */
+        if (j < n && !(q->flags & PI_LABEL) &&
+            !((p->flags | q->flags) & (PI_RELOC | PI_CODE)) &&
+            p->len == 2 && q->len == 2 && c[0] == 0x89 && d[0] == 0x89 &&
+            (c[1] >> 6) == 3 &&
+            d[1] == (0xc0 | ((c[1] & 7) << 3) | ((c[1] >> 3) & 7))) {
+            q->flags |= PI_DEL;
+            changed = 1;
+            j = i;
+            continue;
+        }
+        if (p->flags & (PI_JMP | PI_JCC)) {
+            /* jump to jump */
+            t = peep_live(tab, p->target);
+            for(hops = 0; hops < PEEP_HOPS_MAX && t != i && t < n &&
+                    (tab[t].flags & PI_JMP); hops++)
+                t = peep_live(tab, tab[t].target);
+            if (t != p->target) {
+                p->target = t;
+                changed = 1;
+            }
+            /* jump to the next instruction */
+            if (t == j) {
+                p->flags |= PI_DEL;
+                changed = 1;
+                continue;
+            }
+            /* jcc over a jmp: jncc to the target of the jmp */
+            if ((p->flags & PI_JCC) && (q->flags & PI_JMP) &&
+                !(q->flags & PI_LABEL) && t == peep_live(tab, j + 1)) {
+                p->cc ^= 1;
+                p->target = q->target;
+                q->flags |= PI_DEL;
+                changed = 1;
+                j = i;
+                continue;
+            }
+            /* jmp to the end of the function */
+            if ((p->flags & PI_JMP) && (len = peep_tail_len(tab, t))) {
+                for(k = 0; k < len; t++) {
+                    t = peep_live(tab, t);
+                    if (tab[t].flags & PI_CODE) {
+                        memcpy(p->code + k, tab[t].code, tab[t].nlen);
+                        k += tab[t].nlen;
+                    } else {
+                        memcpy(p->code + k, code + tab[t].pos, tab[t].len);
+                        k += tab[t].len;
+                    }
+                }
+                p->nlen = len;
+                p->flags = (p->flags & ~PI_JMP) | PI_CODE | PI_RET;
+                changed = 1;
+            }
+        }
+        if (p->flags & (PI_JMP | PI_RET)) {
+            /* code after a jmp or a ret which no jump leads to */
+            while (j < n && !(tab[j].flags & (PI_LABEL | PI_RELOC))) {
+                tab[j].flags |= PI_DEL;
+                changed = 1;
+                j = peep_live(tab, j + 1);
+            }
+        }
+    }
+    return changed;
+}
+
+/* give each instruction its offset in the optimized function, with
+   the jumps in their short form when the displacement allows it.
+   Return the size of the function. */
+static int peep_layout(PeepInsn *tab, int n)
+{
+    PeepInsn *p;
+    int i, pos, disp, changed;
+
+    for(i = 0; i < n; i++) {
+        p = &tab[i];
+        if (p->flags & PI_DEL)
+            p->nlen = 0;
+        else if (p->flags & PI_JMP)
+            p->nlen = 5;
+        else if (p->flags & PI_JCC)
+            p->nlen = 6;
+        else if (!(p->flags & PI_CODE))
+            p->nlen = p->len;
+        p->flags &= ~PI_SHORT;
+    }
+    /* shortening a jump only brings the others closer to their
+       target, so this ends */
+    do {
+        changed = 0;
+        pos = 0;
+        for(i = 0; i <= n; i++) {
+            tab[i].npos = pos;
+            pos += tab[i].nlen;
+        }
+        for(i = 0; i < n; i++) {
+            p = &tab[i];
+            if (!(p->flags & (PI_JMP | PI_JCC)) || (p->flags & (PI_DEL | PI_SHORT)))
+                continue;
+            disp = tab[p->target].npos - (p->npos + 2);
+            if (disp == (signed char)disp) {
+                p->flags |= PI_SHORT;
+                p->nlen = 2;
+                changed = 1;
+            }
+        }
+    } while (changed);
+    return pos;
+}
+
+/* weight under which a slot is not worth a register */
+#define PROMOTE_MIN_WEIGHT 3
+/* deepest loop nesting told apart in the weights */
+#define PROMOTE_DEPTH_MAX 3
+
+typedef struct PromoteSlot {
+    int addr;
+    int weight;                 /* weighted accesses, -1 if not possible */
+} PromoteSlot;
+
+static int promote_cmp(const void *a, const void *b)
+{
+    return ((const PromoteSlot *)a)->addr - ((const PromoteSlot *)b)->addr;
+}
+
+/* index of the first slot of 'tab' at or above 'addr' */
+static int promote_find(PromoteSlot *tab, int n, int addr)
+{
+    int lo = 0, hi = n, m;
+
+    while (lo < hi) {
+        m = (lo + hi) >> 1;
+        if (tab[m].addr < addr)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+/* the slots of 'tab' starting in [lo, hi) cannot live in a register */
+static void promote_kill(PromoteSlot *tab, int n, int lo, int hi)
+{
+    int k;
+
+    for(k = promote_find(tab, n, lo); k < n && tab[k].addr < hi; k++)
+        tab[k].weight = -1;
+}
+
+static void gen_promote(TCCState *st)
+{
+    const uint8_t *code, *c;
+    PromoteSlot *tab;
+    LocalSlot *l;
+    int *depth;
+    int size, n, i, k, m, r, pos, len, disp, mod, best, nb_free;
+
+    if (st->func_no_opt || st->do_debug || st->do_bounds_check)
+        return;
+    nb_free = 0;
+    for(i = 0; i < 3; i++) {
+        if (!(st->func_regs_used & (1 << callee_saved_regs[i])))
+            nb_free++;
+    }
+    for(i = n = 0; i < st->nb_func_locals; i++)
+        n += st->func_locals[i].scalar;
+    if (nb_free == 0 || n == 0)
+        return;
+    tab = tcc_malloc(st, n * sizeof(PromoteSlot));
+    for(i = n = 0; i < st->nb_func_locals; i++) {
+        if (st->func_locals[i].scalar) {
+            tab[n].addr = st->func_locals[i].addr;
+            tab[n].weight = 0;
+            n++;
+        }
+    }
+    qsort(tab, n, sizeof(PromoteSlot), promote_cmp);
+
+    /* loop nesting of each offset, from the backward jumps */
+    code = st->cur_text_section->data + st->func_sub_sp_offset;
+    size = st->ind - st->func_sub_sp_offset;
+    depth = tcc_mallocz(st, (size + 1) * sizeof(int));
+    for(pos = 0; pos < size; pos += len) {
+        c = code + pos;
+        len = peep_insn_len(c, &m);
+        if (len == 0)
+            goto done;
+        if (c[0] == 0xeb || (c[0] & 0xf0) == 0x70)
+            disp = (signed char)c[1];
+        else if (c[0] == 0xe9 || (c[0] == 0x0f && (c[1] & 0xf0) == 0x80))
+            disp = *(int *)(c + len - 4);
+        else
+            continue;
+        k = pos + len + disp;
+        if (k >= 0 && k <= pos) {
+            depth[k]++;
+            depth[pos + len]--;
+        }
+    }
+    if (pos != size)
+        goto done;
+    for(pos = 1; pos <= size; pos++)
+        depth[pos] += depth[pos - 1];
+
+    for(pos = 0; pos < size; pos += len) {
+        c = code + pos;
+        len = peep_insn_len(c, &m);
+        if (m < 0 || (c[m] >> 6) == 3)
+            continue;
+        mod = c[m] >> 6;
+        if ((c[m] & 7) == 4) {
+            /* the frame is only addressed without index */
+            if (mod != 0 && (c[m + 1] & 7) == 5)
+                goto done;
+            continue;
+        }
+        if ((c[m] & 7) != 5 || mod == 0)
+            continue;
+        if (mod == 1)
+            disp = (signed char)c[m + 1];
+        else
+            disp = *(int *)(c + m + 1);
+        if (m == 1 && (c[0] == 0x89 || c[0] == 0x8b)) {
+            promote_kill(tab, n, disp - 3, disp);
+            promote_kill(tab, n, disp + 1, disp + 4);
+            k = promote_find(tab, n, disp);
+            if (k < n && tab[k].addr == disp && tab[k].weight >= 0)
+                tab[k].weight += 1 << (3 * (depth[pos] < PROMOTE_DEPTH_MAX ?
+                                            depth[pos] : PROMOTE_DEPTH_MAX));
+        } else if (m == 1 && c[0] == 0x8d) {
+            /* address taken: the whole object it points in or after */
+            k = 0;
+            for(i = 0; i < st->nb_func_locals; i++) {
+                l = &st->func_locals[i];
+                if (disp >= l->addr && disp <= l->addr + l->size) {
+                    promote_kill(tab, n, l->addr, l->addr + l->size);
+                    k = 1;
+                }
+            }
+            if (!k)
+                goto done;
+        } else {
+            /* any other access, of up to 16 bytes */
+            promote_kill(tab, n, disp - 3, disp + 16);
+        }
+    }
+
+    for(i = 0; i < 3; i++) {
+        r = callee_saved_regs[i];
+        if (st->func_regs_used & (1 << r))
+            continue;
+        best = -1;
+        for(k = 0; k < n; k++) {
+            if (tab[k].weight >= PROMOTE_MIN_WEIGHT &&
+                (best < 0 || tab[k].weight > tab[best].weight))
+                best = k;
+        }
+        if (best < 0)
+            break;
+        st->func_reg_slot[r] = tab[best].addr;
+        st->func_regs_used |= 1 << r;
+        tab[best].weight = -1;
+    }
+ done:
+    ckfree((char *)depth);
+    ckfree((char *)tab);
+}
+
+/* make the moves from and to the slots chosen by gen_promote() register
+   moves, and load the parameters among them at the end of the prolog */
+static void peep_promote(TCCState *st, PeepInsn *tab, int n, const uint8_t *code)
+{
+    PeepInsn *p;
+    const uint8_t *c;
+    int i, r, k, disp, mod;
+
+    for(r = 0; r < 8 && !st->func_reg_slot[r]; r++)
+        ;
+    if (r == 8)
+        return;
+    k = peep_find(tab, n, st->func_sub_sp_offset - st->func_ind) - 1;
+    if (k < 0 || (tab[k].flags & (PI_RELOC | PI_CODE)))
+        return;
+    p = &tab[k];
+    c = code + p->pos;
+    p->nlen = 0;
+    if (c[0] != 0x90) {
+        memcpy(p->code, c, p->len);
+        p->nlen = p->len;
+    }
+    for(r = 0; r < 8; r++) {
+        disp = st->func_reg_slot[r];
+        if (disp <= 0)
+            continue;
+        p->code[p->nlen++] = 0x8b;
+        if (disp == (signed char)disp) {
+            p->code[p->nlen++] = 0x45 | (r << 3);
+            p->code[p->nlen++] = disp;
+        } else {
+            p->code[p->nlen++] = 0x85 | (r << 3);
+            memcpy(p->code + p->nlen, &disp, 4);
+            p->nlen += 4;
+        }
+    }
+    p->flags |= PI_CODE;
+
+    for(i = 0; i < n; i++) {
+        p = &tab[i];
+        c = code + p->pos;
+        if ((p->flags & (PI_RELOC | PI_CODE)) || (c[0] != 0x89 && c[0] != 0x8b))
+            continue;
+        mod = c[1] >> 6;
+        if ((c[1] & 7) != 5 || (mod != 1 && mod != 2))
+            continue;
+        disp = mod == 1 ? (signed char)c[2] : *(int *)(c + 2);
+        for(r = 0; r < 8 && st->func_reg_slot[r] != disp; r++)
+            ;
+        if (r == 8)
+            continue;
+        if (c[0] == 0x89) /* store: mov %reg,%r */
+            p->code[1] = 0xc0 | (c[1] & 0x38) | r;
+        else /* load: mov %r,%reg */
+            p->code[1] = 0xc0 | (r << 3) | ((c[1] >> 3) & 7);
+        p->code[0] = 0x89;
+        p->nlen = 2;
+        p->flags |= PI_CODE;
+    }
+}
+
+static void gen_peephole(TCCState *st)
+{
+    Section *sec = st->cur_text_section;
+    const uint8_t *code = sec->data + st->func_ind, *c;
+    uint8_t *out, *o1;
+    int size = st->ind - st->func_ind;
+    PeepInsn *tab, *p;
+    ElfW_Rel *rel, *rel_end;
+    int n, i, k, pos, len, rsize, disp;
+    unsigned long off;
+
+    if (st->func_no_opt || st->do_debug || st->do_bounds_check)
+        return;
+    for(n = 0, pos = 0; pos < size; n++, pos += len) {
+        len = peep_insn_len(code + pos, &k);
+        if (len == 0)
+            return;
+    }
+    if (pos != size)
+        return;
+    tab = tcc_mallocz(st, (n + 1) * sizeof(PeepInsn));
+    for(i = 0, pos = 0; i < n; i++) {
+        p = &tab[i];
+        c = code + pos;
+        p->pos = pos;
+        p->len = peep_insn_len(c, &k);
+        if (c[0] == 0xe9 || c[0] == 0xeb) {
+            p->flags = PI_JMP;
+        } else if ((c[0] & 0xf0) == 0x70) {
+            p->flags = PI_JCC;
+            p->cc = c[0] & 15;
+        } else if (c[0] == 0x0f && (c[1] & 0xf0) == 0x80) {
+            p->flags = PI_JCC;
+            p->cc = c[1] & 15;
+        } else if (c[0] == 0xc3 || c[0] == 0xc2 ||
+                   (c[0] == 0xff && (c[1] & 0xf8) == 0xe0)) {
+            /* ret, or an indirect jmp which never falls through */
+            p->flags = PI_RET;
+        }
+        pos += p->len;
+    }
+    tab[n].pos = size;
+
+    /* the relocations of the function are the last ones of the section */
+    rel = rel_end = NULL;
+    if (sec->reloc) {
+        rel = (ElfW_Rel *)sec->reloc->data;
+        rel_end = (ElfW_Rel *)(sec->reloc->data + sec->reloc->data_offset);
+        while (rel_end > rel && rel_end[-1].r_offset >= st->func_ind)
+            rel_end--;
+        rel = rel_end;
+        rel_end = (ElfW_Rel *)(sec->reloc->data + sec->reloc->data_offset);
+        for(; rel < rel_end; rel++) {
+            k = peep_find(tab, n, rel->r_offset - st->func_ind + 1) - 1;
+            tab[k].flags = (tab[k].flags & ~(PI_JMP | PI_JCC)) | PI_RELOC;
+            /* a jmp to a symbol is a tail call */
+            if (code[tab[k].pos] == 0xe9)
+                tab[k].flags |= PI_RET;
+        }
+    }
+
+    for(i = 0; i < n; i++) {
+        p = &tab[i];
+        c = code + p->pos;
+        if (c[0] == 0xe8 && !(p->flags & PI_RELOC))
+            goto fail;
+        if (!(p->flags & (PI_JMP | PI_JCC)))
+            continue;
+        if (p->len == 2)
+            disp = (signed char)c[1];
+        else
+            disp = *(int *)(c + p->len - 4);
+        pos = p->pos + p->len + disp;
+        k = peep_find(tab, n, pos);
+        if (pos < 0 || pos > size || tab[k].pos != pos)
+            goto fail;
+        p->target = k;
+        tab[k].flags |= PI_LABEL;
+    }
+    for(i = 0; i < st->nb_func_code_refs; i++) {
+        pos = *(int *)(st->data_section->data + st->func_code_refs[i]) -
+            st->func_ind;
+        k = peep_find(tab, n, pos);
+        if (pos < 0 || pos > size || tab[k].pos != pos)
+            goto fail;
+        tab[k].flags |= PI_LABEL;
+    }
+
+    peep_promote(st, tab, n, code);
+    while (peep_simplify(tab, n, code))
+        ;
+    rsize = peep_layout(tab, n);
+
+    out = o1 = tcc_malloc(st, rsize);
+    for(i = 0; i < n; i++) {
+        p = &tab[i];
+        if (p->flags & PI_DEL)
+            continue;
+        if (p->flags & (PI_JMP | PI_JCC)) {
+            disp = tab[p->target].npos - (p->npos + p->nlen);
+            if (p->flags & PI_SHORT) {
+                *o1++ = (p->flags & PI_JMP) ? 0xeb : 0x70 + p->cc;
+                *o1++ = disp;
+            } else {
+                if (p->flags & PI_JMP) {
+                    *o1++ = 0xe9;
+                } else {
+                    *o1++ = 0x0f;
+                    *o1++ = 0x80 + p->cc;
+                }
+                memcpy(o1, &disp, 4);
+                o1 += 4;
+            }
+        } else if (p->flags & PI_CODE) {
+            memcpy(o1, p->code, p->nlen);
+            o1 += p->nlen;
+        } else {
+            memcpy(o1, code + p->pos, p->len);
+            o1 += p->len;
+        }
+    }
+
+    /* move the relocations and code addresses with their instructions */
+    if (sec->reloc) {
+        for(rel = rel_end; rel > (ElfW_Rel *)sec->reloc->data &&
+                rel[-1].r_offset >= st->func_ind; rel--) {
+            off = rel[-1].r_offset - st->func_ind;
+            k = peep_find(tab, n, off + 1) - 1;
+            rel[-1].r_offset = st->func_ind + tab[k].npos + off - tab[k].pos;
+        }
+    }
+    for(i = 0; i < st->nb_func_code_refs; i++) {
+        c = st->data_section->data + st->func_code_refs[i];
+        k = peep_find(tab, n, *(int *)c - st->func_ind);
+        *(int *)c = st->func_ind + tab[k].npos;
+    }
+    if (st->func_ind + rsize > sec->data_allocated)
+        section_realloc(st, sec, st->func_ind + rsize);
+    memcpy(sec->data + st->func_ind, out, rsize);
+    st->ind = st->func_ind + rsize;
+    ckfree((char *)out);
+ fail:
+    ckfree((char *)tab);
+}
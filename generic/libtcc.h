@@ -15,6 +15,10 @@ TCCState *tcc_new(Tcl_Obj *libpath);
 /* free a TCC compilation context */
 void tcc_delete(TCCState *s);
 
+/* free what a context compiled and make it a new one with the same
+   output type. Relocated code stays in memory. */
+void tcc_reset(TCCState *s);
+
 /* add debug information in the generated code */
 void tcc_enable_debug(TCCState *s);
 
@@ -25,6 +29,13 @@ void tcc_set_error_func(TCCState *s, void *error_opaque,
 /* set/reset a warning */
 int tcc_set_warning(TCCState *s, const char *warning_name, int value);
 
+/* set/reset a flag, such as "unsigned-char" or "sse2" */
+int tcc_set_flag(TCCState *s, const char *flag_name, int value);
+
+/* set the optimization level, 0 by default. From level 1 the i386
+   code of each function goes through a peephole optimizer */
+void tcc_set_optimize(TCCState *s, int level);
+
 /*****************************/
 /* preprocessor */
 
@@ -51,6 +62,10 @@ int tcc_add_file(TCCState *s, const char *filename);
    error. */
 int tcc_compile_string(TCCState *s, const char *buf);
 
+/* compile the 'len' bytes of C source at 'buf', mostly without copying
+   them. 'buf' is never written to. Return non zero if error. */
+int tcc_compile_buffer(TCCState *s, const char *buf, int len);
+
 /*****************************/
 /* linking commands */
 
@@ -20,27 +20,33 @@
 
 #include "tcc.h"
 
-/* This stuff is used by the code generation backend. */
-
-static int ind; /* output code index */
-static int loc; /* local variable index */
-static Section *cur_text_section; /* current section where function code is generated */
-static SValue *vtop;
-static Section *symtab_section;
-static CType func_vt; /* current function return type (used by return instruction) */
-static int func_vc;
-static Section *lbounds_section; /* contains local data bound description */
-/* Predefined types */
-static CType char_pointer_type;
-static CType func_old_type;
-
-/* compile with built-in memory and bounds checker */
-static int do_bounds_check = 0;
+/* All parser and code generator state lives in TCCState so that
+   independent handles can compile at the same time. Only constant
+   tables are kept at file scope. */
+
+/* true if isid(c) || isnum(c) */
+static unsigned char isidnum_table[256];
+/* the tables above are filled by the first tcc_new(), whatever the
+   thread it runs in */
+TCL_DECLARE_MUTEX(tcc_init_mutex)
+static int tcc_tables_initialized = 0;
+/* keywords and predefined macros, copied into every new state instead
+   of being parsed again. Never modified once built. */
+static TCCState *tcc_template = NULL;
+
+/* display benchmark infos */
+#if !defined(LIBTCC)
+static int do_bench = 0;
+#endif
 
 #ifdef TCC_TARGET_I386
 #include "i386/i386-gen.c"
 #endif
 
+#ifdef TCC_TARGET_X86_64
+#include "x86_64/x86_64-gen.c"
+#endif
+
 #ifdef TCC_TARGET_ARM
 #include "arm-gen.c"
 #endif
@@ -49,92 +55,19 @@ static int do_bounds_check = 0;
 #include "c67-gen.c"
 #endif
 
-/* parser */
-static struct BufferedFile *file;
-static int fch, tok;
-static CValue tokc;
-static CString tokcstr; /* current parsed string, if any */
-/* additional informations about token */
-static int tok_flags, next_tok_flags;
-
-static int *macro_ptr, *macro_ptr_allocated;
-static int *unget_saved_macro_ptr;
-static int unget_saved_buffer[TOK_MAX_SIZE + 1];
-static int unget_buffer_enabled;
-static int parse_flags;
-static Section *text_section, *data_section, *bss_section; /* predefined sections */
-#ifdef CONFIG_TCC_ASM
-static Section *last_text_section; /* to handle .previous asm directive */
-#endif
-
-/* bound check related sections */
-static Section *bounds_section; /* contains global data bound description */
-/* symbol sections */
-static Section *strtab_section;
-
-/* debug sections */
-static Section *stab_section, *stabstr_section;
-
-/*
-   rsym: return symbol
-   anon_sym: anonymous symbol index
-*/
-static int rsym, anon_sym;
-/* expression generation modifiers */
-static int const_wanted; /* true if constant wanted */
-static int global_expr;  /* true if compound literals must be allocated
-                            globally (used during initializers parsing */
-static int last_line_num, last_ind, func_ind; /* debug last line number and pc */
-static int tok_ident;
-static TokenSym **table_ident;
-static TokenSym *hash_ident[TOK_HASH_SIZE];
-static char token_buf[STRING_MAX_SIZE + 1];
-static char *funcname;
-static Sym *global_stack, *local_stack;
-static Sym *define_stack;
-static Sym *global_label_stack, *local_label_stack;
-/* symbol allocator */
-static Sym *sym_free_first;
-
-static SValue vstack[VSTACK_SIZE];
-/* some predefined types */
-static CType int_type;
-/* true if isid(c) || isnum(st, c) */
-static unsigned char isidnum_table[256];
-
-/* compile with debug symbol (and use them if error during execution) */
-static int do_debug = 0;
-
-/* display benchmark infos */
-#if !defined(LIBTCC)
-static int do_bench = 0;
-#endif
-static int total_lines;
-static int total_bytes;
-
-/* use GNU C extensions */
-static int gnu_ext = 1;
-
-/* use Tiny C extensions */
-static int tcc_ext = 1;
-
-/* max number of callers shown if error */
-static int num_callers = 6;
-static const char **rt_bound_error_msg;
-
 /********************************************************/
 
 /* we use our own 'finite' function to avoid potential problems with
    non standard math libs */
 /* XXX: endianness dependent */
-int ieee_finite(TCCState *st, double d)
+int ieee_finite(double d)
 {
     int *p = (int *)&d;
     return ((unsigned)((p[1] | 0x800fffff) + 1)) >> 31;
 }
 
 /* copy a string and truncate it. */
-static char *pstrcpy(TCCState *st, char *buf, int buf_size, const char *s)
+static char *pstrcpy(char *buf, int buf_size, const char *s)
 {
     char *q, *q_end;
     int c;
@@ -153,16 +86,16 @@ static char *pstrcpy(TCCState *st, char *buf, int buf_size, const char *s)
 }
 
 /* strcat and truncate. */
-static char *pstrcat(TCCState *st, char *buf, int buf_size, const char *s)
+static char *pstrcat(char *buf, int buf_size, const char *s)
 {
     int len;
     len = strlen(buf);
     if (len < buf_size) 
-        pstrcpy(st,  buf + len, buf_size - len, s);
+        pstrcpy(buf + len, buf_size - len, s);
     return buf;
 }
 
-static int strstart(TCCState *st, const char *str, const char *val, const char **ptr)
+static int strstart(const char *str, const char *val, const char **ptr)
 {
     const char *p, *q;
     p = str;
@@ -208,6 +141,93 @@ static char *tcc_strdup(TCCState *st, const char *str)
     return ptr;
 }
 
+/* The token strings made while compiling (macro bodies and arguments,
+   expansions, inline functions), the case labels of switch
+   statements and the stack slots of functions come from an arena that
+   is emptied at the end of tcc_compile instead of being freed one by one. Allocations
+   are bump allocated; the last one can grow or be freed in place, which
+   covers the usual build, expand and drop pattern of the preprocessor. */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+#define arena_data(c) ((char *)((c) + 1))
+
+static void *arena_malloc(TCCState *st, unsigned long size)
+{
+    ArenaChunk *c;
+    unsigned long n;
+
+    size = (size + 7) & ~7;
+    c = st->arena;
+    if (!c || c->used + size > c->size) {
+        n = c ? c->size * 2 : ARENA_CHUNK_SIZE;
+        while (n < size)
+            n *= 2;
+        c = tcc_malloc(st, sizeof(ArenaChunk) + n);
+        c->prev = st->arena;
+        c->size = n;
+        c->used = 0;
+        st->arena = c;
+    }
+    c->last = c->used;
+    c->used += size;
+    return arena_data(c) + c->last;
+}
+
+/* is 'ptr' in the arena */
+static int arena_owns(TCCState *st, void *ptr)
+{
+    ArenaChunk *c;
+
+    for(c = st->arena; c; c = c->prev) {
+        if ((char *)ptr >= arena_data(c) && (char *)ptr < arena_data(c) + c->size)
+            return 1;
+    }
+    return 0;
+}
+
+/* only the last allocation is really freed */
+static void arena_free(TCCState *st, void *ptr)
+{
+    ArenaChunk *c = st->arena;
+
+    if ((char *)ptr == arena_data(c) + c->last)
+        c->used = c->last;
+}
+
+/* grow 'ptr' of 'old_size' bytes, which may also be a heap block */
+static void *arena_realloc(TCCState *st, void *ptr, unsigned long old_size,
+                           unsigned long size)
+{
+    ArenaChunk *c = st->arena;
+    void *ptr1;
+
+    if (ptr && c && (char *)ptr == arena_data(c) + c->last &&
+        c->last + size <= c->size) {
+        c->used = c->last + ((size + 7) & ~7);
+        return ptr;
+    }
+    ptr1 = arena_malloc(st, size);
+    if (ptr) {
+        memcpy(ptr1, ptr, old_size);
+        if (!arena_owns(st, ptr))
+            ckfree((char *)ptr);
+    }
+    return ptr1;
+}
+
+/* empty the arena, keeping its first chunk for the next compilation */
+static void arena_reset(TCCState *st)
+{
+    ArenaChunk *c;
+
+    while ((c = st->arena) && c->prev) {
+        st->arena = c->prev;
+        ckfree((char *)c);
+    }
+    if (c)
+        c->used = c->last = 0;
+}
+
 #define malloc(s) ckalloc(s)
 
 static void dynarray_add(TCCState *st, void ***ptab, int *nb_ptr, void *data)
@@ -239,32 +259,33 @@ static Sym *__sym_malloc(TCCState *st)
     int i;
 
     sym_pool = tcc_malloc(st, SYM_POOL_NB * sizeof(Sym));
+    dynarray_add(st, &st->sym_pools, &st->nb_sym_pools, sym_pool);
 
-    last_sym = sym_free_first;
+    last_sym = st->sym_free_first;
     sym = sym_pool;
     for(i = 0; i < SYM_POOL_NB; i++) {
         sym->next = last_sym;
         last_sym = sym;
         sym++;
     }
-    sym_free_first = last_sym;
+    st->sym_free_first = last_sym;
     return last_sym;
 }
 
 static inline Sym *sym_malloc(TCCState * st)
 {
     Sym *sym;
-    sym = sym_free_first;
+    sym = st->sym_free_first;
     if (!sym)
         sym = __sym_malloc(st);
-    sym_free_first = sym->next;
+    st->sym_free_first = sym->next;
     return sym;
 }
 
 static inline void sym_free(TCCState *st, Sym *sym)
 {
-    sym->next = sym_free_first;
-    sym_free_first = sym;
+    sym->next = st->sym_free_first;
+    st->sym_free_first = sym;
 }
 
 Section *new_section(TCCState *st, const char *name, int sh_type, int sh_flags)
@@ -278,10 +299,11 @@ Section *new_section(TCCState *st, const char *name, int sh_type, int sh_flags)
     switch(sh_type) {
     case SHT_HASH:
     case SHT_REL:
+    case SHT_RELA:
     case SHT_DYNSYM:
     case SHT_SYMTAB:
     case SHT_DYNAMIC:
-        sec->sh_addralign = 4;
+        sec->sh_addralign = PTR_SIZE;
         break;
     case SHT_STRTAB:
         sec->sh_addralign = 1;
@@ -362,7 +384,7 @@ static void put_extern_sym2(TCCState * st, Sym *sym, Section *section,
                             int can_add_underscore)
 {
     int sym_type, sym_bind, sh_num, info;
-    Elf32_Sym *esym;
+    ElfW(Sym) *esym;
     const char *name;
     char buf1[256];
 
@@ -384,7 +406,7 @@ static void put_extern_sym2(TCCState * st, Sym *sym, Section *section,
         
         name = get_tok_str(st, sym->v, NULL);
 #if 0
-        if (do_bounds_check) {
+        if (st->do_bounds_check) {
             char buf[32];
 
             /* XXX: avoid doing that for statics ? */
@@ -414,13 +436,13 @@ static void put_extern_sym2(TCCState * st, Sym *sym, Section *section,
 #endif
         if (st->leading_underscore && can_add_underscore) {
             buf1[0] = '_';
-            pstrcpy(st,  buf1 + 1, sizeof(buf1) - 1, name);
+            pstrcpy(buf1 + 1, sizeof(buf1) - 1, name);
             name = buf1;
         }
-        info = ELF32_ST_INFO(sym_bind, sym_type);
-        sym->c = add_elf_sym(st, symtab_section, value, size, info, 0, sh_num, name);
+        info = ELFW(ST_INFO)(sym_bind, sym_type);
+        sym->c = add_elf_sym(st, st->symtab_section, value, size, info, 0, sh_num, name);
     } else {
-        esym = &((Elf32_Sym *)symtab_section->data)[sym->c];
+        esym = &((ElfW(Sym) *)st->symtab_section->data)[sym->c];
         esym->st_value = value;
         esym->st_size = size;
         esym->st_shndx = sh_num;
@@ -439,7 +461,7 @@ static void greloc(TCCState * st, Section *s, Sym *sym, unsigned long offset, in
     if (!sym->c) 
         put_extern_sym(st, sym, NULL, 0, 0);
     /* now we can add ELF relocation info */
-    put_elf_reloc(st, symtab_section, s, offset, type, sym->c);
+    put_elf_reloc(st, st->symtab_section, s, offset, type, sym->c);
 }
 
 static inline int isid(TCCState *st, int c)
@@ -488,16 +510,16 @@ void error1(TCCState *st, int is_warning, const char *fmt, va_list ap)
     BufferedFile **f;
     
     buf[0] = '\0';
-    if (file) {
+    if (st->file) {
         for(f = st->include_stack; f < st->include_stack_ptr; f++)
             strcat_printf(st, buf, sizeof(buf), "In file included from %s:%d:\n", 
                           (*f)->filename, (*f)->line_num);
-        if (file->line_num > 0) {
+        if (st->file->line_num > 0) {
             strcat_printf(st, buf, sizeof(buf), 
-                          "%s:%d: ", file->filename, file->line_num);
+                          "%s:%d: ", st->file->filename, st->file->line_num);
         } else {
             strcat_printf(st, buf, sizeof(buf),
-                          "%s: ", file->filename);
+                          "%s: ", st->file->filename);
         }
     } else {
         strcat_printf(st, buf, sizeof(buf),
@@ -571,75 +593,117 @@ void warning(TCCState * st, const char *fmt, ...)
 
 void skip(TCCState *st, int c)
 {
-    if (tok != c)
+    if (st->tok != c)
        tcc_error(st,"'%c' expected", c);
     next(st);
 }
 
 static void test_lvalue(TCCState *st)
 {
-    if (!(vtop->r & VT_LVAL))
+    if (!(st->vtop->r & VT_LVAL))
         expect(st, "lvalue");
 }
 
 /* allocate a new token */
-static TokenSym *tok_alloc_new(TCCState *st, TokenSym **pts, const char *str, int len)
+static TokenSym *tok_alloc_new(TCCState *st, const char *str, int len)
 {
     TokenSym *ts, **ptable;
     int i;
 
-    if (tok_ident >= SYM_FIRST_ANOM) 
+    if (st->tok_ident >= SYM_FIRST_ANOM) 
        tcc_error(st, "memory full");
 
     /* expand token table if needed */
-    i = tok_ident - TOK_IDENT;
+    i = st->tok_ident - TOK_IDENT;
     if ((i % TOK_ALLOC_INCR) == 0) {
-        ptable = tcc_realloc(st, table_ident, (i + TOK_ALLOC_INCR) * sizeof(TokenSym *));
+        ptable = tcc_realloc(st, st->table_ident, (i + TOK_ALLOC_INCR) * sizeof(TokenSym *));
         if (!ptable)
            tcc_error(st, "memory full");
-        table_ident = ptable;
+        st->table_ident = ptable;
     }
 
     ts = tcc_malloc(st, sizeof(TokenSym) + len);
-    table_ident[i] = ts;
-    ts->tok = tok_ident++;
+    st->table_ident[i] = ts;
+    ts->tok = st->tok_ident++;
     ts->sym_define = NULL;
     ts->sym_label = NULL;
     ts->sym_struct = NULL;
     ts->sym_identifier = NULL;
     ts->len = len;
-    ts->hash_next = NULL;
     memcpy(ts->str, str, len);
     ts->str[len] = '\0';
-    *pts = ts;
     return ts;
 }
 
-#define TOK_HASH_INIT 1
-#define TOK_HASH_FUNC(h, c) ((h) * 263 + (c))
+/* FNV-1a, one character at a time */
+#define TOK_HASH_INIT 2166136261U
+#define TOK_HASH_FUNC(h, c) (((h) ^ (c)) * 16777619U)
+
+/* resize the identifier hash table to 'size' slots */
+static void tok_hash_resize(TCCState *st, int size)
+{
+    TokenHash *tab, *old;
+    unsigned int i, j, mask;
+
+    tab = tcc_mallocz(st, size * sizeof(TokenHash));
+    mask = size - 1;
+    old = st->hash_ident;
+    if (old) {
+        for(i = 0; i <= (unsigned int)st->hash_ident_mask; i++) {
+            if (!old[i].tok)
+                continue;
+            for(j = old[i].hash & mask; tab[j].tok; j = (j + 1) & mask);
+            tab[j] = old[i];
+        }
+        ckfree((char *)old);
+    }
+    st->hash_ident = tab;
+    st->hash_ident_mask = mask;
+}
+
+/* find the token 'str' whose characters hash to 'h' with TOK_HASH_FUNC
+   and add it if not found */
+static TokenSym *tok_find(TCCState *st, const char *str, int len, unsigned int h)
+{
+    TokenHash *e;
+    TokenSym *ts;
+    unsigned int i;
+
+    /* mix the high bits into the low ones, which index the table */
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+
+    if (!st->hash_ident)
+        tok_hash_resize(st, TOK_HASH_SIZE);
+    for(i = h;; i++) {
+        e = &st->hash_ident[i & st->hash_ident_mask];
+        if (!e->tok)
+            break;
+        if (e->hash == h) {
+            ts = st->table_ident[e->tok - TOK_IDENT];
+            if (ts->len == len && !memcmp(ts->str, str, len))
+                return ts;
+        }
+    }
+    ts = tok_alloc_new(st, str, len);
+    e->hash = h;
+    e->tok = ts->tok;
+    if ((st->tok_ident - TOK_IDENT) * 2 > st->hash_ident_mask)
+        tok_hash_resize(st, (st->hash_ident_mask + 1) * 2);
+    return ts;
+}
 
 /* find a token and add it if not found */
 static TokenSym *tok_alloc(TCCState *st, const char *str, int len)
 {
-    TokenSym *ts, **pts;
     int i;
     unsigned int h;
     
     h = TOK_HASH_INIT;
     for(i=0;i<len;i++)
         h = TOK_HASH_FUNC(h, ((unsigned char *)str)[i]);
-    h &= (TOK_HASH_SIZE - 1);
-
-    pts = &hash_ident[h];
-    for(;;) {
-        ts = *pts;
-        if (!ts)
-            break;
-        if (ts->len == len && !memcmp(ts->str, str, len))
-            return ts;
-        pts = &(ts->hash_next);
-    }
-    return tok_alloc_new(st, pts, str, len);
+    return tok_find(st, str, len, h);
 }
 
 /* CString handling */
@@ -735,17 +799,17 @@ static void add_char(TCCState *st, CString *cstr, int c)
 /* XXX: float tokens */
 char *get_tok_str(TCCState *st, int v, CValue *cv)
 {
-    static char buf[STRING_MAX_SIZE + 1];
-    static CString cstr_buf;
+    char *buf = st->tok_str_buf;
+    CString *cstr_buf = &st->tok_str_cstr;
     CString *cstr;
     unsigned char *q;
     char *p;
     int i, len;
 
     /* NOTE: to go faster, we give a fixed buffer for small strings */
-    cstr_reset(st, &cstr_buf);
-    cstr_buf.data = buf;
-    cstr_buf.size_allocated = sizeof(buf);
+    cstr_reset(st, cstr_buf);
+    cstr_buf->data = buf;
+    cstr_buf->size_allocated = sizeof(st->tok_str_buf);
     p = buf;
 
     switch(v) {
@@ -761,33 +825,33 @@ char *get_tok_str(TCCState *st, int v, CValue *cv)
         break;
     case TOK_CCHAR:
     case TOK_LCHAR:
-        cstr_ccat(st, &cstr_buf, '\'');
-        add_char(st, &cstr_buf, cv->i);
-        cstr_ccat(st, &cstr_buf, '\'');
-        cstr_ccat(st, &cstr_buf, '\0');
+        cstr_ccat(st, cstr_buf, '\'');
+        add_char(st, cstr_buf, cv->i);
+        cstr_ccat(st, cstr_buf, '\'');
+        cstr_ccat(st, cstr_buf, '\0');
         break;
     case TOK_PPNUM:
         cstr = cv->cstr;
         len = cstr->size - 1;
         for(i=0;i<len;i++)
-            add_char(st, &cstr_buf, ((unsigned char *)cstr->data)[i]);
-        cstr_ccat(st, &cstr_buf, '\0');
+            add_char(st, cstr_buf, ((unsigned char *)cstr->data)[i]);
+        cstr_ccat(st, cstr_buf, '\0');
         break;
     case TOK_STR:
     case TOK_LSTR:
         cstr = cv->cstr;
-        cstr_ccat(st, &cstr_buf, '\"');
+        cstr_ccat(st, cstr_buf, '\"');
         if (v == TOK_STR) {
             len = cstr->size - 1;
             for(i=0;i<len;i++)
-                add_char(st, &cstr_buf, ((unsigned char *)cstr->data)[i]);
+                add_char(st, cstr_buf, ((unsigned char *)cstr->data)[i]);
         } else {
             len = (cstr->size / sizeof(nwchar_t)) - 1;
             for(i=0;i<len;i++)
-                add_char(st, &cstr_buf, ((nwchar_t *)cstr->data)[i]);
+                add_char(st, cstr_buf, ((nwchar_t *)cstr->data)[i]);
         }
-        cstr_ccat(st, &cstr_buf, '\"');
-        cstr_ccat(st, &cstr_buf, '\0');
+        cstr_ccat(st, cstr_buf, '\"');
+        cstr_ccat(st, cstr_buf, '\0');
         break;
     case TOK_LT:
         v = '<';
@@ -817,8 +881,8 @@ char *get_tok_str(TCCState *st, int v, CValue *cv)
         addv:
             *p++ = v;
             *p = '\0';
-        } else if (v < tok_ident) {
-            return table_ident[v - TOK_IDENT]->str;
+        } else if (v < st->tok_ident) {
+            return st->table_ident[v - TOK_IDENT]->str;
         } else if (v >= SYM_FIRST_ANOM) {
             /* special name for anonymous symbol */
             sprintf(p, "L.%u", v - SYM_FIRST_ANOM);
@@ -828,11 +892,11 @@ char *get_tok_str(TCCState *st, int v, CValue *cv)
         }
         break;
     }
-    return cstr_buf.data;
+    return cstr_buf->data;
 }
 
 /* push, without hashing */
-static Sym *sym_push2(TCCState *st, Sym **ps, int v, int t, int c)
+static Sym *sym_push2(TCCState *st, Sym **ps, int v, int t, long c)
 {
     Sym *s;
     s = sym_malloc(st);
@@ -862,18 +926,18 @@ static Sym *sym_find2(TCCState *st, Sym *s, int v)
 static inline Sym *struct_find(TCCState *st, int v)
 {
     v -= TOK_IDENT;
-    if ((unsigned)v >= (unsigned)(tok_ident - TOK_IDENT))
+    if ((unsigned)v >= (unsigned)(st->tok_ident - TOK_IDENT))
         return NULL;
-    return table_ident[v]->sym_struct;
+    return st->table_ident[v]->sym_struct;
 }
 
 /* find an identifier */
 static inline Sym *sym_find(TCCState *st, int v)
 {
     v -= TOK_IDENT;
-    if ((unsigned)v >= (unsigned)(tok_ident - TOK_IDENT))
+    if ((unsigned)v >= (unsigned)(st->tok_ident - TOK_IDENT))
         return NULL;
-    return table_ident[v]->sym_identifier;
+    return st->table_ident[v]->sym_identifier;
 }
 
 /* push a given symbol on the symbol stack */
@@ -882,10 +946,10 @@ static Sym *sym_push(TCCState *st, int v, CType *type, int r, int c)
     Sym *s, **ps;
     TokenSym *ts;
 
-    if (local_stack)
-        ps = &local_stack;
+    if (st->local_stack)
+        ps = &st->local_stack;
     else
-        ps = &global_stack;
+        ps = &st->global_stack;
     s = sym_push2(st, ps, v, type->t, c);
     s->type.ref = type->ref;
     s->r = r;
@@ -893,7 +957,7 @@ static Sym *sym_push(TCCState *st, int v, CType *type, int r, int c)
     /* XXX: simplify */
     if (!(v & SYM_FIELD) && (v & ~SYM_STRUCT) < SYM_FIRST_ANOM) {
         /* record symbol in token array */
-        ts = table_ident[(v & ~SYM_STRUCT) - TOK_IDENT];
+        ts = st->table_ident[(v & ~SYM_STRUCT) - TOK_IDENT];
         if (v & SYM_STRUCT)
             ps = &ts->sym_struct;
         else
@@ -908,10 +972,10 @@ static Sym *sym_push(TCCState *st, int v, CType *type, int r, int c)
 static Sym *global_identifier_push(TCCState *st, int v, int t, int c)
 {
     Sym *s, **ps;
-    s = sym_push2(st, &global_stack, v, t, c);
+    s = sym_push2(st, &st->global_stack, v, t, c);
     /* don't record anonymous symbol */
     if (v < SYM_FIRST_ANOM) {
-        ps = &table_ident[v - TOK_IDENT]->sym_identifier;
+        ps = &st->table_ident[v - TOK_IDENT]->sym_identifier;
         /* modify the top most local identifier, so that
            sym_identifier will point to 's' when popped */
         while (*ps != NULL)
@@ -936,7 +1000,7 @@ static void sym_pop(TCCState *st, Sym **ptop, Sym *b)
         /* remove symbol in token array */
         /* XXX: simplify */
         if (!(v & SYM_FIELD) && (v & ~SYM_STRUCT) < SYM_FIRST_ANOM) {
-            ts = table_ident[(v & ~SYM_STRUCT) - TOK_IDENT];
+            ts = st->table_ident[(v & ~SYM_STRUCT) - TOK_IDENT];
             if (v & SYM_STRUCT)
                 ps = &ts->sym_struct;
             else
@@ -951,32 +1015,84 @@ static void sym_pop(TCCState *st, Sym **ptop, Sym *b)
 
 /* I/O layer */
 
-BufferedFile *tcc_open(TCCState *st, const char *filename)
+#ifndef WIN32
+/* map the file at the native path of 'path' so that the lexer reads it
+   in place, the end of buffer mark going in the zeroed end of the last
+   page. Return NULL and set '*missing' if the file does not exist, or
+   NULL alone if it cannot be mapped (empty, no room after the last
+   byte, not in the native file system). */
+static BufferedFile *tcc_open_map(TCCState *st, Tcl_Obj *path, int *missing)
+{
+    const char *native;
+    BufferedFile *bf;
+    struct stat sb;
+    void *map;
+    int fd;
+
+    native = Tcl_FSGetNativePath(path);
+    if (!native)
+        return NULL;
+    fd = open(native, O_RDONLY);
+    if (fd < 0) {
+        *missing = (errno == ENOENT || errno == ENOTDIR);
+        return NULL;
+    }
+    map = MAP_FAILED;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+        sb.st_size < 0x7fffffff && sb.st_size % sysconf(_SC_PAGESIZE) != 0)
+        map = mmap(NULL, sb.st_size + 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    bf = tcc_malloc(st, sizeof(BufferedFile));
+    bf->fd = NULL;
+    bf->src_ptr = bf->src_end = NULL;
+    bf->map = map;
+    bf->map_size = sb.st_size + 1;
+    bf->buf_ptr = map;
+    bf->buf_end = bf->buf_ptr + sb.st_size;
+    *bf->buf_end = CH_EOB;
+    st->total_bytes += sb.st_size;
+    return bf;
+}
+#endif
+
+/* open 'filename' for reading. Sources are mapped if 'map' is set and
+   the file allows it, other files are read through a Tcl channel. */
+BufferedFile *tcc_open(TCCState *st, const char *filename, int map)
 {
     Tcl_Channel fd;
     BufferedFile *bf;
-    int i, len;
+    int i, len, missing;
     /*printf("opening '%s'\n", filename); */
     Tcl_Obj * path ;
     path = Tcl_NewStringObj(filename,-1);
     Tcl_IncrRefCount(path);
-    fd = Tcl_FSOpenFileChannel(NULL,path, "r", 0);
+    bf = NULL;
+    missing = 0;
+#ifndef WIN32
+    if (map)
+        bf = tcc_open_map(st, path, &missing);
+#endif
+    if (!bf && !missing) {
+        fd = Tcl_FSOpenFileChannel(NULL,path, "r", 0);
+        if (fd!=NULL) {
+            bf = tcc_malloc(st, sizeof(BufferedFile));
+            bf->fd = fd;
+            bf->map = NULL;
+            bf->src_ptr = bf->src_end = NULL;
+            bf->buf_ptr = bf->buffer;
+            bf->buf_end = bf->buffer;
+            bf->buffer[0] = CH_EOB; /* put eob symbol */
+        }
+    }
     Tcl_DecrRefCount(path);
-    if (fd==NULL) {
+    if (bf==NULL) {
         /*printf("T_FOFC, returned NULL\n");  */
         return NULL;
     }
-    /*printf("T_FOFC, returned SUCCESS\n");  */
-    bf = tcc_malloc(st, sizeof(BufferedFile));
-    if (!bf) {
-        Tcl_Close(NULL,fd);
-        return NULL;
-    }
-    bf->fd = fd;
-    bf->buf_ptr = bf->buffer;
-    bf->buf_end = bf->buffer;
-    bf->buffer[0] = CH_EOB; /* put eob symbol */
-    pstrcpy(st,  bf->filename, sizeof(bf->filename), filename);
+    pstrcpy(bf->filename, sizeof(bf->filename), filename);
     len = strlen(bf->filename);
     for (i = 0; i < len; i++)
         if (bf->filename[i] == '\\')
@@ -984,13 +1100,19 @@ BufferedFile *tcc_open(TCCState *st, const char *filename)
     bf->line_num = 1;
     bf->ifndef_macro = 0;
     bf->ifdef_stack_ptr = st->ifdef_stack_ptr;
+    bf->inc_file = NULL;
     return bf;
 }
 
-void tcc_close(BufferedFile *bf)
+void tcc_close(TCCState *st, BufferedFile *bf)
 {
-    total_lines += bf->line_num;
-    Tcl_Close(NULL,bf->fd);
+    st->total_lines += bf->line_num;
+#ifndef WIN32
+    if (bf->map)
+        munmap(bf->map, bf->map_size);
+    else
+#endif
+        Tcl_Close(NULL,bf->fd);
     ckfree((char *)bf);
 }
 
@@ -1010,9 +1132,14 @@ static int tcc_peekc_slow(TCCState *st, BufferedFile *bf)
             if (len < 0)
                 len = 0;
         } else {
-            len = 0;
-        }
-        total_bytes += len;
+            /* source string: copy its next block */
+            len = bf->src_end - bf->src_ptr;
+            if (len > IO_BUF_SIZE)
+                len = IO_BUF_SIZE;
+            memcpy(bf->buffer, bf->src_ptr, len);
+            bf->src_ptr += len;
+        }
+        st->total_bytes += len;
         bf->buf_ptr = bf->buffer;
         bf->buf_end = bf->buffer + len;
         *bf->buf_end = CH_EOB;
@@ -1029,16 +1156,16 @@ static int tcc_peekc_slow(TCCState *st, BufferedFile *bf)
    (but not stray) */
 static int handle_eob(TCCState *st)
 {
-    return tcc_peekc_slow(st, file);
+    return tcc_peekc_slow(st, st->file);
 }
 
 /* read next char from current input file and handle end of input buffer */
 static inline void inp(TCCState *st)
 {
-    fch = *(++(file->buf_ptr));
+    st->fch = *(++(st->file->buf_ptr));
     /* end of buffer/file handling */
-    if (fch == CH_EOB)
-        fch = handle_eob(st);
+    if (st->fch == CH_EOB)
+        st->fch = handle_eob(st);
 }
 
 /* space excluding newline */
@@ -1047,14 +1174,170 @@ static inline int is_space(TCCState *st, int ch)
     return ch == ' ' || ch == '\t' || ch == '\v' || ch == '\f' || ch == '\r';
 }
 
+/* Fast paths of the lexer. They skip the bytes from 'p' that the
+   byte at a time loops of the callers would skip, 16 at a time, but
+   only in the complete blocks before 'end', the end of the buffer: the
+   callers finish the job, so the end of buffer is handled as before. */
+#ifdef __SSE2__
+
+/* return a mask of the bytes of 'x' in the range [lo, lo + n) */
+static inline __m128i scan_range(__m128i x, int lo, int n)
+{
+    x = _mm_add_epi8(x, _mm_set1_epi8((char)(0x80 - lo)));
+    return _mm_cmplt_epi8(x, _mm_set1_epi8((char)(0x80 + n)));
+}
+
+/* skip the blocks without 'c1' or 'c2', stopping at the first of them
+   in the block found */
+static inline uint8_t *scan_to_chars(uint8_t *p, uint8_t *end,
+                                     int c1, int c2)
+{
+    __m128i x;
+    int mask;
+
+    while (p + 16 <= end) {
+        x = _mm_loadu_si128((__m128i *)p);
+        mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(c1)),
+                         _mm_cmpeq_epi8(x, _mm_set1_epi8(c2))));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return p;
+}
+
+/* skip the blocks of a C comment without its end or a backslash,
+   counting their newlines */
+static inline uint8_t *scan_comment(TCCState *st, uint8_t *p, uint8_t *end)
+{
+    __m128i x, y;
+    int mask, nl;
+
+    while (p + 17 <= end) {
+        x = _mm_loadu_si128((__m128i *)p);
+        y = _mm_loadu_si128((__m128i *)(p + 1));
+        mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('*')),
+                                       _mm_cmpeq_epi8(y, _mm_set1_epi8('/'))),
+                         _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))));
+        nl = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+        if (mask) {
+            mask = __builtin_ctz(mask);
+            st->file->line_num += __builtin_popcount(nl & ((1 << mask) - 1));
+            return p + mask;
+        }
+        st->file->line_num += __builtin_popcount(nl);
+        p += 16;
+    }
+    return p;
+}
+
+/* skip the blanks, spaces and tabs */
+static inline uint8_t *scan_blanks(uint8_t *p, uint8_t *end)
+{
+    __m128i x;
+    int mask;
+
+    while (p + 16 <= end) {
+        x = _mm_loadu_si128((__m128i *)p);
+        mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(x, _mm_set1_epi8('\t')))) ^ 0xffff;
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return p;
+}
+
+/* skip the letters, digits and underscores */
+static inline uint8_t *scan_idnum(uint8_t *p, uint8_t *end)
+{
+    __m128i x, id;
+    int mask;
+
+    while (p + 16 <= end) {
+        x = _mm_loadu_si128((__m128i *)p);
+        id = _mm_or_si128(scan_range(_mm_or_si128(x, _mm_set1_epi8(0x20)),
+                                     'a', 26),
+                          _mm_or_si128(scan_range(x, '0', 10),
+                                       _mm_cmpeq_epi8(x, _mm_set1_epi8('_'))));
+        mask = _mm_movemask_epi8(id) ^ 0xffff;
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return p;
+}
+
+#else
+
+/* a word with the byte 'c' in each of its bytes */
+#define SCAN_WORD(c) ((~0UL / 255) * (c))
+/* not zero if a byte of the word 'w' is zero */
+#define SCAN_HAS_ZERO(w) (((w) - SCAN_WORD(1)) & ~(w) & SCAN_WORD(0x80))
+
+static inline uint8_t *scan_to_chars(uint8_t *p, uint8_t *end,
+                                     int c1, int c2)
+{
+    unsigned long w;
+
+    while (p + sizeof(w) <= end) {
+        memcpy(&w, p, sizeof(w));
+        if (SCAN_HAS_ZERO(w ^ SCAN_WORD(c1)) ||
+            SCAN_HAS_ZERO(w ^ SCAN_WORD(c2)))
+            break;
+        p += sizeof(w);
+    }
+    return p;
+}
+
+/* skip the words of a C comment without a star or a backslash,
+   counting their newlines */
+static inline uint8_t *scan_comment(TCCState *st, uint8_t *p, uint8_t *end)
+{
+    unsigned long w, nl;
+
+    while (p + sizeof(w) <= end) {
+        memcpy(&w, p, sizeof(w));
+        if (SCAN_HAS_ZERO(w ^ SCAN_WORD('*')) ||
+            SCAN_HAS_ZERO(w ^ SCAN_WORD('\\')))
+            break;
+        /* exactly the bytes that are newlines, without the borrows of
+           SCAN_HAS_ZERO */
+        nl = w ^ SCAN_WORD('\n');
+        nl = ~(((nl & SCAN_WORD(0x7f)) + SCAN_WORD(0x7f)) | nl) &
+            SCAN_WORD(0x80);
+        while (nl) {
+            st->file->line_num++;
+            nl &= nl - 1;
+        }
+        p += sizeof(w);
+    }
+    return p;
+}
+
+static inline uint8_t *scan_blanks(uint8_t *p, uint8_t *end)
+{
+    return p;
+}
+
+static inline uint8_t *scan_idnum(uint8_t *p, uint8_t *end)
+{
+    return p;
+}
+
+#endif
+
 /* handle '\[\r]\n' */
 static int handle_stray_noerror(TCCState *st)
 {
-    while (fch == '\\') {
+    while (st->fch == '\\') {
         inp(st);
-        while (is_space(st, fch)) inp(st);
-        if (fch == '\n') {
-            file->line_num++;
+        while (is_space(st, st->fch)) inp(st);
+        if (st->fch == '\n') {
+            st->file->line_num++;
             inp(st);
         } else return 1;
     }
@@ -1073,18 +1356,18 @@ static int handle_stray1(TCCState *st, uint8_t *p)
 {
     int c;
 
-    if (p >= file->buf_end) {
-        file->buf_ptr = p;
+    if (p >= st->file->buf_end) {
+        st->file->buf_ptr = p;
         c = handle_eob(st);
-        p = file->buf_ptr;
+        p = st->file->buf_ptr;
         if (c == '\\')
             goto parse_stray;
     } else {
     parse_stray:
-        file->buf_ptr = p;
-        fch = *p;
+        st->file->buf_ptr = p;
+        st->fch = *p;
         handle_stray(st);
-        p = file->buf_ptr;
+        p = st->file->buf_ptr;
         c = *p;
     }
     return c;
@@ -1096,9 +1379,9 @@ static int handle_stray1(TCCState *st, uint8_t *p)
     p++;\
     c = *p;\
     if (c == '\\') {\
-        file->buf_ptr = p;\
+        st->file->buf_ptr = p;\
         c = handle_eob(st);\
-        p = file->buf_ptr;\
+        p = st->file->buf_ptr;\
     }\
 }
 
@@ -1109,7 +1392,7 @@ static int handle_stray1(TCCState *st, uint8_t *p)
     c = *p;\
     if (c == '\\') {\
         c = handle_stray1(st, p);\
-        p = file->buf_ptr;\
+        p = st->file->buf_ptr;\
     }\
 }
 
@@ -1119,7 +1402,7 @@ static int handle_stray1(TCCState *st, uint8_t *p)
 static void minp(TCCState *st)
 {
     inp(st);
-    if (fch == '\\') 
+    if (st->fch == '\\') 
         handle_stray(st);
 }
 
@@ -1131,23 +1414,24 @@ static uint8_t *parse_line_comment(TCCState *st, uint8_t *p)
 
     p++;
     for(;;) {
+        p = scan_to_chars(p, st->file->buf_end, '\n', '\\');
         c = *p;
     redo:
         if (c == '\n' || c == CH_EOF) {
             break;
         } else if (c == '\\') {
-            file->buf_ptr = p;
+            st->file->buf_ptr = p;
             c = handle_eob(st);
-            p = file->buf_ptr;
+            p = st->file->buf_ptr;
             if (c == '\\') {
                 PEEKC_EOB(st, c, p);
                 if (c == '\n') {
-                    file->line_num++;
+                    st->file->line_num++;
                     PEEKC_EOB(st, c, p);
                 } else if (c == '\r') {
                     PEEKC_EOB(st, c, p);
                     if (c == '\n') {
-                        file->line_num++;
+                        st->file->line_num++;
                         PEEKC_EOB(st, c, p);
                     }
                 }
@@ -1169,6 +1453,7 @@ static uint8_t *parse_comment(TCCState *st, uint8_t *p)
     p++;
     for(;;) {
         /* fast skip loop */
+        p = scan_comment(st, p, st->file->buf_end);
         for(;;) {
             c = *p;
             if (c == '\n' || c == '*' || c == '\\')
@@ -1181,7 +1466,7 @@ static uint8_t *parse_comment(TCCState *st, uint8_t *p)
         }
         /* now we can handle all the cases */
         if (c == '\n') {
-            file->line_num++;
+            st->file->line_num++;
             p++;
         } else if (c == '*') {
             p++;
@@ -1192,20 +1477,20 @@ static uint8_t *parse_comment(TCCState *st, uint8_t *p)
                 } else if (c == '/') {
                     goto end_of_comment;
                 } else if (c == '\\') {
-                    file->buf_ptr = p;
+                    st->file->buf_ptr = p;
                     c = handle_eob(st);
-                    p = file->buf_ptr;
+                    p = st->file->buf_ptr;
                     if (c == '\\') {
                         /* skip '\[\r]\n', otherwise just skip the stray */
                         while (c == '\\') {
                             PEEKC_EOB(st, c, p);
                             if (c == '\n') {
-                                file->line_num++;
+                                st->file->line_num++;
                                 PEEKC_EOB(st, c, p);
                             } else if (c == '\r') {
                                 PEEKC_EOB(st, c, p);
                                 if (c == '\n') {
-                                    file->line_num++;
+                                    st->file->line_num++;
                                     PEEKC_EOB(st, c, p);
                                 }
                             } else {
@@ -1220,9 +1505,9 @@ static uint8_t *parse_comment(TCCState *st, uint8_t *p)
         after_star: ;
         } else {
             /* stray, eob or eof */
-            file->buf_ptr = p;
+            st->file->buf_ptr = p;
             c = handle_eob(st);
-            p = file->buf_ptr;
+            p = st->file->buf_ptr;
             if (c == CH_EOF) {
                tcc_error(st, "unexpected end of file in comment");
             } else if (c == '\\') {
@@ -1239,8 +1524,12 @@ static uint8_t *parse_comment(TCCState *st, uint8_t *p)
 
 static inline void skip_spaces(TCCState *st)
 {
-    while (is_space(st, fch))
+    while (is_space(st, st->fch)) {
+        /* skip the blanks which follow at once */
+        st->file->buf_ptr = scan_blanks(st->file->buf_ptr + 1,
+                                        st->file->buf_end) - 1;
         cinp(st);
+    }
 }
 
 /* parse a string without interpreting escapes */
@@ -1254,9 +1543,9 @@ static uint8_t *parse_pp_string(TCCState *st, uint8_t *p,
         if (c == sep) {
             break;
         } else if (c == '\\') {
-            file->buf_ptr = p;
+            st->file->buf_ptr = p;
             c = handle_eob(st);
-            p = file->buf_ptr;
+            p = st->file->buf_ptr;
             if (c == CH_EOF) {
             unterminated_string:
                 /* XXX: indicate line number of start of string */
@@ -1265,13 +1554,13 @@ static uint8_t *parse_pp_string(TCCState *st, uint8_t *p,
                 /* escape : just skip \[\r]\n */
                 PEEKC_EOB(st, c, p);
                 if (c == '\n') {
-                    file->line_num++;
+                    st->file->line_num++;
                     p++;
                 } else if (c == '\r') {
                     PEEKC_EOB(st, c, p);
                     if (c != '\n')
                         expect(st, "'\n' after '\r'");
-                    file->line_num++;
+                    st->file->line_num++;
                     p++;
                 } else if (c == CH_EOF) {
                     goto unterminated_string;
@@ -1284,7 +1573,7 @@ static uint8_t *parse_pp_string(TCCState *st, uint8_t *p,
                 }
             }
         } else if (c == '\n') {
-            file->line_num++;
+            st->file->line_num++;
             goto add_char;
         } else if (c == '\r') {
             PEEKC_EOB(st, c, p);
@@ -1292,7 +1581,7 @@ static uint8_t *parse_pp_string(TCCState *st, uint8_t *p,
                 if (str)
                     cstr_ccat(st, str, '\r');
             } else {
-                file->line_num++;
+                st->file->line_num++;
                 goto add_char;
             }
         } else {
@@ -1313,7 +1602,7 @@ void preprocess_skip(TCCState *st)
     int a, start_of_line, c;
     uint8_t *p;
 
-    p = file->buf_ptr;
+    p = st->file->buf_ptr;
     start_of_line = 1;
     a = 0;
     for(;;) {
@@ -1329,19 +1618,19 @@ void preprocess_skip(TCCState *st)
             goto redo_no_start;
         case '\n':
             start_of_line = 1;
-            file->line_num++;
+            st->file->line_num++;
             p++;
             goto redo_no_start;
         case '\\':
-            file->buf_ptr = p;
+            st->file->buf_ptr = p;
             c = handle_eob(st);
             if (c == CH_EOF) {
                 expect(st, "#endif");
             } else if (c == '\\') {
-                fch = file->buf_ptr[0];
+                st->fch = st->file->buf_ptr[0];
                 handle_stray_noerror(st);
             }
-            p = file->buf_ptr;
+            p = st->file->buf_ptr;
             goto redo_no_start;
             /* skip strings */
         case '\"':
@@ -1350,13 +1639,13 @@ void preprocess_skip(TCCState *st)
             break;
             /* skip comments */
         case '/':
-            file->buf_ptr = p;
-            fch = *p;
+            st->file->buf_ptr = p;
+            st->fch = *p;
             minp(st);
-            p = file->buf_ptr;
-            if (fch == '*') {
+            p = st->file->buf_ptr;
+            if (st->fch == '*') {
                 p = parse_comment(st, p);
-            } else if (fch == '/') {
+            } else if (st->fch == '/') {
                 p = parse_line_comment(st, p);
             }
             break;
@@ -1364,15 +1653,15 @@ void preprocess_skip(TCCState *st)
         case '#':
             p++;
             if (start_of_line) {
-                file->buf_ptr = p;
+                st->file->buf_ptr = p;
                 next_nomacro(st);
-                p = file->buf_ptr;
+                p = st->file->buf_ptr;
                 if (a == 0 && 
-                    (tok == TOK_ELSE || tok == TOK_ELIF || tok == TOK_ENDIF))
+                    (st->tok == TOK_ELSE || st->tok == TOK_ELIF || st->tok == TOK_ENDIF))
                     goto the_end;
-                if (tok == TOK_IF || tok == TOK_IFDEF || tok == TOK_IFNDEF)
+                if (st->tok == TOK_IF || st->tok == TOK_IFDEF || st->tok == TOK_IFNDEF)
                     a++;
-                else if (tok == TOK_ENDIF)
+                else if (st->tok == TOK_ENDIF)
                     a--;
             }
             break;
@@ -1383,7 +1672,7 @@ void preprocess_skip(TCCState *st)
         start_of_line = 0;
     }
  the_end: ;
-    file->buf_ptr = p;
+    st->file->buf_ptr = p;
 }
 
 /* ParseState handling */
@@ -1395,19 +1684,19 @@ void preprocess_skip(TCCState *st)
 /* save current parse state in 's' */
 void save_parse_state(TCCState *st, ParseState *s)
 {
-    s->line_num = file->line_num;
-    s->macro_ptr = macro_ptr;
-    s->tok = tok;
-    s->tokc = tokc;
+    s->line_num = st->file->line_num;
+    s->macro_ptr = st->macro_ptr;
+    s->tok = st->tok;
+    s->tokc = st->tokc;
 }
 
 /* restore parse state from 's' */
 void restore_parse_state(TCCState *st, ParseState *s)
 {
-    file->line_num = s->line_num;
-    macro_ptr = s->macro_ptr;
-    tok = s->tok;
-    tokc = s->tokc;
+    st->file->line_num = s->line_num;
+    st->macro_ptr = s->macro_ptr;
+    st->tok = s->tok;
+    st->tokc = s->tokc;
 }
 
 /* return the number of additional 'ints' necessary to store the
@@ -1447,11 +1736,64 @@ static inline void tok_str_new(TCCState *st, TokenString *s)
     s->len = 0;
     s->allocated_len = 0;
     s->last_line_num = -1;
+    s->expand = NULL;
 }
 
 static void tok_str_free(TCCState *st, int *str)
 {
-    ckfree((char *)str);
+    if (arena_owns(st, str))
+        arena_free(st, str);
+    else
+        ckfree((char *)str);
+}
+
+/* start a token string in a free expansion buffer of 'st' */
+static void tok_str_new_expand(TCCState *st, TokenString *s)
+{
+    ExpandBuffer *b;
+
+    b = st->expand_free;
+    if (b) {
+        st->expand_free = b->next;
+    } else {
+        b = tcc_malloc(st, sizeof(ExpandBuffer) +
+                       EXPAND_BUFFER_SIZE * sizeof(int));
+        b->size = EXPAND_BUFFER_SIZE;
+        b->index = st->nb_expand_buffers;
+        dynarray_add(st, (void ***)&st->expand_buffers,
+                     &st->nb_expand_buffers, b);
+        st->expand_bytes += sizeof(ExpandBuffer) +
+            EXPAND_BUFFER_SIZE * sizeof(int);
+    }
+    s->str = (int *)(b + 1);
+    s->len = 0;
+    s->allocated_len = b->size;
+    s->last_line_num = -1;
+    s->expand = b;
+}
+
+/* give back the expansion buffer holding 'str' */
+static void tok_str_free_expand(TCCState *st, int *str)
+{
+    ExpandBuffer *b = (ExpandBuffer *)str - 1;
+
+    b->next = st->expand_free;
+    st->expand_free = b;
+}
+
+/* mark all the expansion buffers free, whatever an error left in use,
+   and clear the counters for a new compilation */
+static void expand_buffers_reset(TCCState *st)
+{
+    int i;
+
+    st->expand_free = NULL;
+    for(i = st->nb_expand_buffers - 1; i >= 0; i--) {
+        st->expand_buffers[i]->next = st->expand_free;
+        st->expand_free = st->expand_buffers[i];
+    }
+    st->nb_expansions = 0;
+    st->expand_bytes = 0;
 }
 
 static int *tok_str_realloc(TCCState *st, TokenString *s)
@@ -1463,7 +1805,20 @@ static int *tok_str_realloc(TCCState *st, TokenString *s)
     } else {
         len = s->allocated_len * 2;
     }
-    str = tcc_realloc(st, s->str, len * sizeof(int));
+    if (s->expand) {
+        ExpandBuffer *b;
+
+        b = tcc_realloc(st, s->expand, sizeof(ExpandBuffer) + len * sizeof(int));
+        b->size = len;
+        st->expand_buffers[b->index] = b;
+        st->expand_bytes += (len - s->allocated_len) * sizeof(int);
+        s->expand = b;
+        str = (int *)(b + 1);
+    } else if (st->arena_enabled)
+        str = arena_realloc(st, s->str, s->allocated_len * sizeof(int),
+                            len * sizeof(int));
+    else
+        str = tcc_realloc(st, s->str, len * sizeof(int));
     if (!str)
        tcc_error(st, "memory full");
     s->allocated_len = len;
@@ -1539,6 +1894,12 @@ static void tok_str_add2(TCCState *st, TokenString *s, int t, int tf, CValue *cv
         str[len++] = cv->tab[0];
         str[len++] = cv->tab[1];
         str[len++] = cv->tab[2];
+#elif LDOUBLE_SIZE == 16
+    case TOK_CLDOUBLE:
+        str[len++] = cv->tab[0];
+        str[len++] = cv->tab[1];
+        str[len++] = cv->tab[2];
+        str[len++] = cv->tab[3];
 #elif LDOUBLE_SIZE != 8
 #error add long double size support
 #endif
@@ -1555,12 +1916,12 @@ static void tok_str_add_tok(TCCState *st, TokenString *s)
     CValue cval;
 
     /* save line number info */
-    if (file->line_num != s->last_line_num) {
-        s->last_line_num = file->line_num;
+    if (st->file->line_num != s->last_line_num) {
+        s->last_line_num = st->file->line_num;
         cval.i = s->last_line_num;
         tok_str_add2(st, s, TOK_LINENUM, 0, &cval);
     }
-    tok_str_add2(st, s, tok, tok_flags, &tokc);
+    tok_str_add2(st, s, st->tok, st->tok_flags, &st->tokc);
 }
 
 #if LDOUBLE_SIZE == 12
@@ -1568,6 +1929,12 @@ static void tok_str_add_tok(TCCState *st, TokenString *s)
         cv.tab[0] = p[0];                       \
         cv.tab[1] = p[1];                       \
         cv.tab[2] = p[2];
+#elif LDOUBLE_SIZE == 16
+#define LDOUBLE_GET(st, p, cv)                      \
+        cv.tab[0] = p[0];                       \
+        cv.tab[1] = p[1];                       \
+        cv.tab[2] = p[2];                       \
+        cv.tab[3] = p[3];
 #elif LDOUBLE_SIZE == 8
 #define LDOUBLE_GET(st, p, cv)                      \
         cv.tab[0] = p[0];                       \
@@ -1615,32 +1982,84 @@ static void tok_str_add_tok(TCCState *st, TokenString *s)
     }                                           \
 }
 
+/* length in ints of a token string, including the final 0. Unlike
+   TOK_GET it does not write to the string, which may be shared between
+   threads (template and precompiled header macros) */
+static int tok_str_len(TCCState *st, const int *str)
+{
+    const int *p;
+    int t;
+
+    p = str;
+    for(;;) {
+        t = *p;
+        p += 2;
+        switch(t) {
+        case 0:
+            return p - str;
+        case TOK_CINT:
+        case TOK_CUINT:
+        case TOK_CCHAR:
+        case TOK_LCHAR:
+        case TOK_CFLOAT:
+        case TOK_LINENUM:
+            p++;
+            break;
+        case TOK_STR:
+        case TOK_LSTR:
+        case TOK_PPNUM:
+            p += (sizeof(CString) + ((const CString *)p)->size + 3) >> 2;
+            break;
+        case TOK_CDOUBLE:
+        case TOK_CLLONG:
+        case TOK_CULLONG:
+            p += 2;
+            break;
+        case TOK_CLDOUBLE:
+            p += LDOUBLE_SIZE / 4;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static int *tok_str_dup(TCCState *st, const int *str)
+{
+    int *str1, len;
+
+    len = tok_str_len(st, str) * sizeof(int);
+    str1 = tcc_malloc(st, len);
+    memcpy(str1, str, len);
+    return str1;
+}
+
 /* defines handling */
 static inline void define_push(TCCState *st, int v, int macro_type, int *str, Sym *first_arg)
 {
     Sym *s;
 
-    s = sym_push2(st, &define_stack, v, macro_type, (int)str);
+    s = sym_push2(st, &st->define_stack, v, macro_type, (long)str);
     s->next = first_arg;
-    table_ident[v - TOK_IDENT]->sym_define = s;
+    st->table_ident[v - TOK_IDENT]->sym_define = s;
 }
 
 /* undefined a define symbol. Its name is just set to zero */
-static void define_undef(Sym *s)
+static void define_undef(TCCState *st, Sym *s)
 {
     int v;
     v = s->v;
-    if (v >= TOK_IDENT && v < tok_ident)
-        table_ident[v - TOK_IDENT]->sym_define = NULL;
+    if (v >= TOK_IDENT && v < st->tok_ident)
+        st->table_ident[v - TOK_IDENT]->sym_define = NULL;
     s->v = 0;
 }
 
 static inline Sym *define_find(TCCState *st, int v)
 {
     v -= TOK_IDENT;
-    if ((unsigned)v >= (unsigned)(tok_ident - TOK_IDENT))
+    if ((unsigned)v >= (unsigned)(st->tok_ident - TOK_IDENT))
         return NULL;
-    return table_ident[v]->sym_define;
+    return st->table_ident[v]->sym_define;
 }
 
 /* free define stack until top reaches 'b' */
@@ -1649,28 +2068,28 @@ static void free_defines(TCCState *st, Sym *b)
     Sym *top, *top1;
     int v;
 
-    top = define_stack;
+    top = st->define_stack;
     while (top != b) {
         top1 = top->prev;
         /* do not free args or predefined defines */
         if (top->c)
             tok_str_free(st, (int *)top->c);
         v = top->v;
-        if (v >= TOK_IDENT && v < tok_ident)
-            table_ident[v - TOK_IDENT]->sym_define = NULL;
+        if (v >= TOK_IDENT && v < st->tok_ident)
+            st->table_ident[v - TOK_IDENT]->sym_define = NULL;
         sym_free(st, top);
         top = top1;
     }
-    define_stack = b;
+    st->define_stack = b;
 }
 
 /* label lookup */
 static Sym *label_find(TCCState *st, int v)
 {
     v -= TOK_IDENT;
-    if ((unsigned)v >= (unsigned)(tok_ident - TOK_IDENT))
+    if ((unsigned)v >= (unsigned)(st->tok_ident - TOK_IDENT))
         return NULL;
-    return table_ident[v]->sym_label;
+    return st->table_ident[v]->sym_label;
 }
 
 static Sym *label_push(TCCState *st, Sym **ptop, int v, int flags)
@@ -1678,8 +2097,8 @@ static Sym *label_push(TCCState *st, Sym **ptop, int v, int flags)
     Sym *s, **ps;
     s = sym_push2(st, ptop, v, 0, 0);
     s->r = flags;
-    ps = &table_ident[v - TOK_IDENT]->sym_label;
-    if (ptop == &global_label_stack) {
+    ps = &st->table_ident[v - TOK_IDENT]->sym_label;
+    if (ptop == &st->global_label_stack) {
         /* modify the top most local identifier, so that
            sym_identifier will point to 's' when popped */
         while (*ps != NULL)
@@ -1706,11 +2125,11 @@ static void label_pop(TCCState * state, Sym **ptop, Sym *slast)
             if (s->c) {
                 /* define corresponding symbol. A size of
                    1 is put. */
-                put_extern_sym(state, s, cur_text_section, (long)s->next, 1);
+                put_extern_sym(state, s, state->cur_text_section, (long)s->next, 1);
             }
         }
         /* remove label */
-        table_ident[s->v - TOK_IDENT]->sym_label = s->prev_tok;
+        state->table_ident[s->v - TOK_IDENT]->sym_label = s->prev_tok;
         sym_free(state, s);
     }
     *ptop = slast;
@@ -1723,32 +2142,32 @@ static int expr_preprocess(TCCState *st)
     TokenString str;
     
     tok_str_new(st, &str);
-    while (tok != TOK_LINEFEED && tok != TOK_EOF) {
+    while (st->tok != TOK_LINEFEED && st->tok != TOK_EOF) {
         next(st); /* do macro subst */
-        if (tok == TOK_DEFINED) {
+        if (st->tok == TOK_DEFINED) {
             next_nomacro(st);
-            t = tok;
+            t = st->tok;
             if (t == '(') 
                 next_nomacro(st);
-            c = define_find(st, tok) != 0;
+            c = define_find(st, st->tok) != 0;
             if (t == '(')
                 next_nomacro(st);
-            tok = TOK_CINT;
-            tokc.i = c;
-        } else if (tok >= TOK_IDENT) {
+            st->tok = TOK_CINT;
+            st->tokc.i = c;
+        } else if (st->tok >= TOK_IDENT) {
             /* if undefined macro */
-            tok = TOK_CINT;
-            tokc.i = 0;
+            st->tok = TOK_CINT;
+            st->tokc.i = 0;
         }
         tok_str_add_tok(st, &str);
     }
     tok_str_add(st, &str, -1, 0); /* simulate end of file */
     tok_str_add(st, &str, 0, 0);
     /* now evaluate C constant expression */
-    macro_ptr = str.str;
+    st->macro_ptr = str.str;
     next(st);
     c = expr_const(st);
-    macro_ptr = NULL;
+    st->macro_ptr = NULL;
     tok_str_free(st, str.str);
     return c != 0;
 }
@@ -1776,37 +2195,37 @@ static void parse_define(TCCState *st)
     int v, t, varg, is_vaargs, c;
     TokenString str;
     
-    v = tok;
+    v = st->tok;
     if (v < TOK_IDENT)
-       tcc_error(st, "invalid macro name '%s'", get_tok_str(st, tok, &tokc));
+       tcc_error(st, "invalid macro name '%s'", get_tok_str(st, st->tok, &st->tokc));
     /* XXX: should check if same macro (ANSI) */
     first = NULL;
     t = MACRO_OBJ;
     /* '(' must be just after macro definition for MACRO_FUNC */
-    c = file->buf_ptr[0];
+    c = st->file->buf_ptr[0];
     if (c == '\\')
-        c = handle_stray1(st, file->buf_ptr);
+        c = handle_stray1(st, st->file->buf_ptr);
     if (c == '(') {
         next_nomacro(st);
         next_nomacro(st);
         ps = &first;
-        while (tok != ')') {
-            varg = tok;
+        while (st->tok != ')') {
+            varg = st->tok;
             next_nomacro(st);
             is_vaargs = 0;
             if (varg == TOK_DOTS) {
                 varg = TOK___VA_ARGS__;
                 is_vaargs = 1;
-            } else if (tok == TOK_DOTS && gnu_ext) {
+            } else if (st->tok == TOK_DOTS && st->gnu_ext) {
                 is_vaargs = 1;
                 next_nomacro(st);
             }
             if (varg < TOK_IDENT)
                tcc_error(st,"badly punctuated parameter list");
-            s = sym_push2(st,&define_stack, varg | SYM_FIELD, is_vaargs, 0);
+            s = sym_push2(st,&st->define_stack, varg | SYM_FIELD, is_vaargs, 0);
             *ps = s;
             ps = &s->next;
-            if (tok != ',')
+            if (st->tok != ',')
                 break;
             next_nomacro(st);
         }
@@ -1815,8 +2234,8 @@ static void parse_define(TCCState *st)
     tok_str_new(st, &str);
     next_nomacro(st);
     /* EOF testing necessary for '-D' handling */
-    while (tok != TOK_LINEFEED && tok != TOK_EOF) {
-        tok_str_add2(st,&str, tok, tok_flags, &tokc);
+    while (st->tok != TOK_LINEFEED && st->tok != TOK_EOF) {
+        tok_str_add2(st,&str, st->tok, st->tok_flags, &st->tokc);
         next_nomacro(st);
     }
     tok_str_add(st,&str, 0, 0);
@@ -1827,6 +2246,253 @@ static void parse_define(TCCState *st)
     define_push(st, v, t, str.str, first);
 }
 
+/* The include cache of the process. Whatever handle and path they are
+   included by, it knows the guard macro of the headers and if they
+   have '#pragma once', so that they are not opened when they would add
+   nothing, and the names the include directories do not hold, so that
+   they are not looked for there again. Headers are known by their
+   device and inode, and trusted while their modification time and size
+   do not change, directories while their modification time does not.
+   Entries are never freed. */
+TCL_DECLARE_MUTEX(include_mutex)
+static Tcl_HashTable include_files;     /* IncludeFile by IncludeKey */
+static Tcl_HashTable include_dirs;      /* IncludeDir by path */
+static int include_cache_initialized;
+
+typedef struct IncludeKey {
+    Tcl_WideInt dev, ino;
+} IncludeKey;
+
+/* marks the include paths whose misses are not cached */
+static IncludeDir include_dir_none;
+/* incremented when the contents of an include directory may change */
+static int include_generation;
+
+/* call with include_mutex locked */
+static void include_cache_init(void)
+{
+    if (!include_cache_initialized) {
+        Tcl_InitHashTable(&include_files, sizeof(IncludeKey) / sizeof(int));
+        Tcl_InitHashTable(&include_dirs, TCL_STRING_KEYS);
+        include_cache_initialized = 1;
+    }
+}
+
+/* return the include cache entry of the file 'sb' describes, or NULL
+   if the file system gives no inode numbers */
+static IncludeFile *include_file_get(TCCState *st, Tcl_StatBuf *sb)
+{
+    IncludeKey key;
+    Tcl_HashEntry *entry;
+    IncludeFile *f;
+    int new;
+
+    if (sb->st_ino == 0)
+        return NULL;
+    memset(&key, 0, sizeof(key));
+    key.dev = sb->st_dev;
+    key.ino = sb->st_ino;
+    Tcl_MutexLock(&include_mutex);
+    include_cache_init();
+    entry = Tcl_CreateHashEntry(&include_files, (char *)&key, &new);
+    if (new) {
+        f = (IncludeFile *)ckalloc(sizeof(IncludeFile));
+        f->guard = NULL;
+        Tcl_SetHashValue(entry, f);
+    } else {
+        f = (IncludeFile *)Tcl_GetHashValue(entry);
+    }
+    if (new || f->mtime != sb->st_mtime || f->size != sb->st_size) {
+        /* new or modified */
+        f->mtime = sb->st_mtime;
+        f->size = sb->st_size;
+        f->once = 0;
+        if (f->guard)
+            ckfree(f->guard);
+        f->guard = NULL;
+    }
+    Tcl_MutexUnlock(&include_mutex);
+    return f;
+}
+
+/* record that the header 'f' is all guarded by the macro 'guard', or
+   has '#pragma once' if 'guard' is NULL */
+static void include_file_set(TCCState *st, IncludeFile *f, const char *guard)
+{
+    Tcl_MutexLock(&include_mutex);
+    if (!guard) {
+        f->once = 1;
+    } else if (!f->guard || strcmp(f->guard, guard)) {
+        if (f->guard)
+            ckfree(f->guard);
+        f->guard = strcpy(ckalloc(strlen(guard) + 1), guard);
+    }
+    Tcl_MutexUnlock(&include_mutex);
+}
+
+/* return true if including the header 'f' again would add nothing */
+static int include_file_skip(TCCState *st, IncludeFile *f)
+{
+    char guard[256];
+    int i, once;
+
+    Tcl_MutexLock(&include_mutex);
+    once = f->once;
+    guard[0] = '\0';
+    if (f->guard)
+        pstrcpy(guard, sizeof(guard), f->guard);
+    Tcl_MutexUnlock(&include_mutex);
+    if (once) {
+        for(i = 0; i < st->nb_included_files; i++) {
+            if (st->included_files[i] == f)
+                return 1;
+        }
+    }
+    return guard[0] && define_find(st, tok_alloc(st, guard, strlen(guard))->tok);
+}
+
+/* return the include cache entry of the directory 'path', or
+   include_dir_none if its misses cannot be cached */
+static IncludeDir *include_dir_check(TCCState *st, const char *path)
+{
+    Tcl_StatBuf sb;
+    Tcl_Obj *obj;
+    Tcl_HashEntry *entry;
+    IncludeDir *d;
+    int new;
+
+    d = &include_dir_none;
+    obj = Tcl_NewStringObj(path, -1);
+    Tcl_IncrRefCount(obj);
+    /* a directory modified in the last second may still change
+       without its time changing */
+    if (Tcl_FSStat(obj, &sb) == 0 && S_ISDIR(sb.st_mode) &&
+        sb.st_ino != 0 && sb.st_mtime < time(NULL) - 1) {
+        Tcl_MutexLock(&include_mutex);
+        include_cache_init();
+        entry = Tcl_CreateHashEntry(&include_dirs, path, &new);
+        if (new) {
+            d = (IncludeDir *)ckalloc(sizeof(IncludeDir));
+            Tcl_InitHashTable(&d->missing, TCL_STRING_KEYS);
+            Tcl_SetHashValue(entry, d);
+        } else {
+            d = (IncludeDir *)Tcl_GetHashValue(entry);
+        }
+        if (new || d->dev != sb.st_dev || d->ino != sb.st_ino ||
+            d->mtime != sb.st_mtime) {
+            /* new or modified */
+            d->dev = sb.st_dev;
+            d->ino = sb.st_ino;
+            d->mtime = sb.st_mtime;
+            Tcl_DeleteHashTable(&d->missing);
+            Tcl_InitHashTable(&d->missing, TCL_STRING_KEYS);
+            include_generation++;
+        }
+        Tcl_MutexUnlock(&include_mutex);
+    }
+    Tcl_DecrRefCount(obj);
+    return d;
+}
+
+/* check the include paths once per compilation. Where a header was
+   found along them can be remembered only if none can be modified
+   unnoticed: st->include_generation is then the generation of the
+   include cache they were found in, else -1. */
+static void include_paths_check(TCCState *st)
+{
+    int i, n, trusted;
+
+    if (st->include_dirs)
+        return;
+    n = st->nb_include_paths + st->nb_sysinclude_paths;
+    st->include_dirs = arena_malloc(st, n * sizeof(IncludeDir *));
+    trusted = 1;
+    for(i = 0; i < n; i++) {
+        st->include_dirs[i] = include_dir_check(st,
+            i < st->nb_include_paths ? st->include_paths[i] :
+            st->sysinclude_paths[i - st->nb_include_paths]);
+        if (st->include_dirs[i] == &include_dir_none)
+            trusted = 0;
+    }
+    Tcl_MutexLock(&include_mutex);
+    st->include_generation = trusted ? include_generation : -1;
+    Tcl_MutexUnlock(&include_mutex);
+}
+
+/* remember the header 'filename' described by 'sb' for the compile
+   cache, which reuses the code only while its headers do not change */
+static void header_opened(TCCState *st, const char *filename, Tcl_StatBuf *sb)
+{
+    OpenedHeader *h;
+
+    /* a header modified in the last second may still change without
+       its time changing: the code cannot be cached */
+    if (sb->st_mtime >= time(NULL) - 1)
+        st->cache_key[0] = '\0';
+    h = tcc_malloc(st, sizeof(OpenedHeader) + strlen(filename));
+    h->dev = sb->st_dev;
+    h->ino = sb->st_ino;
+    h->mtime = sb->st_mtime;
+    h->size = sb->st_size;
+    strcpy(h->path, filename);
+    dynarray_add(st, (void ***)&st->opened_headers, &st->nb_opened_headers, h);
+}
+
+/* open the header 'filename', 'name' looked for in the include path
+   'dir_index', or in the directory of the current file if 'dir_index'
+   is -1, for an #include. Return NULL if it does not exist,
+   or if it would add nothing to the compilation, then setting '*guarded'. */
+static BufferedFile *tcc_open_include(TCCState *st, const char *filename,
+                                      int dir_index, const char *name,
+                                      int *guarded)
+{
+    Tcl_StatBuf sb;
+    Tcl_Obj *obj;
+    IncludeDir *d;
+    IncludeFile *f;
+    BufferedFile *bf;
+    int r, new;
+
+    /* a name in a subdirectory can appear without the directory
+       itself changing */
+    d = &include_dir_none;
+    if (dir_index >= 0 && !strchr(name, '/')) {
+        include_paths_check(st);
+        d = st->include_dirs[dir_index];
+    }
+    if (d != &include_dir_none) {
+        Tcl_MutexLock(&include_mutex);
+        r = Tcl_FindHashEntry(&d->missing, name) != NULL;
+        Tcl_MutexUnlock(&include_mutex);
+        if (r)
+            return NULL;
+    }
+    obj = Tcl_NewStringObj(filename, -1);
+    Tcl_IncrRefCount(obj);
+    r = Tcl_FSStat(obj, &sb);
+    Tcl_DecrRefCount(obj);
+    if (r != 0) {
+        if (d != &include_dir_none && errno == ENOENT) {
+            Tcl_MutexLock(&include_mutex);
+            Tcl_CreateHashEntry(&d->missing, name, &new);
+            Tcl_MutexUnlock(&include_mutex);
+        }
+        return NULL;
+    }
+    f = include_file_get(st, &sb);
+    if (f && include_file_skip(st, f)) {
+        *guarded = 1;
+        return NULL;
+    }
+    bf = tcc_open(st, filename, 1);
+    if (bf) {
+        bf->inc_file = f;
+        if (st->compile_cache)
+            header_opened(st, filename, &sb);
+    }
+    return bf;
+}
+
 static inline int hash_cached_include(TCCState *st, int type, const char *filename)
 {
     const unsigned char *s;
@@ -1862,28 +2528,36 @@ static CachedInclude *search_cached_include(TCCState *st,
     return NULL;
 }
 
-static inline void add_cached_include(TCCState *st, int type, 
-                                      const char *filename, int ifndef_macro)
+/* return the entry of the include cache of the handle for the header
+   'filename', setting its 'ifndef macro' if not zero */
+static CachedInclude *add_cached_include(TCCState *st, int type,
+                                         const char *filename,
+                                         int ifndef_macro)
 {
     CachedInclude *e;
     int h;
 
-    if (search_cached_include(st, type, filename))
-        return;
+    e = search_cached_include(st, type, filename);
+    if (e) {
+        if (ifndef_macro)
+            e->ifndef_macro = ifndef_macro;
+        return e;
+    }
 #ifdef INC_DEBUG
     printf("adding cached '%s' %s\n", filename, get_tok_str(st, ifndef_macro, NULL));
 #endif
     e = tcc_malloc(st, sizeof(CachedInclude) + strlen(filename));
-    if (!e)
-        return;
     e->type = type;
     strcpy(e->filename, filename);
     e->ifndef_macro = ifndef_macro;
+    e->path_index = 0;
+    e->generation = -1;
     dynarray_add(st, (void ***)&st->cached_includes, &st->nb_cached_includes, e);
     /* add in hash table */
     h = hash_cached_include(st, type, filename);
     e->hash_next = st->cached_includes_hash[h];
     st->cached_includes_hash[h] = st->nb_cached_includes;
+    return e;
 }
 
 static void pragma_parse(TCCState *st)
@@ -1891,7 +2565,7 @@ static void pragma_parse(TCCState *st)
     int val;
 
     next(st);
-    if (tok == TOK_pack) {
+    if (st->tok == TOK_pack) {
         /*
           This may be:
           #pragma pack(1) set 
@@ -1901,7 +2575,7 @@ static void pragma_parse(TCCState *st)
         */
         next(st);
         skip(st, '(');
-        if (tok == TOK_ASM_pop) {
+        if (st->tok == TOK_ASM_pop) {
             next(st);
             if (st->pack_stack_ptr <= st->pack_stack) {
             stk_error:
@@ -1910,19 +2584,19 @@ static void pragma_parse(TCCState *st)
             st->pack_stack_ptr--;
         } else {
             val = 0;
-            if (tok != ')') {
-                if (tok == TOK_ASM_push) {
+            if (st->tok != ')') {
+                if (st->tok == TOK_ASM_push) {
                     next(st);
                     if (st->pack_stack_ptr >= st->pack_stack + PACK_STACK_SIZE - 1)
                         goto stk_error;
                     st->pack_stack_ptr++;
                     skip(st, ',');
                 }
-                if (tok != TOK_CINT) {
+                if (st->tok != TOK_CINT) {
                 pack_error:
                    tcc_error(st, "invalid pack pragma");
                 }
-                val = tokc.i;
+                val = st->tokc.i;
                 if (val < 1 || val > 16 || (val & (val - 1)) != 0)
                     goto pack_error;
                 next(st);
@@ -1930,6 +2604,9 @@ static void pragma_parse(TCCState *st)
             *st->pack_stack_ptr = val;
             skip(st, ')');
         }
+    } else if (st->tok == TOK_once) {
+        if (st->file->inc_file)
+            include_file_set(st, st->file->inc_file, NULL);
     }
 }
 
@@ -1942,41 +2619,42 @@ static void preprocess(TCCState * st, int is_bof)
     BufferedFile *f;
     Sym *s;
     CachedInclude *e;
+    int guarded;
     
-    saved_parse_flags = parse_flags;
-    parse_flags = PARSE_FLAG_PREPROCESS | PARSE_FLAG_TOK_NUM | 
+    saved_parse_flags = st->parse_flags;
+    st->parse_flags = PARSE_FLAG_PREPROCESS | PARSE_FLAG_TOK_NUM | 
         PARSE_FLAG_LINEFEED;
     next_nomacro(st);
  redo:
-    switch(tok) {
+    switch(st->tok) {
     case TOK_DEFINE:
         next_nomacro(st);
         parse_define(st);
         break;
     case TOK_UNDEF:
         next_nomacro(st);
-        s = define_find(st, tok);
+        s = define_find(st, st->tok);
         /* undefine symbol by putting an invalid name */
         if (s)
-            define_undef(s);
+            define_undef(st, s);
         break;
     case TOK_INCLUDE:
     case TOK_INCLUDE_NEXT:
-        fch = file->buf_ptr[0];
+        st->fch = st->file->buf_ptr[0];
         /* XXX: incorrect if comments : use next_nomacro with a special mode */
         skip_spaces(st);
-        if (fch == '<') {
+        if (st->fch == '<') {
             c = '>';
             goto read_name;
-        } else if (fch == '\"') {
-            c = fch;
+        } else if (st->fch == '\"') {
+            c = st->fch;
         read_name:
             /* XXX: better stray handling */
             minp(st);
             q = buf;
-            while (fch != c && fch != '\n' && fch != CH_EOF) {
+            while (st->fch != c && st->fch != '\n' && st->fch != CH_EOF) {
                 if ((q - buf) < sizeof(buf) - 1)
-                    *q++ = fch;
+                    *q++ = st->fch;
                 minp(st);
             }
             *q = '\0';
@@ -1992,20 +2670,20 @@ static void preprocess(TCCState * st, int is_bof)
                we have anything enclosed in '<>' */
             next(st);
             buf[0] = '\0';
-            if (tok == TOK_STR) {
-                while (tok != TOK_LINEFEED) {
-                    if (tok != TOK_STR) {
+            if (st->tok == TOK_STR) {
+                while (st->tok != TOK_LINEFEED) {
+                    if (st->tok != TOK_STR) {
                     include_syntax:
                        tcc_error(st,"'#include' expects \"FILENAME\" or <FILENAME>");
                     }
-                    pstrcat(st, buf, sizeof(buf), (char *)tokc.cstr->data);
+                    pstrcat(buf, sizeof(buf), (char *)st->tokc.cstr->data);
                     next(st);
                 }
                 c = '\"';
             } else {
                 int len;
-                while (tok != TOK_LINEFEED) {
-                    pstrcat(st, buf, sizeof(buf), get_tok_str(st,tok, &tokc));
+                while (st->tok != TOK_LINEFEED) {
+                    pstrcat(buf, sizeof(buf), get_tok_str(st,st->tok, &st->tokc));
                     next(st);
                 }
                 len = strlen(buf);
@@ -2023,67 +2701,101 @@ static void preprocess(TCCState * st, int is_bof)
             /* no need to parse the include because the 'ifndef macro'
                is defined */
 #ifdef INC_DEBUG
-            printf("%s: skipping %s\n", file->filename, buf);
+            printf("%s: skipping %s\n", st->file->filename, buf);
 #endif
         } else {
+            guarded = 0;
             if (c == '\"') {
                 /* first search in current dir if "header.h" */
                 size = 0;
-                p = strrchr(file->filename, '/');
+                p = strrchr(st->file->filename, '/');
                 if (p) 
-                    size = p + 1 - file->filename;
+                    size = p + 1 - st->file->filename;
                 if (size > sizeof(buf1) - 1)
                     size = sizeof(buf1) - 1;
-                memcpy(buf1, file->filename, size);
+                memcpy(buf1, st->file->filename, size);
                 buf1[size] = '\0';
-                pstrcat(st, buf1, sizeof(buf1), buf);
-                f = tcc_open(st, buf1);
-                if (f) {
-                    if (tok == TOK_INCLUDE_NEXT)
-                        tok = TOK_INCLUDE;
-                    else
+                pstrcat(buf1, sizeof(buf1), buf);
+                f = tcc_open_include(st, buf1, -1, buf, &guarded);
+                if (f || guarded) {
+                    if (st->tok == TOK_INCLUDE_NEXT) {
+                        st->tok = TOK_INCLUDE;
+                        guarded = 0;
+                    } else {
                         goto found;
+                    }
                 }
             }
             if (st->include_stack_ptr >= st->include_stack + INCLUDE_STACK_SIZE)
                tcc_error(st, "#include recursion too deep");
-            /* now search in all the include paths */
+            /* now search in all the include paths, from the one the
+               header was found in before if none changed since */
             n = st->nb_include_paths + st->nb_sysinclude_paths;
-            for(i = 0; i < n; i++) {
+            i = 0;
+            e = NULL;
+            if (st->tok == TOK_INCLUDE) {
+                include_paths_check(st);
+                e = add_cached_include(st, c, buf, 0);
+                if (st->include_generation >= 0 &&
+                    e->generation == st->include_generation)
+                    i = e->path_index;
+            }
+            for(; i < n; i++) {
                 const char *path;
                 if (i < st->nb_include_paths)
                     path = st->include_paths[i];
                 else
                     path = st->sysinclude_paths[i - st->nb_include_paths];
-                pstrcpy(st,  buf1, sizeof(buf1), path);
-                pstrcat(st, buf1, sizeof(buf1), "/");
-                pstrcat(st, buf1, sizeof(buf1), buf);
-                f = tcc_open(st, buf1);
-                if (f) {
-                    if (tok == TOK_INCLUDE_NEXT)
-                        tok = TOK_INCLUDE;
-                    else
+                pstrcpy(buf1, sizeof(buf1), path);
+                pstrcat(buf1, sizeof(buf1), "/");
+                pstrcat(buf1, sizeof(buf1), buf);
+                f = tcc_open_include(st, buf1, i, buf, &guarded);
+                if (f || guarded) {
+                    if (st->tok == TOK_INCLUDE_NEXT) {
+                        st->tok = TOK_INCLUDE;
+                        guarded = 0;
+                    } else {
+                        if (e) {
+                            e->path_index = i;
+                            e->generation = st->include_generation;
+                        }
                         goto found;
+                    }
                 }
             }
            tcc_error(st, "include file '%s' not found", buf);
             f = NULL;
         found:
+            if (guarded) {
+                /* guarded by a defined macro or '#pragma once' */
+#ifdef INC_DEBUG
+                printf("%s: skipping %s\n", st->file->filename, buf1);
+#endif
+                break;
+            }
+            if (f->inc_file) {
+                n = st->nb_included_files;
+                if ((n & (n - 1)) == 0)
+                    st->included_files = arena_realloc(st, st->included_files,
+                        n * sizeof(IncludeFile *),
+                        (n ? n * 2 : 1) * sizeof(IncludeFile *));
+                st->included_files[st->nb_included_files++] = f->inc_file;
+            }
 #ifdef INC_DEBUG
-            printf("%s: including %s\n", file->filename, buf1);
+            printf("%s: including %s\n", st->file->filename, buf1);
 #endif
             f->inc_type = c;
-            pstrcpy(st,  f->inc_filename, sizeof(f->inc_filename), buf);
+            pstrcpy(f->inc_filename, sizeof(f->inc_filename), buf);
             /* push current file in stack */
             /* XXX: fix current line init */
-            *st->include_stack_ptr++ = file;
-            file = f;
+            *st->include_stack_ptr++ = st->file;
+            st->file = f;
             /* add include file debug info */
-            if (do_debug) {
-                put_stabs(st, file->filename, N_BINCL, 0, 0, 0);
+            if (st->do_debug) {
+                put_stabs(st, st->file->filename, N_BINCL, 0, 0, 0);
             }
-            next_tok_flags |= TOK_FLAG_BOW | TOK_FLAG_BOF | TOK_FLAG_BOL;
-            fch = file->buf_ptr[0];
+            st->next_tok_flags |= TOK_FLAG_BOW | TOK_FLAG_BOF | TOK_FLAG_BOL;
+            st->fch = st->file->buf_ptr[0];
             goto the_end;
         }
         break;
@@ -2097,17 +2809,17 @@ static void preprocess(TCCState * st, int is_bof)
         c = 0;
     do_ifdef:
         next_nomacro(st);
-        if (tok < TOK_IDENT)
+        if (st->tok < TOK_IDENT)
            tcc_error(st,"invalid argument for '#if%sdef'", c ? "n" : "");
         if (is_bof) {
             if (c) {
 #ifdef INC_DEBUG
-                printf("#ifndef %s\n", get_tok_str(st, tok, NULL));
+                printf("#ifndef %s\n", get_tok_str(st, st->tok, NULL));
 #endif
-                file->ifndef_macro = tok;
+                st->file->ifndef_macro = st->tok;
             }
         }
-        c = (define_find(st, tok) != 0) ^ c;
+        c = (define_find(st, st->tok) != 0) ^ c;
     do_if:
         if (st->ifdef_stack_ptr >= st->ifdef_stack + IFDEF_STACK_SIZE)
            tcc_error(st, "memory full");
@@ -2140,45 +2852,45 @@ static void preprocess(TCCState * st, int is_bof)
         }
         break;
     case TOK_ENDIF:
-        if (st->ifdef_stack_ptr <= file->ifdef_stack_ptr)
+        if (st->ifdef_stack_ptr <= st->file->ifdef_stack_ptr)
            tcc_error(st, "#endif without matching #if");
         st->ifdef_stack_ptr--;
         /* '#ifndef macro' was at the start of file. Now we check if
            an '#endif' is exactly at the end of file */
-        if (file->ifndef_macro &&
-            st->ifdef_stack_ptr == file->ifdef_stack_ptr) {
-            file->ifndef_macro_saved = file->ifndef_macro;
+        if (st->file->ifndef_macro &&
+            st->ifdef_stack_ptr == st->file->ifdef_stack_ptr) {
+            st->file->ifndef_macro_saved = st->file->ifndef_macro;
             /* need to set to zero to avoid false matches if another
                #ifndef at middle of file */
-            file->ifndef_macro = 0;
-            while (tok != TOK_LINEFEED)
+            st->file->ifndef_macro = 0;
+            while (st->tok != TOK_LINEFEED)
                 next_nomacro(st);
-            next_tok_flags |= TOK_FLAG_ENDIF;
+            st->next_tok_flags |= TOK_FLAG_ENDIF;
             goto the_end;
         }
         break;
     case TOK_LINE:
         next(st);
-        if (tok != TOK_CINT)
+        if (st->tok != TOK_CINT)
            tcc_error(st, "#line");
-        file->line_num = tokc.i - 1; /* the line number will be incremented after */
+        st->file->line_num = st->tokc.i - 1; /* the line number will be incremented after */
         next(st);
-        if (tok != TOK_LINEFEED) {
-            if (tok != TOK_STR)
+        if (st->tok != TOK_LINEFEED) {
+            if (st->tok != TOK_STR)
                tcc_error(st, "#line");
-            pstrcpy(st,  file->filename, sizeof(file->filename), 
-                    (char *)tokc.cstr->data);
+            pstrcpy(st->file->filename, sizeof(st->file->filename), 
+                    (char *)st->tokc.cstr->data);
         }
         break;
     case TOK_ERROR:
     case TOK_WARNING:
-        c = tok;
-        fch = file->buf_ptr[0];
+        c = st->tok;
+        st->fch = st->file->buf_ptr[0];
         skip_spaces(st);
         q = buf;
-        while (fch != '\n' && fch != CH_EOF) {
+        while (st->fch != '\n' && st->fch != CH_EOF) {
             if ((q - buf) < sizeof(buf) - 1)
-                *q++ = fch;
+                *q++ = st->fch;
             minp(st);
         }
         *q = '\0';
@@ -2191,20 +2903,20 @@ static void preprocess(TCCState * st, int is_bof)
         pragma_parse(st);
         break;
     default:
-        if (tok == TOK_LINEFEED || tok == '!' || tok == TOK_CINT) {
+        if (st->tok == TOK_LINEFEED || st->tok == '!' || st->tok == TOK_CINT) {
             /* '!' is ignored to allow C scripts. numbers are ignored
                to emulate cpp behaviour */
         } else {
             if (!(saved_parse_flags & PARSE_FLAG_ASM_COMMENTS))
-               tcc_error(st, "invalid preprocessing directive #%s", get_tok_str(st,tok, &tokc));
+               tcc_error(st, "invalid preprocessing directive #%s", get_tok_str(st,st->tok, &st->tokc));
         }
         break;
     }
     /* ignore other preprocess commands or #! for C scripts */
-    while (tok != TOK_LINEFEED)
+    while (st->tok != TOK_LINEFEED)
         next_nomacro(st);
  the_end:
-    parse_flags = saved_parse_flags;
+    st->parse_flags = saved_parse_flags;
 }
 
 /* evaluate escape codes in a string. */
@@ -2282,7 +2994,7 @@ static void parse_escape_string(TCCState *st, CString *outstr, const uint8_t *bu
                 c = '\v';
                 break;
             case 'e':
-                if (!gnu_ext)
+                if (!st->gnu_ext)
                     goto invalid_escape;
                 c = 27;
                 break;
@@ -2347,7 +3059,7 @@ void parse_number(TCCState *st, const char *p)
     double d;
 
     /* number */
-    q = token_buf;
+    q = st->token_buf;
     ch = *p++;
     t = ch;
     ch = *p++;
@@ -2360,7 +3072,7 @@ void parse_number(TCCState *st, const char *p)
             q--;
             ch = *p++;
             b = 16;
-        } else if (tcc_ext && (ch == 'b' || ch == 'B')) {
+        } else if (st->tcc_ext && (ch == 'b' || ch == 'B')) {
             q--;
             ch = *p++;
             b = 2;
@@ -2379,7 +3091,7 @@ void parse_number(TCCState *st, const char *p)
             break;
         if (t >= b)
             break;
-        if (q >= token_buf + STRING_MAX_SIZE) {
+        if (q >= st->token_buf + STRING_MAX_SIZE) {
         num_too_long:
            tcc_error(st, "number too long");
         }
@@ -2401,7 +3113,7 @@ void parse_number(TCCState *st, const char *p)
             else 
                 shift = 2;
             bn_zero(bn);
-            q = token_buf;
+            q = st->token_buf;
             while (1) {
                 t = *q++;
                 if (t == '\0') {
@@ -2462,40 +3174,40 @@ void parse_number(TCCState *st, const char *p)
             t = toup(st, ch);
             if (t == 'F') {
                 ch = *p++;
-                tok = TOK_CFLOAT;
+                st->tok = TOK_CFLOAT;
                 /* float : should handle overflow */
-                tokc.f = (float)d;
+                st->tokc.f = (float)d;
             } else if (t == 'L') {
                 ch = *p++;
-                tok = TOK_CLDOUBLE;
+                st->tok = TOK_CLDOUBLE;
                 /* XXX: not large enough */
-                tokc.ld = (long double)d;
+                st->tokc.ld = (long double)d;
             } else {
-                tok = TOK_CDOUBLE;
-                tokc.d = d;
+                st->tok = TOK_CDOUBLE;
+                st->tokc.d = d;
             }
         } else {
             /* decimal floats */
             if (ch == '.') {
-                if (q >= token_buf + STRING_MAX_SIZE)
+                if (q >= st->token_buf + STRING_MAX_SIZE)
                     goto num_too_long;
                 *q++ = ch;
                 ch = *p++;
             float_frac_parse:
                 while (ch >= '0' && ch <= '9') {
-                    if (q >= token_buf + STRING_MAX_SIZE)
+                    if (q >= st->token_buf + STRING_MAX_SIZE)
                         goto num_too_long;
                     *q++ = ch;
                     ch = *p++;
                 }
             }
             if (ch == 'e' || ch == 'E') {
-                if (q >= token_buf + STRING_MAX_SIZE)
+                if (q >= st->token_buf + STRING_MAX_SIZE)
                     goto num_too_long;
                 *q++ = ch;
                 ch = *p++;
                 if (ch == '-' || ch == '+') {
-                    if (q >= token_buf + STRING_MAX_SIZE)
+                    if (q >= st->token_buf + STRING_MAX_SIZE)
                         goto num_too_long;
                     *q++ = ch;
                     ch = *p++;
@@ -2503,7 +3215,7 @@ void parse_number(TCCState *st, const char *p)
                 if (ch < '0' || ch > '9')
                     expect(st, "exponent digits");
                 while (ch >= '0' && ch <= '9') {
-                    if (q >= token_buf + STRING_MAX_SIZE)
+                    if (q >= st->token_buf + STRING_MAX_SIZE)
                         goto num_too_long;
                     *q++ = ch;
                     ch = *p++;
@@ -2514,15 +3226,15 @@ void parse_number(TCCState *st, const char *p)
             errno = 0;
             if (t == 'F') {
                 ch = *p++;
-                tok = TOK_CFLOAT;
-                tokc.f = strtof(token_buf, NULL);
+                st->tok = TOK_CFLOAT;
+                st->tokc.f = strtof(st->token_buf, NULL);
             } else if (t == 'L') {
                 ch = *p++;
-                tok = TOK_CLDOUBLE;
-                tokc.ld = strtold(token_buf, NULL);
+                st->tok = TOK_CLDOUBLE;
+                st->tokc.ld = strtold(st->token_buf, NULL);
             } else {
-                tok = TOK_CDOUBLE;
-                tokc.d = strtod(token_buf, NULL);
+                st->tok = TOK_CDOUBLE;
+                st->tokc.d = strtod(st->token_buf, NULL);
             }
         }
     } else {
@@ -2531,7 +3243,7 @@ void parse_number(TCCState *st, const char *p)
 
         /* integer number */
         *q = '\0';
-        q = token_buf;
+        q = st->token_buf;
         if (b == 10 && *q == '0') {
             b = 8;
             q++;
@@ -2562,13 +3274,13 @@ void parse_number(TCCState *st, const char *p)
         /* XXX: not exactly ANSI compliant */
         if ((n & 0xffffffff00000000LL) != 0) {
             if ((n >> 63) != 0)
-                tok = TOK_CULLONG;
+                st->tok = TOK_CULLONG;
             else
-                tok = TOK_CLLONG;
+                st->tok = TOK_CLLONG;
         } else if (n > 0x7fffffff) {
-            tok = TOK_CUINT;
+            st->tok = TOK_CUINT;
         } else {
-            tok = TOK_CINT;
+            st->tok = TOK_CINT;
         }
         lcount = 0;
         ucount = 0;
@@ -2578,30 +3290,34 @@ void parse_number(TCCState *st, const char *p)
                 if (lcount >= 2)
                    tcc_error(st, "three 'l's in integer constant");
                 lcount++;
+#ifdef TCC_TARGET_X86_64
+                if (lcount >= 1) {
+#else
                 if (lcount == 2) {
-                    if (tok == TOK_CINT)
-                        tok = TOK_CLLONG;
-                    else if (tok == TOK_CUINT)
-                        tok = TOK_CULLONG;
+#endif
+                    if (st->tok == TOK_CINT)
+                        st->tok = TOK_CLLONG;
+                    else if (st->tok == TOK_CUINT)
+                        st->tok = TOK_CULLONG;
                 }
                 ch = *p++;
             } else if (t == 'U') {
                 if (ucount >= 1)
                    tcc_error(st, "two 'u's in integer constant");
                 ucount++;
-                if (tok == TOK_CINT)
-                    tok = TOK_CUINT;
-                else if (tok == TOK_CLLONG)
-                    tok = TOK_CULLONG;
+                if (st->tok == TOK_CINT)
+                    st->tok = TOK_CUINT;
+                else if (st->tok == TOK_CLLONG)
+                    st->tok = TOK_CULLONG;
                 ch = *p++;
             } else {
                 break;
             }
         }
-        if (tok == TOK_CINT || tok == TOK_CUINT)
-            tokc.ui = n;
+        if (st->tok == TOK_CINT || st->tok == TOK_CUINT)
+            st->tokc.ui = n;
         else
-            tokc.ull = n;
+            st->tokc.ull = n;
     }
 }
 
@@ -2611,9 +3327,9 @@ void parse_number(TCCState *st, const char *p)
         PEEKC(st, c, p);                            \
         if (c == c2) {                          \
             p++;                                \
-            tok = tok2;                         \
+            st->tok = tok2;                         \
         } else {                                \
-            tok = tok1;                         \
+            st->tok = tok1;                         \
         }                                       \
         break;
 
@@ -2622,10 +3338,10 @@ static inline void next_nomacro1(TCCState *st)
 {
     int t, c, is_long;
     TokenSym *ts;
-    uint8_t *p, *p1;
+    uint8_t *p, *p1, *p2;
     unsigned int h;
 
-    p = file->buf_ptr;
+    p = st->file->buf_ptr;
  redo_no_start:
     c = *p;
     switch(c) {
@@ -2634,68 +3350,71 @@ static inline void next_nomacro1(TCCState *st)
     case '\f':
     case '\v':
     case '\r':
-        p++;
-        next_tok_flags |= TOK_FLAG_BOW;
+        p = scan_blanks(p + 1, st->file->buf_end);
+        st->next_tok_flags |= TOK_FLAG_BOW;
         goto redo_no_start;
         
     case '\\':
         /* first look if it is in fact an end of buffer */
-        if (p >= file->buf_end) {
-            file->buf_ptr = p;
+        if (p >= st->file->buf_end) {
+            st->file->buf_ptr = p;
             handle_eob(st);
-            p = file->buf_ptr;
-            if (p >= file->buf_end)
+            p = st->file->buf_ptr;
+            if (p >= st->file->buf_end)
                 goto parse_eof;
             else
                 goto redo_no_start;
         } else {
-            file->buf_ptr = p;
-            fch = *p;
+            st->file->buf_ptr = p;
+            st->fch = *p;
             handle_stray(st);
-            p = file->buf_ptr;
+            p = st->file->buf_ptr;
             goto redo_no_start;
         }
     parse_eof:
         {
-            if (parse_flags & PARSE_FLAG_LINEFEED) {
-                tok = TOK_LINEFEED;
+            if (st->parse_flags & PARSE_FLAG_LINEFEED) {
+                st->tok = TOK_LINEFEED;
             } else if (st->include_stack_ptr == st->include_stack ||
-                       !(parse_flags & PARSE_FLAG_PREPROCESS)) {
+                       !(st->parse_flags & PARSE_FLAG_PREPROCESS)) {
                 /* no include left : end of file. */
-                tok = TOK_EOF;
+                st->tok = TOK_EOF;
             } else {
                 /* pop include file */
                 
                 /* test if previous '#endif' was after a #ifdef at
                    start of file */
-                if (next_tok_flags & TOK_FLAG_ENDIF) {
+                if (st->next_tok_flags & TOK_FLAG_ENDIF) {
 #ifdef INC_DEBUG
-                    printf("#endif %s\n", get_tok_str(st, file->ifndef_macro_saved, NULL));
+                    printf("#endif %s\n", get_tok_str(st, st->file->ifndef_macro_saved, NULL));
 #endif
-                    add_cached_include(st, file->inc_type, file->inc_filename,
-                                       file->ifndef_macro_saved);
+                    add_cached_include(st, st->file->inc_type, st->file->inc_filename,
+                                       st->file->ifndef_macro_saved);
+                    if (st->file->inc_file)
+                        include_file_set(st, st->file->inc_file,
+                            get_tok_str(st, st->file->ifndef_macro_saved, NULL));
                 }
 
                 /* add end of include file debug info */
-                if (do_debug) {
+                if (st->do_debug) {
                     put_stabd(st, N_EINCL, 0, 0);
                 }
                 /* pop include stack */
-                tcc_close(file);
+                tcc_close(st, st->file);
                 st->include_stack_ptr--;
-                file = *st->include_stack_ptr;
-                p = file->buf_ptr;
+                st->file = *st->include_stack_ptr;
+                p = st->file->buf_ptr;
                 goto redo_no_start;
             }
         }
         break;
 
     case '\n':
-        if (parse_flags & PARSE_FLAG_LINEFEED) {
-            tok = TOK_LINEFEED;
+        if (st->parse_flags & PARSE_FLAG_LINEFEED) {
+            st->tok = TOK_LINEFEED;
         } else {
-            file->line_num++;
-            next_tok_flags |= TOK_FLAG_BOW | TOK_FLAG_BOL;
+            st->file->line_num++;
+            st->next_tok_flags |= TOK_FLAG_BOW | TOK_FLAG_BOL;
             p++;
             goto redo_no_start;
         }
@@ -2704,22 +3423,22 @@ static inline void next_nomacro1(TCCState *st)
     case '#':
         /* XXX: simplify */
         PEEKC(st, c, p);
-        if ((next_tok_flags & TOK_FLAG_BOL) && 
-            (parse_flags & PARSE_FLAG_PREPROCESS)) {
-            file->buf_ptr = p;
-            preprocess(st, next_tok_flags & TOK_FLAG_BOF);
-            p = file->buf_ptr;
+        if ((st->next_tok_flags & TOK_FLAG_BOL) && 
+            (st->parse_flags & PARSE_FLAG_PREPROCESS)) {
+            st->file->buf_ptr = p;
+            preprocess(st, st->next_tok_flags & TOK_FLAG_BOF);
+            p = st->file->buf_ptr;
             goto redo_no_start;
         } else {
             if (c == '#') {
                 p++;
-                tok = TOK_TWOSHARPS;
+                st->tok = TOK_TWOSHARPS;
             } else {
-                if (parse_flags & PARSE_FLAG_ASM_COMMENTS) {
+                if (st->parse_flags & PARSE_FLAG_ASM_COMMENTS) {
                     p = parse_line_comment(st, p - 1);
                     goto redo_no_start;
                 } else {
-                    tok = '#';
+                    st->tok = '#';
                 }
             }
         }
@@ -2745,6 +3464,8 @@ static inline void next_nomacro1(TCCState *st)
         h = TOK_HASH_INIT;
         h = TOK_HASH_FUNC(h, c);
         p++;
+        for(p2 = scan_idnum(p, st->file->buf_end); p < p2; p++)
+            h = TOK_HASH_FUNC(h, *p);
         for(;;) {
             c = *p;
             if (!isidnum_table[c])
@@ -2753,42 +3474,27 @@ static inline void next_nomacro1(TCCState *st)
             p++;
         }
         if (c != '\\') {
-            TokenSym **pts;
-            int len;
-
             /* fast case : no stray found, so we have the full token
                and we have already hashed it */
-            len = p - p1;
-            h &= (TOK_HASH_SIZE - 1);
-            pts = &hash_ident[h];
-            for(;;) {
-                ts = *pts;
-                if (!ts)
-                    break;
-                if (ts->len == len && !memcmp(ts->str, p1, len))
-                    goto token_found;
-                pts = &(ts->hash_next);
-            }
-            ts = tok_alloc_new(st, pts, p1, len);
-        token_found: ;
+            ts = tok_find(st, (char *)p1, p - p1, h);
         } else {
             /* slower case */
-            cstr_reset(st, &tokcstr);
+            cstr_reset(st, &st->tokcstr);
 
             while (p1 < p) {
-                cstr_ccat(st, &tokcstr, *p1);
+                cstr_ccat(st, &st->tokcstr, *p1);
                 p1++;
             }
             p--;
             PEEKC(st, c, p);
         parse_ident_slow:
             while (isidnum_table[c]) {
-                cstr_ccat(st, &tokcstr, c);
+                cstr_ccat(st, &st->tokcstr, c);
                 PEEKC(st, c, p);
             }
-            ts = tok_alloc(st, tokcstr.data, tokcstr.size);
+            ts = tok_alloc(st, st->tokcstr.data, st->tokcstr.size);
         }
-        tok = ts->tok;
+        st->tok = ts->tok;
         break;
     case 'L':
         t = p[1];
@@ -2801,8 +3507,8 @@ static inline void next_nomacro1(TCCState *st)
                 is_long = 1;
                 goto str_const;
             } else {
-                cstr_reset(st, &tokcstr);
-                cstr_ccat(st, &tokcstr, 'L');
+                cstr_reset(st, &st->tokcstr);
+                cstr_ccat(st, &st->tokcstr, 'L');
                 goto parse_ident_slow;
             }
         }
@@ -2811,13 +3517,13 @@ static inline void next_nomacro1(TCCState *st)
     case '4': case '5': case '6': case '7':
     case '8': case '9':
 
-        cstr_reset(st, &tokcstr);
+        cstr_reset(st, &st->tokcstr);
         /* after the first digit, accept digits, alpha, '.' or sign if
            prefixed by 'eEpP' */
     parse_num:
         for(;;) {
             t = c;
-            cstr_ccat(st, &tokcstr, c);
+            cstr_ccat(st, &st->tokcstr, c);
             PEEKC(st, c, p);
             if (!(isnum(st, c) || isid(st, c) || c == '.' ||
                   ((c == '+' || c == '-') && 
@@ -2825,25 +3531,25 @@ static inline void next_nomacro1(TCCState *st)
                 break;
         }
         /* We add a trailing '\0' to ease parsing */
-        cstr_ccat(st, &tokcstr, '\0');
-        tokc.cstr = &tokcstr;
-        tok = TOK_PPNUM;
+        cstr_ccat(st, &st->tokcstr, '\0');
+        st->tokc.cstr = &st->tokcstr;
+        st->tok = TOK_PPNUM;
         break;
     case '.':
         /* special dot handling because it can also start a number */
         PEEKC(st, c, p);
         if (isnum(st, c)) {
-            cstr_reset(st, &tokcstr);
-            cstr_ccat(st, &tokcstr, '.');
+            cstr_reset(st, &st->tokcstr);
+            cstr_ccat(st, &st->tokcstr, '.');
             goto parse_num;
         } else if (c == '.') {
             PEEKC(st, c, p);
             if (c != '.')
                 expect(st, "'.'");
             PEEKC(st, c, p);
-            tok = TOK_DOTS;
+            st->tok = TOK_DOTS;
         } else {
-            tok = '.';
+            st->tok = '.';
         }
         break;
     case '\'':
@@ -2862,8 +3568,8 @@ static inline void next_nomacro1(TCCState *st)
             cstr_ccat(st, &str, '\0');
             
             /* eval the escape (should be done as TOK_PPNUM) */
-            cstr_reset(st, &tokcstr);
-            parse_escape_string(st, &tokcstr, str.data, is_long);
+            cstr_reset(st, &st->tokcstr);
+            parse_escape_string(st, &st->tokcstr, str.data, is_long);
             cstr_free(st, &str);
 
             if (sep == '\'') {
@@ -2873,23 +3579,23 @@ static inline void next_nomacro1(TCCState *st)
                     char_size = 1;
                 else
                     char_size = sizeof(nwchar_t);
-                if (tokcstr.size <= char_size)
+                if (st->tokcstr.size <= char_size)
                    tcc_error(st, "empty character constant");
-                if (tokcstr.size > 2 * char_size)
+                if (st->tokcstr.size > 2 * char_size)
                     warning(st, "multi-character character constant");
                 if (!is_long) {
-                    tokc.i = *(int8_t *)tokcstr.data;
-                    tok = TOK_CCHAR;
+                    st->tokc.i = *(int8_t *)st->tokcstr.data;
+                    st->tok = TOK_CCHAR;
                 } else {
-                    tokc.i = *(nwchar_t *)tokcstr.data;
-                    tok = TOK_LCHAR;
+                    st->tokc.i = *(nwchar_t *)st->tokcstr.data;
+                    st->tok = TOK_LCHAR;
                 }
             } else {
-                tokc.cstr = &tokcstr;
+                st->tokc.cstr = &st->tokcstr;
                 if (!is_long)
-                    tok = TOK_STR;
+                    st->tok = TOK_STR;
                 else
-                    tok = TOK_LSTR;
+                    st->tok = TOK_LSTR;
             }
         }
         break;
@@ -2898,17 +3604,17 @@ static inline void next_nomacro1(TCCState *st)
         PEEKC(st, c, p);
         if (c == '=') {
             p++;
-            tok = TOK_LE;
+            st->tok = TOK_LE;
         } else if (c == '<') {
             PEEKC(st, c, p);
             if (c == '=') {
                 p++;
-                tok = TOK_A_SHL;
+                st->tok = TOK_A_SHL;
             } else {
-                tok = TOK_SHL;
+                st->tok = TOK_SHL;
             }
         } else {
-            tok = TOK_LT;
+            st->tok = TOK_LT;
         }
         break;
         
@@ -2916,17 +3622,17 @@ static inline void next_nomacro1(TCCState *st)
         PEEKC(st, c, p);
         if (c == '=') {
             p++;
-            tok = TOK_GE;
+            st->tok = TOK_GE;
         } else if (c == '>') {
             PEEKC(st, c, p);
             if (c == '=') {
                 p++;
-                tok = TOK_A_SAR;
+                st->tok = TOK_A_SAR;
             } else {
-                tok = TOK_SAR;
+                st->tok = TOK_SAR;
             }
         } else {
-            tok = TOK_GT;
+            st->tok = TOK_GT;
         }
         break;
         
@@ -2934,12 +3640,12 @@ static inline void next_nomacro1(TCCState *st)
         PEEKC(st, c, p);
         if (c == '&') {
             p++;
-            tok = TOK_LAND;
+            st->tok = TOK_LAND;
         } else if (c == '=') {
             p++;
-            tok = TOK_A_AND;
+            st->tok = TOK_A_AND;
         } else {
-            tok = '&';
+            st->tok = '&';
         }
         break;
         
@@ -2947,12 +3653,12 @@ static inline void next_nomacro1(TCCState *st)
         PEEKC(st, c, p);
         if (c == '|') {
             p++;
-            tok = TOK_LOR;
+            st->tok = TOK_LOR;
         } else if (c == '=') {
             p++;
-            tok = TOK_A_OR;
+            st->tok = TOK_A_OR;
         } else {
-            tok = '|';
+            st->tok = '|';
         }
         break;
 
@@ -2960,12 +3666,12 @@ static inline void next_nomacro1(TCCState *st)
         PEEKC(st, c, p);
         if (c == '+') {
             p++;
-            tok = TOK_INC;
+            st->tok = TOK_INC;
         } else if (c == '=') {
             p++;
-            tok = TOK_A_ADD;
+            st->tok = TOK_A_ADD;
         } else {
-            tok = '+';
+            st->tok = '+';
         }
         break;
         
@@ -2973,15 +3679,15 @@ static inline void next_nomacro1(TCCState *st)
         PEEKC(st, c, p);
         if (c == '-') {
             p++;
-            tok = TOK_DEC;
+            st->tok = TOK_DEC;
         } else if (c == '=') {
             p++;
-            tok = TOK_A_SUB;
+            st->tok = TOK_A_SUB;
         } else if (c == '>') {
             p++;
-            tok = TOK_ARROW;
+            st->tok = TOK_ARROW;
         } else {
-            tok = '-';
+            st->tok = '-';
         }
         break;
 
@@ -2996,17 +3702,17 @@ static inline void next_nomacro1(TCCState *st)
         PEEKC(st, c, p);
         if (c == '*') {
             p = parse_comment(st, p);
-            next_tok_flags |= TOK_FLAG_BOW;
+            st->next_tok_flags |= TOK_FLAG_BOW;
             goto redo_no_start;
         } else if (c == '/') {
             p = parse_line_comment(st, p);
-            next_tok_flags |= TOK_FLAG_BOW;
+            st->next_tok_flags |= TOK_FLAG_BOW;
             goto redo_no_start;
         } else if (c == '=') {
             p++;
-            tok = TOK_A_DIV;
+            st->tok = TOK_A_DIV;
         } else {
-            tok = '/';
+            st->tok = '/';
         }
         break;
         
@@ -3024,18 +3730,18 @@ static inline void next_nomacro1(TCCState *st)
     case '~':
     case '$': /* only used in assembler */
     case '@': /* dito */
-        tok = c;
+        st->tok = c;
         p++;
         break;
     default:
        tcc_error(st, "unrecognized character \\x%02x", c);
         break;
     }
-    file->buf_ptr = p;
-    tok_flags = next_tok_flags;
-    next_tok_flags = 0;
+    st->file->buf_ptr = p;
+    st->tok_flags = st->next_tok_flags;
+    st->next_tok_flags = 0;
 #if defined(PARSE_DEBUG)
-    printf("token = %s\n", get_tok_str(st, tok, &tokc));
+    printf("token = %s\n", get_tok_str(st, st->tok, &st->tokc));
 #endif
 }
 
@@ -3043,13 +3749,13 @@ static inline void next_nomacro1(TCCState *st)
    macro_ptr buffer */
 static void next_nomacro(TCCState *st)
 {
-    if (macro_ptr) {
+    if (st->macro_ptr) {
     redo:
-        tok = *macro_ptr;
-        if (tok) {
-            TOK_GET(tok, tok_flags, macro_ptr, tokc);
-            if (tok == TOK_LINENUM) {
-                file->line_num = tokc.i;
+        st->tok = *st->macro_ptr;
+        if (st->tok) {
+            TOK_GET(st->tok, st->tok_flags, st->macro_ptr, st->tokc);
+            if (st->tok == TOK_LINENUM) {
+                st->file->line_num = st->tokc.i;
                 goto redo;
             }
         }
@@ -3067,7 +3773,7 @@ static int *macro_arg_subst(TCCState *state, Sym **nested_list, int *macro_str,
     TokenString str;
     CString cstr;
 
-    tok_str_new(state, &str);
+    tok_str_new_expand(state, &str);
     last_tok = 0;
     while(1) {
         TOK_GET(t, tf, macro_str, cval);
@@ -3114,13 +3820,13 @@ static int *macro_arg_subst(TCCState *state, Sym **nested_list, int *macro_str,
                     /* XXX: test of the ',' is not 100%
                        reliable. should fix it to avoid security
                        problems */
-                    if (gnu_ext && s->type.t &&
+                    if (state->gnu_ext && s->type.t &&
                         last_tok == TOK_TWOSHARPS && 
                         str.len >= 4 && str.str[str.len - 4] == ',') {
                         if (*st == 0) {
                             /* suppress ',' '##' */
                             str.len -= 4;
-                            next_tok_flags = tok_flags;
+                            state->next_tok_flags = state->tok_flags;
                         } else {
                             /* suppress '##' and add variable */
                             str.len -= 2;
@@ -3176,21 +3882,21 @@ static int macro_subst_tok(TCCState *st, TokenString *tok_str,
     
     /* if symbol is a macro, prepare substitution */
     /* special macros */
-    if (tok == TOK___LINE__) {
-        snprintf(buf, sizeof(buf), "%d", file->line_num);
+    if (st->tok == TOK___LINE__) {
+        snprintf(buf, sizeof(buf), "%d", st->file->line_num);
         cstrval = buf;
         t1 = TOK_PPNUM;
         goto add_cstr1;
-    } else if (tok == TOK___FILE__) {
-        cstrval = file->filename;
+    } else if (st->tok == TOK___FILE__) {
+        cstrval = st->file->filename;
         goto add_cstr;
-    } else if (tok == TOK___DATE__ || tok == TOK___TIME__) {
+    } else if (st->tok == TOK___DATE__ || st->tok == TOK___TIME__) {
         time_t ti;
         struct tm *tm;
 
         time(&ti);
         tm = localtime(&ti);
-        if (tok == TOK___DATE__) {
+        if (st->tok == TOK___DATE__) {
             snprintf(buf, sizeof(buf), "%s %2d %d", 
                      ab_month_name[tm->tm_mon], tm->tm_mday, tm->tm_year + 1900);
         } else {
@@ -3205,26 +3911,26 @@ static int macro_subst_tok(TCCState *st, TokenString *tok_str,
         cstr_cat(st, &cstr, cstrval);
         cstr_ccat(st, &cstr, '\0');
         cval.cstr = &cstr;
-        tok_str_add2(st, tok_str, t1, tok_flags, &cval);
+        tok_str_add2(st, tok_str, t1, st->tok_flags, &cval);
         cstr_free(st, &cstr);
     } else {
         mstr = (int *)s->c;
-        mstr[1] = tok_flags;
+        mstr[1] = st->tok_flags;
         mstr_allocated = 0;
         if (s->type.t == MACRO_FUNC) {
             /* NOTE: we do not use next_nomacro to avoid eating the
                next token. XXX: find better solution */
         redo:
-            if (macro_ptr) {
-                t = *macro_ptr;
+            if (st->macro_ptr) {
+                t = *st->macro_ptr;
                 if (t == 0 && can_read_stream) {
                     /* end of macro stream: we must look at the token
                        after in the file */
                     struct macro_level *ml = *can_read_stream;
-                    macro_ptr = NULL;
+                    st->macro_ptr = NULL;
                     if (ml)
                     {
-                        macro_ptr = ml->p;
+                        st->macro_ptr = ml->p;
                         ml->p = NULL;
                         *can_read_stream = ml -> prev;
                     }
@@ -3232,10 +3938,10 @@ static int macro_subst_tok(TCCState *st, TokenString *tok_str,
                 }
             } else {
                 /* XXX: incorrect with comments */
-                fch = file->buf_ptr[0];
-                while (is_space(st, fch) || fch == '\n')
+                st->fch = st->file->buf_ptr[0];
+                while (is_space(st, st->fch) || st->fch == '\n')
                     cinp(st);
-                t = fch;
+                t = st->fch;
             }
             if (t != '(') /* no macro subst */
                 return -1;
@@ -3248,37 +3954,37 @@ static int macro_subst_tok(TCCState *st, TokenString *tok_str,
             /* NOTE: empty args are allowed, except if no args */
             for(;;) {
                 /* handle '()' case */
-                if (!args && !sa && tok == ')')
+                if (!args && !sa && st->tok == ')')
                     break;
                 if (!sa)
                    tcc_error(st, "macro '%s' used with too many args",
                           get_tok_str(st, s->v, 0));
-                tok_str_new(st, &str);
+                tok_str_new_expand(st, &str);
                 parlevel = 0;
                 /* NOTE: non zero sa->t indicates VA_ARGS */
                 while ((parlevel > 0 || 
-                        (tok != ')' && 
-                         (tok != ',' || sa->type.t))) && 
-                       tok != -1) {
-                    if (tok == '(')
+                        (st->tok != ')' && 
+                         (st->tok != ',' || sa->type.t))) && 
+                       st->tok != -1) {
+                    if (st->tok == '(')
                         parlevel++;
-                    else if (tok == ')')
+                    else if (st->tok == ')')
                         parlevel--;
-                    tok_str_add2(st, &str, tok, tok_flags, &tokc);
+                    tok_str_add2(st, &str, st->tok, st->tok_flags, &st->tokc);
                     next_nomacro(st);
                 }
                 tok_str_add(st, &str, 0, 0);
-                sym_push2(st, &args, sa->v & ~SYM_FIELD, sa->type.t, (int)str.str);
+                sym_push2(st, &args, sa->v & ~SYM_FIELD, sa->type.t, (long)str.str);
                 sa = sa->next;
-                if (tok == ')') {
+                if (st->tok == ')') {
                     /* special case for gcc var args: add an empty
                        var arg argument if it is omitted */
-                    if (sa && sa->type.t && gnu_ext)
+                    if (sa && sa->type.t && st->gnu_ext)
                         continue;
                     else
                         break;
                 }
-                if (tok != ',')
+                if (st->tok != ',')
                     expect(st, ",");
                 next_nomacro(st);
             }
@@ -3293,7 +3999,7 @@ static int macro_subst_tok(TCCState *st, TokenString *tok_str,
             sa = args;
             while (sa) {
                 sa1 = sa->prev;
-                tok_str_free(st, (int *)sa->c);
+                tok_str_free_expand(st, (int *)sa->c);
                 sym_free(st, sa);
                 sa = sa1;
             }
@@ -3306,8 +4012,9 @@ static int macro_subst_tok(TCCState *st, TokenString *tok_str,
         *nested_list = sa1->prev;
         sym_free(st, sa1);
         if (mstr_allocated)
-            tok_str_free(st, mstr);
+            tok_str_free_expand(st, mstr);
     }
+    st->nb_expansions++;
     return 0;
 }
 
@@ -3337,47 +4044,47 @@ static inline int *macro_twosharps(TCCState *st, const int *macro_str)
 
     /* we saw '##', so we need more processing to handle it */
     cstr_new(st, &cstr);
-    tok_str_new(st, &macro_str1);
-    tok = t;
-    tok_flags = tf;
-    tokc = cval;
+    tok_str_new_expand(st, &macro_str1);
+    st->tok = t;
+    st->tok_flags = tf;
+    st->tokc = cval;
 
     /* add all tokens seen so far */
     for(ptr = start_macro_ptr; ptr < macro_ptr1;) {
         TOK_GET(t, tf, ptr, cval);
         tok_str_add2(st, &macro_str1, t, tf, &cval);
     }
-    saved_macro_ptr = macro_ptr;
+    saved_macro_ptr = st->macro_ptr;
     /* XXX: get rid of the use of macro_ptr here */
-    macro_ptr = (int *)macro_str;
+    st->macro_ptr = (int *)macro_str;
     for(;;) {
-        while (*macro_ptr == TOK_TWOSHARPS) {
-            macro_ptr+=2;
-            macro_ptr1 = macro_ptr;
-            t = *macro_ptr;
+        while (*st->macro_ptr == TOK_TWOSHARPS) {
+            st->macro_ptr+=2;
+            macro_ptr1 = st->macro_ptr;
+            t = *st->macro_ptr;
             if (t) {
-                TOK_GET(t, tf, macro_ptr, cval);
+                TOK_GET(t, tf, st->macro_ptr, cval);
                 /* We concatenate the two tokens if we have an
                    identifier or a preprocessing number */
                 cstr_reset(st, &cstr);
-                p1 = get_tok_str(st, tok, &tokc);
+                p1 = get_tok_str(st, st->tok, &st->tokc);
                 cstr_cat(st, &cstr, p1);
                 p2 = get_tok_str(st, t, &cval);
                 cstr_cat(st, &cstr, p2);
                 cstr_ccat(st, &cstr, '\0');
                 
-                if ((tok >= TOK_IDENT || tok == TOK_PPNUM) && 
+                if ((st->tok >= TOK_IDENT || st->tok == TOK_PPNUM) && 
                     (t >= TOK_IDENT || t == TOK_PPNUM)) {
-                    if (tok == TOK_PPNUM) {
+                    if (st->tok == TOK_PPNUM) {
                         /* if number, then create a number token */
                         /* NOTE: we cannot use cstr directly for this
                            because if there are multiple token pastings
                            in a sequence the concatenation will reset
                            cstr before the final token is ready. */
-                        cstr_reset(st, &tokcstr);
-                        cstr_cat(st, &tokcstr, cstr.data);
-                        cstr_ccat(st, &tokcstr, '\0');
-                        tokc.cstr = &tokcstr;
+                        cstr_reset(st, &st->tokcstr);
+                        cstr_cat(st, &st->tokcstr, cstr.data);
+                        cstr_ccat(st, &st->tokcstr, '\0');
+                        st->tokc.cstr = &st->tokcstr;
                     } else {
                         /* if identifier, we must do a test to
                            validate we have a correct identifier */
@@ -3396,7 +4103,7 @@ static inline int *macro_twosharps(TCCState *st, const int *macro_str)
                             }
                         }
                         ts = tok_alloc(st, cstr.data, strlen(cstr.data));
-                        tok = ts->tok; /* modify current token */
+                        st->tok = ts->tok; /* modify current token */
                     }
                 } else {
                     const char *str = cstr.data;
@@ -3405,9 +4112,9 @@ static inline int *macro_twosharps(TCCState *st, const int *macro_str)
                     /* we look for a valid token */
                     /* XXX: do more extensive checks */
                     if (!strcmp(str, ">>=")) {
-                        tok = TOK_A_SAR;
+                        st->tok = TOK_A_SAR;
                     } else if (!strcmp(str, "<<=")) {
-                        tok = TOK_A_SHL;
+                        st->tok = TOK_A_SHL;
                     } else if (strlen(str) == 2) {
                         /* search in two bytes table */
                         q = tok_two_chars;
@@ -3418,32 +4125,32 @@ static inline int *macro_twosharps(TCCState *st, const int *macro_str)
                                 break;
                             q += 3;
                         }
-                        tok = q[2];
+                        st->tok = q[2];
                     } else {
                     error_pasting:
                         /* NOTE: because get_tok_str use a static buffer,
                            we must save it */
                         cstr_reset(st, &cstr);
-                        p1 = get_tok_str(st, tok, &tokc);
+                        p1 = get_tok_str(st, st->tok, &st->tokc);
                         cstr_cat(st, &cstr, p1);
                         cstr_ccat(st, &cstr, '\0');
                         p2 = get_tok_str(st, t, &cval);
                         warning(st, "pasting \"%s\" and \"%s\" does not give a valid preprocessing token", cstr.data, p2);
                         /* cannot merge tokens: just add them separately */
-                        tok_str_add2(st, &macro_str1, tok, tok_flags, &tokc);
+                        tok_str_add2(st, &macro_str1, st->tok, st->tok_flags, &st->tokc);
                         /* XXX: free associated memory ? */
-                        tok = t;
-                        tokc = cval;
+                        st->tok = t;
+                        st->tokc = cval;
                     }
                 }
             }
         }
-        tok_str_add2(st, &macro_str1, tok, tok_flags, &tokc);
+        tok_str_add2(st, &macro_str1, st->tok, st->tok_flags, &st->tokc);
         next_nomacro(st);
-        if (tok == 0)
+        if (st->tok == 0)
             break;
     }
-    macro_ptr = (int *)saved_macro_ptr;
+    st->macro_ptr = (int *)saved_macro_ptr;
     cstr_free(st, &cstr);
     tok_str_add(st, &macro_str1, 0, 0);
     return macro_str1.str;
@@ -3481,15 +4188,15 @@ static void macro_subst(TCCState *st, TokenString *tok_str, Sym **nested_list,
             /* if nested substitution, do nothing */
             if (sym_find2(st, *nested_list, t))
                 goto no_subst;
-            ml.p = macro_ptr;
+            ml.p = st->macro_ptr;
             if (can_read_stream)
                 ml.prev = *can_read_stream, *can_read_stream = &ml;
-            macro_ptr = (int *)ptr;
-            tok = t;
-            tok_flags = tf;
+            st->macro_ptr = (int *)ptr;
+            st->tok = t;
+            st->tok_flags = tf;
             ret = macro_subst_tok(st, tok_str, nested_list, s, can_read_stream);
-            ptr = (int *)macro_ptr;
-            macro_ptr = ml.p;
+            ptr = (int *)st->macro_ptr;
+            st->macro_ptr = ml.p;
             if (can_read_stream && *can_read_stream == &ml)
                     *can_read_stream = ml.prev;
             if (ret != 0)
@@ -3500,7 +4207,7 @@ static void macro_subst(TCCState *st, TokenString *tok_str, Sym **nested_list,
         }
     }
     if (macro_str1)
-        tok_str_free(st, macro_str1);
+        tok_str_free_expand(st, macro_str1);
 }
 
 
@@ -3513,45 +4220,46 @@ static void next(TCCState *st)
 
  redo:
     next_nomacro(st);
-    if (!macro_ptr) {
+    if (!st->macro_ptr) {
         /* if not reading from macro substituted string, then try
            to substitute macros */
-        if (tok >= TOK_IDENT &&
-            (parse_flags & PARSE_FLAG_PREPROCESS)) {
-            s = define_find(st, tok);
+        if (st->tok >= TOK_IDENT &&
+            (st->parse_flags & PARSE_FLAG_PREPROCESS)) {
+            s = define_find(st, st->tok);
             if (s) {
                 /* we have a macro: we try to substitute */
-                tok_str_new(st, &str);
+                tok_str_new_expand(st, &str);
                 nested_list = NULL;
                 ml = NULL;
                 if (macro_subst_tok(st, &str, &nested_list, s, &ml) == 0) {
                     /* substitution done, NOTE: maybe empty */
                     tok_str_add(st, &str, 0, 0);
-                    macro_ptr = str.str;
-                    macro_ptr_allocated = str.str;
+                    st->macro_ptr = str.str;
+                    st->macro_ptr_allocated = str.str;
                     goto redo;
                 }
+                tok_str_free_expand(st, str.str);
             }
         }
     } else {
-        if (tok == 0) {
+        if (st->tok == 0) {
             /* end of macro or end of unget buffer */
-            if (unget_buffer_enabled) {
-                macro_ptr = unget_saved_macro_ptr;
-                unget_buffer_enabled = 0;
+            if (st->unget_buffer_enabled) {
+                st->macro_ptr = st->unget_saved_macro_ptr;
+                st->unget_buffer_enabled = 0;
             } else {
                 /* end of macro string: free it */
-                tok_str_free(st, macro_ptr_allocated);
-                macro_ptr = NULL;
+                tok_str_free_expand(st, st->macro_ptr_allocated);
+                st->macro_ptr = NULL;
             }
             goto redo;
         }
     }
     
     /* convert preprocessor tokens into C tokens */
-    if (tok == TOK_PPNUM &&
-        (parse_flags & PARSE_FLAG_TOK_NUM)) {
-        parse_number(st, (char *)tokc.cstr->data);
+    if (st->tok == TOK_PPNUM &&
+        (st->parse_flags & PARSE_FLAG_TOK_NUM)) {
+        parse_number(st, (char *)st->tokc.cstr->data);
     }
     
 }
@@ -3562,16 +4270,16 @@ static inline void unget_tok(TCCState *st, int last_tok)
 {
     int i, n;
     int *q;
-    unget_saved_macro_ptr = macro_ptr;
-    unget_buffer_enabled = 1;
-    q = unget_saved_buffer;
-    macro_ptr = q;
-    *q++ = tok;
-    n = tok_ext_size(st, tok) - 1;
+    st->unget_saved_macro_ptr = st->macro_ptr;
+    st->unget_buffer_enabled = 1;
+    q = st->unget_saved_buffer;
+    st->macro_ptr = q;
+    *q++ = st->tok;
+    n = tok_ext_size(st, st->tok) - 1;
     for(i=0;i<n;i++)
-        *q++ = tokc.tab[i];
+        *q++ = st->tokc.tab[i];
     *q = 0; /* end of token string */
-    tok = last_tok;
+    st->tok = last_tok;
 }
 
 
@@ -3587,29 +4295,33 @@ void vsetc(TCCState *st, CType *type, int r, CValue *vc)
 {
     int v;
 
-    if (vtop >= vstack + (VSTACK_SIZE - 1))
+    if (st->vtop >= st->vstack + (VSTACK_SIZE - 1))
        tcc_error(st, "memory full");
     /* cannot let cpu flags if other instruction are generated. Also
        avoid leaving VT_JMP anywhere except on the top of the stack
        because it would complicate the code generator. */
-    if (vtop >= vstack) {
-        v = vtop->r & VT_VALMASK;
+    if (st->vtop >= st->vstack) {
+        v = st->vtop->r & VT_VALMASK;
         if (v == VT_CMP || (v & ~1) == VT_JMP)
             gv(st, RC_INT);
     }
-    vtop++;
-    vtop->type = *type;
-    vtop->r = r;
-    vtop->r2 = VT_CONST;
-    vtop->c = *vc;
+    st->vtop++;
+    st->vtop->type = *type;
+    st->vtop->r = r;
+    st->vtop->r2 = VT_CONST;
+    st->vtop->c = *vc;
 }
 
 /* push integer constant */
 void vpushi(TCCState *st, int v)
 {
     CValue cval;
+#ifdef TCC_TARGET_X86_64
+    cval.ll = v;
+#else
     cval.i = v;
-    vsetc(st, &int_type, VT_CONST, &cval);
+#endif
+    vsetc(st, &st->int_type, VT_CONST, &cval);
 }
 
 /* Return a static symbol pointing to a section */
@@ -3619,7 +4331,7 @@ static Sym *get_sym_ref(TCCState *st, CType *type, Section *sec,
     int v;
     Sym *sym;
 
-    v = anon_sym++;
+    v = st->anon_sym++;
     sym = global_identifier_push(st, v, type->t | VT_STATIC, 0);
     sym->type.ref = type->ref;
     sym->r = VT_CONST | VT_SYM;
@@ -3634,7 +4346,7 @@ static void vpush_ref(TCCState *s, CType *type, Section *sec, unsigned long offs
 
     cval.ul = 0;
     vsetc(s, type, VT_CONST | VT_SYM, &cval);
-    vtop->sym = get_sym_ref(s, type, sec, offset, size);
+    s->vtop->sym = get_sym_ref(s, type, sec, offset, size);
 }
 
 /* define a new external reference to a symbol 'v' of type 'u' */
@@ -3679,14 +4391,18 @@ static void vpush_global_sym(TCCState *st, CType *type, int v)
     sym = external_global_sym(st, v, type, 0);
     cval.ul = 0;
     vsetc(st, type, VT_CONST | VT_SYM, &cval);
-    vtop->sym = sym;
+    st->vtop->sym = sym;
 }
 
 void vset(TCCState *st, CType *type, int r, int v)
 {
     CValue cval;
 
+#ifdef TCC_TARGET_X86_64
+    cval.ll = v;
+#else
     cval.i = v;
+#endif
     vsetc(st, type, r, &cval);
 }
 
@@ -3701,22 +4417,43 @@ void vswap(TCCState *st)
 {
     SValue tmp;
 
-    tmp = vtop[0];
-    vtop[0] = vtop[-1];
-    vtop[-1] = tmp;
+    tmp = st->vtop[0];
+    st->vtop[0] = st->vtop[-1];
+    st->vtop[-1] = tmp;
 }
 
 void vpushv(TCCState *st, SValue *v)
 {
-    if (vtop >= vstack + (VSTACK_SIZE - 1))
+    if (st->vtop >= st->vstack + (VSTACK_SIZE - 1))
        tcc_error(st, "memory full");
-    vtop++;
-    *vtop = *v;
+    st->vtop++;
+    *st->vtop = *v;
 }
 
 void vdup(TCCState *st)
 {
-    vpushv(st, vtop);
+    vpushv(st, st->vtop);
+}
+
+/* record a stack slot of the current function. The i386 optimizer
+   keeps the most used scalar slots in registers. */
+static void func_local(TCCState *st, int addr, int size, CType *type)
+{
+    LocalSlot *l;
+
+    if (st->optimize < 2)
+        return;
+    if ((st->nb_func_locals & (st->nb_func_locals - 1)) == 0)
+        st->func_locals = arena_realloc(st, st->func_locals,
+                                        st->nb_func_locals * sizeof(LocalSlot),
+                                        (st->nb_func_locals ? st->nb_func_locals * 2 : 1) *
+                                        sizeof(LocalSlot));
+    l = &st->func_locals[st->nb_func_locals++];
+    l->addr = addr;
+    l->size = size;
+    l->scalar = size == 4 &&
+        !(type->t & (VT_ARRAY | VT_VOLATILE)) &&
+        (type->t & VT_BTYPE) != VT_STRUCT;
 }
 
 /* save r to the memory stack, and mark it as being free */
@@ -3729,7 +4466,7 @@ void save_reg(TCCState *st, int r)
     /* modify all stack values */
     saved = 0;
     l = 0;
-    for(p=vstack;p<=vtop;p++) {
+    for(p=st->vstack;p<=st->vtop;p++) {
         if ((p->r & VT_VALMASK) == r ||
             ((p->type.t & VT_BTYPE) == VT_LLONG && (p->r2 & VT_VALMASK) == r))
         {
@@ -3739,16 +4476,23 @@ void save_reg(TCCState *st, int r)
                 r = p->r & VT_VALMASK;
                 /* store register in the stack */
                 type = &p->type;
+#ifdef TCC_TARGET_X86_64
+                /* save the whole register */
+                if ((p->r & VT_LVAL) || !is_float(st, type->t))
+                    type = &st->char_pointer_type;
+#else
                 if ((p->r & VT_LVAL) || 
                     (!is_float(st, type->t) && (type->t & VT_BTYPE) != VT_LLONG))
-                    type = &int_type;
+                    type = &st->int_type;
+#endif
                 size = type_size(st, type, &align);
-                loc = (loc - size) & -align;
+                st->loc = (st->loc - size) & -align;
+                func_local(st, st->loc, size, type);
                 sv.type.t = type->t;
                 sv.r = VT_LOCAL | VT_LVAL;
-                sv.c.ul = loc;
+                sv.c.ul = st->loc;
                 store(st, r, &sv);
-#ifdef TCC_TARGET_I386
+#if defined(TCC_TARGET_I386) || defined(TCC_TARGET_X86_64)
                 /* x86 specific: need to pop fp register ST0 if saved */
                 if (r == TREG_ST0) {
                     o(st, 0xd9dd); /* fstp %st(1) */
@@ -3759,7 +4503,7 @@ void save_reg(TCCState *st, int r)
                     sv.c.ul += 4;
                     store(st, p->r2, &sv);
                 }
-                l = loc;
+                l = st->loc;
                 saved = 1;
             }
             /* mark that stack entry as being saved on the stack */
@@ -3788,7 +4532,7 @@ int get_reg_ex(TCCState *st, int rc, int rc2)
         if (reg_classes[r] & rc2) {
             int n;
             n=0;
-            for(p = vstack; p <= vtop; p++) {
+            for(p = st->vstack; p <= st->vtop; p++) {
                 if ((p->r & VT_VALMASK) == r ||
                     (p->r2 & VT_VALMASK) == r)
                     n++;
@@ -3809,11 +4553,12 @@ int get_reg(TCCState *st, int rc)
     /* find a free register */
     for(r=0;r<NB_REGS;r++) {
         if (reg_classes[r] & rc) {
-            for(p=vstack;p<=vtop;p++) {
+            for(p=st->vstack;p<=st->vtop;p++) {
                 if ((p->r & VT_VALMASK) == r ||
                     (p->r2 & VT_VALMASK) == r)
                     goto notfound;
             }
+            st->func_regs_used |= 1 << r;
             return r;
         }
     notfound: ;
@@ -3822,7 +4567,7 @@ int get_reg(TCCState *st, int rc)
     /* no register left : free the first one on the stack (VERY
        IMPORTANT to start from the bottom to ensure that we don't
        spill registers used in gen_opi()) */
-    for(p=vstack;p<=vtop;p++) {
+    for(p=st->vstack;p<=st->vtop;p++) {
         r = p->r & VT_VALMASK;
         if (r < VT_CONST && (reg_classes[r] & rc))
             goto save_found;
@@ -3843,8 +4588,8 @@ void save_regs(TCCState *st, int n)
 {
     int r;
     SValue *p, *p1;
-    p1 = vtop - n;
-    for(p = vstack;p <= p1; p++) {
+    p1 = st->vtop - n;
+    for(p = st->vstack;p <= p1; p++) {
         r = p->r & VT_VALMASK;
         if (r < VT_CONST) {
             save_reg(st, r);
@@ -3870,10 +4615,10 @@ void move_reg(TCCState *st, int r, int s)
 /* get address of vtop (vtop MUST BE an lvalue) */
 void gaddrof(TCCState *st)
 {
-    vtop->r &= ~VT_LVAL;
+    st->vtop->r &= ~VT_LVAL;
     /* tricky: if saved lvalue, then we can go back to lvalue */
-    if ((vtop->r & VT_VALMASK) == VT_LLOCAL)
-        vtop->r = (vtop->r & ~(VT_VALMASK | VT_LVAL_TYPE)) | VT_LOCAL | VT_LVAL;
+    if ((st->vtop->r & VT_VALMASK) == VT_LLOCAL)
+        st->vtop->r = (st->vtop->r & ~(VT_VALMASK | VT_LVAL_TYPE)) | VT_LOCAL | VT_LVAL;
 }
 
 #if 0
@@ -3883,20 +4628,20 @@ void gbound(TCCState *st)
     int lval_type;
     CType type1;
 
-    vtop->r &= ~VT_MUSTBOUND;
+    st->vtop->r &= ~VT_MUSTBOUND;
     /* if lvalue, then use checking code before dereferencing */
-    if (vtop->r & VT_LVAL) {
+    if (st->vtop->r & VT_LVAL) {
         /* if not VT_BOUNDED value, then make one */
-        if (!(vtop->r & VT_BOUNDED)) {
-            lval_type = vtop->r & (VT_LVAL_TYPE | VT_LVAL);
+        if (!(st->vtop->r & VT_BOUNDED)) {
+            lval_type = st->vtop->r & (VT_LVAL_TYPE | VT_LVAL);
             /* must save type because we must set it to int to get pointer */
-            type1 = vtop->type;
-            vtop->type.t = VT_INT;
+            type1 = st->vtop->type;
+            st->vtop->type.t = VT_INT;
             gaddrof(st );
             vpushi(st, 0);
             gen_bounded_ptr_add(st);
-            vtop->r |= lval_type;
-            vtop->type = type1;
+            st->vtop->r |= lval_type;
+            st->vtop->type = type1;
         }
         /* then check for dereferencing */
         gen_bounded_ptr_deref(st);
@@ -3909,15 +4654,18 @@ void gbound(TCCState *st)
    register value (such as structures). */
 int gv(TCCState *st, int rc)
 {
-    int r, r2, rc2, bit_pos, bit_size, size, align, i;
+    int r, bit_pos, bit_size, size, align, i;
+#ifndef TCC_TARGET_X86_64
+    int r2, rc2;
     unsigned long long ll;
+#endif
 
     /* NOTE: get_reg can modify vstack[] */
-    if (vtop->type.t & VT_BITFIELD) {
-        bit_pos = (vtop->type.t >> VT_STRUCT_SHIFT) & 0x3f;
-        bit_size = (vtop->type.t >> (VT_STRUCT_SHIFT + 6)) & 0x3f;
+    if (st->vtop->type.t & VT_BITFIELD) {
+        bit_pos = (st->vtop->type.t >> VT_STRUCT_SHIFT) & 0x3f;
+        bit_size = (st->vtop->type.t >> (VT_STRUCT_SHIFT + 6)) & 0x3f;
         /* remove bit field info to avoid loops */
-        vtop->type.t &= ~(VT_BITFIELD | (-1 << VT_STRUCT_SHIFT));
+        st->vtop->type.t &= ~(VT_BITFIELD | (-1 << VT_STRUCT_SHIFT));
         /* generate shifts */
         vpushi(st, 32 - (bit_pos + bit_size));
         gen_op(st, TOK_SHL);
@@ -3926,8 +4674,17 @@ int gv(TCCState *st, int rc)
         gen_op(st, TOK_SAR);
         r = gv(st, rc);
     } else {
-        if (is_float(st, vtop->type.t) && 
-            (vtop->r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
+#ifdef TCC_TARGET_X86_64
+        /* long doubles only live on the x87 stack */
+        if ((st->vtop->type.t & VT_BTYPE) == VT_LDOUBLE)
+            rc = RC_ST0;
+#endif
+#ifdef TCC_TARGET_I386
+        if (rc == RC_FLOAT)
+            rc = float_class(st, st->vtop->type.t);
+#endif
+        if (is_float(st, st->vtop->type.t) && 
+            (st->vtop->r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
             Sym *sym;
             int *ptr;
             unsigned long offset;
@@ -3938,119 +4695,132 @@ int gv(TCCState *st, int rc)
             /* XXX: unify with initializers handling ? */
             /* CPUs usually cannot use float constants, so we store them
                generically in data segment */
-            size = type_size(st, &vtop->type, &align);
-            offset = (data_section->data_offset + align - 1) & -align;
-            data_section->data_offset = offset;
+            size = type_size(st, &st->vtop->type, &align);
+            offset = (st->data_section->data_offset + align - 1) & -align;
+            st->data_section->data_offset = offset;
             /* XXX: not portable yet */
-#ifdef __i386__
+#ifdef TCC_TARGET_I386
             /* long doubles are defined to be 96 bit wide by
                the i386 ABI but the x87 only uses the first 80. The rest
                is filled with garbage by now, so clear it before writing */
             if(size == 12)
-                vtop->c.tab[2] &= 0xffff;
+                st->vtop->c.tab[2] &= 0xffff;
 #endif
-            ptr = section_ptr_add(st, data_section, size);
+#ifdef TCC_TARGET_X86_64
+            /* same for the 6 padding bytes of the 128 bit slot */
+            if (size == 16) {
+                st->vtop->c.tab[2] &= 0xffff;
+                st->vtop->c.tab[3] = 0;
+            }
+#endif
+            ptr = section_ptr_add(st, st->data_section, size);
             size = size >> 2;
 #if defined(TCC_TARGET_ARM) && !defined(TCC_ARM_VFP)
             check.d = 1;
             if(check.tab[0])
                 for(i=0;i<size;i++)
-                    ptr[i] = vtop->c.tab[size-1-i];
+                    ptr[i] = st->vtop->c.tab[size-1-i];
             else
 #endif
             for(i=0;i<size;i++)
-                ptr[i] = vtop->c.tab[i];
-            sym = get_sym_ref(st, &vtop->type, data_section, offset, size << 2);
-            vtop->r |= VT_LVAL | VT_SYM;
-            vtop->sym = sym;
-            vtop->c.ul = 0;
+                ptr[i] = st->vtop->c.tab[i];
+            sym = get_sym_ref(st, &st->vtop->type, st->data_section, offset, size << 2);
+            st->vtop->r |= VT_LVAL | VT_SYM;
+            st->vtop->sym = sym;
+            st->vtop->c.ul = 0;
         }
 #if 0
-        if (vtop->r & VT_MUSTBOUND) 
+        if (st->vtop->r & VT_MUSTBOUND) 
             gbound(st );
 #endif
 
-        r = vtop->r & VT_VALMASK;
+        r = st->vtop->r & VT_VALMASK;
         /* need to reload if:
            - constant
            - lvalue (need to dereference pointer)
            - already a register, but not in the right class */
         if (r >= VT_CONST || 
-            (vtop->r & VT_LVAL) ||
-            !(reg_classes[r] & rc) ||
-            ((vtop->type.t & VT_BTYPE) == VT_LLONG && 
-             !(reg_classes[vtop->r2] & rc))) {
+            (st->vtop->r & VT_LVAL) ||
+            !(reg_classes[r] & rc)
+#ifndef TCC_TARGET_X86_64
+            || ((st->vtop->type.t & VT_BTYPE) == VT_LLONG && 
+                !(reg_classes[st->vtop->r2] & rc))
+#endif
+            ) {
             r = get_reg(st, rc);
-            if ((vtop->type.t & VT_BTYPE) == VT_LLONG) {
+#ifndef TCC_TARGET_X86_64
+            if ((st->vtop->type.t & VT_BTYPE) == VT_LLONG) {
                 /* two register type load : expand to two words
                    temporarily */
-                if ((vtop->r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
+                if ((st->vtop->r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
                     /* load constant */
-                    ll = vtop->c.ull;
-                    vtop->c.ui = ll; /* first word */
-                    load(st, r, vtop);
-                    vtop->r = r; /* save register value */
+                    ll = st->vtop->c.ull;
+                    st->vtop->c.ui = ll; /* first word */
+                    load(st, r, st->vtop);
+                    st->vtop->r = r; /* save register value */
                     vpushi(st, ll >> 32); /* second word */
                 } else if (r >= VT_CONST || /* XXX: test to VT_CONST incorrect ? */
-                           (vtop->r & VT_LVAL)) {
+                           (st->vtop->r & VT_LVAL)) {
                     /* We do not want to modifier the long long
                        pointer here, so the safest (and less
                        efficient) is to save all the other registers
                        in the stack. XXX: totally inefficient. */
                     save_regs(st, 1);
                     /* load from memory */
-                    load(st, r, vtop);
+                    load(st, r, st->vtop);
                     vdup(st);
-                    vtop[-1].r = r; /* save register value */
+                    st->vtop[-1].r = r; /* save register value */
                     /* increment pointer to get second word */
-                    vtop->type.t = VT_INT;
+                    st->vtop->type.t = VT_INT;
                     gaddrof(st);
                     vpushi(st, 4);
                     gen_op(st, '+');
-                    vtop->r |= VT_LVAL;
+                    st->vtop->r |= VT_LVAL;
                 } else {
                     /* move registers */
-                    load(st, r, vtop);
+                    load(st, r, st->vtop);
                     vdup(st );
-                    vtop[-1].r = r; /* save register value */
-                    vtop->r = vtop[-1].r2;
+                    st->vtop[-1].r = r; /* save register value */
+                    st->vtop->r = st->vtop[-1].r2;
                 }
                 /* allocate second register */
                 rc2 = RC_INT;
                 if (rc == RC_IRET)
                     rc2 = RC_LRET;
                 r2 = get_reg(st, rc2);
-                load(st, r2, vtop);
+                load(st, r2, st->vtop);
                 vpop(st);
                 /* write second register */
-                vtop->r2 = r2;
-            } else if ((vtop->r & VT_LVAL) && !is_float(st, vtop->type.t)) {
+                st->vtop->r2 = r2;
+            } else
+#endif
+            if ((st->vtop->r & VT_LVAL) && !is_float(st, st->vtop->type.t)) {
                 int t1, t;
                 /* lvalue of scalar type : need to use lvalue type
                    because of possible cast */
-                t = vtop->type.t;
+                t = st->vtop->type.t;
                 t1 = t;
                 /* compute memory access type */
-                if (vtop->r & VT_LVAL_BYTE)
+                if (st->vtop->r & VT_LVAL_BYTE)
                     t = VT_BYTE;
-                else if (vtop->r & VT_LVAL_SHORT)
+                else if (st->vtop->r & VT_LVAL_SHORT)
                     t = VT_SHORT;
-                if (vtop->r & VT_LVAL_UNSIGNED)
+                if (st->vtop->r & VT_LVAL_UNSIGNED)
                     t |= VT_UNSIGNED;
-                vtop->type.t = t;
-                load(st, r, vtop);
+                st->vtop->type.t = t;
+                load(st, r, st->vtop);
                 /* restore wanted type */
-                vtop->type.t = t1;
+                st->vtop->type.t = t1;
             } else {
                 /* one register type load */
-                load(st, r, vtop);
+                load(st, r, st->vtop);
             }
         }
-        vtop->r = r;
+        st->vtop->r = r;
 #ifdef TCC_TARGET_C67
         /* uses register pairs for doubles */
-        if ((vtop->type.t & VT_BTYPE) == VT_DOUBLE) 
-            vtop->r2 = r+1;
+        if ((st->vtop->type.t & VT_BTYPE) == VT_DOUBLE) 
+            st->vtop->r2 = r+1;
 #endif
     }
     return r;
@@ -4064,14 +4834,14 @@ void gv2(TCCState *st, int rc1, int rc2)
     /* generate more generic register first. But VT_JMP or VT_CMP
        values must be generated first in all cases to avoid possible
        reload errors */
-    v = vtop[0].r & VT_VALMASK;
+    v = st->vtop[0].r & VT_VALMASK;
     if (v != VT_CMP && (v & ~1) != VT_JMP && rc1 <= rc2) {
         vswap(st);
         gv(st, rc1);
         vswap(st);
         gv(st, rc2);
         /* test if reload is needed for first register */
-        if ((vtop[-1].r & VT_VALMASK) >= VT_CONST) {
+        if ((st->vtop[-1].r & VT_VALMASK) >= VT_CONST) {
             vswap(st);
             gv(st, rc1);
             vswap(st);
@@ -4082,7 +4852,7 @@ void gv2(TCCState *st, int rc1, int rc2)
         gv(st, rc1);
         vswap(st);
         /* test if reload is needed for first register */
-        if ((vtop[0].r & VT_VALMASK) >= VT_CONST) {
+        if ((st->vtop[0].r & VT_VALMASK) >= VT_CONST) {
             gv(st, rc2);
         }
     }
@@ -4093,41 +4863,41 @@ void lexpand(TCCState *st)
 {
     int u;
 
-    u = vtop->type.t & VT_UNSIGNED;
+    u = st->vtop->type.t & VT_UNSIGNED;
     gv(st, RC_INT);
     vdup(st);
-    vtop[0].r = vtop[-1].r2;
-    vtop[0].r2 = VT_CONST;
-    vtop[-1].r2 = VT_CONST;
-    vtop[0].type.t = VT_INT | u;
-    vtop[-1].type.t = VT_INT | u;
+    st->vtop[0].r = st->vtop[-1].r2;
+    st->vtop[0].r2 = VT_CONST;
+    st->vtop[-1].r2 = VT_CONST;
+    st->vtop[0].type.t = VT_INT | u;
+    st->vtop[-1].type.t = VT_INT | u;
 }
 
 #ifdef TCC_TARGET_ARM
 /* expand long long on stack */
-void lexpand_nr(void)
+void lexpand_nr(TCCState *st)
 {
     int u,v;
 
-    u = vtop->type.t & VT_UNSIGNED;
+    u = st->vtop->type.t & VT_UNSIGNED;
     vdup(st);
-    vtop->r2 = VT_CONST;
-    vtop->type.t = VT_INT | u;
-    v=vtop[-1].r & (VT_VALMASK | VT_LVAL);
+    st->vtop->r2 = VT_CONST;
+    st->vtop->type.t = VT_INT | u;
+    v=st->vtop[-1].r & (VT_VALMASK | VT_LVAL);
     if (v == VT_CONST) {
-      vtop[-1].c.ui = vtop->c.ull;
-      vtop->c.ui = vtop->c.ull >> 32;
-      vtop->r = VT_CONST;
+      st->vtop[-1].c.ui = st->vtop->c.ull;
+      st->vtop->c.ui = st->vtop->c.ull >> 32;
+      st->vtop->r = VT_CONST;
     } else if (v == (VT_LVAL|VT_CONST) || v == (VT_LVAL|VT_LOCAL)) {
-      vtop->c.ui += 4;
-      vtop->r = vtop[-1].r;
+      st->vtop->c.ui += 4;
+      st->vtop->r = st->vtop[-1].r;
     } else if (v > VT_CONST) {
-      vtop--;
+      st->vtop--;
       lexpand(st);
     } else
-      vtop->r = vtop[-1].r2;
-    vtop[-1].r2 = VT_CONST;
-    vtop[-1].type.t = VT_INT | u;
+      st->vtop->r = st->vtop[-1].r2;
+    st->vtop[-1].r2 = VT_CONST;
+    st->vtop[-1].type.t = VT_INT | u;
 }
 #endif
 
@@ -4135,8 +4905,8 @@ void lexpand_nr(void)
 void lbuild(TCCState *st, int t)
 {
     gv2(st, RC_INT, RC_INT);
-    vtop[-1].r2 = vtop[0].r;
-    vtop[-1].type.t = t;
+    st->vtop[-1].r2 = st->vtop[0].r;
+    st->vtop[-1].type.t = t;
     vpop(st);
 }
 
@@ -4148,10 +4918,10 @@ void vrotb(TCCState *s, int n)
     int i;
     SValue tmp;
 
-    tmp = vtop[-n + 1];
+    tmp = s->vtop[-n + 1];
     for(i=-n+1;i!=0;i++)
-        vtop[i] = vtop[i+1];
-    vtop[0] = tmp;
+        s->vtop[i] = s->vtop[i+1];
+    s->vtop[0] = tmp;
 }
 
 /* rotate n first stack elements to the top 
@@ -4162,10 +4932,10 @@ void vrott(TCCState *s, int n)
     int i;
     SValue tmp;
 
-    tmp = vtop[0];
+    tmp = s->vtop[0];
     for(i = 0;i < n - 1; i++)
-        vtop[-i] = vtop[-i - 1];
-    vtop[-n + 1] = tmp;
+        s->vtop[-i] = s->vtop[-i - 1];
+    s->vtop[-n + 1] = tmp;
 }
 
 #ifdef TCC_TARGET_ARM
@@ -4177,10 +4947,10 @@ void vnrott(TCCState *s, int n)
     int i;
     SValue tmp;
 
-    tmp = vtop[-n + 1];
+    tmp = s->vtop[-n + 1];
     for(i = n - 1; i > 0; i--)
-        vtop[-i] = vtop[-i + 1];
-    vtop[0] = tmp;
+        s->vtop[-i] = s->vtop[-i + 1];
+    s->vtop[0] = tmp;
 }
 #endif
 
@@ -4188,8 +4958,8 @@ void vnrott(TCCState *s, int n)
 void vpop(TCCState *st)
 {
     int v;
-    v = vtop->r & VT_VALMASK;
-#ifdef TCC_TARGET_I386
+    v = st->vtop->r & VT_VALMASK;
+#if defined(TCC_TARGET_I386) || defined(TCC_TARGET_X86_64)
     /* for x86, we need to pop the FP stack */
     if (v == TREG_ST0) {
         o(st, 0xd9dd); /* fstp %st(1) */
@@ -4197,9 +4967,9 @@ void vpop(TCCState *st)
 #endif
     if (v == VT_JMP || v == VT_JMPI) {
         /* need to put correct jump if && or || without test */
-        gsym(vtop->c.ul);
+        gsym(st, st->vtop->c.ul);
     }
-    vtop--;
+    st->vtop--;
 }
 
 /* convert stack entry to register and duplicate its value in another
@@ -4209,7 +4979,15 @@ void gv_dup(TCCState *st)
     int rc, t, r, r1;
     SValue sv;
 
-    t = vtop->type.t;
+    t = st->vtop->type.t;
+#ifdef TCC_TARGET_X86_64
+    if ((t & VT_BTYPE) == VT_LDOUBLE) {
+        /* there is a single x87 register: go through memory */
+        save_reg(st, gv(st, RC_ST0));
+        vdup(st);
+        return;
+    }
+#else
     if ((t & VT_BTYPE) == VT_LLONG) {
         lexpand(st);
         gv_dup(st);
@@ -4224,12 +5002,17 @@ void gv_dup(TCCState *st)
         vswap(st);
         lbuild(st, t);
         vswap(st);
-    } else {
+    } else
+#endif
+    {
         /* duplicate value */
         rc = RC_INT;
         sv.type.t = VT_INT;
         if (is_float(st, t)) {
             rc = RC_FLOAT;
+#ifdef TCC_TARGET_I386
+            rc = float_class(st, t);
+#endif
             sv.type.t = t;
         }
         r = gv(st, rc);
@@ -4239,10 +5022,11 @@ void gv_dup(TCCState *st)
         load(st, r1, &sv); /* move r to r1 */
         vdup(st);
         /* duplicates value */
-        vtop->r = r1;
+        st->vtop->r = r1;
     }
 }
 
+#ifndef TCC_TARGET_X86_64
 /* generate CPU independent (unsigned) long long operations */
 void gen_opl(TCCState *st, int op)
 {
@@ -4265,12 +5049,12 @@ void gen_opl(TCCState *st, int op)
         func = TOK___umoddi3;
     gen_func:
         /* call generic long long function */
-        vpush_global_sym(st, &func_old_type, func);
+        vpush_global_sym(st, &st->func_old_type, func);
         vrott(st, 3);
         gfunc_call(st, 2);
         vpushi(st, 0);
-        vtop->r = REG_IRET;
-        vtop->r2 = REG_LRET;
+        st->vtop->r = REG_IRET;
+        st->vtop->r2 = REG_LRET;
         break;
     case '^':
     case '&':
@@ -4278,32 +5062,32 @@ void gen_opl(TCCState *st, int op)
     case '*':
     case '+':
     case '-':
-        t = vtop->type.t;
+        t = st->vtop->type.t;
         vswap(st);
         lexpand(st);
         vrotb(st, 3);
         lexpand(st);
         /* stack: L1 H1 L2 H2 */
-        tmp = vtop[0];
-        vtop[0] = vtop[-3];
-        vtop[-3] = tmp;
-        tmp = vtop[-2];
-        vtop[-2] = vtop[-3];
-        vtop[-3] = tmp;
+        tmp = st->vtop[0];
+        st->vtop[0] = st->vtop[-3];
+        st->vtop[-3] = tmp;
+        tmp = st->vtop[-2];
+        st->vtop[-2] = st->vtop[-3];
+        st->vtop[-3] = tmp;
         vswap(st);
         /* stack: H1 H2 L1 L2 */
         if (op == '*') {
-            vpushv(st, vtop - 1);
-            vpushv(st, vtop - 1);
+            vpushv(st, st->vtop - 1);
+            vpushv(st, st->vtop - 1);
             gen_op(st, TOK_UMULL);
             lexpand(st);
             /* stack: H1 H2 L1 L2 ML MH */
             for(i=0;i<4;i++)
                 vrotb(st, 6);
             /* stack: ML MH H1 H2 L1 L2 */
-            tmp = vtop[0];
-            vtop[0] = vtop[-2];
-            vtop[-2] = tmp;
+            tmp = st->vtop[0];
+            st->vtop[0] = st->vtop[-2];
+            st->vtop[-2] = tmp;
             /* stack: ML MH H1 L2 H2 L1 */
             gen_op(st, '*');
             vrotb(st, 3);
@@ -4338,13 +5122,13 @@ void gen_opl(TCCState *st, int op)
     case TOK_SAR:
     case TOK_SHR:
     case TOK_SHL:
-        if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
-            t = vtop[-1].type.t;
+        if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+            t = st->vtop[-1].type.t;
             vswap(st);
             lexpand(st);
             vrotb(st, 3);
             /* stack: L H shift */
-            c = (int)vtop->c.i;
+            c = (int)st->vtop->c.i;
             /* constant: simpler */
             /* NOTE: all comments are for SHL. the other cases are
                done by swaping words */
@@ -4407,15 +5191,15 @@ void gen_opl(TCCState *st, int op)
         break;
     default:
         /* compare operations */
-        t = vtop->type.t;
+        t = st->vtop->type.t;
         vswap(st);
         lexpand(st);
         vrotb(st, 3);
         lexpand(st);
         /* stack: L1 H1 L2 H2 */
-        tmp = vtop[-1];
-        vtop[-1] = vtop[-2];
-        vtop[-2] = tmp;
+        tmp = st->vtop[-1];
+        st->vtop[-1] = st->vtop[-2];
+        st->vtop[-2] = tmp;
         /* stack: L1 L2 H1 H2 */
         /* compare high */
         op1 = op;
@@ -4444,8 +5228,8 @@ void gen_opl(TCCState *st, int op)
 #if defined(TCC_TARGET_I386)
                 b = psym(st, 0x850f, 0);
 #elif defined(TCC_TARGET_ARM)
-                b = ind;
-                o(st, 0x1A000000 | encbranch(ind, 0, 1));
+                b = st->ind;
+                o(st, 0x1A000000 | encbranch(st->ind, 0, 1));
 #elif defined(TCC_TARGET_C67)
                tcc_error("not implemented");
 #else
@@ -4465,11 +5249,75 @@ void gen_opl(TCCState *st, int op)
             op1 = TOK_UGE;
         gen_op(st, op1);
         a = gtst(st, 1, a);
-        gsym(b);
+        gsym(st, b);
         vseti(st, VT_JMPI, a);
         break;
     }
 }
+#endif
+
+/* find the magic number 'm' and the shift 's' that replace the 32 bit
+   division by the constant 'd' by a multiplication ("Division by
+   invariant integers using multiplication", Granlund and Montgomery).
+   Return 0 if the division must be done by div or idiv, 1 if the high
+   half of the product only has to be shifted (and, for a signed
+   division, corrected by the dividend if 'm' and 'd' differ in sign),
+   2 if an unsigned division needs a 33 bit multiplier whose low half
+   is 'm'. */
+static int div_magic(unsigned int d, int is_signed, unsigned int *m, int *s)
+{
+    unsigned long long p, q;
+    unsigned int ad, anc, t, q1, r1, q2, r2, delta;
+    int l;
+
+    if (is_signed) {
+        ad = (int)d < 0 ? -d : d;
+        if (ad < 2 || ad == 0x80000000)
+            return 0;
+        t = 0x80000000 + (d >> 31);
+        anc = t - 1 - t % ad;
+        l = 31;
+        q1 = 0x80000000 / anc;
+        r1 = 0x80000000 - q1 * anc;
+        q2 = 0x80000000 / ad;
+        r2 = 0x80000000 - q2 * ad;
+        do {
+            l++;
+            q1 *= 2;
+            r1 *= 2;
+            if (r1 >= anc) {
+                q1++;
+                r1 -= anc;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if (r2 >= ad) {
+                q2++;
+                r2 -= ad;
+            }
+            delta = ad - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+        *m = q2 + 1;
+        if ((int)d < 0)
+            *m = -*m;
+        *s = l - 32;
+        return 1;
+    }
+    if (d < 2 || d >= 0x80000000)
+        return 0;
+    for(l = 0; (1U << l) < d; l++);
+    for(*s = 0; *s <= l; (*s)++) {
+        p = 1ULL << (32 + *s);
+        q = (p + d - 1) / d;
+        if (q < (1ULL << 32) && q * d - p <= (1ULL << *s)) {
+            *m = q;
+            return 1;
+        }
+    }
+    *s = l;
+    *m = q;
+    return 2;
+}
 
 /* handle long long constant and various machine independent optimizations */
 void gen_opic(TCCState *st, int op)
@@ -4478,12 +5326,17 @@ void gen_opic(TCCState *st, int op)
     SValue *v1, *v2;
     long long l1, l2;
 
-    v1 = vtop - 1;
-    v2 = vtop;
+    v1 = st->vtop - 1;
+    v2 = st->vtop;
     t1 = v1->type.t & VT_BTYPE;
     t2 = v2->type.t & VT_BTYPE;
+#ifdef TCC_TARGET_X86_64
+    l1 = (t1 == VT_LLONG || t1 == VT_PTR) ? v1->c.ll : v1->c.i;
+    l2 = (t2 == VT_LLONG || t2 == VT_PTR) ? v2->c.ll : v2->c.i;
+#else
     l1 = (t1 == VT_LLONG) ? v1->c.ll : v1->c.i;
     l2 = (t2 == VT_LLONG) ? v2->c.ll : v2->c.i;
+#endif
 
     /* For forward symbols we can only constify &&, || or == NULL */
     c2 = VT_SYM;
@@ -4508,7 +5361,7 @@ void gen_opic(TCCState *st, int op)
         case TOK_UMOD:
             /* if division by zero, generate explicit division */
             if (l2 == 0) {
-                if (const_wanted)
+                if (st->const_wanted)
                    tcc_error(st, "division by zero in constant");
                 goto general_case;
             }
@@ -4540,7 +5393,7 @@ void gen_opic(TCCState *st, int op)
             goto general_case;
         }
         v1->c.ll = l1;
-        vtop--;
+        st->vtop--;
     } else {
         /* if commutative ops, put c2 as constant */
         if (c1 && (op == '+' || op == '&' || op == '^' || 
@@ -4559,7 +5412,12 @@ void gen_opic(TCCState *st, int op)
                    (op == '&' && 
                     l2 == -1))) {
             /* nothing to do */
-            vtop--;
+            st->vtop--;
+        } else if (c2 && op == TOK_UMOD && l2 > 0 && (l2 & (l2 - 1)) == 0) {
+            /* unsigned modulo by a power of two is a mask */
+            st->vtop->c.ll = l2 - 1;
+            op = '&';
+            goto general_case;
         } else if (c2 && (op == '*' || op == TOK_PDIV || op == TOK_UDIV)) {
             /* try to use shifts instead of muls or divs */
             if (l2 > 0 && (l2 & (l2 - 1)) == 0) {
@@ -4568,7 +5426,7 @@ void gen_opic(TCCState *st, int op)
                     l2 >>= 1;
                     n++;
                 }
-                vtop->c.ll = n;
+                st->vtop->c.ll = n;
                 if (op == '*')
                     op = TOK_SHL;
                 else if (op == TOK_PDIV)
@@ -4578,20 +5436,25 @@ void gen_opic(TCCState *st, int op)
             }
             goto general_case;
         } else if (c2 && (op == '+' || op == '-') &&
-                   (vtop[-1].r & (VT_VALMASK | VT_LVAL | VT_SYM)) == 
+                   (st->vtop[-1].r & (VT_VALMASK | VT_LVAL | VT_SYM)) == 
                    (VT_CONST | VT_SYM)) {
             /* symbol + constant case */
             if (op == '-')
                 l2 = -l2;
-            vtop--;
-            vtop->c.ll += l2;
+            st->vtop--;
+            st->vtop->c.ll += l2;
         } else {
         general_case:
             /* call low level op generator */
-            if (cur_text_section) {
+            if (st->cur_text_section) {
+#ifdef TCC_TARGET_X86_64
+                /* 64 bit operations are native */
+                gen_opi(st, op);
+#else
                 if (t1 == VT_LLONG|| t2 == VT_LLONG) gen_opl(st, op);
                 else gen_opi(st, op);
-            } else vtop--;
+#endif
+            } else st->vtop--;
         }
     }
 }
@@ -4603,8 +5466,8 @@ void gen_opif(TCCState *st, int op)
     SValue *v1, *v2;
     long double f1, f2;
 
-    v1 = vtop - 1;
-    v2 = vtop;
+    v1 = st->vtop - 1;
+    v2 = st->vtop;
     /* currently, we cannot do computations with forward symbols */
     c1 = (v1->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST;
     c2 = (v2->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST;
@@ -4622,7 +5485,7 @@ void gen_opif(TCCState *st, int op)
 
         /* NOTE: we only do constant propagation if finite number (not
            NaN or infinity) (ANSI spec) */
-        if (!ieee_finite(st, f1) || !ieee_finite(st, f2))
+        if (!ieee_finite(f1) || !ieee_finite(f2))
             goto general_case;
 
         switch(op) {
@@ -4631,7 +5494,7 @@ void gen_opif(TCCState *st, int op)
         case '*': f1 *= f2; break;
         case '/': 
             if (f2 == 0.0) {
-                if (const_wanted)
+                if (st->const_wanted)
                    tcc_error(st, "division by zero in constant");
                 goto general_case;
             }
@@ -4649,11 +5512,11 @@ void gen_opif(TCCState *st, int op)
         } else {
             v1->c.ld = f1;
         }
-        vtop--;
+        st->vtop--;
     } else {
     general_case:
-        if (cur_text_section) gen_opf(st, op);
-        else vtop--;
+        if (st->cur_text_section) gen_opf(st, op);
+        else st->vtop--;
     }
 }
 
@@ -4731,8 +5594,8 @@ void gen_op(TCCState *st, int op)
     int u, t1, t2, bt1, bt2, t;
     CType type1;
 
-    t1 = vtop[-1].type.t;
-    t2 = vtop[0].type.t;
+    t1 = st->vtop[-1].type.t;
+    t2 = st->vtop[0].type.t;
     bt1 = t1 & VT_BTYPE;
     bt2 = t2 & VT_BTYPE;
 
@@ -4740,21 +5603,29 @@ void gen_op(TCCState *st, int op)
         /* at least one operand is a pointer */
         /* relationnal op: must be both pointers */
         if (op >= TOK_ULT && op <= TOK_LOR) {
-            check_comparison_pointer_types(st, vtop - 1, vtop, op);
+            check_comparison_pointer_types(st, st->vtop - 1, st->vtop, op);
             /* pointers are handled are unsigned */
+#ifdef TCC_TARGET_X86_64
+            t = VT_LLONG | VT_UNSIGNED;
+#else
             t = VT_INT | VT_UNSIGNED;
+#endif
             goto std_op;
         }
         /* if both pointers, then it must be the '-' op */
         if (bt1 == VT_PTR && bt2 == VT_PTR) {
             if (op != '-')
                tcc_error(st, "cannot use pointers here");
-            check_comparison_pointer_types(st, vtop - 1, vtop, op);
+            check_comparison_pointer_types(st, st->vtop - 1, st->vtop, op);
             /* XXX: check that types are compatible */
-            u = pointed_size(st, &vtop[-1].type);
+            u = pointed_size(st, &st->vtop[-1].type);
             gen_opic(st, op);
             /* set to integer type */
-            vtop->type.t = VT_INT; 
+#ifdef TCC_TARGET_X86_64
+            st->vtop->type.t = VT_LLONG;
+#else
+            st->vtop->type.t = VT_INT; 
+#endif
             vpushi(st, u);
             gen_op(st, TOK_PDIV);
         } else {
@@ -4766,14 +5637,22 @@ void gen_op(TCCState *st, int op)
                 vswap(st);
                 swap(&t1, &t2);
             }
-            type1 = vtop[-1].type;
+            type1 = st->vtop[-1].type;
+#ifdef TCC_TARGET_X86_64
+            {
+                /* the offset must be scaled at pointer width */
+                CType ctype;
+                ctype.t = VT_LLONG;
+                gen_cast(st, &ctype);
+            }
+#endif
             /* XXX: cast to int ? (long long case) */
-            vpushi(st, pointed_size(st, &vtop[-1].type));
+            vpushi(st, pointed_size(st, &st->vtop[-1].type));
             gen_op(st, '*');
 #if 0
             /* if evaluating constant expression, no code should be
                generated, so no bound check */
-            if (do_bounds_check && !const_wanted) {
+            if (st->do_bounds_check && !st->const_wanted) {
                 /* if bounded pointers, we generate a special code to
                    test bounds */
                 if (op == '-') {
@@ -4788,7 +5667,7 @@ void gen_op(TCCState *st, int op)
                 gen_opic(st, op);
             }
             /* put again type if gen_opic(st) swaped operands */
-            vtop->type = type1;
+            st->vtop->type = type1;
         }
     } else if (is_float(st, bt1) || is_float(st, bt2)) {
         /* compute bigger type and do implicit casts */
@@ -4853,9 +5732,9 @@ void gen_op(TCCState *st, int op)
             gen_opic(st, op);
         if (op >= TOK_ULT && op <= TOK_GT) {
             /* relationnal op: the result is an int */
-            vtop->type.t = VT_INT;
+            st->vtop->type.t = VT_INT;
         } else {
-            vtop->type.t = t;
+            st->vtop->type.t = t;
         }
     }
 }
@@ -4863,20 +5742,23 @@ void gen_op(TCCState *st, int op)
 /* generic itof for unsigned long long case */
 void gen_cvt_itof1(TCCState *st, int t)
 {
-    if ((vtop->type.t & (VT_BTYPE | VT_UNSIGNED)) == 
+#ifndef TCC_TARGET_X86_64
+    if ((st->vtop->type.t & (VT_BTYPE | VT_UNSIGNED)) == 
         (VT_LLONG | VT_UNSIGNED)) {
 
         if (t == VT_FLOAT)
-            vpush_global_sym(st, &func_old_type, TOK___ulltof);
+            vpush_global_sym(st, &st->func_old_type, TOK___ulltof);
         else if (t == VT_DOUBLE)
-            vpush_global_sym(st, &func_old_type, TOK___ulltod);
+            vpush_global_sym(st, &st->func_old_type, TOK___ulltod);
         else
-            vpush_global_sym(st, &func_old_type, TOK___ulltold);
+            vpush_global_sym(st, &st->func_old_type, TOK___ulltold);
         vrott(st, 2);
         gfunc_call(st, 1);
         vpushi(st, 0);
-        vtop->r = REG_FRET;
-    } else {
+        st->vtop->r = REG_FRET;
+    } else
+#endif
+    {
         gen_cvt_itof(st, t);
     }
 }
@@ -4884,23 +5766,26 @@ void gen_cvt_itof1(TCCState *st, int t)
 /* generic ftoi for unsigned long long case */
 void gen_cvt_ftoi1(TCCState *state, int t)
 {
+#ifndef TCC_TARGET_X86_64
     int st;
 
     if (t == (VT_LLONG | VT_UNSIGNED)) {
         /* not handled natively */
-        st = vtop->type.t & VT_BTYPE;
+        st = state->vtop->type.t & VT_BTYPE;
         if (st == VT_FLOAT)
-            vpush_global_sym(state, &func_old_type, TOK___fixunssfdi);
+            vpush_global_sym(state, &state->func_old_type, TOK___fixunssfdi);
         else if (st == VT_DOUBLE)
-            vpush_global_sym(state, &func_old_type, TOK___fixunsdfdi);
+            vpush_global_sym(state, &state->func_old_type, TOK___fixunsdfdi);
         else
-            vpush_global_sym(state, &func_old_type, TOK___fixunsxfdi);
+            vpush_global_sym(state, &state->func_old_type, TOK___fixunsxfdi);
         vrott(state, 2);
         gfunc_call(state, 1);
         vpushi(state, 0);
-        vtop->r = REG_IRET;
-        vtop->r2 = REG_LRET;
-    } else {
+        state->vtop->r = REG_IRET;
+        state->vtop->r2 = REG_LRET;
+    } else
+#endif
+    {
         gen_cvt_ftoi(state, t);
     }
 }
@@ -4926,7 +5811,7 @@ void force_charshort_cast(TCCState *st, int t)
            This was not the case when "t" was a signed short
            and the last value on the stack was an unsigned int
         */
-        vtop->type.t &= (~VT_UNSIGNED);
+        st->vtop->type.t &= (~VT_UNSIGNED);
         vpushi(st, bits);
         gen_op(st, TOK_SAR);
     }
@@ -4940,40 +5825,40 @@ static void gen_cast(TCCState *st, CType *type)
     /* special delayed cast for char/short */
     /* XXX: in some cases (multiple cascaded casts), it may still
        be incorrect */
-    if (vtop->r & VT_MUSTCAST) {
-        vtop->r &= ~VT_MUSTCAST;
-        force_charshort_cast(st, vtop->type.t);
+    if (st->vtop->r & VT_MUSTCAST) {
+        st->vtop->r &= ~VT_MUSTCAST;
+        force_charshort_cast(st, st->vtop->type.t);
     }
 
     /* bitfields first get cast to ints */
-    if (vtop->type.t & VT_BITFIELD) {
+    if (st->vtop->type.t & VT_BITFIELD) {
         gv(st, RC_INT);
     }
 
     dbt = type->t & (VT_BTYPE | VT_UNSIGNED);
-    sbt = vtop->type.t & (VT_BTYPE | VT_UNSIGNED);
+    sbt = st->vtop->type.t & (VT_BTYPE | VT_UNSIGNED);
 
-    if (sbt != dbt && cur_text_section) {
+    if (sbt != dbt && st->cur_text_section) {
         sf = is_float(st, sbt);
         df = is_float(st, dbt);
-        c = (vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST;
+        c = (st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST;
         if (sf && df) {
             /* convert from fp to fp */
             if (c) {
                 /* constant case: we can do it now */
                 /* XXX: in ISOC, cannot do it if error in convert */
                 if (dbt == VT_FLOAT && sbt == VT_DOUBLE) 
-                    vtop->c.f = (float)vtop->c.d;
+                    st->vtop->c.f = (float)st->vtop->c.d;
                 else if (dbt == VT_FLOAT && sbt == VT_LDOUBLE) 
-                    vtop->c.f = (float)vtop->c.ld;
+                    st->vtop->c.f = (float)st->vtop->c.ld;
                 else if (dbt == VT_DOUBLE && sbt == VT_FLOAT) 
-                    vtop->c.d = (double)vtop->c.f;
+                    st->vtop->c.d = (double)st->vtop->c.f;
                 else if (dbt == VT_DOUBLE && sbt == VT_LDOUBLE) 
-                    vtop->c.d = (double)vtop->c.ld;
+                    st->vtop->c.d = (double)st->vtop->c.ld;
                 else if (dbt == VT_LDOUBLE && sbt == VT_FLOAT) 
-                    vtop->c.ld = (long double)vtop->c.f;
+                    st->vtop->c.ld = (long double)st->vtop->c.f;
                 else if (dbt == VT_LDOUBLE && sbt == VT_DOUBLE) 
-                    vtop->c.ld = (long double)vtop->c.d;
+                    st->vtop->c.ld = (long double)st->vtop->c.d;
             } else {
                 /* non constant case: generate code */
                 gen_cvt_ftof(st, dbt);
@@ -4988,16 +5873,16 @@ static void gen_cast(TCCState *st, CType *type)
                     goto do_itof;
                 case VT_INT | VT_UNSIGNED:
                     switch(dbt) {
-                    case VT_FLOAT: vtop->c.f = (float)vtop->c.ui; break;
-                    case VT_DOUBLE: vtop->c.d = (double)vtop->c.ui; break;
-                    case VT_LDOUBLE: vtop->c.ld = (long double)vtop->c.ui; break;
+                    case VT_FLOAT: st->vtop->c.f = (float)st->vtop->c.ui; break;
+                    case VT_DOUBLE: st->vtop->c.d = (double)st->vtop->c.ui; break;
+                    case VT_LDOUBLE: st->vtop->c.ld = (long double)st->vtop->c.ui; break;
                     }
                     break;
                 default:
                     switch(dbt) {
-                    case VT_FLOAT: vtop->c.f = (float)vtop->c.i; break;
-                    case VT_DOUBLE: vtop->c.d = (double)vtop->c.i; break;
-                    case VT_LDOUBLE: vtop->c.ld = (long double)vtop->c.i; break;
+                    case VT_FLOAT: st->vtop->c.f = (float)st->vtop->c.i; break;
+                    case VT_DOUBLE: st->vtop->c.d = (double)st->vtop->c.i; break;
+                    case VT_LDOUBLE: st->vtop->c.ld = (long double)st->vtop->c.i; break;
                     }
                     break;
                 }
@@ -5028,17 +5913,17 @@ static void gen_cast(TCCState *st, CType *type)
                         goto do_ftoi;
                     case VT_INT | VT_UNSIGNED:
                         switch(sbt) {
-                        case VT_FLOAT: vtop->c.ui = (unsigned int)vtop->c.d; break;
-                        case VT_DOUBLE: vtop->c.ui = (unsigned int)vtop->c.d; break;
-                        case VT_LDOUBLE: vtop->c.ui = (unsigned int)vtop->c.d; break;
+                        case VT_FLOAT: st->vtop->c.ui = (unsigned int)st->vtop->c.d; break;
+                        case VT_DOUBLE: st->vtop->c.ui = (unsigned int)st->vtop->c.d; break;
+                        case VT_LDOUBLE: st->vtop->c.ui = (unsigned int)st->vtop->c.d; break;
                         }
                         break;
                     default:
                         /* int case */
                         switch(sbt) {
-                        case VT_FLOAT: vtop->c.i = (int)vtop->c.d; break;
-                        case VT_DOUBLE: vtop->c.i = (int)vtop->c.d; break;
-                        case VT_LDOUBLE: vtop->c.i = (int)vtop->c.d; break;
+                        case VT_FLOAT: st->vtop->c.i = (int)st->vtop->c.d; break;
+                        case VT_DOUBLE: st->vtop->c.i = (int)st->vtop->c.d; break;
+                        case VT_LDOUBLE: st->vtop->c.i = (int)st->vtop->c.d; break;
                         }
                         break;
                     }
@@ -5048,18 +5933,37 @@ static void gen_cast(TCCState *st, CType *type)
                 }
                 if (dbt == VT_INT && (type->t & (VT_BTYPE | VT_UNSIGNED)) != dbt) {
                     /* additional cast for char/short... */
-                    vtop->type.t = dbt;
+                    st->vtop->type.t = dbt;
                     gen_cast(st, type);
                 }
             }
+#ifdef TCC_TARGET_X86_64
+        } else if ((dbt & VT_BTYPE) == VT_LLONG ||
+                   (dbt & VT_BTYPE) == VT_PTR ||
+                   (dbt & VT_BTYPE) == VT_FUNC) {
+            if ((sbt & VT_BTYPE) != VT_LLONG &&
+                (sbt & VT_BTYPE) != VT_PTR &&
+                (sbt & VT_BTYPE) != VT_FUNC) {
+                /* scalar to 64 bit register */
+                if (c) {
+                    if (sbt == (VT_INT | VT_UNSIGNED))
+                        st->vtop->c.ll = st->vtop->c.ui;
+                    else
+                        st->vtop->c.ll = st->vtop->c.i;
+                } else {
+                    gv(st, RC_INT);
+                    gen_cvt_itoll(st);
+                }
+            }
+#else
         } else if ((dbt & VT_BTYPE) == VT_LLONG) {
             if ((sbt & VT_BTYPE) != VT_LLONG) {
                 /* scalar to long long */
                 if (c) {
                     if (sbt == (VT_INT | VT_UNSIGNED))
-                        vtop->c.ll = vtop->c.ui;
+                        st->vtop->c.ll = st->vtop->c.ui;
                     else
-                        vtop->c.ll = vtop->c.i;
+                        st->vtop->c.ll = st->vtop->c.i;
                 } else {
                     /* machine independent conversion */
                     gv(st, RC_INT);
@@ -5073,10 +5977,11 @@ static void gen_cast(TCCState *st, CType *type)
                         gen_op(st, TOK_SAR);
                     }
                     /* patch second register */
-                    vtop[-1].r2 = vtop->r;
+                    st->vtop[-1].r2 = st->vtop->r;
                     vpop(st);
                 }
             }
+#endif
         } else if (dbt == VT_BOOL) {
             /* scalar to bool */
             vpushi(st, 0);
@@ -5084,28 +5989,35 @@ static void gen_cast(TCCState *st, CType *type)
         } else if ((dbt & VT_BTYPE) == VT_BYTE || 
                    (dbt & VT_BTYPE) == VT_SHORT) {
             if (sbt == VT_PTR) {
-                vtop->type.t = VT_INT;
+                st->vtop->type.t = VT_INT;
                 warning(st, "nonportable conversion from pointer to char/short");
             }
+#ifdef TCC_TARGET_X86_64
+            /* the shifts below work on the low order word */
+            if ((sbt & VT_BTYPE) == VT_LLONG)
+                st->vtop->type.t = VT_INT;
+#endif
             force_charshort_cast(st, dbt);
         } else if ((dbt & VT_BTYPE) == VT_INT) {
             /* scalar to int */
             if (sbt == VT_LLONG) {
+#ifndef TCC_TARGET_X86_64
                 /* from long long: just take low order word */
                 lexpand(st);
                 vpop(st);
+#endif
             } 
             /* if lvalue and single word type, nothing to do because
                the lvalue already contains the real type size (see
                VT_LVAL_xxx constants) */
         }
-    } else if ((dbt & VT_BTYPE) == VT_PTR && !(vtop->r & VT_LVAL)) {
+    } else if ((dbt & VT_BTYPE) == VT_PTR && !(st->vtop->r & VT_LVAL)) {
         /* if we are casting between pointer types,
            we must update the VT_LVAL_xxx size */
-        vtop->r = (vtop->r & ~VT_LVAL_TYPE)
+        st->vtop->r = (st->vtop->r & ~VT_LVAL_TYPE)
                   | (lvalue_type(st, type->ref->type.t) & VT_LVAL_TYPE);
     }
-    vtop->type = *type;
+    st->vtop->type = *type;
 }
 
 /* return type size. Put alignment at 'a' */
@@ -5247,11 +6159,11 @@ void type_to_str(TCCState *st, char *buf, int buf_size,
     bt = t & VT_BTYPE;
     buf[0] = '\0';
     if (t & VT_CONSTANT)
-        pstrcat(st, buf, buf_size, "const ");
+        pstrcat(buf, buf_size, "const ");
     if (t & VT_VOLATILE)
-        pstrcat(st, buf, buf_size, "volatile ");
+        pstrcat(buf, buf_size, "volatile ");
     if (t & VT_UNSIGNED)
-        pstrcat(st, buf, buf_size, "unsigned ");
+        pstrcat(buf, buf_size, "unsigned ");
     switch(bt) {
     case VT_VOID:
         tstr = "void";
@@ -5283,7 +6195,7 @@ void type_to_str(TCCState *st, char *buf, int buf_size,
     case VT_LDOUBLE:
         tstr = "long double";
     add_tstr:
-        pstrcat(st, buf, buf_size, tstr);
+        pstrcat(buf, buf_size, tstr);
         break;
     case VT_ENUM:
     case VT_STRUCT:
@@ -5291,38 +6203,38 @@ void type_to_str(TCCState *st, char *buf, int buf_size,
             tstr = "struct ";
         else
             tstr = "enum ";
-        pstrcat(st, buf, buf_size, tstr);
+        pstrcat(buf, buf_size, tstr);
         v = type->ref->v & ~SYM_STRUCT;
         if (v >= SYM_FIRST_ANOM)
-            pstrcat(st, buf, buf_size, "<anonymous>");
+            pstrcat(buf, buf_size, "<anonymous>");
         else
-            pstrcat(st, buf, buf_size, get_tok_str(st, v, NULL));
+            pstrcat(buf, buf_size, get_tok_str(st, v, NULL));
         break;
     case VT_FUNC:
         s = type->ref;
         type_to_str(st, buf, buf_size, &s->type, varstr);
-        pstrcat(st, buf, buf_size, "(");
+        pstrcat(buf, buf_size, "(");
         sa = s->next;
         while (sa != NULL) {
             type_to_str(st, buf1, sizeof(buf1), &sa->type, NULL);
-            pstrcat(st, buf, buf_size, buf1);
+            pstrcat(buf, buf_size, buf1);
             sa = sa->next;
             if (sa)
-                pstrcat(st, buf, buf_size, ", ");
+                pstrcat(buf, buf_size, ", ");
         }
-        pstrcat(st, buf, buf_size, ")");
+        pstrcat(buf, buf_size, ")");
         goto no_var;
     case VT_PTR:
         s = type->ref;
-        pstrcpy(st,  buf1, sizeof(buf1), "*");
+        pstrcpy(buf1, sizeof(buf1), "*");
         if (varstr)
-            pstrcat(st, buf1, sizeof(buf1), varstr);
+            pstrcat(buf1, sizeof(buf1), varstr);
         type_to_str(st, buf, buf_size, &s->type, buf1);
         goto no_var;
     }
     if (varstr) {
-        pstrcat(st, buf, buf_size, " ");
-        pstrcat(st, buf, buf_size, varstr);
+        pstrcat(buf, buf_size, " ");
+        pstrcat(buf, buf_size, varstr);
     }
  no_var: ;
 }
@@ -5335,7 +6247,7 @@ static void gen_assign_cast(TCCState *state, CType *dt)
     char buf1[256], buf2[256];
     int dbt, sbt;
 
-    st = &vtop->type; /* source type */
+    st = &state->vtop->type; /* source type */
     dbt = dt->t & VT_BTYPE;
     sbt = st->t & VT_BTYPE;
     if (dt->t & VT_CONSTANT)
@@ -5344,7 +6256,7 @@ static void gen_assign_cast(TCCState *state, CType *dt)
     case VT_PTR:
         /* special cases for pointers */
         /* '0' can also be a pointer */
-        if (is_null_pointer(state, vtop))
+        if (is_null_pointer(state, state->vtop))
             goto type_ok;
         /* accept implicit pointer to integer cast with warning */
         if (is_integer_btype(state, sbt)) {
@@ -5411,51 +6323,63 @@ void vstore(TCCState *st)
 {
     int sbt, dbt, ft, r, t, size, align, bit_size, bit_pos, rc, delayed_cast;
 
-    ft = vtop[-1].type.t;
-    sbt = vtop->type.t & VT_BTYPE;
+    ft = st->vtop[-1].type.t;
+    sbt = st->vtop->type.t & VT_BTYPE;
     dbt = ft & VT_BTYPE;
     if (((sbt == VT_INT || sbt == VT_SHORT) && dbt == VT_BYTE) ||
         (sbt == VT_INT && dbt == VT_SHORT)) {
         /* optimize char/short casts */
         delayed_cast = VT_MUSTCAST;
-        vtop->type.t = ft & VT_TYPE;
+        st->vtop->type.t = ft & VT_TYPE;
         /* XXX: factorize */
         if (ft & VT_CONSTANT)
             warning(st, "assignment of read-only location");
     } else {
         delayed_cast = 0;
         if (!(ft & VT_BITFIELD))
-            gen_assign_cast(st, &vtop[-1].type);
+            gen_assign_cast(st, &st->vtop[-1].type);
     }
 
     if (sbt == VT_STRUCT) {
         /* if structure, only generate pointer */
         /* structure assignment : generate memcpy */
-        /* XXX: optimize if small size */
-        if (cur_text_section) {
-            size = type_size(st, &vtop->type, &align);
-
+        if (st->cur_text_section) {
+            size = type_size(st, &st->vtop->type, &align);
+
+            if (size <= MEMCPY_INLINE_MAX) {
+                /* small structures are copied with moves */
+                /* destination */
+                vpushv(st, st->vtop - 1);
+                st->vtop->type = st->char_pointer_type;
+                gaddrof(st);
+                /* source */
+                vpushv(st, st->vtop - 1);
+                st->vtop->type = st->char_pointer_type;
+                gaddrof(st);
+                gen_memcpy(st, size);
+            } else {
 #ifdef TCC_ARM_EABI
-            if(!(align & 7))
-                vpush_global_sym(st, &func_old_type, TOK_memcpy8);
-            else if(!(align & 3))
-                vpush_global_sym(st, &func_old_type, TOK_memcpy4);
-            else
+                if(!(align & 7))
+                    vpush_global_sym(st, &st->func_old_type, TOK_memcpy8);
+                else if(!(align & 3))
+                    vpush_global_sym(st, &st->func_old_type, TOK_memcpy4);
+                else
 #endif
-            vpush_global_sym(st, &func_old_type, TOK_memcpy);
+                vpush_global_sym(st, &st->func_old_type, TOK_memcpy);
+
+                /* destination */
+                vpushv(st, st->vtop - 2);
+                st->vtop->type = st->char_pointer_type;
+                gaddrof(st);
+                /* source */
+                vpushv(st, st->vtop - 2);
+                st->vtop->type = st->char_pointer_type;
+                gaddrof(st);
+                /* type size */
+                vpushi(st, size);
+                gfunc_call(st, 3);
+            }
 
-            /* destination */
-            vpushv(st, vtop - 2);
-            vtop->type.t = VT_INT;
-            gaddrof(st);
-            /* source */
-            vpushv(st, vtop - 2);
-            vtop->type.t = VT_INT;
-            gaddrof(st);
-            /* type size */
-            vpushi(st, size);
-            gfunc_call(st, 3);
-            
             vswap(st);
             vpop(st);
         } else {
@@ -5468,7 +6392,7 @@ void vstore(TCCState *st)
         bit_pos = (ft >> VT_STRUCT_SHIFT) & 0x3f;
         bit_size = (ft >> (VT_STRUCT_SHIFT + 6)) & 0x3f;
         /* remove bit field info to avoid loops */
-        vtop[-1].type.t = ft & ~(VT_BITFIELD | (-1 << VT_STRUCT_SHIFT));
+        st->vtop[-1].type.t = ft & ~(VT_BITFIELD | (-1 << VT_STRUCT_SHIFT));
 
         /* duplicate source into other register */
         gv_dup(st);
@@ -5477,7 +6401,7 @@ void vstore(TCCState *st)
 
         /* duplicate destination */
         vdup(st);
-        vtop[-1] = vtop[-2];
+        st->vtop[-1] = st->vtop[-2];
 
         /* mask and shift source */
         vpushi(st, (1 << bit_size) - 1);
@@ -5498,45 +6422,47 @@ void vstore(TCCState *st)
     } else {
 #if 0
         /* bound check case */
-        if (vtop[-1].r & VT_MUSTBOUND) {
+        if (st->vtop[-1].r & VT_MUSTBOUND) {
             vswap(st);
             gbound(st);
             vswap(st);
         }
 #endif
-        if (cur_text_section) {
+        if (st->cur_text_section) {
             rc = RC_INT;
             if (is_float(st, ft))
                 rc = RC_FLOAT;
             r = gv(st, rc);  /* generate value */
             /* if lvalue was saved on stack, must read it */
-            if ((vtop[-1].r & VT_VALMASK) == VT_LLOCAL) {
+            if ((st->vtop[-1].r & VT_VALMASK) == VT_LLOCAL) {
                 SValue sv;
                 t = get_reg(st, RC_INT);
-                sv.type.t = VT_INT;
+                sv.type.t = VT_PTR;
                 sv.r = VT_LOCAL | VT_LVAL;
-                sv.c.ul = vtop[-1].c.ul;
+                sv.c.ul = st->vtop[-1].c.ul;
                 load(st, t, &sv);
-                vtop[-1].r = t | VT_LVAL;
+                st->vtop[-1].r = t | VT_LVAL;
             }
-            store(st, r, vtop - 1);
+            store(st, r, st->vtop - 1);
+#ifndef TCC_TARGET_X86_64
             /* two word case handling : store second register at word + 4 */
             if ((ft & VT_BTYPE) == VT_LLONG) {
                 vswap(st);
                 /* convert to int to increment easily */
-                vtop->type.t = VT_INT;
+                st->vtop->type.t = VT_INT;
                 gaddrof(st);
                 vpushi(st, 4);
                 gen_op(st, '+');
-                vtop->r |= VT_LVAL;
+                st->vtop->r |= VT_LVAL;
                 vswap(st);
                 /* XXX: it works because r2 is spilled last ! */
-                store(st, vtop->r2, vtop - 1);
+                store(st, st->vtop->r2, st->vtop - 1);
             }
+#endif
         }
         vswap(st);
-        vtop--; /* NOT vpop(st) because on x86 it would flush the fp stack */
-        vtop->r |= delayed_cast;
+        st->vtop--; /* NOT vpop(st) because on x86 it would flush the fp stack */
+        st->vtop->r |= delayed_cast;
     }
 }
 
@@ -5570,28 +6496,28 @@ static void parse_attribute(TCCState *st, AttributeDef *ad)
 {
     int t, n;
     
-    while (tok == TOK_ATTRIBUTE1 || tok == TOK_ATTRIBUTE2) {
+    while (st->tok == TOK_ATTRIBUTE1 || st->tok == TOK_ATTRIBUTE2) {
     next(st);
     skip(st, '(');
     skip(st, '(');
-    while (tok != ')') {
-        if (tok < TOK_IDENT)
+    while (st->tok != ')') {
+        if (st->tok < TOK_IDENT)
             expect(st, "attribute name");
-        t = tok;
+        t = st->tok;
         next(st);
         switch(t) {
         case TOK_SECTION1:
         case TOK_SECTION2:
             skip(st, '(');
-            if (tok != TOK_STR)
+            if (st->tok != TOK_STR)
                 expect(st, "section name");
-            ad->section = find_section(st, (char *)tokc.cstr->data);
+            ad->section = find_section(st, (char *)st->tokc.cstr->data);
             next(st);
             skip(st, ')');
             break;
         case TOK_ALIGNED1:
         case TOK_ALIGNED2:
-            if (tok == '(') {
+            if (st->tok == '(') {
                 next(st);
                 n = expr_const(st);
                 if (n <= 0 || (n & (n - 1)) != 0) 
@@ -5652,17 +6578,17 @@ static void parse_attribute(TCCState *st, AttributeDef *ad)
             if (st->warn_unsupported)
                 warning(st, "'%s' attribute ignored", get_tok_str(st, t, NULL));
             /* skip parameters */
-            if (tok == '(') {
+            if (st->tok == '(') {
                 int parenthesis = 0;
                 do {
-                    if (tok == '(') parenthesis++;
-                    else if (tok == ')') parenthesis--;
+                    if (st->tok == '(') parenthesis++;
+                    else if (st->tok == ')') parenthesis--;
                     next(st);
-                } while (parenthesis && tok != -1);
+                } while (parenthesis && st->tok != -1);
             }
             break;
         }
-        if (tok != ',')
+        if (st->tok != ',')
             break;
         next(st);
     }
@@ -5680,10 +6606,10 @@ static void struct_decl(TCCState *st, CType *type, int u)
     AttributeDef ad;
     CType type1, btype;
 
-    a = tok; /* save decl type */
+    a = st->tok; /* save decl type */
     next(st);
-    if (tok != '{') {
-        v = tok;
+    if (st->tok != '{') {
+        v = st->tok;
         next(st);
         /* struct already defined ? return it */
         if (v < TOK_IDENT)
@@ -5695,7 +6621,7 @@ static void struct_decl(TCCState *st, CType *type, int u)
             goto do_decl;
         }
     } else {
-        v = anon_sym++;
+        v = st->anon_sym++;
     }
     type1.t = a;
     /* we put an undefined size for struct/union */
@@ -5706,7 +6632,7 @@ static void struct_decl(TCCState *st, CType *type, int u)
     type->t = u;
     type->ref = s;
     
-    if (tok == '{') {
+    if (st->tok == '{') {
         next(st);
         if (s->c != -1)
            tcc_error(st, "struct/union/enum already defined");
@@ -5715,23 +6641,23 @@ static void struct_decl(TCCState *st, CType *type, int u)
         /* non empty enums are not allowed */
         if (a == TOK_ENUM) {
             for(;;) {
-                v = tok;
+                v = st->tok;
                 if (v < TOK_UIDENT)
                     expect(st, "identifier");
                 next(st);
-                if (tok == '=') {
+                if (st->tok == '=') {
                     next(st);
                     c = expr_const(st);
                 }
                 /* enum symbols have static storage */
-                ss = sym_push(st, v, &int_type, VT_CONST, c);
+                ss = sym_push(st, v, &st->int_type, VT_CONST, c);
                 ss->type.t |= VT_STATIC;
-                if (tok != ',')
+                if (st->tok != ',')
                     break;
                 next(st);
                 c++;
                 /* NOTE: we accept a trailing comma */
-                if (tok == '}')
+                if (st->tok == '}')
                     break;
             }
             skip(st, '}');
@@ -5740,13 +6666,13 @@ static void struct_decl(TCCState *st, CType *type, int u)
             ps = &s->next;
             bit_pos = 0;
             offset = 0;
-            while (tok != '}') {
+            while (st->tok != '}') {
                 parse_btype(st, &btype, &ad);
                 while (1) {
                     bit_size = -1;
                     v = 0;
                     type1 = btype;
-                    if (tok != ':') {
+                    if (st->tok != ':') {
                         type_decl(st, &type1, &ad, &v, TYPE_DIRECT | TYPE_ABSTRACT);
                         if (v == 0 && (type1.t & VT_BTYPE) != VT_STRUCT)
                             expect(st, "identifier");
@@ -5755,7 +6681,7 @@ static void struct_decl(TCCState *st, CType *type, int u)
                            tcc_error(st, "invalid type for '%s'", 
                                   get_tok_str(st, v, NULL));
                     }
-                    if (tok == ':') {
+                    if (st->tok == ':') {
                         next(st);
                         bit_size = expr_const(st);
                         /* XXX: handle v = 0 case for messages */
@@ -5852,7 +6778,7 @@ static void struct_decl(TCCState *st, CType *type, int u)
                         *ps = ss;
                         ps = &ss->next;
                     }
-                    if (tok == ';' || tok == TOK_EOF)
+                    if (st->tok == ';' || st->tok == TOK_EOF)
                         break;
                     skip(st, ',');
                 }
@@ -5881,7 +6807,7 @@ static int parse_btype(TCCState *st, CType *type, AttributeDef *ad)
     typedef_found = 0;
     t = 0;
     while(1) {
-        switch(tok) {
+        switch(st->tok) {
         case TOK_EXTENSION:
             /* currently, we really ignore extension */
             next(st);
@@ -6013,7 +6939,7 @@ static int parse_btype(TCCState *st, CType *type, AttributeDef *ad)
         default:
             if (typespec_found || typedef_found)
                 goto the_end;
-            s = sym_find(st, tok);
+            s = sym_find(st, st->tok);
             if (!s || !(s->type.t & VT_TYPEDEF))
                 goto the_end;
             typedef_found = 1;
@@ -6036,7 +6962,11 @@ the_end:
 
     /* long is never used as type */
     if ((t & VT_BTYPE) == VT_LONG)
+#ifdef TCC_TARGET_X86_64
+        t = (t & ~VT_BTYPE) | VT_LLONG;
+#else
         t = (t & ~VT_BTYPE) | VT_INT;
+#endif
     type->t = t;
     return type_found;
 }
@@ -6067,7 +6997,7 @@ static void parse_function_parameters(TCCState *st, CType *type, AttributeDef *a
     l = 0;
     first = NULL;
     plast = &first;
-    if (tok != ')') {
+    if (st->tok != ')') {
         for(;;) {
             /* read param name and compute offset */
             if (l != FUNC_OLD) {
@@ -6080,14 +7010,14 @@ static void parse_function_parameters(TCCState *st, CType *type, AttributeDef *a
                     }
                 }
                 l = FUNC_NEW;
-                if ((pt.t & VT_BTYPE) == VT_VOID && tok == ')')
+                if ((pt.t & VT_BTYPE) == VT_VOID && st->tok == ')')
                     break;
                 type_decl(st, &pt, &ad1, &n, TYPE_DIRECT | TYPE_ABSTRACT);
                 if ((pt.t & VT_BTYPE) == VT_VOID)
                    tcc_error(st, "parameter declared as void");
             } else {
             old_proto:
-                n = tok;
+                n = st->tok;
                 if (n < TOK_UIDENT)
                     expect(st, "identifier");
                 pt.t = VT_INT;
@@ -6097,10 +7027,10 @@ static void parse_function_parameters(TCCState *st, CType *type, AttributeDef *a
             s = sym_push(st, n | SYM_FIELD, &pt, 0, 0);
             *plast = s;
             plast = &s->next;
-            if (tok == ')')
+            if (st->tok == ')')
                 break;
             skip(st, ',');
-            if (l == FUNC_NEW && tok == TOK_DOTS) {
+            if (l == FUNC_NEW && st->tok == TOK_DOTS) {
                 l = FUNC_ELLIPSIS;
                 next(st);
                 break;
@@ -6128,19 +7058,19 @@ static void parse_array_dimensions(TCCState *st, CType *type)
 
     /* Starting with '[' parse array dimensions */
     next(st);
-    if (tok == TOK_RESTRICT1) next(st); 
-    if (tok != ']') {
+    if (st->tok == TOK_RESTRICT1) next(st); 
+    if (st->tok != ']') {
         char *message = "invalid array size";
         expr_const1(st);
         /* Conventional constant array? */
-        if ((vtop->r & (VT_VALMASK |VT_LVAL | VT_SYM)) == VT_CONST) {
-            n = vtop->c.i;
+        if ((st->vtop->r & (VT_VALMASK |VT_LVAL | VT_SYM)) == VT_CONST) {
+            n = st->vtop->c.i;
             vpop(st);
 
             if (n < 0)tcc_error(st, message);
-        } else if (!local_stack)tcc_error(st, message);
+        } else if (!st->local_stack)tcc_error(st, message);
         else {
-            gen_assign_cast(st, &int_type);
+            gen_assign_cast(st, &st->int_type);
             n = -2;
            tcc_error(st, "dynamic arrays not implemented yet");
         }
@@ -6149,7 +7079,7 @@ static void parse_array_dimensions(TCCState *st, CType *type)
     /* parse next post type */
     t1 = type->t & VT_STORAGE;
     type->t &= ~VT_STORAGE;
-    if (tok == '[') parse_array_dimensions(st, type);
+    if (st->tok == '[') parse_array_dimensions(st, type);
     
     /* we push a anonymous symbol which will contain the array
        element type */
@@ -6170,11 +7100,11 @@ static void type_decl(TCCState *st, CType *type, AttributeDef *ad, int *v, int t
     CType type1, *type2;
     int qualifiers;
     
-    while (tok == '*') {
+    while (st->tok == '*') {
         qualifiers = 0;
     redo:
         next(st);
-        switch(tok) {
+        switch(st->tok) {
         case TOK_CONST1:
         case TOK_CONST2:
         case TOK_CONST3:
@@ -6195,24 +7125,24 @@ static void type_decl(TCCState *st, CType *type, AttributeDef *ad, int *v, int t
     }
     
     /* XXX: clarify attribute handling */
-    if (tok == TOK_ATTRIBUTE1 || tok == TOK_ATTRIBUTE2)
+    if (st->tok == TOK_ATTRIBUTE1 || st->tok == TOK_ATTRIBUTE2)
         parse_attribute(st, ad);
 
     /* recursive type */
     /* XXX: incorrect if abstract type for functions (e.g. 'int (st)') */
     type1.t = 0; /* XXX: same as int */
-    if (tok == '(') {
+    if (st->tok == '(') {
         next(st);
         /* XXX: this is not correct to modify 'ad' at this point, but
            the syntax is not clear */
-        if (tok == TOK_ATTRIBUTE1 || tok == TOK_ATTRIBUTE2)
+        if (st->tok == TOK_ATTRIBUTE1 || st->tok == TOK_ATTRIBUTE2)
             parse_attribute(st, ad);
         type_decl(st, &type1, ad, v, td);
         skip(st, ')');
     } else {
         /* type identifier */
-        if (tok >= TOK_IDENT && (td & TYPE_DIRECT)) {
-            *v = tok;
+        if (st->tok >= TOK_IDENT && (td & TYPE_DIRECT)) {
+            *v = st->tok;
             next(st);
         } else {
             if (!(td & TYPE_ABSTRACT))
@@ -6220,9 +7150,9 @@ static void type_decl(TCCState *st, CType *type, AttributeDef *ad, int *v, int t
             *v = 0;
         }
     }
-    if (tok == '(') parse_function_parameters(st, type, ad);
-    else if (tok == '[') parse_array_dimensions(st, type);
-    if (tok == TOK_ATTRIBUTE1 || tok == TOK_ATTRIBUTE2)
+    if (st->tok == '(') parse_function_parameters(st, type, ad);
+    else if (st->tok == '[') parse_array_dimensions(st, type);
+    if (st->tok == TOK_ATTRIBUTE1 || st->tok == TOK_ATTRIBUTE2)
         parse_attribute(st, ad);
     if (!type1.t)
         return;
@@ -6259,21 +7189,21 @@ static int lvalue_type(TCCState *st, int t)
 /* indirection with full error checking and bound check */
 static void indir(TCCState *st)
 {
-    if ((vtop->type.t & VT_BTYPE) != VT_PTR) {
-        if ((vtop->type.t & VT_BTYPE) == VT_FUNC)
+    if ((st->vtop->type.t & VT_BTYPE) != VT_PTR) {
+        if ((st->vtop->type.t & VT_BTYPE) == VT_FUNC)
             return;
         expect(st, "pointer");
     }
-    if ((vtop->r & VT_LVAL) && cur_text_section)
+    if ((st->vtop->r & VT_LVAL) && st->cur_text_section)
         gv(st, RC_INT);
-    vtop->type = *pointed_type(st, &vtop->type);
+    st->vtop->type = *pointed_type(st, &st->vtop->type);
     /* Arrays and functions are never lvalues */
-    if (!(vtop->type.t & VT_ARRAY)
-        && (vtop->type.t & VT_BTYPE) != VT_FUNC) {
-        vtop->r |= lvalue_type(st, vtop->type.t);
+    if (!(st->vtop->type.t & VT_ARRAY)
+        && (st->vtop->type.t & VT_BTYPE) != VT_FUNC) {
+        st->vtop->r |= lvalue_type(st, st->vtop->type.t);
         /* if bound checking, the referenced pointer must be checked */
-        if (do_bounds_check) 
-            vtop->r |= VT_MUSTBOUND;
+        if (st->do_bounds_check) 
+            st->vtop->r |= VT_MUSTBOUND;
     }
 }
 
@@ -6287,7 +7217,7 @@ static void gfunc_param_typed(TCCState *st, Sym *func, Sym *arg)
     if (func_type == FUNC_OLD ||
         (func_type == FUNC_ELLIPSIS && arg == NULL)) {
         /* default casting : only need to convert float to double */
-        if ((vtop->type.t & VT_BTYPE) == VT_FLOAT) {
+        if ((st->vtop->type.t & VT_BTYPE) == VT_FLOAT) {
             type.t = VT_DOUBLE;
             gen_cast(st, &type);
         }
@@ -6324,34 +7254,85 @@ static void parse_type(TCCState *st, CType *type)
     if (!parse_btype(st, type, &ad)) {
         expect(st, "type");
     }
-    type_decl(st, type, &ad, &n, TYPE_ABSTRACT);
+    type_decl(st, type, &ad, &n, TYPE_ABSTRACT);
+}
+
+static void vpush_tokc(TCCState *st, int t)
+{
+    CType type;
+    type.t = t;
+    vsetc(st, &type, VT_CONST, &st->tokc);
+}
+
+/* the value returned in registers by a function of return type 'type' */
+static void func_ret_value(TCCState *st, SValue *ret, CType *type)
+{
+    ret->type = *type;
+    ret->r2 = VT_CONST;
+    if (is_float(st, type->t)) {
+        ret->r = REG_FRET;
+#ifdef TCC_TARGET_X86_64
+        if ((type->t & VT_BTYPE) == VT_LDOUBLE)
+            ret->r = TREG_ST0;
+#endif
+    } else {
+#ifndef TCC_TARGET_X86_64
+        if ((type->t & VT_BTYPE) == VT_LLONG)
+            ret->r2 = REG_LRET;
+#endif
+        ret->r = REG_IRET;
+    }
+    ret->c.i = 0;
 }
 
-static void vpush_tokc(TCCState *st, int t)
+/* can 'return f(...);', 'f' being of type 'func' and its 'nb_args'
+   parameters on top of the value stack, jump to 'f' once the frame of
+   the current function is released. 'f' must return the value of the
+   current function the same way. Whether the memory of the frame may
+   still be in use is only known at the end of the function: the epilog
+   then turns the jump back into a call. */
+static int tail_call_ok(TCCState *st, Sym *func, int nb_args)
 {
-    CType type;
-    type.t = t;
-    vsetc(st, &type, VT_CONST, &tokc);
+    int i;
+
+    if (!st->optimize || st->do_debug || st->do_bounds_check ||
+        st->func_no_opt || st->inline_depth ||
+        (func->type.t & VT_BTYPE) == VT_STRUCT ||
+        (func->type.t & (VT_BTYPE | VT_UNSIGNED)) !=
+        (st->func_vt.t & (VT_BTYPE | VT_UNSIGNED)))
+        return 0;
+    /* addresses of locals not loaded yet */
+    for(i = 0; i < nb_args; i++) {
+        if ((st->vtop[-i].r & (VT_VALMASK | VT_LVAL)) == VT_LOCAL)
+            return 0;
+    }
+    return 1;
 }
 
 static void unary(TCCState *st)
 {
-    int n, t, align, size, r;
+    int n, t, align, size, r, tail;
     CType type;
     Sym *s;
     AttributeDef ad;
+    InlineFunc *f;
+
+    /* only a call right at the start of the expression of a 'return'
+       can be a tail call */
+    tail = st->tail_call;
+    st->tail_call = 0;
 
     /* XXX: GCC 2.95.3 does not generate a table although it should be
        better here */
  tok_next:
-    switch(tok) {
+    switch(st->tok) {
     case TOK_EXTENSION:
         next(st);
         goto tok_next;
     case TOK_CINT:
     case TOK_CCHAR: 
     case TOK_LCHAR:
-        vpushi(st, tokc.i);
+        vpushi(st, st->tokc.i);
         next(st);
         break;
     case TOK_CUINT:
@@ -6379,7 +7360,7 @@ static void unary(TCCState *st)
         next(st);
         break;
     case TOK___FUNCTION__:
-        if (!gnu_ext)
+        if (!st->gnu_ext)
             goto tok_identifier;
         /* fall thru */
     case TOK___FUNC__:
@@ -6387,15 +7368,15 @@ static void unary(TCCState *st)
             void *ptr;
             int len;
             /* special function name identifier */
-            len = strlen(funcname) + 1;
+            len = strlen(st->funcname) + 1;
             /* generate char[len] type */
             type.t = VT_BYTE;
             mk_pointer(st, &type);
             type.t |= VT_ARRAY;
             type.ref->c = len;
-            vpush_ref(st, &type, data_section, data_section->data_offset, len);
-            ptr = section_ptr_add(st, data_section, len);
-            memcpy(ptr, funcname, len);
+            vpush_ref(st, &type, st->data_section, st->data_section->data_offset, len);
+            ptr = section_ptr_add(st, st->data_section, len);
+            memcpy(ptr, st->funcname, len);
             next(st);
         }
         break;
@@ -6425,9 +7406,9 @@ static void unary(TCCState *st)
             type_decl(st, &type, &ad, &n, TYPE_ABSTRACT);
             skip(st, ')');
             /* check ISOC99 compound literal */
-            if (tok == '{') {
+            if (st->tok == '{') {
                     /* data is allocated locally by default */
-                if (global_expr)
+                if (st->global_expr)
                     r = VT_CONST;
                 else
                     r = VT_LOCAL;
@@ -6440,12 +7421,12 @@ static void unary(TCCState *st)
                 unary(st);
                 gen_cast(st, &type);
             }
-        } else if (tok == '{') {
+        } else if (st->tok == '{') {
             /* save all registers */
             save_regs(st, 0); 
             /* statement expression : we do not accept break/continue
                inside as GCC does */
-            block(st, NULL, NULL, NULL, NULL, 0, 1);
+            block(st, NULL, NULL, NULL, 1);
             skip(st, ')');
         } else {
             gexpr(st);
@@ -6465,19 +7446,19 @@ static void unary(TCCState *st)
            functions are not lvalues, we only have to handle it
            there and in function calls. */
         /* arrays can also be used although they are not lvalues */
-        if ((vtop->type.t & VT_BTYPE) != VT_FUNC &&
-            !(vtop->type.t & VT_ARRAY) && !(vtop->type.t & VT_LLOCAL))
+        if ((st->vtop->type.t & VT_BTYPE) != VT_FUNC &&
+            !(st->vtop->type.t & VT_ARRAY) && !(st->vtop->type.t & VT_LLOCAL))
             test_lvalue(st);
-        mk_pointer(st, &vtop->type);
+        mk_pointer(st, &st->vtop->type);
         gaddrof(st);
         break;
     case '!':
         next(st);
         unary(st);
-        if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST)
-            vtop->c.i = !vtop->c.i;
-        else if ((vtop->r & VT_VALMASK) == VT_CMP)
-            vtop->c.i = vtop->c.i ^ 1;
+        if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST)
+            st->vtop->c.i = !st->vtop->c.i;
+        else if ((st->vtop->r & VT_VALMASK) == VT_CMP)
+            st->vtop->c.i = st->vtop->c.i ^ 1;
         else {
             save_regs(st, 1);
             vseti(st, VT_JMP, gtst(st, 1, 0));
@@ -6493,7 +7474,7 @@ static void unary(TCCState *st)
         next(st);
         /* in order to force cast, we add zero */
         unary(st);
-        if ((vtop->type.t & VT_BTYPE) == VT_PTR)
+        if ((st->vtop->type.t & VT_BTYPE) == VT_PTR)
            tcc_error(st, "pointer not accepted for unary plus");
         vpushi(st, 0);
         gen_op(st, '+');
@@ -6501,9 +7482,9 @@ static void unary(TCCState *st)
     case TOK_SIZEOF:
     case TOK_ALIGNOF1:
     case TOK_ALIGNOF2:
-        t = tok;
+        t = st->tok;
         next(st);
-        if (tok == '(') {
+        if (st->tok == '(') {
             parse_expr_type(st, &type);
         } else {
             unary_type(st, &type);
@@ -6516,7 +7497,11 @@ static void unary(TCCState *st)
         } else {
             vpushi(st, align);
         }
-        vtop->type.t |= VT_UNSIGNED;
+#ifdef TCC_TARGET_X86_64
+        /* size_t is 'unsigned long' */
+        st->vtop->type.t = VT_LLONG;
+#endif
+        st->vtop->type.t |= VT_UNSIGNED;
         break;
 
     case TOK_builtin_types_compatible_p:
@@ -6539,19 +7524,44 @@ static void unary(TCCState *st)
             int res;
             next(st);
             skip(st, '(');
-            saved_text_section = cur_text_section;
-            cur_text_section = NULL;
+            saved_text_section = st->cur_text_section;
+            st->cur_text_section = NULL;
             gexpr(st);
-            res = (vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST;
+            res = (st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST;
             vpop(st);
-            cur_text_section = saved_text_section;
+            st->cur_text_section = saved_text_section;
             skip(st, ')');
             vpushi(st, res);
         }
         break;
+#ifdef TCC_TARGET_X86_64
+    case TOK_builtin_va_start:
+        next(st);
+        skip(st, '(');
+        expr_eq(st);
+        skip(st, ')');
+        if (st->cur_text_section)
+            gen_va_start(st);
+        else
+            st->vtop--;
+        vpushi(st, 0);
+        st->vtop->type.t = VT_VOID;
+        break;
+    case TOK_builtin_va_arg_types:
+        {
+            /* register class of a va_arg() type, see <stdarg.h> */
+            CType type1;
+            next(st);
+            skip(st, '(');
+            parse_type(st, &type1);
+            skip(st, ')');
+            vpushi(st, gen_va_arg_class(st, &type1));
+        }
+        break;
+#endif
     case TOK_INC:
     case TOK_DEC:
-        t = tok;
+        t = st->tok;
         next(st);
         unary(st);
         inc(st, 0, t);
@@ -6563,44 +7573,49 @@ static void unary(TCCState *st)
         gen_op(st, '-');
         break;
     case TOK_LAND:
-        if (!gnu_ext)
+        if (!st->gnu_ext)
             goto tok_identifier;
         next(st);
         /* allow to take the address of a label */
-        if (tok < TOK_UIDENT)
+        if (st->tok < TOK_UIDENT)
             expect(st, "label identifier");
-        s = label_find(st, tok);
+        s = label_find(st, st->tok);
         if (!s) {
-            s = label_push(st, &global_label_stack, tok, LABEL_FORWARD);
+            s = label_push(st, &st->global_label_stack, st->tok, LABEL_FORWARD);
         } else {
             if (s->r == LABEL_DECLARED)
                 s->r = LABEL_FORWARD;
         }
+        st->func_no_opt = 1;
         if (!s->type.t) {
             s->type.t = VT_VOID;
             mk_pointer(st, &s->type);
             s->type.t |= VT_STATIC;
         }
         vset(st, &s->type, VT_CONST | VT_SYM, 0);
-        vtop->sym = s;
+        st->vtop->sym = s;
         next(st);
         break;
     default:
     tok_identifier:
-        t = tok;
+        t = st->tok;
         next(st);
         if (t < TOK_UIDENT)
             expect(st, "identifier");
         s = sym_find(st, t);
         if (!s) {
-            if (tok != '(')
+            if (st->tok != '(')
                tcc_error(st, "'%s' undeclared", get_tok_str(st, t, NULL));
             /* for simple function calls, we tolerate undeclared
                external reference to int(st) function */
             if (st->warn_implicit_function_declaration)
                 warning(st, "implicit declaration of function '%s'",
                         get_tok_str(st, t, NULL));
-            s = external_global_sym(st, t, &func_old_type, 0); 
+            s = external_global_sym(st, t, &st->func_old_type, 0); 
+        }
+        if (st->tok == '(' && (f = inline_find(st, s)) != NULL) {
+            gen_inline_call(st, f);
+            break;
         }
         if ((s->type.t & (VT_STATIC | VT_INLINE | VT_BTYPE)) ==
             (VT_STATIC | VT_INLINE | VT_FUNC)) {
@@ -6610,85 +7625,88 @@ static void unary(TCCState *st)
                compilation unit. Inline function as always
                generated in the text section. */
             if (!s->c)
-                put_extern_sym(st, s, text_section, 0, 0);
+                put_extern_sym(st, s, st->text_section, 0, 0);
             r = VT_SYM | VT_CONST;
         } else {
             r = s->r;
         }
         vset(st, &s->type, r, s->c);
         /* if forward reference, we must point to s */
-        if (vtop->r & VT_SYM) {
-            vtop->sym = s;
-            vtop->c.ul = 0;
+        if (st->vtop->r & VT_SYM) {
+            st->vtop->sym = s;
+            st->vtop->c.ul = 0;
         }
         break;
     }
     
     /* post operations */
     while (1) {
-        if (tok == TOK_INC || tok == TOK_DEC) {
-            inc(st, 1, tok);
+        if (st->tok == TOK_INC || st->tok == TOK_DEC) {
+            inc(st, 1, st->tok);
             next(st);
-        } else if (tok == '.' || tok == TOK_ARROW) {
+        } else if (st->tok == '.' || st->tok == TOK_ARROW) {
             /* field */ 
-            if (tok == TOK_ARROW) 
+            if (st->tok == TOK_ARROW) 
                 indir(st);
             test_lvalue(st);
             gaddrof(st);
             next(st);
             /* expect pointer on structure */
-            if ((vtop->type.t & VT_BTYPE) != VT_STRUCT)
+            if ((st->vtop->type.t & VT_BTYPE) != VT_STRUCT)
                 expect(st, "struct or union");
-            s = vtop->type.ref;
+            s = st->vtop->type.ref;
             /* find field */
-            tok |= SYM_FIELD;
+            st->tok |= SYM_FIELD;
             while ((s = s->next) != NULL) {
-                if (s->v == tok)
+                if (s->v == st->tok)
                     break;
             }
             if (!s)
                tcc_error(st, "field not found");
             /* add field offset to pointer */
-            vtop->type = char_pointer_type; /* change type to 'char *' */
+            st->vtop->type = st->char_pointer_type; /* change type to 'char *' */
             vpushi(st, s->c);
             gen_op(st, '+');
             /* change type to field type, and set to lvalue */
-            vtop->type = s->type;
+            st->vtop->type = s->type;
             /* an array is never an lvalue */
-            if (!(vtop->type.t & VT_ARRAY)) {
-                vtop->r |= lvalue_type(st, vtop->type.t);
+            if (!(st->vtop->type.t & VT_ARRAY)) {
+                st->vtop->r |= lvalue_type(st, st->vtop->type.t);
                 /* if bound checking, the referenced pointer must be checked */
-                if (do_bounds_check) 
-                    vtop->r |= VT_MUSTBOUND;
+                if (st->do_bounds_check) 
+                    st->vtop->r |= VT_MUSTBOUND;
             }
             next(st);
-        } else if (tok == '[') {
+        } else if (st->tok == '[') {
             next(st);
             gexpr(st);
             gen_op(st, '+');
             indir(st);
             skip(st, ']');
-        } else if (tok == '(') {
+        } else if (st->tok == '(') {
             SValue ret;
             Sym *sa;
             int nb_args;
 
             /* function call  */
-            if ((vtop->type.t & VT_BTYPE) != VT_FUNC) {
+            if ((st->vtop->type.t & VT_BTYPE) != VT_FUNC) {
                 /* pointer test (no array accepted) */
-                if ((vtop->type.t & (VT_BTYPE | VT_ARRAY)) == VT_PTR) {
-                    vtop->type = *pointed_type(st, &vtop->type);
-                    if ((vtop->type.t & VT_BTYPE) != VT_FUNC)
+                if ((st->vtop->type.t & (VT_BTYPE | VT_ARRAY)) == VT_PTR) {
+                    st->vtop->type = *pointed_type(st, &st->vtop->type);
+                    if ((st->vtop->type.t & VT_BTYPE) != VT_FUNC)
                         goto error_func;
                 } else {
                 error_func:
                     expect(st, "function pointer");
                 }
             } else {
-                vtop->r &= ~VT_LVAL; /* no lvalue */
+                st->vtop->r &= ~VT_LVAL; /* no lvalue */
             }
+            /* the memory allocated stays in the frame */
+            if ((st->vtop->r & VT_SYM) && st->vtop->sym->v == TOK_alloca)
+                st->func_addr_taken = 1;
             /* get return type */
-            s = vtop->type.ref;
+            s = st->vtop->type.ref;
             next(st);
             sa = s->next; /* first parameter */
             nb_args = 0;
@@ -6696,35 +7714,27 @@ static void unary(TCCState *st)
             if ((s->type.t & VT_BTYPE) == VT_STRUCT) {
                 /* get some space for the returned structure */
                 size = type_size(st, &s->type, &align);
-                loc = (loc - size) & -align;
+                st->loc = (st->loc - size) & -align;
+                func_local(st, st->loc, size, &s->type);
                 ret.type = s->type;
                 ret.r = VT_LOCAL | VT_LVAL;
+                ret.r2 = VT_CONST;
                 /* pass it as 'int' to avoid structure arg passing
                    problems */
-                vseti(st, VT_LOCAL, loc);
-                ret.c = vtop->c;
+                vseti(st, VT_LOCAL, st->loc);
+                ret.c = st->vtop->c;
                 nb_args++;
             } else {
-                ret.type = s->type; 
-                ret.r2 = VT_CONST;
-                /* return in register */
-                if (is_float(st, ret.type.t)) {
-                    ret.r = REG_FRET; 
-                } else {
-                    if ((ret.type.t & VT_BTYPE) == VT_LLONG)
-                        ret.r2 = REG_LRET;
-                    ret.r = REG_IRET;
-                }
-                ret.c.i = 0;
+                func_ret_value(st, &ret, &s->type);
             }
-            if (tok != ')') {
+            if (st->tok != ')') {
                 for(;;) {
                     expr_eq(st);
                     gfunc_param_typed(st, s, sa);
                     nb_args++;
                     if (sa)
                         sa = sa->next;
-                    if (tok == ')')
+                    if (st->tok == ')')
                         break;
                     skip(st, ',');
                 }
@@ -6732,14 +7742,18 @@ static void unary(TCCState *st)
             if (sa)
                tcc_error(st, "too few arguments to function");
             skip(st, ')');
-            if (cur_text_section) gfunc_call(st, nb_args);
-            else vtop -= (nb_args + 1);
+            if (!st->cur_text_section)
+                st->vtop -= (nb_args + 1);
+            else if (!tail || st->tok != ';' || !tail_call_ok(st, s, nb_args) ||
+                     !gfunc_tail_call(st, nb_args))
+                gfunc_call(st, nb_args);
             /* return value */
             vsetc(st, &ret.type, ret.r, &ret.c);
-            vtop->r2 = ret.r2;
+            st->vtop->r2 = ret.r2;
         } else {
             break;
         }
+        tail = 0;
     }
 }
 
@@ -6748,12 +7762,12 @@ static void uneq(TCCState *st)
     int t;
     
     unary(st);
-    if (tok == '=' ||
-        (tok >= TOK_A_MOD && tok <= TOK_A_DIV) ||
-        tok == TOK_A_XOR || tok == TOK_A_OR ||
-        tok == TOK_A_SHL || tok == TOK_A_SAR) {
+    if (st->tok == '=' ||
+        (st->tok >= TOK_A_MOD && st->tok <= TOK_A_DIV) ||
+        st->tok == TOK_A_XOR || st->tok == TOK_A_OR ||
+        st->tok == TOK_A_SHL || st->tok == TOK_A_SAR) {
         test_lvalue(st);
-        t = tok;
+        t = st->tok;
         next(st);
         if (t == '=') {
             expr_eq(st);
@@ -6771,8 +7785,8 @@ static void expr_prod(TCCState *st)
     int t;
 
     uneq(st);
-    while (tok == '*' || tok == '/' || tok == '%') {
-        t = tok;
+    while (st->tok == '*' || st->tok == '/' || st->tok == '%') {
+        t = st->tok;
         next(st);
         uneq(st);
         gen_op(st, t);
@@ -6784,8 +7798,8 @@ static void expr_sum(TCCState *st)
     int t;
 
     expr_prod(st);
-    while (tok == '+' || tok == '-') {
-        t = tok;
+    while (st->tok == '+' || st->tok == '-') {
+        t = st->tok;
         next(st);
         expr_prod(st);
         gen_op(st, t);
@@ -6797,8 +7811,8 @@ static void expr_shift(TCCState *st)
     int t;
 
     expr_sum(st);
-    while (tok == TOK_SHL || tok == TOK_SAR) {
-        t = tok;
+    while (st->tok == TOK_SHL || st->tok == TOK_SAR) {
+        t = st->tok;
         next(st);
         expr_sum(st);
         gen_op(st, t);
@@ -6810,9 +7824,9 @@ static void expr_cmp(TCCState *st)
     int t;
 
     expr_shift(st);
-    while ((tok >= TOK_ULE && tok <= TOK_GT) ||
-           tok == TOK_ULT || tok == TOK_UGE) {
-        t = tok;
+    while ((st->tok >= TOK_ULE && st->tok <= TOK_GT) ||
+           st->tok == TOK_ULT || st->tok == TOK_UGE) {
+        t = st->tok;
         next(st);
         expr_shift(st);
         gen_op(st, t);
@@ -6824,8 +7838,8 @@ static void expr_cmpeq(TCCState *st)
     int t;
 
     expr_cmp(st);
-    while (tok == TOK_EQ || tok == TOK_NE) {
-        t = tok;
+    while (st->tok == TOK_EQ || st->tok == TOK_NE) {
+        t = st->tok;
         next(st);
         expr_cmp(st);
         gen_op(st, t);
@@ -6835,7 +7849,7 @@ static void expr_cmpeq(TCCState *st)
 static void expr_and(TCCState *st)
 {
     expr_cmpeq(st);
-    while (tok == '&') {
+    while (st->tok == '&') {
         next(st);
         expr_cmpeq(st);
         gen_op(st, '&');
@@ -6845,7 +7859,7 @@ static void expr_and(TCCState *st)
 static void expr_xor(TCCState *st)
 {
     expr_and(st);
-    while (tok == '^') {
+    while (st->tok == '^') {
         next(st);
         expr_and(st);
         gen_op(st, '^');
@@ -6855,7 +7869,7 @@ static void expr_xor(TCCState *st)
 static void expr_or(TCCState *st)
 {
     expr_xor(st);
-    while (tok == '|') {
+    while (st->tok == '|') {
         next(st);
         expr_xor(st);
         gen_op(st, '|');
@@ -6866,7 +7880,7 @@ static void expr_or(TCCState *st)
 static void expr_land_const(TCCState *st)
 {
     expr_or(st);
-    while (tok == TOK_LAND) {
+    while (st->tok == TOK_LAND) {
         next(st);
         expr_or(st);
         gen_op(st, TOK_LAND);
@@ -6877,7 +7891,7 @@ static void expr_land_const(TCCState *st)
 static void expr_lor_const(TCCState *st)
 {
     expr_land_const(st);
-    while (tok == TOK_LOR) {
+    while (st->tok == TOK_LOR) {
         next(st);
         expr_land_const(st);
         gen_op(st, TOK_LOR);
@@ -6890,12 +7904,12 @@ static void expr_land(TCCState *st)
     int t;
 
     expr_or(st);
-    if (tok == TOK_LAND) {
+    if (st->tok == TOK_LAND) {
         t = 0;
         save_regs(st, 1);
         for(;;) {
             t = gtst(st, 1, t);
-            if (tok != TOK_LAND) {
+            if (st->tok != TOK_LAND) {
                 vseti(st, VT_JMPI, t);
                 break;
             }
@@ -6910,12 +7924,12 @@ static void expr_lor(TCCState *st)
     int t;
 
     expr_land(st);
-    if (tok == TOK_LOR) {
+    if (st->tok == TOK_LOR) {
         t = 0;
         save_regs(st, 1);
         for(;;) {
             t = gtst(st, 0, t);
-            if (tok != TOK_LOR) {
+            if (st->tok != TOK_LOR) {
                 vseti(st, VT_JMP, t);
                 break;
             }
@@ -6932,54 +7946,54 @@ static void expr_eq(TCCState *st)
     SValue sv;
     CType type, type1, type2;
 
-    if (const_wanted) {
+    if (st->const_wanted) {
         int c1, c;
         expr_lor_const(st);
-        if (tok == '?') {
-            c = vtop->c.i;
+        if (st->tok == '?') {
+            c = st->vtop->c.i;
             vpop(st);
             next(st);
-            if (tok == ':' && gnu_ext) {
+            if (st->tok == ':' && st->gnu_ext) {
                 c1 = c;
             } else {
                 gexpr(st);
-                c1 = vtop->c.i;
+                c1 = st->vtop->c.i;
                 vpop(st);
             }
             skip(st, ':');
             expr_eq(st);
             if (c)
-                vtop->c.i = c1;
+                st->vtop->c.i = c1;
         }
     } else {
         expr_lor(st);
-        if (tok == '?') {
+        if (st->tok == '?') {
             next(st);
-            if (vtop != vstack) {
+            if (st->vtop != st->vstack) {
                 /* needed to avoid having different registers saved in
                    each branch */
-                if (is_float(st, vtop->type.t))
+                if (is_float(st, st->vtop->type.t))
                     rc = RC_FLOAT;
                 else
                     rc = RC_INT;
                     gv(st, rc);
                     save_regs(st, 1);
             }
-            if (tok == ':' && gnu_ext) {
+            if (st->tok == ':' && st->gnu_ext) {
                 gv_dup(st);
                 tt = gtst(st, 1, 0);
             } else {
                 tt = gtst(st, 1, 0);
                 gexpr(st);
             }
-            type1 = vtop->type;
-            sv = *vtop; /* save value to handle it later */
-            vtop--; /* no vpop so that FP stack is not flushed */
+            type1 = st->vtop->type;
+            sv = *st->vtop; /* save value to handle it later */
+            st->vtop--; /* no vpop so that FP stack is not flushed */
             skip(st, ':');
             u = gjmp(st, 0);
-            gsym(tt);
+            gsym(st, tt);
             expr_eq(st);
-            type2 = vtop->type;
+            type2 = st->vtop->type;
 
             t1 = type1.t;
             bt1 = t1 & VT_BTYPE;
@@ -7024,7 +8038,7 @@ static void expr_eq(TCCState *st)
                 
             /* now we convert second operand */
             gen_cast(st, &type);
-            if (VT_STRUCT == (vtop->type.t & VT_BTYPE))
+            if (VT_STRUCT == (st->vtop->type.t & VT_BTYPE))
                 gaddrof(st);
             rc = RC_INT;
             if (is_float(st, type.t)) {
@@ -7039,16 +8053,16 @@ static void expr_eq(TCCState *st)
             /* this is horrible, but we must also convert first
                operand */
             tt = gjmp(st, 0);
-            gsym(u);
+            gsym(st, u);
             /* put again first value and cast it */
-            *vtop = sv;
+            *st->vtop = sv;
             gen_cast(st, &type);
-            if (VT_STRUCT == (vtop->type.t & VT_BTYPE))
+            if (VT_STRUCT == (st->vtop->type.t & VT_BTYPE))
                 gaddrof(st);
             r1 = gv(st, rc);
             move_reg(st, r2, r1);
-            vtop->r = r2;
-            gsym(tt);
+            st->vtop->r = r2;
+            gsym(st, tt);
         }
     }
 }
@@ -7057,7 +8071,7 @@ static void gexpr(TCCState *st)
 {
     while (1) {
         expr_eq(st);
-        if (tok != ',')
+        if (st->tok != ',')
             break;
         vpop(st);
         next(st);
@@ -7067,36 +8081,36 @@ static void gexpr(TCCState *st)
 /* parse an expression and return its type without any side effect. */
 static void expr_type(TCCState *st, CType *type)
 {
-    Section *saved_text_section = cur_text_section;
+    Section *saved_text_section = st->cur_text_section;
 
-    cur_text_section = NULL;
+    st->cur_text_section = NULL;
     gexpr(st);
-    *type = vtop->type;
+    *type = st->vtop->type;
     vpop(st);
-    cur_text_section = saved_text_section;
+    st->cur_text_section = saved_text_section;
 }
 
 /* parse a unary expression and return its type without any side
    effect. */
 static void unary_type(TCCState *st, CType *type)
 {
-    Section *saved_text_section = cur_text_section;
+    Section *saved_text_section = st->cur_text_section;
 
-    cur_text_section = NULL;
+    st->cur_text_section = NULL;
     unary(st);
-    *type = vtop->type;
+    *type = st->vtop->type;
     vpop(st);
-    cur_text_section = saved_text_section;
+    st->cur_text_section = saved_text_section;
 }
 
 /* parse a constant expression and return value in vtop.  */
 static void expr_const1(TCCState *st)
 {
     int a;
-    a = const_wanted;
-    const_wanted = 1;
+    a = st->const_wanted;
+    st->const_wanted = 1;
     expr_eq(st);
-    const_wanted = a;
+    st->const_wanted = a;
 }
 
 /* parse an integer constant and return its value. */
@@ -7104,9 +8118,9 @@ static int expr_const(TCCState *st)
 {
     int c;
     expr_const1(st);
-    if ((vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != VT_CONST)
+    if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != VT_CONST)
         expect(st, "constant expression");
-    c = vtop->c.i;
+    c = st->vtop->c.i;
     vpop(st);
     return c;
 }
@@ -7118,12 +8132,12 @@ static int is_label(TCCState *st)
     int last_tok;
 
     /* fast test first */
-    if (tok < TOK_UIDENT)
+    if (st->tok < TOK_UIDENT)
         return 0;
     /* no need to save tokc because tok is an identifier */
-    last_tok = tok;
+    last_tok = st->tok;
     next(st);
-    if (tok == ':') {
+    if (st->tok == ':') {
         next(st);
         return last_tok;
     } else {
@@ -7132,71 +8146,240 @@ static int is_label(TCCState *st)
     }
 }
 
-static void block(TCCState *st, int *bsym, int *csym, int *case_sym, int *def_sym, 
-                  int case_reg, int is_expr)
+/* the cases of a switch, or a run of them found by the binary search,
+   are reached through a table when there are at least CASE_TABLE_MIN of
+   them filling a third of it. Up to CASE_LINEAR_MAX cases are compared
+   one by one. */
+#define CASE_TABLE_MIN 4
+#define CASE_LINEAR_MAX 4
+
+static int case_cmp(const void *pa, const void *pb)
+{
+    long long a = ((const CaseLabel *)pa)->v1;
+    long long b = ((const CaseLabel *)pb)->v1;
+    return a < b ? -1 : a > b;
+}
+
+/* parse a case value, converted to the type of the switch value */
+static long long case_const(TCCState *st, SwitchState *sw)
+{
+    long long c;
+
+    expr_const1(st);
+    if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != VT_CONST)
+        expect(st, "constant expression");
+    gen_cast(st, &sw->type);
+    if ((sw->type.t & VT_BTYPE) == VT_LLONG)
+        c = st->vtop->c.ll;
+    else
+        c = st->vtop->c.i;
+    vpop(st);
+    return c;
+}
+
+/* push the switch value */
+static void case_value(TCCState *st, SwitchState *sw)
+{
+    vset(st, &sw->type, sw->reg, 0);
+    st->vtop->r2 = sw->reg2;
+}
+
+/* push the case value 'v' */
+static void case_push(TCCState *st, SwitchState *sw, long long v)
+{
+    CValue cval;
+
+    if ((sw->type.t & VT_BTYPE) == VT_LLONG) {
+        cval.ll = v;
+        vsetc(st, &sw->type, VT_CONST, &cval);
+    } else {
+        vpushi(st, (int)v);
+    }
+}
+
+/* jump through a table to the 'n' cases at 'p'. Return the jumps taken
+   for values without a case, added to the list 'dsym' */
+static int gen_case_table(TCCState *st, SwitchState *sw, CaseLabel *p, int n,
+                          int dsym)
+{
+    Section *sec = st->data_section;
+    unsigned long span, i, offset;
+    Sym *text_sym;
+    CType type;
+    int hole, addr, j;
+
+    span = (unsigned long long)p[n - 1].v2 - p[0].v1;
+    case_value(st, sw);
+    case_push(st, sw, p[0].v1);
+    gen_op(st, '-');
+    vdup(st);
+    case_push(st, sw, span);
+    gen_op(st, TOK_UGT);
+    dsym = gtst(st, 0, dsym);
+    if ((sw->type.t & VT_BTYPE) == VT_LLONG && PTR_SIZE == 4) {
+        /* the index fits in an int now */
+        type.t = VT_INT;
+        gen_cast(st, &type);
+    }
+
+    sec->data_offset = (sec->data_offset + PTR_SIZE - 1) & -PTR_SIZE;
+    offset = sec->data_offset;
+    section_ptr_add(st, sec, (span + 1) * PTR_SIZE);
+    type = st->char_pointer_type;
+    mk_pointer(st, &type);
+    vpush_ref(st, &type, sec, offset, (span + 1) * PTR_SIZE);
+    vswap(st);
+    gen_op(st, '+');
+    indir(st);
+    ggoto(st);
+    hole = st->ind;
+    dsym = gjmp(st, dsym);
+
+    /* the entries are relocated against the start of the text section */
+    text_sym = get_sym_ref(st, &st->char_pointer_type, st->cur_text_section, 0, 0);
+    for(i = 0, j = 0; i <= span; i++) {
+        if ((unsigned long long)p[j].v2 - p[0].v1 < i)
+            j++;
+        addr = (unsigned long long)p[j].v1 - p[0].v1 <= i ? p[j].addr : hole;
+        greloc(st, sec, text_sym, offset + i * PTR_SIZE, R_DATA_PTR);
+        if ((st->nb_func_code_refs & (st->nb_func_code_refs - 1)) == 0)
+            st->func_code_refs =
+                arena_realloc(st, st->func_code_refs,
+                              st->nb_func_code_refs * sizeof(unsigned long),
+                              (st->nb_func_code_refs ? st->nb_func_code_refs * 2 : 1) *
+                              sizeof(unsigned long));
+        st->func_code_refs[st->nb_func_code_refs++] = offset + i * PTR_SIZE;
+#ifdef TCC_TARGET_X86_64
+        *(long long *)(sec->data + offset + i * PTR_SIZE) = addr;
+#else
+        *(int *)(sec->data + offset + i * PTR_SIZE) = addr;
+#endif
+    }
+    return dsym;
+}
+
+/* generate the code sending the switch value to one of the 'n' sorted
+   cases at 'p': a jump table if they are dense enough, compares for a
+   few, otherwise a binary search. Return the jumps taken when no case
+   matches, added to the list 'dsym' */
+static int gen_case(TCCState *st, SwitchState *sw, CaseLabel *p, int n,
+                    int dsym)
+{
+    int i, t;
+
+    if (n >= CASE_TABLE_MIN &&
+        (unsigned long long)p[n - 1].v2 - p[0].v1 < 3 * (unsigned)n)
+        return gen_case_table(st, sw, p, n, dsym);
+    if (n > CASE_LINEAR_MAX) {
+        i = n / 2;
+        case_value(st, sw);
+        case_push(st, sw, p[i].v1);
+        gen_op(st, TOK_LT);
+        t = gtst(st, 0, 0);
+        dsym = gen_case(st, sw, p + i, n - i, dsym);
+        gsym(st, t);
+        return gen_case(st, sw, p, i, dsym);
+    }
+    for(i = 0; i < n; i++) {
+        case_value(st, sw);
+        case_push(st, sw, p[i].v1);
+        if (p[i].v1 == p[i].v2) {
+            gen_op(st, TOK_EQ);
+            gsym_addr(st, gtst(st, 0, 0), p[i].addr);
+        } else {
+            gen_op(st, TOK_LT);
+            t = gtst(st, 0, 0);
+            case_value(st, sw);
+            case_push(st, sw, p[i].v2);
+            gen_op(st, TOK_LE);
+            gsym_addr(st, gtst(st, 0, 0), p[i].addr);
+            gsym(st, t);
+        }
+    }
+    return gjmp(st, dsym);
+}
+
+/* generate the dispatch of a switch statement. Return the jumps taken
+   when no case matches */
+static int gen_switch(TCCState *st, SwitchState *sw)
+{
+    int i;
+
+    if (!sw->nb_cases)
+        return gjmp(st, 0);
+    qsort(sw->cases, sw->nb_cases, sizeof(CaseLabel), case_cmp);
+    for(i = 1; i < sw->nb_cases; i++) {
+        if (sw->cases[i].v1 <= sw->cases[i - 1].v2)
+            tcc_error(st, "duplicate case value");
+    }
+    return gen_case(st, sw, sw->cases, sw->nb_cases, 0);
+}
+
+static void block(TCCState *st, int *bsym, int *csym, SwitchState *sw,
+                  int is_expr)
 {
     int a, b, c, d;
     Sym *s;
 
     /* generate line number info */
-    if (do_debug && 
-        (last_line_num != file->line_num || last_ind != ind)) {
-        put_stabn(st, N_SLINE, 0, file->line_num, ind - func_ind);
-        last_ind = ind;
-        last_line_num = file->line_num;
+    if (st->do_debug && 
+        (st->last_line_num != st->file->line_num || st->last_ind != st->ind)) {
+        put_stabn(st, N_SLINE, 0, st->file->line_num, st->ind - st->func_ind);
+        st->last_ind = st->ind;
+        st->last_line_num = st->file->line_num;
     }
 
     if (is_expr) {
         /* default return value is (void) */
         vpushi(st, 0);
-        vtop->type.t = VT_VOID;
+        st->vtop->type.t = VT_VOID;
     }
 
-    if (tok == TOK_IF) {
+    if (st->tok == TOK_IF) {
         /* if test */
         next(st);
         skip(st, '(');
         gexpr(st);
         skip(st, ')');
         a = gtst(st, 1, 0);
-        block(st, bsym, csym, case_sym, def_sym, case_reg, 0);
-        c = tok;
+        block(st, bsym, csym, sw, 0);
+        c = st->tok;
         if (c == TOK_ELSE) {
             next(st);
             d = gjmp(st, 0);
-            gsym(a);
-            block(st, bsym, csym, case_sym, def_sym, case_reg, 0);
-            gsym(d); /* patch else jmp */
+            gsym(st, a);
+            block(st, bsym, csym, sw, 0);
+            gsym(st, d); /* patch else jmp */
         } else
-            gsym(a);
-    } else if (tok == TOK_WHILE) {
+            gsym(st, a);
+    } else if (st->tok == TOK_WHILE) {
         next(st);
-        d = ind;
+        d = st->ind;
         skip(st, '(');
         gexpr(st);
         skip(st, ')');
         a = gtst(st, 1, 0);
         b = 0;
-        block(st, &a, &b, case_sym, def_sym, case_reg, 0);
+        block(st, &a, &b, sw, 0);
         gjmp_addr(st, d);
-        gsym(a);
-        gsym_addr(b, d);
-    } else if (tok == '{') {
+        gsym(st, a);
+        gsym_addr(st, b, d);
+    } else if (st->tok == '{') {
         Sym *llabel;
         
         next(st);
         /* record local declaration stack position */
-        s = local_stack;
-        llabel = local_label_stack;
+        s = st->local_stack;
+        llabel = st->local_label_stack;
         /* handle local labels declarations */
-        if (tok == TOK_LABEL) {
+        if (st->tok == TOK_LABEL) {
             next(st);
             for(;;) {
-                if (tok < TOK_UIDENT)
+                if (st->tok < TOK_UIDENT)
                     expect(st, "label identifier");
-                label_push(st, &local_label_stack, tok, LABEL_DECLARED);
+                label_push(st, &st->local_label_stack, st->tok, LABEL_DECLARED);
                 next(st);
-                if (tok == ',') {
+                if (st->tok == ',') {
                     next(st);
                 } else {
                     skip(st, ';');
@@ -7204,51 +8387,52 @@ static void block(TCCState *st, int *bsym, int *csym, int *case_sym, int *def_sy
                 }
             }
         }
-        while (tok != '}') {
+        while (st->tok != '}') {
             decl(st, VT_LOCAL);
-            if (tok != '}') {
+            if (st->tok != '}') {
                 if (is_expr)
                     vpop(st);
-                block(st, bsym, csym, case_sym, def_sym, case_reg, is_expr);
+                block(st, bsym, csym, sw, is_expr);
             }
         }
         /* pop locally defined labels */
-        label_pop(st, &local_label_stack, llabel);
+        label_pop(st, &st->local_label_stack, llabel);
         /* pop locally defined symbols */
-        sym_pop(st, &local_stack, s);
+        sym_pop(st, &st->local_stack, s);
         next(st);
-    } else if (tok == TOK_RETURN) {
+    } else if (st->tok == TOK_RETURN) {
         next(st);
-        if (tok != ';') {
+        if (st->tok != ';') {
+            st->tail_call = 1;
             gexpr(st);
-            gen_assign_cast(st, &func_vt);
-            if ((func_vt.t & VT_BTYPE) == VT_STRUCT) {
+            gen_assign_cast(st, &st->func_vt);
+            if ((st->func_vt.t & VT_BTYPE) == VT_STRUCT) {
                 CType type;
                 /* if returning structure, must copy it to implicit
                    first pointer arg location */
 #ifdef TCC_ARM_EABI
                 int align, size;
-                size = type_size(st, &func_vt,&align);
+                size = type_size(st, &st->func_vt,&align);
                 if(size <= 4) {
-                    if((vtop->r != (VT_LOCAL | VT_LVAL) || (vtop->c.i & 3))
+                    if((st->vtop->r != (VT_LOCAL | VT_LVAL) || (st->vtop->c.i & 3))
                        && (align & 3))
                     {
                         int addr;
-                        loc = (loc - size) & -4;
-                        addr = loc;
-                        type = func_vt;
+                        st->loc = (st->loc - size) & -4;
+                        addr = st->loc;
+                        type = st->func_vt;
                         vset(st, &type, VT_LOCAL | VT_LVAL, addr);
                         vswap(st);
                         vstore(st);
-                        vset(st, &int_type, VT_LOCAL | VT_LVAL, addr);
+                        vset(st, &st->int_type, VT_LOCAL | VT_LVAL, addr);
                     }
-                    vtop->type = int_type;
+                    st->vtop->type = st->int_type;
                     gv(st, RC_IRET);
                 } else {
 #endif
-                type = func_vt;
+                type = st->func_vt;
                 mk_pointer(st, &type);
-                vset(st, &type, VT_LOCAL | VT_LVAL, func_vc);
+                vset(st, &type, VT_LOCAL | VT_LVAL, st->func_vc);
                 indir(st);
                 vswap(st);
                 /* copy structure value to pointer */
@@ -7256,161 +8440,166 @@ static void block(TCCState *st, int *bsym, int *csym, int *case_sym, int *def_sy
 #ifdef TCC_ARM_EABI
                 }
 #endif
-            } else if (is_float(st, func_vt.t)) {
+            } else if (is_float(st, st->func_vt.t)) {
                 gv(st, RC_FRET);
             } else {
                 gv(st, RC_IRET);
             }
-            vtop--; /* NOT vpop(st) because on x86 it would flush the fp stack */
+            st->vtop--; /* NOT vpop(st) because on x86 it would flush the fp stack */
         }
         skip(st, ';');
-        rsym = gjmp(st, rsym); /* jmp */
-    } else if (tok == TOK_BREAK) {
+        st->rsym = gjmp(st, st->rsym); /* jmp */
+    } else if (st->tok == TOK_BREAK) {
         /* compute jump */
         if (!bsym)
            tcc_error(st, "cannot break");
         *bsym = gjmp(st, *bsym);
         next(st);
         skip(st, ';');
-    } else if (tok == TOK_CONTINUE) {
+    } else if (st->tok == TOK_CONTINUE) {
         /* compute jump */
         if (!csym)
            tcc_error(st, "cannot continue");
         *csym = gjmp(st, *csym);
         next(st);
         skip(st, ';');
-    } else if (tok == TOK_FOR) {
+    } else if (st->tok == TOK_FOR) {
         int e;
         next(st);
         skip(st, '(');
-        if (tok != ';') {
+        if (st->tok != ';') {
             gexpr(st);
             vpop(st);
         }
         skip(st, ';');
-        d = ind;
-        c = ind;
+        d = st->ind;
+        c = st->ind;
         a = 0;
         b = 0;
-        if (tok != ';') {
+        if (st->tok != ';') {
             gexpr(st);
             a = gtst(st, 1, 0);
         }
         skip(st, ';');
-        if (tok != ')') {
+        if (st->tok != ')') {
             e = gjmp(st, 0);
-            c = ind;
+            c = st->ind;
             gexpr(st);
             vpop(st);
             gjmp_addr(st, d);
-            gsym(e);
+            gsym(st, e);
         }
         skip(st, ')');
-        block(st, &a, &b, case_sym, def_sym, case_reg, 0);
+        block(st, &a, &b, sw, 0);
         gjmp_addr(st, c);
-        gsym(a);
-        gsym_addr(b, c);
+        gsym(st, a);
+        gsym_addr(st, b, c);
     } else 
-    if (tok == TOK_DO) {
+    if (st->tok == TOK_DO) {
         next(st);
         a = 0;
         b = 0;
-        d = ind;
-        block(st, &a, &b, case_sym, def_sym, case_reg, 0);
+        d = st->ind;
+        block(st, &a, &b, sw, 0);
         skip(st, TOK_WHILE);
         skip(st, '(');
-        gsym(b);
+        gsym(st, b);
         gexpr(st);
         c = gtst(st, 0, 0);
-        gsym_addr(c, d);
+        gsym_addr(st, c, d);
         skip(st, ')');
-        gsym(a);
+        gsym(st, a);
         skip(st, ';');
     } else
-    if (tok == TOK_SWITCH) {
+    if (st->tok == TOK_SWITCH) {
+        SwitchState sw1;
         next(st);
         skip(st, '(');
         gexpr(st);
-        /* XXX: other types than integer */
-        case_reg = gv(st, RC_INT);
+        /* the values are compared as signed ints or long longs, which
+           finds the same case as the unsigned compares */
+        if ((st->vtop->type.t & VT_BTYPE) == VT_LLONG)
+            sw1.type.t = VT_LLONG;
+        else
+            sw1.type.t = VT_INT;
+        gen_cast(st, &sw1.type);
+        sw1.reg = gv(st, RC_INT);
+        sw1.reg2 = st->vtop->r2;
         vpop(st);
         skip(st, ')');
+        sw1.cases = NULL;
+        sw1.nb_cases = 0;
+        sw1.def_addr = 0;
         a = 0;
-        b = gjmp(st, 0); /* jump to first case */
-        c = 0;
-        block(st, &a, csym, &b, &c, case_reg, 0);
+        b = gjmp(st, 0); /* jump to the case dispatch */
+        block(st, &a, csym, &sw1, 0);
+        a = gjmp(st, a);
+        gsym(st, b);
+        c = gen_switch(st, &sw1);
         /* if no default, jmp after switch */
-        if (c == 0)
-            c = ind;
-        /* default label */
-        gsym_addr(b, c);
+        if (sw1.def_addr)
+            gsym_addr(st, c, sw1.def_addr);
+        else
+            gsym(st, c);
         /* break label */
-        gsym(a);
+        gsym(st, a);
     } else
-    if (tok == TOK_CASE) {
-        int v1, v2;
-        if (!case_sym)
+    if (st->tok == TOK_CASE) {
+        long long v1, v2;
+        if (!sw)
             expect(st, "switch");
-        /* since a case is like a label, we must skip it with a jmp */
-        b = gjmp(st, 0);
     next_case:
         next(st);
-        v1 = expr_const(st);
+        v1 = case_const(st, sw);
         v2 = v1;
-        if (gnu_ext && tok == TOK_DOTS) {
+        if (st->gnu_ext && st->tok == TOK_DOTS) {
             next(st);
-            v2 = expr_const(st);
+            v2 = case_const(st, sw);
             if (v2 < v1)
                 warning(st, "empty case range");
         }
-        gsym(*case_sym);
-        vseti(st, case_reg, 0);
-        vpushi(st, v1);
-        if (v1 == v2) {
-            gen_op(st, TOK_EQ);
-            *case_sym = 0;
-        } else {
-            gen_op(st, TOK_GE);
-            *case_sym = gtst(st, 1, 0);
-            vseti(st, case_reg, 0);
-            vpushi(st, v2);
-            gen_op(st, TOK_LE);
-        }
         skip(st, ':');
-        if (tok == TOK_CASE) {
-            b = gtst(st, 0, b);
+        if (v2 >= v1) {
+            if ((sw->nb_cases & (sw->nb_cases - 1)) == 0)
+                sw->cases = arena_realloc(st, sw->cases,
+                                          sw->nb_cases * sizeof(CaseLabel),
+                                          (sw->nb_cases ? sw->nb_cases * 2 : 1) *
+                                          sizeof(CaseLabel));
+            sw->cases[sw->nb_cases].v1 = v1;
+            sw->cases[sw->nb_cases].v2 = v2;
+            sw->cases[sw->nb_cases].addr = st->ind;
+            sw->nb_cases++;
+        }
+        if (st->tok == TOK_CASE)
             goto next_case;
-        }
-        *case_sym = gtst(st, 1, *case_sym);
-        gsym(b);
         is_expr = 0;
         goto block_after_label;
     } else 
-    if (tok == TOK_DEFAULT) {
+    if (st->tok == TOK_DEFAULT) {
         next(st);
         skip(st, ':');
-        if (!def_sym)
+        if (!sw)
             expect(st, "switch");
-        if (*def_sym)
+        if (sw->def_addr)
            tcc_error(st, "too many 'default'");
-        *def_sym = ind;
+        sw->def_addr = st->ind;
         is_expr = 0;
         goto block_after_label;
     } else
-    if (tok == TOK_GOTO) {
+    if (st->tok == TOK_GOTO) {
         next(st);
-        if (tok == '*' && gnu_ext) {
+        if (st->tok == '*' && st->gnu_ext) {
             /* computed goto */
             next(st);
             gexpr(st);
-            if ((vtop->type.t & VT_BTYPE) != VT_PTR)
+            if ((st->vtop->type.t & VT_BTYPE) != VT_PTR)
                 expect(st, "pointer");
             ggoto(st);
-        } else if (tok >= TOK_UIDENT) {
-            s = label_find(st, tok);
+        } else if (st->tok >= TOK_UIDENT) {
+            s = label_find(st, st->tok);
             /* put forward definition if needed */
             if (!s) {
-                s = label_push(st, &global_label_stack, tok, LABEL_FORWARD);
+                s = label_push(st, &st->global_label_stack, st->tok, LABEL_FORWARD);
             } else {
                 if (s->r == LABEL_DECLARED)
                     s->r = LABEL_FORWARD;
@@ -7425,7 +8614,8 @@ static void block(TCCState *st, int *bsym, int *csym, int *case_sym, int *def_sy
             expect(st, "label identifier");
         }
         skip(st, ';');
-    } else if (tok == TOK_ASM1 || tok == TOK_ASM2 || tok == TOK_ASM3) {
+    } else if (st->tok == TOK_ASM1 || st->tok == TOK_ASM2 || st->tok == TOK_ASM3) {
+        st->func_no_opt = 1;
         asm_instr(st);
     } else {
         b = is_label(st);
@@ -7435,24 +8625,24 @@ static void block(TCCState *st, int *bsym, int *csym, int *case_sym, int *def_sy
             if (s) {
                 if (s->r == LABEL_DEFINED)
                    tcc_error(st, "duplicate label '%s'", get_tok_str(st, s->v, NULL));
-                gsym((long)s->next);
+                gsym(st, (long)s->next);
                 s->r = LABEL_DEFINED;
             } else {
-                s = label_push(st, &global_label_stack, b, LABEL_DEFINED);
+                s = label_push(st, &st->global_label_stack, b, LABEL_DEFINED);
             }
-            s->next = (void *)ind;
+            s->next = (void *)st->ind;
             /* we accept this, but it is a mistake */
         block_after_label:
-            if (tok == '}') {
+            if (st->tok == '}') {
                 warning(st, "deprecated use of label at end of compound statement");
             } else {
                 if (is_expr)
                     vpop(st);
-                block(st, bsym, csym, case_sym, def_sym, case_reg, is_expr);
+                block(st, bsym, csym, sw, is_expr);
             }
         } else {
             /* expression case */
-            if (tok != ';') {
+            if (st->tok != ';') {
                 if (is_expr) {
                     vpop(st);
                     gexpr(st);
@@ -7481,10 +8671,10 @@ static void decl_designator(TCCState *st, CType *type, Section *sec, unsigned lo
     notfirst = 0;
     elem_size = 0;
     nb_elems = 1;
-    if (gnu_ext && (l = is_label(st)) != 0)
+    if (st->gnu_ext && (l = is_label(st)) != 0)
         goto struct_field;
-    while (tok == '[' || tok == '.') {
-        if (tok == '[') {
+    while (st->tok == '[' || st->tok == '.') {
+        if (st->tok == '[') {
             if (!(type->t & VT_ARRAY))
                 expect(st, "array type");
             s = type->ref;
@@ -7492,7 +8682,7 @@ static void decl_designator(TCCState *st, CType *type, Section *sec, unsigned lo
             index = expr_const(st);
             if (index < 0 || (s->c >= 0 && index >= s->c))
                 expect(st, "invalid index");
-            if (tok == TOK_DOTS && gnu_ext) {
+            if (st->tok == TOK_DOTS && st->gnu_ext) {
                 next(st);
                 index_last = expr_const(st);
                 if (index_last < 0 || 
@@ -7516,7 +8706,7 @@ static void decl_designator(TCCState *st, CType *type, Section *sec, unsigned lo
             }
         } else {
             next(st);
-            l = tok;
+            l = st->tok;
             next(st);
         struct_field:
             if ((type->t & VT_BTYPE) != VT_STRUCT)
@@ -7542,10 +8732,10 @@ static void decl_designator(TCCState *st, CType *type, Section *sec, unsigned lo
         notfirst = 1;
     }
     if (notfirst) {
-        if (tok == '=') {
+        if (st->tok == '=') {
             next(st);
         } else {
-            if (!gnu_ext)
+            if (!st->gnu_ext)
                 expect(st, "=");
         }
     } else {
@@ -7605,12 +8795,12 @@ static void init_putv(TCCState *st, CType *type, Section *sec, unsigned long c,
         break;
     case EXPR_CONST:
         /* compound literals must be allocated globally in this case */
-        saved_global_expr = global_expr;
-        global_expr = 1;
+        saved_global_expr = st->global_expr;
+        st->global_expr = 1;
         expr_const1(st);
-        global_expr = saved_global_expr;
+        st->global_expr = saved_global_expr;
         /* NOTE: symbols are accepted */
-        if ((vtop->r & (VT_VALMASK | VT_LVAL)) != VT_CONST)
+        if ((st->vtop->r & (VT_VALMASK | VT_LVAL)) != VT_CONST)
            tcc_error(st, "initializer element is not constant");
         break;
     case EXPR_ANY:
@@ -7633,42 +8823,56 @@ static void init_putv(TCCState *st, CType *type, Section *sec, unsigned long c,
             bit_size = 32;
             bit_mask = -1LL;
         } else {
-            bit_pos = (vtop->type.t >> VT_STRUCT_SHIFT) & 0x3f;
-            bit_size = (vtop->type.t >> (VT_STRUCT_SHIFT + 6)) & 0x3f;
+            bit_pos = (st->vtop->type.t >> VT_STRUCT_SHIFT) & 0x3f;
+            bit_size = (st->vtop->type.t >> (VT_STRUCT_SHIFT + 6)) & 0x3f;
             bit_mask = (1LL << bit_size) - 1;
         }
-        if ((vtop->r & VT_SYM) &&
+        if ((st->vtop->r & VT_SYM) &&
             (bt == VT_BYTE ||
              bt == VT_SHORT ||
              bt == VT_DOUBLE ||
              bt == VT_LDOUBLE ||
+#ifndef TCC_TARGET_X86_64
              bt == VT_LLONG ||
+#endif
              (bt == VT_INT && bit_size != 32)))
            tcc_error(st, "initializer element is not computable at load time");
         switch(bt) {
         case VT_BYTE:
-            *(char *)ptr |= (vtop->c.i & bit_mask) << bit_pos;
+            *(char *)ptr |= (st->vtop->c.i & bit_mask) << bit_pos;
             break;
         case VT_SHORT:
-            *(short *)ptr |= (vtop->c.i & bit_mask) << bit_pos;
+            *(short *)ptr |= (st->vtop->c.i & bit_mask) << bit_pos;
             break;
         case VT_DOUBLE:
-            *(double *)ptr = vtop->c.d;
+            *(double *)ptr = st->vtop->c.d;
             break;
         case VT_LDOUBLE:
-            *(long double *)ptr = vtop->c.ld;
+            *(long double *)ptr = st->vtop->c.ld;
             break;
         case VT_LLONG:
-            *(long long *)ptr |= (vtop->c.ll & bit_mask) << bit_pos;
+#ifdef TCC_TARGET_X86_64
+            if (st->vtop->r & VT_SYM)
+                greloc(st, sec, st->vtop->sym, c, R_DATA_PTR);
+#endif
+            *(long long *)ptr |= (st->vtop->c.ll & bit_mask) << bit_pos;
+            break;
+#ifdef TCC_TARGET_X86_64
+        case VT_PTR:
+        case VT_FUNC:
+            if (st->vtop->r & VT_SYM)
+                greloc(st, sec, st->vtop->sym, c, R_DATA_PTR);
+            *(long long *)ptr |= st->vtop->c.ll;
             break;
+#endif
         default:
-            if (vtop->r & VT_SYM) {
-                greloc(st, sec, vtop->sym, c, R_DATA_32);
+            if (st->vtop->r & VT_SYM) {
+                greloc(st, sec, st->vtop->sym, c, R_DATA_32);
             }
-            *(int *)ptr |= (vtop->c.i & bit_mask) << bit_pos;
+            *(int *)ptr |= (st->vtop->c.i & bit_mask) << bit_pos;
             break;
         }
-        vtop--;
+        st->vtop--;
     } else {
         vset(st, &dtype, VT_LOCAL|VT_LVAL, c);
         vswap(st);
@@ -7682,8 +8886,11 @@ static void init_putz(TCCState *st, CType *t, Section *sec, unsigned long c, int
 {
     if (sec) {
         /* nothing to do because globals are already set to zero */
+    } else if (size <= MEMCPY_INLINE_MAX) {
+        vseti(st, VT_LOCAL, c);
+        gen_memzero(st, size);
     } else {
-        vpush_global_sym(st, &func_old_type, TOK_memset);
+        vpush_global_sym(st, &st->func_old_type, TOK_memset);
         vseti(st, VT_LOCAL, c);
         vpushi(st, 0);
         vpushi(st, size);
@@ -7712,29 +8919,29 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
         size1 = type_size(st, t1, &align1);
 
         no_oblock = 1;
-        if ((first && tok != TOK_LSTR && tok != TOK_STR) || 
-            tok == '{') {
+        if ((first && st->tok != TOK_LSTR && st->tok != TOK_STR) || 
+            st->tok == '{') {
             skip(st, '{');
             no_oblock = 0;
         }
 
         /* only parse strings here if correct type (otherwise: handle
            them as ((w)char *) expressions */
-        if ((tok == TOK_LSTR && 
+        if ((st->tok == TOK_LSTR && 
 #ifdef WIN32
              (t1->t & VT_BTYPE) == VT_SHORT && (t1->t & VT_UNSIGNED)) ||
 #else
              (t1->t & VT_BTYPE) == VT_INT) ||
 #endif
-            (tok == TOK_STR &&
+            (st->tok == TOK_STR &&
              (t1->t & VT_BTYPE) == VT_BYTE)) {
-            while (tok == TOK_STR || tok == TOK_LSTR) {
+            while (st->tok == TOK_STR || st->tok == TOK_LSTR) {
                 int cstr_len, ch;
                 CString *cstr;
 
-                cstr = tokc.cstr;
+                cstr = st->tokc.cstr;
                 /* compute maximum number of chars wanted */
-                if (tok == TOK_STR)
+                if (st->tok == TOK_STR)
                     cstr_len = cstr->size;
                 else
                     cstr_len = cstr->size / sizeof(nwchar_t);
@@ -7748,11 +8955,11 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
                     /* in order to go faster for common case (char
                        string in global variable, we handle it
                        specifically */
-                    if (sec && tok == TOK_STR && size1 == 1) {
+                    if (sec && st->tok == TOK_STR && size1 == 1) {
                         memcpy(sec->data + c + array_length, cstr->data, nb);
                     } else {
                         for(i=0;i<nb;i++) {
-                            if (tok == TOK_STR)
+                            if (st->tok == TOK_STR)
                                 ch = ((unsigned char *)cstr->data)[i];
                             else
                                 ch = ((nwchar_t *)cstr->data)[i];
@@ -7774,7 +8981,7 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
             }
         } else {
             index = 0;
-            while (tok != '}') {
+            while (st->tok != '}') {
                 decl_designator(st, type, sec, c, &index, NULL, size_only);
                 if (n >= 0 && index >= n)
                    tcc_error(st, "index too large");
@@ -7792,7 +8999,7 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
                    same time) */
                 if (index >= n && no_oblock)
                     break;
-                if (tok == '}')
+                if (st->tok == '}')
                     break;
                 skip(st, ',');
             }
@@ -7808,7 +9015,7 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
         if (n < 0)
             s->c = array_length;
     } else if ((type->t & VT_BTYPE) == VT_STRUCT &&
-               (sec || !first || tok == '{')) {
+               (sec || !first || st->tok == '{')) {
         int par_count;
 
         /* NOTE: the previous test is a specific case for automatic
@@ -7820,11 +9027,11 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
            to do it correctly (ideally, the expression parser should
            be used in all cases) */
         par_count = 0;
-        if (tok == '(') {
+        if (st->tok == '(') {
             AttributeDef ad1;
             CType type1;
             next(st);
-            while (tok == '(') {
+            while (st->tok == '(') {
                 par_count++;
                 next(st);
             }
@@ -7838,7 +9045,7 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
             skip(st, ')');
         }
         no_oblock = 1;
-        if (first || tok == '{') {
+        if (first || st->tok == '{') {
             skip(st, '{');
             no_oblock = 0;
         }
@@ -7847,7 +9054,7 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
         array_length = 0;
         index = 0;
         n = s->c;
-        while (tok != '}') {
+        while (st->tok != '}') {
             decl_designator(st, type, sec, c, NULL, &f, size_only);
             index = f->c;
             if (!size_only && array_length < index) {
@@ -7860,7 +9067,7 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
             f = f->next;
             if (no_oblock && f == NULL)
                 break;
-            if (tok == '}')
+            if (st->tok == '}')
                 break;
             skip(st, ',');
         }
@@ -7875,18 +9082,18 @@ static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned l
             skip(st, ')');
             par_count--;
         }
-    } else if (tok == '{') {
+    } else if (st->tok == '{') {
         next(st);
         decl_initializer(st, type, sec, c, first, size_only);
         skip(st, '}');
     } else if (size_only) {
         /* just skip expression */
         parlevel = 0;
-        while ((parlevel > 0 || (tok != '}' && tok != ',')) && 
-               tok != -1) {
-            if (tok == '(')
+        while ((parlevel > 0 || (st->tok != '}' && st->tok != ',')) && 
+               st->tok != -1) {
+            if (st->tok == '(')
                 parlevel++;
-            else if (tok == ')')
+            else if (st->tok == ')')
                 parlevel--;
             next(st);
         }
@@ -7930,19 +9137,19 @@ static void decl_initializer_alloc(TCCState *st, CType *type, AttributeDef *ad,
         /* get all init string */
         if (has_init == 2) {
             /* only get strings */
-            while (tok == TOK_STR || tok == TOK_LSTR) {
+            while (st->tok == TOK_STR || st->tok == TOK_LSTR) {
                 tok_str_add_tok(st, &init_str);
                 next(st);
             }
         } else {
             level = 0;
-            while (level > 0 || (tok != ',' && tok != ';')) {
-                if (tok < 0)
+            while (level > 0 || (st->tok != ',' && st->tok != ';')) {
+                if (st->tok < 0)
                    tcc_error(st, "unexpected end of file in initializer");
                 tok_str_add_tok(st, &init_str);
-                if (tok == '{')
+                if (st->tok == '{')
                     level++;
-                else if (tok == '}') {
+                else if (st->tok == '}') {
                     if (level == 0)
                         break;
                     level--;
@@ -7956,11 +9163,11 @@ static void decl_initializer_alloc(TCCState *st, CType *type, AttributeDef *ad,
         /* compute size */
         save_parse_state(st, &saved_parse_state);
 
-        macro_ptr = init_str.str;
+        st->macro_ptr = init_str.str;
         next(st);
         decl_initializer(st, type, NULL, 0, 1, 1);
         /* prepare second initializer parsing */
-        macro_ptr = init_str.str;
+        st->macro_ptr = init_str.str;
         next(st);
         
         /* if still unknown size, error */
@@ -7977,19 +9184,20 @@ static void decl_initializer_alloc(TCCState *st, CType *type, AttributeDef *ad,
     }
     if ((r & VT_VALMASK) == VT_LOCAL) {
         sec = NULL;
-        if (do_bounds_check && (type->t & VT_ARRAY)) 
-            loc--;
-        loc = (loc - size) & -align;
-        addr = loc;
+        if (st->do_bounds_check && (type->t & VT_ARRAY)) 
+            st->loc--;
+        st->loc = (st->loc - size) & -align;
+        addr = st->loc;
+        func_local(st, addr, size, type);
         /* handles bounds */
         /* XXX: currently, since we do only one pass, we cannot track
            '&' operators, so we add only arrays */
-        if (do_bounds_check && (type->t & VT_ARRAY)) {
+        if (st->do_bounds_check && (type->t & VT_ARRAY)) {
             unsigned long *bounds_ptr;
             /* add padding between regions */
-            loc--;
+            st->loc--;
             /* then add local bound info */
-            bounds_ptr = section_ptr_add(st, lbounds_section, 2 * sizeof(unsigned long));
+            bounds_ptr = section_ptr_add(st, st->lbounds_section, 2 * sizeof(unsigned long));
             bounds_ptr[0] = addr;
             bounds_ptr[1] = size;
         }
@@ -8038,9 +9246,9 @@ static void decl_initializer_alloc(TCCState *st, CType *type, AttributeDef *ad,
         sec = ad->section;
         if (!sec) {
             if (has_init)
-                sec = data_section;
+                sec = st->data_section;
             else if (st->nocommon)
-                sec = bss_section;
+                sec = st->bss_section;
         }
         if (sec) {
             data_offset = sec->data_offset;
@@ -8050,7 +9258,7 @@ static void decl_initializer_alloc(TCCState *st, CType *type, AttributeDef *ad,
                because initializers themselves can create new initializers */
             data_offset += size;
             /* add padding if bound check */
-            if (do_bounds_check)
+            if (st->do_bounds_check)
                 data_offset++;
             sec->data_offset = data_offset;
             /* allocate section space to put the data */
@@ -8072,11 +9280,11 @@ static void decl_initializer_alloc(TCCState *st, CType *type, AttributeDef *ad,
             if (sec) {
                 put_extern_sym(st, sym, sec, addr, size);
             } else {
-                Elf32_Sym *esym;
+                ElfW(Sym) *esym;
                 /* put a common area */
                 put_extern_sym(st, sym, NULL, align, size);
                 /* XXX: find a nicer way */
-                esym = &((Elf32_Sym *)symtab_section->data)[sym->c];
+                esym = &((ElfW(Sym) *)st->symtab_section->data)[sym->c];
                 esym->st_shndx = SHN_COMMON;
             }
         } else {
@@ -8086,17 +9294,17 @@ static void decl_initializer_alloc(TCCState *st, CType *type, AttributeDef *ad,
             sym = get_sym_ref(st, type, sec, addr, size);
             cval.ul = 0;
             vsetc(st, type, VT_CONST | VT_SYM, &cval);
-            vtop->sym = sym;
+            st->vtop->sym = sym;
         }
 
         /* handles bounds now because the symbol must be defined
            before for the relocation */
-        if (do_bounds_check) {
+        if (st->do_bounds_check) {
             unsigned long *bounds_ptr;
 
-            greloc(st, bounds_section, sym, bounds_section->data_offset, R_DATA_32);
+            greloc(st, st->bounds_section, sym, st->bounds_section->data_offset, R_DATA_32);
             /* then add global bound info */
-            bounds_ptr = section_ptr_add(st, bounds_section, 2 * sizeof(long));
+            bounds_ptr = section_ptr_add(st, st->bounds_section, 2 * sizeof(long));
             bounds_ptr[0] = 0; /* relocated */
             bounds_ptr[1] = size;
         }
@@ -8119,11 +9327,11 @@ void put_func_debug(TCCState *st, Sym *sym)
     /* stabs info */
     /* XXX: we put here a dummy type */
     snprintf(buf, sizeof(buf), "%s:%c1", 
-             funcname, sym->type.t & VT_STATIC ? 'f' : 'F');
-    put_stabs_r(st, buf, N_FUN, 0, file->line_num, 0,
-                cur_text_section, sym->c);
-    last_ind = 0;
-    last_line_num = 0;
+             st->funcname, sym->type.t & VT_STATIC ? 'f' : 'F');
+    put_stabs_r(st, buf, N_FUN, 0, st->file->line_num, 0,
+                st->cur_text_section, sym->c);
+    st->last_ind = 0;
+    st->last_line_num = 0;
 }
 
 /* parse an old style function declaration list */
@@ -8136,12 +9344,12 @@ static void func_decl_list(TCCState *st, Sym *func_sym)
     CType btype, type;
 
     /* parse each declaration */
-    while (tok != '{' && tok != ';' && tok != ',' && tok != TOK_EOF) {
+    while (st->tok != '{' && st->tok != ';' && st->tok != ',' && st->tok != TOK_EOF) {
         if (!parse_btype(st, &btype, &ad)) 
             expect(st, "declaration list");
         if (((btype.t & VT_BTYPE) == VT_ENUM ||
              (btype.t & VT_BTYPE) == VT_STRUCT) && 
-            tok == ';') {
+            st->tok == ';') {
             /* we accept no variable after */
         } else {
             for(;;) {
@@ -8164,7 +9372,7 @@ static void func_decl_list(TCCState *st, Sym *func_sym)
                 /* we can add the type (NOTE: it could be local to the function) */
                 s->type = type;
                 /* accept other parameters */
-                if (tok == ',')
+                if (st->tok == ',')
                     next(st);
                 else
                     break;
@@ -8178,34 +9386,250 @@ static void func_decl_list(TCCState *st, Sym *func_sym)
    'cur_text_section' */
 static void gen_function(TCCState *st, Sym *sym)
 {
-    ind = cur_text_section->data_offset;
+    st->ind = st->cur_text_section->data_offset;
     /* NOTE: we patch the symbol size later */
-    put_extern_sym(st, sym, cur_text_section, ind, 0);
-    funcname = get_tok_str(st, sym->v, NULL);
-    func_ind = ind;
+    put_extern_sym(st, sym, st->cur_text_section, st->ind, 0);
+    st->funcname = get_tok_str(st, sym->v, NULL);
+    st->func_ind = st->ind;
     /* put debug symbol */
-    if (do_debug)
+    if (st->do_debug)
         put_func_debug(st, sym);
     /* push a dummy symbol to enable local sym storage */
-    sym_push2(st, &local_stack, SYM_FIELD, 0, 0);
+    sym_push2(st, &st->local_stack, SYM_FIELD, 0, 0);
+    st->func_regs_used = 0;
+    st->func_no_opt = 0;
+    st->func_addr_taken = 0;
+    st->func_code_refs = NULL;
+    st->nb_func_code_refs = 0;
+    st->func_locals = NULL;
+    st->nb_func_locals = 0;
+    memset(st->func_reg_slot, 0, sizeof(st->func_reg_slot));
     gfunc_prolog(st, &sym->type);
-    rsym = 0;
-    block(st, NULL, NULL, NULL, NULL, 0, 0);
-    gsym(rsym);
+    st->rsym = 0;
+    block(st, NULL, NULL, NULL, 0);
+    gsym(st, st->rsym);
     gfunc_epilog(st);
-    cur_text_section->data_offset = ind;
-    label_pop(st, &global_label_stack, NULL);
-    sym_pop(st, &local_stack, NULL); /* reset local stack */
+    st->cur_text_section->data_offset = st->ind;
+    label_pop(st, &st->global_label_stack, NULL);
+    sym_pop(st, &st->local_stack, NULL); /* reset local stack */
     /* end of function */
-    /* patch symbol size */
-    ((Elf32_Sym *)symtab_section->data)[sym->c].st_size = 
-        ind - func_ind;
-    if (do_debug) {
-        put_stabn(st, N_FUN, 0, 0, ind - func_ind);
+    /* patch symbol address, the code generator may have moved the
+       start, and size */
+    ((ElfW(Sym) *)st->symtab_section->data)[sym->c].st_value = st->func_ind;
+    ((ElfW(Sym) *)st->symtab_section->data)[sym->c].st_size = 
+        st->ind - st->func_ind;
+    if (st->do_debug) {
+        put_stabn(st, N_FUN, 0, 0, st->ind - st->func_ind);
+    }
+    st->funcname = ""; /* for safety */
+    st->func_vt.t = VT_VOID; /* for safety */
+    st->ind = 0; /* for safety */
+}
+
+/* longest body, in tokens, of a function whose calls are inlined */
+#define INLINE_TOKENS_MAX 64
+/* most parameters of a function whose calls are inlined */
+#define INLINE_PARAMS_MAX 8
+/* deepest nesting of inlined calls */
+#define INLINE_DEPTH_MAX 4
+
+/* record the tokens of a function body, from '{' to the matching '}'.
+   '*inlinable' is set if the body is short and has no labels, static
+   variables, asm or anything else that needs a function of its own. */
+static int *func_body_tokens(TCCState *st, int *inlinable)
+{
+    TokenString func_str;
+    int block_level, t, n, prev, prev2;
+
+    tok_str_new(st, &func_str);
+    block_level = 0;
+    n = prev = prev2 = 0;
+    for(;;) {
+        if (st->tok == TOK_EOF)
+           tcc_error(st, "unexpected end of file");
+        tok_str_add_tok(st, &func_str);
+        t = st->tok;
+        if (t == TOK_GOTO || t == TOK_STATIC ||
+            t == TOK_ASM1 || t == TOK_ASM2 || t == TOK_ASM3 ||
+            t == TOK___FUNCTION__ || t == TOK___FUNC__ || t == TOK_alloca ||
+            (t == ':' && prev >= TOK_UIDENT &&
+             (prev2 == '{' || prev2 == '}' || prev2 == ';' || prev2 == ':')))
+            n = INLINE_TOKENS_MAX;
+        n++;
+        prev2 = prev;
+        prev = t;
+        next(st);
+        if (t == '{') {
+            block_level++;
+        } else if (t == '}') {
+            block_level--;
+            if (block_level == 0)
+                break;
+        }
+    }
+    tok_str_add(st, &func_str, -1, 0);
+    tok_str_add(st, &func_str, 0, 0);
+    *inlinable = n <= INLINE_TOKENS_MAX;
+    return func_str.str;
+}
+
+/* remember the static function 'sym' of inlinable body 'str', copied if
+   'copy', if its calls can be replaced by its body. Return non zero if
+   it was recorded. */
+static int inline_add(TCCState *st, Sym *sym, int *str, int copy)
+{
+    Sym *s = sym->type.ref;
+    InlineFunc *f;
+    int *p, t, n;
+
+    t = s->type.t & VT_BTYPE;
+    if (s->c != FUNC_NEW || t == VT_STRUCT || t == VT_LDOUBLE ||
+        st->do_debug || st->do_bounds_check)
+        return 0;
+    n = 0;
+    for(s = s->next; s; s = s->next) {
+        if (++n > INLINE_PARAMS_MAX)
+            return 0;
+    }
+    if (copy) {
+        n = tok_str_len(st, str) * sizeof(int);
+        p = arena_malloc(st, n);
+        memcpy(p, str, n);
+        str = p;
+    }
+    if ((st->nb_inline_funcs & (st->nb_inline_funcs - 1)) == 0)
+        st->inline_funcs = arena_realloc(st, st->inline_funcs,
+                                         st->nb_inline_funcs * sizeof(InlineFunc),
+                                         (st->nb_inline_funcs ? st->nb_inline_funcs * 2 : 1) *
+                                         sizeof(InlineFunc));
+    f = &st->inline_funcs[st->nb_inline_funcs++];
+    f->sym = sym;
+    f->str = str;
+    f->active = 0;
+    return 1;
+}
+
+/* the record of 'sym' if a call to it can be inlined here */
+static InlineFunc *inline_find(TCCState *st, Sym *sym)
+{
+    InlineFunc *f;
+
+    if ((sym->type.t & (VT_STATIC | VT_BTYPE)) != (VT_STATIC | VT_FUNC) ||
+        !st->cur_text_section || !st->local_stack || st->const_wanted ||
+        (st->unget_buffer_enabled && *st->macro_ptr != 0) ||
+        st->inline_depth >= INLINE_DEPTH_MAX)
+        return NULL;
+    for(f = st->inline_funcs + st->nb_inline_funcs; f-- > st->inline_funcs;) {
+        if (f->sym == sym)
+            return f->active ? NULL : f;
+    }
+    return NULL;
+}
+
+/* head of the token table list of the symbol 's', NULL if it has none */
+static Sym **sym_token_head(TCCState *st, Sym *s)
+{
+    TokenSym *ts;
+    int v = s->v;
+
+    if ((v & SYM_FIELD) || (v & ~SYM_STRUCT) >= SYM_FIRST_ANOM)
+        return NULL;
+    ts = st->table_ident[(v & ~SYM_STRUCT) - TOK_IDENT];
+    return (v & SYM_STRUCT) ? &ts->sym_struct : &ts->sym_identifier;
+}
+
+/* parse the arguments of a call to the function of 'f' and generate its
+   body in place of the call. The arguments are stored in new locals
+   named by the parameters, and the body does not see the locals of the
+   caller. */
+static void gen_inline_call(TCCState *st, InlineFunc *f)
+{
+    Sym *s, *sa, *top, *l, **hidden, **ps;
+    CType type, saved_func_vt;
+    SValue ret;
+    ParseState saved_parse_state;
+    int addr[INLINE_PARAMS_MAX];
+    int nb_args, nb_hidden, size, align, saved_rsym, i;
+
+    s = f->sym->type.ref;
+    if (st->unget_buffer_enabled) {
+        /* leave the buffer of unget_tok(), now empty, as next() would */
+        st->macro_ptr = st->unget_saved_macro_ptr;
+        st->unget_buffer_enabled = 0;
+    }
+    skip(st, '(');
+    sa = s->next;
+    nb_args = 0;
+    if (st->tok != ')') {
+        for(;;) {
+            expr_eq(st);
+            gfunc_param_typed(st, s, sa);
+            type = sa->type;
+            type.t &= ~VT_CONSTANT;
+            size = type_size(st, &type, &align);
+            st->loc = (st->loc - size) & -align;
+            func_local(st, st->loc, size, &type);
+            addr[nb_args++] = st->loc;
+            vset(st, &type, VT_LOCAL | lvalue_type(st, type.t), st->loc);
+            vswap(st);
+            vstore(st);
+            vpop(st);
+            sa = sa->next;
+            if (st->tok == ')')
+                break;
+            skip(st, ',');
+        }
+    }
+    if (sa)
+        tcc_error(st, "too few arguments to function");
+    skip(st, ')');
+    /* the body may use any register */
+    save_regs(st, 0);
+
+    nb_hidden = 0;
+    for(l = st->local_stack; l; l = l->prev)
+        nb_hidden++;
+    hidden = tcc_malloc(st, (nb_hidden + 1) * sizeof(Sym *));
+    nb_hidden = 0;
+    for(l = st->local_stack; l; l = l->prev) {
+        ps = sym_token_head(st, l);
+        if (ps && *ps == l) {
+            *ps = l->prev_tok;
+            hidden[nb_hidden++] = l;
+        }
+    }
+    top = st->local_stack;
+    for(sa = s->next, i = 0; sa; sa = sa->next, i++)
+        sym_push(st, sa->v & ~SYM_FIELD, &sa->type,
+                 VT_LOCAL | lvalue_type(st, sa->type.t), addr[i]);
+
+    saved_func_vt = st->func_vt;
+    saved_rsym = st->rsym;
+    st->func_vt = s->type;
+    st->rsym = 0;
+    f->active = 1;
+    st->inline_depth++;
+    save_parse_state(st, &saved_parse_state);
+    st->macro_ptr = f->str;
+    next(st);
+    block(st, NULL, NULL, NULL, 0);
+    restore_parse_state(st, &saved_parse_state);
+    gsym(st, st->rsym);
+    st->inline_depth--;
+    f->active = 0;
+    st->rsym = saved_rsym;
+    st->func_vt = saved_func_vt;
+
+    sym_pop(st, &st->local_stack, top);
+    while (nb_hidden > 0) {
+        l = hidden[--nb_hidden];
+        *sym_token_head(st, l) = l;
     }
-    funcname = ""; /* for safety */
-    func_vt.t = VT_VOID; /* for safety */
-    ind = 0; /* for safety */
+    ckfree((char *)hidden);
+
+    func_ret_value(st, &ret, &s->type);
+    vsetc(st, &ret.type, ret.r, &ret.c);
+    st->vtop->r2 = ret.r2;
 }
 
 static void gen_inline_functions(TCCState *st)
@@ -8217,7 +9641,7 @@ static void gen_inline_functions(TCCState *st)
     /* iterate while inline function are referenced */
     for(;;) {
         inline_generated = 0;
-        for(sym = global_stack; sym != NULL; sym = sym->prev) {
+        for(sym = st->global_stack; sym != NULL; sym = sym->prev) {
             type = &sym->type;
             if (((type->t & VT_BTYPE) == VT_FUNC) &&
                 (type->t & (VT_STATIC | VT_INLINE)) == 
@@ -8229,11 +9653,11 @@ static void gen_inline_functions(TCCState *st)
                 sym->r = VT_SYM | VT_CONST;
                 type->t &= ~VT_INLINE;
 
-                macro_ptr = str;
+                st->macro_ptr = str;
                 next(st);
-                cur_text_section = text_section;
+                st->cur_text_section = st->text_section;
                 gen_function(st, sym);
-                macro_ptr = NULL; /* fail safe */
+                st->macro_ptr = NULL; /* fail safe */
 
                 tok_str_free(st, str);
                 inline_generated = 1;
@@ -8244,7 +9668,7 @@ static void gen_inline_functions(TCCState *st)
     }
 
     /* free all remaining inline function tokens */
-    for(sym = global_stack; sym != NULL; sym = sym->prev) {
+    for(sym = st->global_stack; sym != NULL; sym = sym->prev) {
         type = &sym->type;
         if (((type->t & VT_BTYPE) == VT_FUNC) &&
             (type->t & (VT_STATIC | VT_INLINE)) == 
@@ -8259,34 +9683,35 @@ static void gen_inline_functions(TCCState *st)
 /* 'l' is VT_LOCAL or VT_CONST to define default storage type */
 static void decl(TCCState *st, int l)
 {
-    int v, has_init, r;
+    int v, has_init, r, *str, inlinable;
     CType type, btype;
     Sym *sym;
     AttributeDef ad;
+    ParseState saved_parse_state;
     
     while (1) {
         if (!parse_btype(st, &btype, &ad)) {
             /* skip redundant ';' */
             /* XXX: find more elegant solution */
-            if (tok == ';') {
+            if (st->tok == ';') {
                 next(st);
                 continue;
             }
             if (l == VT_CONST &&
-                (tok == TOK_ASM1 || tok == TOK_ASM2 || tok == TOK_ASM3)) {
+                (st->tok == TOK_ASM1 || st->tok == TOK_ASM2 || st->tok == TOK_ASM3)) {
                 /* global asm block */
                 asm_global_instr(st);
                 continue;
             }
             /* special test for old K&R protos without explicit int
                type. Only accepted when defining global data */
-            if (l == VT_LOCAL || tok < TOK_DEFINE)
+            if (l == VT_LOCAL || st->tok < TOK_DEFINE)
                 break;
             btype.t = VT_INT;
         }
         if (((btype.t & VT_BTYPE) == VT_ENUM ||
              (btype.t & VT_BTYPE) == VT_STRUCT) && 
-            tok == ';') {
+            st->tok == ';') {
             /* we accept no variable after */
             next(st);
             continue;
@@ -8311,7 +9736,7 @@ static void decl(TCCState *st, int l)
 
             /* Open curly bracket here can only be a function body, because
                struct and union contents are handled by parse_btype(st) above. */
-            if (tok == '{') {
+            if (st->tok == '{') {
                 if (l == VT_LOCAL)
                    tcc_error(st, "cannot use local functions");
                 if ((type.t & VT_BTYPE) != VT_FUNC)
@@ -8355,40 +9780,33 @@ static void decl(TCCState *st, int l)
                    the compilation unit only if they are used */
                 if ((type.t & (VT_INLINE | VT_STATIC)) == 
                     (VT_INLINE | VT_STATIC)) {
-                    TokenString func_str;
-                    int block_level;
-                           
-                    tok_str_new(st, &func_str);
-                    
-                    block_level = 0;
-                    for(;;) {
-                        int t;
-                        if (tok == TOK_EOF)
-                           tcc_error(st, "unexpected end of file");
-                        tok_str_add_tok(st, &func_str);
-                        t = tok;
-                        next(st);
-                        if (t == '{') {
-                            block_level++;
-                        } else if (t == '}') {
-                            block_level--;
-                            if (block_level == 0)
-                                break;
-                        }
-                    }
-                    tok_str_add(st, &func_str, -1, 0);
-                    tok_str_add(st, &func_str, 0, 0);
-                    sym->r = (int)func_str.str;
+                    str = func_body_tokens(st, &inlinable);
+                    sym->r = (long)str;
+                    if (inlinable)
+                        inline_add(st, sym, str, 1);
                 } else {
                     /* compute text section */
-                    cur_text_section = ad.section;
-                    if (!cur_text_section)
-                        cur_text_section = text_section;
+                    st->cur_text_section = ad.section;
+                    if (!st->cur_text_section)
+                        st->cur_text_section = st->text_section;
                     sym->r = VT_SYM | VT_CONST;
-                    gen_function(st, sym);
+                    if (st->optimize && (type.t & VT_STATIC)) {
+                        /* keep the body of a small static function
+                           for inlining its calls */
+                        str = func_body_tokens(st, &inlinable);
+                        save_parse_state(st, &saved_parse_state);
+                        st->macro_ptr = str;
+                        next(st);
+                        gen_function(st, sym);
+                        restore_parse_state(st, &saved_parse_state);
+                        if (!inlinable || !inline_add(st, sym, str, 0))
+                            tok_str_free(st, str);
+                    } else {
+                        gen_function(st, sym);
+                    }
 #ifdef WIN32
                     if (ad.dllexport) {
-                        ((Elf32_Sym *)symtab_section->data)[sym->c].st_other |= 1;
+                        ((ElfW(Sym) *)st->symtab_section->data)[sym->c].st_other |= 1;
                     }
 #endif
                 }
@@ -8412,7 +9830,7 @@ static void decl(TCCState *st, int l)
                     r = 0;
                     if (!(type.t & VT_ARRAY))
                         r |= lvalue_type(st, type.t);
-                    has_init = (tok == '=');
+                    has_init = (st->tok == '=');
                     if ((btype.t & VT_EXTERN) || 
                         ((type.t & VT_ARRAY) && (type.t & VT_STATIC) &&
                          !has_init && l == VT_CONST && type.ref->c < 0)) {
@@ -8433,7 +9851,7 @@ static void decl(TCCState *st, int l)
                                                has_init, v, l);
                     }
                 }
-                if (tok != ',') {
+                if (st->tok != ',') {
                     skip(st, ';');
                     break;
                 }
@@ -8451,54 +9869,64 @@ static void preprocess_init(TCCState *st)
     /* XXX: move that before to avoid having to initialize
        file->ifdef_stack_ptr ? */
     st->ifdef_stack_ptr = st->ifdef_stack;
-    file->ifdef_stack_ptr = st->ifdef_stack_ptr;
+    st->file->ifdef_stack_ptr = st->ifdef_stack_ptr;
 
-    vtop = vstack;
+    st->vtop = st->vstack;
     st->pack_stack[0] = 0;
     st->pack_stack_ptr = st->pack_stack;
+
+    st->include_dirs = NULL;
+    st->included_files = NULL;
+    st->nb_included_files = 0;
+
+    expand_buffers_reset(st);
 }
 
 /* compile the C file opened in 'file'. Return non zero if errors. */
 static int tcc_compile(TCCState *st)
 {
-    Sym *define_start;
+    Sym *define_start, *global_start;
+    unsigned long symtab_start;
     char buf[512];
     volatile int section_sym;
 
     preprocess_init(st);
 
-    funcname = "";
-    anon_sym = SYM_FIRST_ANOM; 
+    st->funcname = "";
+    st->anon_sym = SYM_FIRST_ANOM; 
+    st->inline_funcs = NULL;
+    st->nb_inline_funcs = 0;
+    st->inline_depth = 0;
 
     /* file info: full path + filename */
     section_sym = 0; /* avoid warning */
-    if (do_debug) {
-        section_sym = put_elf_sym(st, symtab_section, 0, 0, 
-                                  ELF32_ST_INFO(STB_LOCAL, STT_SECTION), 0, 
-                                  text_section->sh_num, NULL);
+    if (st->do_debug) {
+        section_sym = put_elf_sym(st, st->symtab_section, 0, 0, 
+                                  ELFW(ST_INFO)(STB_LOCAL, STT_SECTION), 0, 
+                                  st->text_section->sh_num, NULL);
         getcwd(buf, sizeof(buf));
-        pstrcat(st, buf, sizeof(buf), "/");
+        pstrcat(buf, sizeof(buf), "/");
         put_stabs_r(st, buf, N_SO, 0, 0, 
-                    text_section->data_offset, text_section, section_sym);
-        put_stabs_r(st, file->filename, N_SO, 0, 0, 
-                    text_section->data_offset, text_section, section_sym);
+                    st->text_section->data_offset, st->text_section, section_sym);
+        put_stabs_r(st, st->file->filename, N_SO, 0, 0, 
+                    st->text_section->data_offset, st->text_section, section_sym);
     }
     /* an elf symbol of type STT_FILE must be put so that STB_LOCAL
        symbols can be safely used */
-    put_elf_sym(st, symtab_section, 0, 0, 
-                ELF32_ST_INFO(STB_LOCAL, STT_FILE), 0, 
-                SHN_ABS, file->filename);
+    put_elf_sym(st, st->symtab_section, 0, 0, 
+                ELFW(ST_INFO)(STB_LOCAL, STT_FILE), 0, 
+                SHN_ABS, st->file->filename);
 
     /* define some often used types */
 
     
-    int_type.t = VT_INT;
+    st->int_type.t = VT_INT;
 
-    char_pointer_type.t = VT_BYTE;
-    mk_pointer(st, &char_pointer_type);
+    st->char_pointer_type.t = VT_BYTE;
+    mk_pointer(st, &st->char_pointer_type);
 
-    func_old_type.t = VT_FUNC;
-    func_old_type.ref = sym_push(st, SYM_FIELD, &int_type, FUNC_CDECL, FUNC_OLD);
+    st->func_old_type.t = VT_FUNC;
+    st->func_old_type.ref = sym_push(st, SYM_FIELD, &st->int_type, FUNC_CDECL, FUNC_OLD);
 
 #if defined(TCC_ARM_EABI) && defined(TCC_ARM_VFP)
     float_type.t = VT_FLOAT;
@@ -8515,7 +9943,7 @@ static int tcc_compile(TCCState *st)
     {
         Sym *st;
 
-        p = anon_sym++;
+        p = st->anon_sym++;
         sym = sym_push(st, p, mk_pointer(st, VT_VOID), FUNC_CDECL, FUNC_NEW);
         st = sym_push(st, SYM_FIELD, VT_UNSIGNED | VT_INT, 0, 0);
         st->next = NULL;
@@ -8524,34 +9952,54 @@ static int tcc_compile(TCCState *st)
     }
 #endif
 
-    define_start = define_stack;
+    define_start = st->define_stack;
+    global_start = st->global_stack;
+    symtab_start = st->symtab_section->data_offset;
 
+    st->arena_enabled = 1;
     if (setjmp(st->error_jmp_buf) == 0) {
         st->nb_errors = 0;
         st->error_set_jmp_enabled = 1;
 
-        fch = file->buf_ptr[0];
-        next_tok_flags = TOK_FLAG_BOW | TOK_FLAG_BOL | TOK_FLAG_BOF;
-        parse_flags = PARSE_FLAG_PREPROCESS | PARSE_FLAG_TOK_NUM;
+        if (st->pch)
+            pch_restore(st, st->pch);
+        st->fch = st->file->buf_ptr[0];
+        st->next_tok_flags = TOK_FLAG_BOW | TOK_FLAG_BOL | TOK_FLAG_BOF;
+        st->parse_flags = PARSE_FLAG_PREPROCESS | PARSE_FLAG_TOK_NUM;
         next(st);
         decl(st, VT_CONST);
-        if (tok != TOK_EOF) expect(st, "declaration");
+        if (st->tok != TOK_EOF) expect(st, "declaration");
+        if (st->pch_out)
+            pch_save(st, st->pch_out, define_start, global_start, symtab_start);
 
         /* end of translation unit info */
-        if (do_debug) {
-            put_stabs_r(st, NULL, N_SO, 0, 0, text_section->data_offset,
-                        text_section, section_sym);
+        if (st->do_debug) {
+            put_stabs_r(st, NULL, N_SO, 0, 0, st->text_section->data_offset,
+                        st->text_section, section_sym);
         }
     }
     st->error_set_jmp_enabled = 0;
 
+    /* close the include files an error left open */
+    while (st->include_stack_ptr > st->include_stack) {
+        tcc_close(st, st->file);
+        st->include_stack_ptr--;
+        st->file = *st->include_stack_ptr;
+    }
+
     /* reset define stack, but leave -Dsymbols (may be incorrect if
        they are undefined) */
     free_defines(st, define_start); 
 
     gen_inline_functions(st);
 
-    sym_pop(st, &global_stack, NULL);
+    sym_pop(st, &st->global_stack, NULL);
+
+    /* an error may have left a macro being expanded */
+    st->macro_ptr = NULL;
+    st->unget_buffer_enabled = 0;
+    st->arena_enabled = 0;
+    arena_reset(st);
 
     return st->nb_errors != 0 ? -1 : 0;
 }
@@ -8565,27 +10013,27 @@ static int tcc_preprocess(TCCState *st)
 
     preprocess_init(st);
 
-    define_start = define_stack;
+    define_start = st->define_stack;
 
-    fch = file->buf_ptr[0];
-    tok_flags = TOK_FLAG_BOL | TOK_FLAG_BOF;
-    parse_flags = PARSE_FLAG_ASM_COMMENTS | PARSE_FLAG_PREPROCESS |
+    st->fch = st->file->buf_ptr[0];
+    st->tok_flags = TOK_FLAG_BOL | TOK_FLAG_BOF;
+    st->parse_flags = PARSE_FLAG_ASM_COMMENTS | PARSE_FLAG_PREPROCESS |
         PARSE_FLAG_LINEFEED;
     last_is_space = 1;
     next(st);
     for(;;) {
-        if (tok == TOK_EOF)
+        if (st->tok == TOK_EOF)
             break;
         if (!last_is_space) {
             fputc(' ', st->outfile);
         }
-        fputs(get_tok_str(st, tok, &tokc), st->outfile);
-        if (tok == TOK_LINEFEED) {
+        fputs(get_tok_str(st, st->tok, &st->tokc), st->outfile);
+        if (st->tok == TOK_LINEFEED) {
             last_is_space = 1;
             /* XXX: suppress that hack */
-            parse_flags &= ~PARSE_FLAG_LINEFEED;
+            st->parse_flags &= ~PARSE_FLAG_LINEFEED;
             next(st);
-            parse_flags |= PARSE_FLAG_LINEFEED;
+            st->parse_flags |= PARSE_FLAG_LINEFEED;
         } else {
             last_is_space = 0;
             next(st);
@@ -8598,34 +10046,47 @@ static int tcc_preprocess(TCCState *st)
 }
 
 #ifdef LIBTCC
-int tcc_compile_string(TCCState *s, const char *str)
+int tcc_compile_buffer(TCCState *s, const char *buf, int len)
 {
     BufferedFile bf1, *bf = &bf1;
-    int ret, len;
-    char *buf;
+    const uint8_t *p;
+    int ret;
 
-    /* init file structure */
+    /* init file structure: the lexer reads 'buf' in place up to its
+       last CH_EOB char, which serves as end of buffer mark. The bytes
+       from there are copied to bf->buffer as with a file. */
     bf->fd = NULL;
-    /* XXX: avoid copying */
-    len = strlen(str);
-    buf = tcc_malloc(s, len + 1);
-    if (!buf)
-        return -1;
-    memcpy(buf, str, len);
-    buf[len] = CH_EOB;
-    bf->buf_ptr = buf;
-    bf->buf_end = buf + len;
-    pstrcpy(s,  bf->filename, sizeof(bf->filename), "<string>");
+    bf->map = NULL;
+    p = (const uint8_t *)buf + len;
+    while (p > (const uint8_t *)buf && p[-1] != CH_EOB)
+        p--;
+    if (p > (const uint8_t *)buf) {
+        bf->buf_ptr = (uint8_t *)buf;
+        bf->buf_end = (uint8_t *)p - 1;
+        bf->src_ptr = p - 1;
+    } else {
+        bf->buf_ptr = bf->buffer;
+        bf->buf_end = bf->buffer;
+        bf->buffer[0] = CH_EOB;
+        bf->src_ptr = p;
+    }
+    bf->src_end = (const uint8_t *)buf + len;
+    s->total_bytes += bf->src_ptr - (const uint8_t *)buf;
+    pstrcpy(bf->filename, sizeof(bf->filename), "<string>");
     bf->line_num = 1;
-    file = bf;
+    bf->inc_file = NULL;
+    s->file = bf;
     
     ret = tcc_compile(s);
     
-    ckfree((char *)buf);
-
     /* currently, no need to close */
     return ret;
 }
+
+int tcc_compile_string(TCCState *s, const char *str)
+{
+    return tcc_compile_buffer(s, str, strlen(str));
+}
 #endif
 
 /* define a preprocessor symbol. A value can also be provided with the '=' operator */
@@ -8633,29 +10094,31 @@ void tcc_define_symbol(TCCState *st, const char *sym, const char *value)
 {
     BufferedFile bf1, *bf = &bf1;
 
-    pstrcpy(st,  bf->buffer, IO_BUF_SIZE, sym);
-    pstrcat(st, bf->buffer, IO_BUF_SIZE, " ");
+    pstrcpy(bf->buffer, IO_BUF_SIZE, sym);
+    pstrcat(bf->buffer, IO_BUF_SIZE, " ");
     /* default value */
     if (!value) 
         value = "1";
-    pstrcat(st, bf->buffer, IO_BUF_SIZE, value);
+    pstrcat(bf->buffer, IO_BUF_SIZE, value);
     
     /* init file structure */
     bf->fd = NULL;
+    bf->src_ptr = bf->src_end = NULL;
     bf->buf_ptr = bf->buffer;
     bf->buf_end = bf->buffer + strlen(bf->buffer);
     *bf->buf_end = CH_EOB;
     bf->filename[0] = '\0';
     bf->line_num = 1;
-    file = bf;
+    bf->inc_file = NULL;
+    st->file = bf;
     
     st->include_stack_ptr = st->include_stack;
 
     /* parse with define parser */
-    fch = file->buf_ptr[0];
+    st->fch = st->file->buf_ptr[0];
     next_nomacro(st);
     parse_define(st);
-    file = NULL;
+    st->file = NULL;
 }
 
 /* undefine a preprocessor symbol */
@@ -8667,7 +10130,7 @@ void tcc_undefine_symbol(TCCState *st, const char *sym)
     s = define_find(st, ts->tok);
     /* undefine symbol by putting an invalid name */
     if (s)
-        define_undef(s);
+        define_undef(st, s);
 }
 
 #ifdef CONFIG_TCC_ASM
@@ -8690,6 +10153,12 @@ static void asm_global_instr(TCCState *st)
 
 #include "tccelf.c"
 
+#ifdef TCC_TARGET_I386
+#include "i386/i386-opt.c"
+#endif
+
+#include "tccpch.c"
+
 #ifdef TCC_TARGET_COFF
 #include "tcccoff.c"
 #endif
@@ -8712,10 +10181,30 @@ int tcc_relocate(TCCState *st)
     tcc_add_runtime(st);
 #endif
 
-    relocate_common_syms();
+    relocate_common_syms(st);
     tcc_add_linker_symbols(st);
     build_got_entries(st);
     
+#ifdef TCC_TARGET_X86_64
+    /* the sections are relocated for the block they are then copied
+       to, so that they are in reach of each other */
+    if (!alloc_runtime_mem(st)) {
+        error_noabort(st, "memory full");
+        return -1;
+    }
+    relocate_syms(st, 1);
+    if (st->nb_errors == 0) {
+        for(i = 1; i < st->nb_sections; i++) {
+            s = st->sections[i];
+            if (s->reloc)
+                relocate_section(st, s);
+        }
+    }
+    move_runtime_mem(st, st->nb_errors == 0);
+    if (st->nb_errors != 0)
+        return -1;
+    return 0;
+#else
     /* compute relocation address : section are relocated in place. We
        also alloc the bss space */
     for(i = 1; i < st->nb_sections; i++) {
@@ -8763,6 +10252,7 @@ int tcc_relocate(TCCState *st)
         }
     }
     return 0;
+#endif
 }
 
 /* launch the compiled program with the given arguments */
@@ -8776,11 +10266,11 @@ int tcc_run(TCCState *st, int argc, char **argv)
     prog_main = tcc_get_symbol_err(st, "main");
     
 #if 0
-    if (do_bounds_check) {
+    if (st->do_bounds_check) {
         void (*bound_init)(void);
 
         /* set error function */
-        rt_bound_error_msg = (void *)tcc_get_symbol_err(st, 
+        st->rt_bound_error_msg = (void *)tcc_get_symbol_err(st, 
                                                         "__bound_error_msg");
 
         /* XXX: use .init section so that it also work in binary ? */
@@ -8791,30 +10281,17 @@ int tcc_run(TCCState *st, int argc, char **argv)
     return (*prog_main)(argc, argv);
 }
 
-TCCState *tcc_new(Tcl_Obj * libpath)
+/* parse the keywords and the predefined macros into 's' */
+static void tcc_template_init(TCCState *s)
 {
     const char *p, *r;
-    TCCState *s;
-    TokenSym *ts;
-    int i, c;
-
-    s = tcc_mallocz(NULL, sizeof(TCCState));
-    if (!s)
-        return NULL;
-    s->output_type = TCC_OUTPUT_MEMORY;
-
-    Tcl_IncrRefCount(libpath);
-    s->tcc_lib_path = libpath ;
+    int c;
 
-    /* init isid table */
-    for(i=0;i<256;i++)
-        isidnum_table[i] = isid(s, i) || isnum(s, i);
+    s->gnu_ext = 1;
+    s->tcc_ext = 1;
 
     /* add all tokens */
-    table_ident = NULL;
-    memset(hash_ident, 0, TOK_HASH_SIZE * sizeof(TokenSym *));
-    
-    tok_ident = TOK_IDENT;
+    s->tok_ident = TOK_IDENT;
     p = tcc_keywords;
     while (*p) {
         r = p;
@@ -8823,7 +10300,7 @@ TCCState *tcc_new(Tcl_Obj * libpath)
             if (c == '\0')
                 break;
         }
-        ts = tok_alloc(s, p, r - p - 1);
+        tok_alloc(s, p, r - p - 1);
         p = r;
     }
 
@@ -8840,6 +10317,14 @@ TCCState *tcc_new(Tcl_Obj * libpath)
 #if defined(TCC_TARGET_I386)
     tcc_define_symbol(s, "__i386__", NULL);
 #endif
+#if defined(TCC_TARGET_X86_64)
+    tcc_define_symbol(s, "__x86_64__", NULL);
+    tcc_define_symbol(s, "__x86_64", NULL);
+    tcc_define_symbol(s, "__amd64__", NULL);
+    tcc_define_symbol(s, "__amd64", NULL);
+    tcc_define_symbol(s, "__LP64__", NULL);
+    tcc_define_symbol(s, "_LP64", NULL);
+#endif
 #if defined(TCC_TARGET_ARM)
     tcc_define_symbol(s, "__ARM_ARCH_4__", NULL);
     tcc_define_symbol(s, "__arm_elf__", NULL);
@@ -8858,13 +10343,83 @@ TCCState *tcc_new(Tcl_Obj * libpath)
     tcc_define_symbol(s, "__TINYC__", NULL);
 
     /* tiny C & gcc defines */
+#ifdef TCC_TARGET_X86_64
+    tcc_define_symbol(s, "__SIZE_TYPE__", "unsigned long");
+    tcc_define_symbol(s, "__PTRDIFF_TYPE__", "long");
+#else
     tcc_define_symbol(s, "__SIZE_TYPE__", "unsigned int");
     tcc_define_symbol(s, "__PTRDIFF_TYPE__", "int");
+#endif
 #ifdef WIN32
     tcc_define_symbol(s, "__WCHAR_TYPE__", "unsigned short");
 #else
     tcc_define_symbol(s, "__WCHAR_TYPE__", "int");
 #endif
+}
+
+/* give 's' the identifiers and the defines of the template 't', in the
+   same order and with the same hash table */
+static void tcc_template_copy(TCCState *s, TCCState *t)
+{
+    TokenSym *ts, *ts1;
+    Sym **tab, *d, *d1;
+    int i, n;
+
+    n = t->tok_ident - TOK_IDENT;
+    s->table_ident = tcc_malloc(s, ((n + TOK_ALLOC_INCR - 1) & ~(TOK_ALLOC_INCR - 1)) *
+                                sizeof(TokenSym *));
+    for(i = 0; i < n; i++) {
+        ts = t->table_ident[i];
+        ts1 = tcc_malloc(s, sizeof(TokenSym) + ts->len);
+        memcpy(ts1, ts, sizeof(TokenSym) + ts->len);
+        ts1->sym_define = NULL;
+        s->table_ident[i] = ts1;
+    }
+    s->hash_ident = tcc_malloc(s, (t->hash_ident_mask + 1) * sizeof(TokenHash));
+    memcpy(s->hash_ident, t->hash_ident, (t->hash_ident_mask + 1) * sizeof(TokenHash));
+    s->hash_ident_mask = t->hash_ident_mask;
+    s->tok_ident = t->tok_ident;
+
+    /* predefined macros have no arguments, push them bottom first */
+    n = 0;
+    for(d = t->define_stack; d; d = d->prev)
+        n++;
+    tab = tcc_malloc(s, (n + 1) * sizeof(Sym *));
+    i = n;
+    for(d = t->define_stack; d; d = d->prev)
+        tab[--i] = d;
+    for(i = 0; i < n; i++) {
+        d = tab[i];
+        d1 = sym_push2(s, &s->define_stack, d->v, d->type.t, 0);
+        if (d->c)
+            d1->c = (long)tok_str_dup(s, (int *)d->c);
+        s->table_ident[d->v - TOK_IDENT]->sym_define = d1;
+    }
+    ckfree((char *)tab);
+}
+
+/* fill a zeroed state whose library path is set */
+static void tcc_state_init(TCCState *s)
+{
+    int i;
+
+    s->output_type = TCC_OUTPUT_MEMORY;
+    s->gnu_ext = 1;
+    s->tcc_ext = 1;
+    s->num_callers = 6;
+
+    /* init isid table and the template */
+    Tcl_MutexLock(&tcc_init_mutex);
+    if (!tcc_tables_initialized) {
+        for(i=0;i<256;i++)
+            isidnum_table[i] = isid(s, i) || isnum(s, i);
+        tcc_template = tcc_mallocz(NULL, sizeof(TCCState));
+        tcc_template_init(tcc_template);
+        tcc_tables_initialized = 1;
+    }
+    Tcl_MutexUnlock(&tcc_init_mutex);
+
+    tcc_template_copy(s, tcc_template);
     
     /* default library paths */
     {
@@ -8875,6 +10430,10 @@ TCCState *tcc_new(Tcl_Obj * libpath)
     }
 #ifndef WIN32
     tcc_add_library_path(s, "/usr/local/lib");
+#ifdef TCC_TARGET_X86_64
+    tcc_add_library_path(s, "/usr/lib/x86_64-linux-gnu");
+    tcc_add_library_path(s, "/lib/x86_64-linux-gnu");
+#endif
     tcc_add_library_path(s, "/usr/lib");
     tcc_add_library_path(s, "/lib");
 #endif
@@ -8883,15 +10442,15 @@ TCCState *tcc_new(Tcl_Obj * libpath)
     dynarray_add(s, (void ***)&s->sections, &s->nb_sections, NULL);
 
     /* create standard sections */
-    text_section = new_section(s, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR);
-    data_section = new_section(s, ".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE);
-    bss_section = new_section(s, ".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE);
+    s->text_section = new_section(s, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR);
+    s->data_section = new_section(s, ".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE);
+    s->bss_section = new_section(s, ".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE);
 
     /* symbols are always generated for linking stage */
-    symtab_section = new_symtab(s, ".symtab", SHT_SYMTAB, 0,
+    s->symtab_section = new_symtab(s, ".symtab", SHT_SYMTAB, 0,
                                 ".strtab",
                                 ".hashtab", SHF_PRIVATE); 
-    strtab_section = symtab_section->link;
+    s->strtab_section = s->symtab_section->link;
     
     /* private symbol table for dynamic symbols */
     s->dynsymtab_section = new_symtab(s, ".dynsymtab", SHT_SYMTAB, SHF_PRIVATE,
@@ -8906,37 +10465,74 @@ TCCState *tcc_new(Tcl_Obj * libpath)
     /* XXX: currently the PE linker is not ready to support that */
     s->leading_underscore = 1;
 #endif
+}
+
+TCCState *tcc_new(Tcl_Obj * libpath)
+{
+    TCCState *s;
+
+    s = tcc_mallocz(NULL, sizeof(TCCState));
+    if (!s)
+        return NULL;
+    Tcl_IncrRefCount(libpath);
+    s->tcc_lib_path = libpath ;
+    tcc_state_init(s);
     return s;
 }
 
-void tcc_delete(TCCState *st)
+/* free everything 'st' allocated but the state itself and its library
+   path. The code and data of a relocated state stay where they are, as
+   the commands created from them still use them. */
+static void tcc_state_free(TCCState *st)
 {
-    /* this leaks but allows you to reuse handles without crashing the process */
+    Section *s;
     int i, n;
 
     /* free -D defines */
     free_defines(st, NULL);
 
     /* free tokens */
-    if(0) {
-    n = tok_ident - TOK_IDENT;
+    n = st->tok_ident - TOK_IDENT;
     for(i = 0; i < n; i++)
-        ckfree((char *)(table_ident[i]));
-    ckfree((char *)table_ident);
+        ckfree((char *)(st->table_ident[i]));
+    ckfree((char *)st->table_ident);
+    ckfree((char *)st->hash_ident);
 
-    /* free all sections */
+    /* free symbols, whatever the stack they are in */
+    for(i = 0; i < st->nb_sym_pools; i++)
+        ckfree((char *)(st->sym_pools[i]));
+    ckfree((char *)(st->sym_pools));
+
+    arena_reset(st);
+    ckfree((char *)st->arena);
+
+    for(i = 0; i < st->nb_expand_buffers; i++)
+        ckfree((char *)st->expand_buffers[i]);
+    ckfree((char *)st->expand_buffers);
 
+    cstr_free(st, &st->tokcstr);
+    cstr_free(st, &st->tok_str_cstr);
 
-        free_section(st, symtab_section->hash);
+    /* free all sections */
+    free_section(st, st->symtab_section->hash);
 
-        free_section(st, st->dynsymtab_section->hash);
-        free_section(st, st->dynsymtab_section->link);
-        free_section(st, st->dynsymtab_section);
+    free_section(st, st->dynsymtab_section->hash);
+    free_section(st, st->dynsymtab_section->link);
+    free_section(st, st->dynsymtab_section);
 
-        for(i = 1; i < st->nb_sections; i++)
-            free_section(st, st->sections[i]);
-        ckfree((char *)(st->sections));
+    for(i = 1; i < st->nb_sections; i++) {
+        s = st->sections[i];
+        if (st->relocated && (s->sh_flags & SHF_ALLOC))
+            s->data = NULL;
+        free_section(st, s);
     }
+    ckfree((char *)(st->sections));
+
+#ifdef WIN32
+    /* the slots of imported symbols are used by relocated code */
+    if (!st->relocated)
+        ckfree((char *)(st->pe_imp));
+#endif
     
     /* free loaded dlls array */
     for(i = 0; i < st->nb_loaded_dlls; i++)
@@ -8961,15 +10557,56 @@ void tcc_delete(TCCState *st)
         ckfree((char *)(st->sysinclude_paths[i]));
     ckfree((char *)(st->sysinclude_paths));
 
+    for(i = 0; i < st->nb_opened_headers; i++)
+        ckfree((char *)(st->opened_headers[i]));
+    ckfree((char *)(st->opened_headers));
+}
+
+void tcc_delete(TCCState *st)
+{
+    tcc_state_free(st);
     ckfree((char *)st);
 }
 
+/* free what 'st' compiled and start again with the options of a new
+   state: the library path, the error callback and the output type are
+   kept. */
+void tcc_reset(TCCState *st)
+{
+    Tcl_Obj *libpath;
+    void *error_opaque;
+    void (*error_func)(void *opaque, const char *msg);
+    int output_type;
+
+    libpath = st->tcc_lib_path;
+    error_opaque = st->error_opaque;
+    error_func = st->error_func;
+    output_type = st->output_type;
+
+    tcc_state_free(st);
+    memset(st, 0, sizeof(TCCState));
+    st->tcc_lib_path = libpath;
+    tcc_state_init(st);
+    tcc_set_error_func(st, error_opaque, error_func);
+    tcc_set_output_type(st, output_type);
+}
+
+/* forget where the headers were found: the include paths changed */
+static void include_paths_reset(TCCState *st)
+{
+    int i;
+
+    for(i = 0; i < st->nb_cached_includes; i++)
+        st->cached_includes[i]->generation = -1;
+}
+
 int tcc_add_include_path(TCCState *st, const char *pathname)
 {
     char *pathname1;
     
     pathname1 = tcc_strdup(st, pathname);
     dynarray_add(st, (void ***)&st->include_paths, &st->nb_include_paths, pathname1);
+    include_paths_reset(st);
     return 0;
 }
 
@@ -8979,15 +10616,16 @@ int tcc_add_sysinclude_path(TCCState *st, const char *pathname)
     
     pathname1 = tcc_strdup(st, pathname);
     dynarray_add(st, (void ***)&st->sysinclude_paths, &st->nb_sysinclude_paths, pathname1);
+    include_paths_reset(st);
     return 0;
 }
 
 static int tcc_add_file_internal(TCCState *st, const char *filename, int flags)
 {
     const char *ext, *filename1;
-    Elf32_Ehdr ehdr;
+    ElfW(Ehdr) ehdr;
     Tcl_Channel fd;
-    int ret;
+    int ret, source;
     BufferedFile *saved_file;
 
     /* find source file type with extension */
@@ -9000,10 +10638,14 @@ static int tcc_add_file_internal(TCCState *st, const char *filename, int flags)
     if (ext)
         ext++;
 
-    /* open the file */
-    saved_file = file;
-    file = tcc_open(st, filename);
-    if (!file) {
+    /* open the file, sources are read in place if possible */
+    source = (flags & AFF_PREPROCESS) || !ext || !strcmp(ext, "c");
+#ifdef CONFIG_TCC_ASM
+    source = source || !strcmp(ext, "S") || !strcmp(ext, "s");
+#endif
+    saved_file = st->file;
+    st->file = tcc_open(st, filename, source);
+    if (!st->file) {
         if (flags & AFF_PRINT_ERROR) {
             error_noabort(st, "file '%s' not found", filename);
         }
@@ -9027,11 +10669,13 @@ static int tcc_add_file_internal(TCCState *st, const char *filename, int flags)
 #endif
 #ifdef WIN32
     if (!strcmp(ext, "def")) {
-        ret = pe_load_def_file(st, file->fd);
+        ret = pe_load_def_file(st, st->file->fd);
     } else
 #endif
     {
-        fd = file->fd;
+        fd = st->file->fd;
+        /* objects and libraries must be read as is */
+        Tcl_SetChannelOption(NULL, fd, "-translation", "binary");
         /* assume executable format: auto guess file type */
         ret = Tcl_Read(fd, (char *)&ehdr, sizeof(ehdr));
         Tcl_Seek(fd, 0, SEEK_SET);
@@ -9046,7 +10690,7 @@ static int tcc_add_file_internal(TCCState *st, const char *filename, int flags)
             ehdr.e_ident[1] == ELFMAG1 &&
             ehdr.e_ident[2] == ELFMAG2 &&
             ehdr.e_ident[3] == ELFMAG3) {
-            file->line_num = 0; /* do not display line number if error */
+            st->file->line_num = 0; /* do not display line number if error */
             if (ehdr.e_type == ET_REL) {
                 ret = tcc_load_object_file(st, fd, 0);
             } else if (ehdr.e_type == ET_DYN) {
@@ -9070,7 +10714,7 @@ static int tcc_add_file_internal(TCCState *st, const char *filename, int flags)
                 goto fail;
             }
         } else if (memcmp((char *)&ehdr, ARMAG, 8) == 0) {
-            file->line_num = 0; /* do not display line number if error */
+            st->file->line_num = 0; /* do not display line number if error */
             ret = tcc_load_archive(st, fd);
         } else 
 #ifdef TCC_TARGET_COFF
@@ -9089,9 +10733,9 @@ static int tcc_add_file_internal(TCCState *st, const char *filename, int flags)
         }
     }
  the_end:
-    tcc_close(file);
+    tcc_close(st, st->file);
  fail1:
-    file = saved_file;
+    st->file = saved_file;
     return ret;
  fail:
     ret = -1;
@@ -9160,8 +10804,8 @@ int tcc_add_library(TCCState *s, const char *libraryname)
 
 int tcc_add_symbol(TCCState *st, const char *name, unsigned long val)
 {
-    add_elf_sym(st, symtab_section, val, 0, 
-                ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
+    add_elf_sym(st, st->symtab_section, val, 0, 
+                ELFW(ST_INFO)(STB_GLOBAL, STT_NOTYPE), 0,
                 SHN_ABS, name);
     return 0;
 }
@@ -9177,6 +10821,9 @@ int tcc_set_output_type(TCCState *s, int output_type)
         /* XXX: reverse order needed if -isystem support */
 #ifndef WIN32
         tcc_add_sysinclude_path(s, "/usr/local/include");
+#ifdef TCC_TARGET_X86_64
+        tcc_add_sysinclude_path(s, "/usr/include/x86_64-linux-gnu");
+#endif
         tcc_add_sysinclude_path(s, "/usr/include");
 #endif
         snprintf(buf, sizeof(buf), "%s/include", Tcl_GetString(s->tcc_lib_path));
@@ -9189,13 +10836,13 @@ int tcc_set_output_type(TCCState *s, int output_type)
 
     /* if bound checking, then add corresponding sections */
 #if 0
-    if (do_bounds_check) {
+    if (s->do_bounds_check) {
         /* define symbol */
         tcc_define_symbol(s, "__BOUNDS_CHECKING_ON", NULL);
         /* create bounds sections */
-        bounds_section = new_section(s, ".bounds", 
+        s->bounds_section = new_section(s, ".bounds", 
                                      SHT_PROGBITS, SHF_ALLOC);
-        lbounds_section = new_section(s, ".lbounds", 
+        s->lbounds_section = new_section(s, ".lbounds", 
                                       SHT_PROGBITS, SHF_ALLOC);
     }
 #endif
@@ -9205,13 +10852,13 @@ int tcc_set_output_type(TCCState *s, int output_type)
     }
 
     /* add debug sections */
-    if (do_debug) {
+    if (s->do_debug) {
         /* stab symbols */
-        stab_section = new_section(s, ".stab", SHT_PROGBITS, 0);
-        stab_section->sh_entsize = sizeof(Stab_Sym);
-        stabstr_section = new_section(s, ".stabstr", SHT_STRTAB, 0);
-        put_elf_str(s, stabstr_section, "");
-        stab_section->link = stabstr_section;
+        s->stab_section = new_section(s, ".stab", SHT_PROGBITS, 0);
+        s->stab_section->sh_entsize = sizeof(Stab_Sym);
+        s->stabstr_section = new_section(s, ".stabstr", SHT_STRTAB, 0);
+        put_elf_str(s, s->stabstr_section, "");
+        s->stab_section->link = s->stabstr_section;
         /* put first entry */
         put_stabs(s, "", 0, 0, 0, 0);
     }
@@ -9293,6 +10940,8 @@ static const FlagDef flag_defs[] = {
     { offsetof(TCCState, char_is_unsigned), FD_INVERT, "signed-char" },
     { offsetof(TCCState, nocommon), FD_INVERT, "common" },
     { offsetof(TCCState, leading_underscore), 0, "leading-underscore" },
+    { offsetof(TCCState, sse2), 0, "sse2" },
+    { offsetof(TCCState, compile_cache), 0, "compile-cache" },
 };
 
 /* set/reset a flag */
@@ -9302,6 +10951,12 @@ int tcc_set_flag(TCCState *s, const char *flag_name, int value)
                     flag_name, value);
 }
 
+/* set the optimization level */
+void tcc_set_optimize(TCCState *s, int level)
+{
+    s->optimize = level;
+}
+
 /* extract the basename of a file */
 static const char *tcc_basename(const char *name)
 {
@@ -46,6 +46,10 @@
 #else
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
 #endif /* !CONFIG_TCCBOOT */
@@ -75,19 +79,24 @@
 
 /* target selection */
 
-/* default target is I386 */
+/* default target is the host: X86_64 on 64 bit x86 unix, else I386 */
 #if !defined(TCC_TARGET_I386) && !defined(TCC_TARGET_ARM) && \
-    !defined(TCC_TARGET_C67)
+    !defined(TCC_TARGET_C67) && !defined(TCC_TARGET_X86_64)
+#if defined(__x86_64__) && !defined(WIN32)
+#define TCC_TARGET_X86_64
+#else
 #define TCC_TARGET_I386
 #endif
+#endif
 
 #if !defined(WIN32) && !defined(TCC_UCLIBC) && !defined(TCC_TARGET_ARM) && \
-    !defined(TCC_TARGET_C67)
+    !defined(TCC_TARGET_C67) && !defined(TCC_TARGET_X86_64)
 #define CONFIG_TCC_BCHECK /* enable bound checking code */
 #endif
 
 /* define it to include assembler support */
-#if !defined(TCC_TARGET_ARM) && !defined(TCC_TARGET_C67)
+#if !defined(TCC_TARGET_ARM) && !defined(TCC_TARGET_C67) && \
+    !defined(TCC_TARGET_X86_64)
 #define CONFIG_TCC_ASM
 #endif
 
@@ -96,6 +105,23 @@
 #define TCC_TARGET_COFF
 #endif
 
+/* ELF class and relocation format of the target */
+#ifdef TCC_TARGET_X86_64
+#define ELFCLASSW ELFCLASS64
+#define ElfW(type) Elf64_##type
+#define ELFW(type) ELF64_##type
+#define ElfW_Rel ElfW(Rela)
+#define SHT_RELX SHT_RELA
+#define REL_SECTION_FMT ".rela%s"
+#else
+#define ELFCLASSW ELFCLASS32
+#define ElfW(type) Elf32_##type
+#define ELFW(type) ELF32_##type
+#define ElfW_Rel ElfW(Rel)
+#define SHT_RELX SHT_REL
+#define REL_SECTION_FMT ".rel%s"
+#endif
+
 #define FALSE 0
 #define false 0
 #define TRUE 1
@@ -104,21 +130,28 @@ typedef int BOOL;
 
 /* path to find crt1.o, crti.o and crtn.o. Only needed when generating
    executables or dlls */
+#ifdef TCC_TARGET_X86_64
+#define CONFIG_TCC_CRT_PREFIX "/usr/lib/x86_64-linux-gnu"
+#else
 #define CONFIG_TCC_CRT_PREFIX "/usr/lib"
+#endif
 
 #define INCLUDE_STACK_SIZE  32
 #define IFDEF_STACK_SIZE    64
 #define VSTACK_SIZE         256
 #define STRING_MAX_SIZE     1024
+#define MEMCPY_INLINE_MAX   64 /* larger structures are copied and cleared
+                                  by calls to memcpy and memset */
 #define PACK_STACK_SIZE     8
 
-#define TOK_HASH_SIZE       8192 /* must be a power of two */
+#define TOK_HASH_SIZE       8192 /* first size of the identifier hash table,
+                                    must be a power of two */
 #define TOK_ALLOC_INCR      512  /* must be a power of two */
 #define TOK_MAX_SIZE        5 /* token max size in int unit when stored in string */
+#define EXPAND_BUFFER_SIZE  256 /* first size in ints of a macro expansion buffer */
 
 /* token symbol management */
 typedef struct TokenSym {
-    struct TokenSym *hash_next;
     struct Sym *sym_define; /* direct pointer to define */
     struct Sym *sym_label; /* direct pointer to label */
     struct Sym *sym_struct; /* direct pointer to structure */
@@ -128,6 +161,13 @@ typedef struct TokenSym {
     char str[1];
 } TokenSym;
 
+/* slot of the identifier hash table: the hash of an identifier and its
+   token, which is 0 if the slot is free */
+typedef struct TokenHash {
+    unsigned int hash;
+    int tok;
+} TokenHash;
+
 #ifdef WIN32
 typedef unsigned short nwchar_t;
 #else
@@ -159,7 +199,7 @@ typedef union CValue {
     unsigned long long ull;
     struct CString *cstr;
     void *ptr;
-    int tab[1];
+    int tab[sizeof(long double) / sizeof(int)];
 } CValue;
 
 /* value on stack */
@@ -175,8 +215,8 @@ typedef struct SValue {
 /* symbol management */
 typedef struct Sym {
     int v;    /* symbol token */
-    int r;    /* associated register */
-    int c;    /* associated number */
+    long r;   /* associated register (or token string of an inline function) */
+    long c;   /* associated number (or token string of a macro) */
     CType type;    /* associated type */
     struct Sym *next; /* next related symbol */
     struct Sym *prev; /* prev symbol in stack */
@@ -255,16 +295,41 @@ typedef struct AttributeDef {
 #define TYPE_ABSTRACT  1 /* type without variable */
 #define TYPE_DIRECT    2 /* type with variable */
 
+/* headers and include directories known to the whole process, by the
+   identity of their files, see the include cache in tcc.c */
+typedef struct IncludeFile {
+    Tcl_WideInt mtime, size;    /* the file version described */
+    int once;                   /* it has '#pragma once' */
+    char *guard;                /* macro guarding all of it, or NULL */
+} IncludeFile;
+
+typedef struct IncludeDir {
+    Tcl_WideInt dev, ino, mtime;
+    Tcl_HashTable missing;      /* names known not to be in it */
+} IncludeDir;
+
+/* a header opened by code that may go to the compile cache, as it was
+   when opened */
+typedef struct OpenedHeader {
+    Tcl_WideInt dev, ino, mtime, size;
+    char path[1];
+} OpenedHeader;
+
 #define IO_BUF_SIZE 8192
 
 typedef struct BufferedFile {
     uint8_t *buf_ptr;
     uint8_t *buf_end;
     Tcl_Channel fd;
+    void *map;       /* if not NULL, the file is mapped and read in place */
+    unsigned long map_size;
+    const uint8_t *src_ptr; /* rest of a source string without fd, */
+    const uint8_t *src_end; /* copied to 'buffer' as it is read */
     int line_num;    /* current line number - here to simplify code */
     int ifndef_macro;  /* #ifndef macro / #endif search */
     int ifndef_macro_saved; /* saved ifndef_macro */
     int *ifdef_stack_ptr; /* ifdef_stack value at the start of the file */
+    IncludeFile *inc_file;  /* entry of the include cache, or NULL */
     char inc_type;          /* type of include */
     char inc_filename[512]; /* filename specified by the user */
     char filename[1024];    /* current filename - here to simplify code */
@@ -283,25 +348,106 @@ typedef struct ParseState {
     CValue tokc;
 } ParseState;
 
+/* buffer holding the tokens of a macro expansion. A state keeps its
+   buffers and reuses them for the next expansions; the tokens follow
+   the header. */
+typedef struct ExpandBuffer {
+    struct ExpandBuffer *next;  /* next free buffer */
+    int size;                   /* in ints */
+    int index;                  /* in the expand_buffers of the state */
+} ExpandBuffer;
+
 /* used to record tokens */
 typedef struct TokenString {
     int *str;
     int len;
     int allocated_len;
     int last_line_num;
+    ExpandBuffer *expand;       /* buffer holding 'str' or NULL */
 } TokenString;
 
+/* chunk of the arena holding the token strings of one compilation.
+   The data follows the header. */
+typedef struct ArenaChunk {
+    struct ArenaChunk *prev;
+    unsigned long size;         /* bytes of data */
+    unsigned long used;
+    unsigned long last;         /* offset of the last allocation */
+} ArenaChunk;
+
+/* case label of a switch statement */
+typedef struct CaseLabel {
+    long long v1, v2;           /* values, v2 > v1 for a gnu case range */
+    int addr;                   /* code offset of the label */
+} CaseLabel;
+
+/* stack slot of the function being compiled */
+typedef struct LocalSlot {
+    int addr;                   /* offset from the frame pointer */
+    int size;
+    int scalar;                 /* non volatile 4 byte scalar */
+} LocalSlot;
+
+/* call in tail position compiled as a jump. The epilog turns it back
+   into a call if the frame of the function may still be in use. */
+typedef struct TailCall {
+    int start;                  /* code releasing the frame */
+    int restore;                /* i386: room for the register restores */
+    int jump;                   /* jump to the function */
+} TailCall;
+
+/* small function whose calls are replaced by its body */
+typedef struct InlineFunc {
+    Sym *sym;
+    int *str;                   /* tokens of the body */
+    int active;                 /* the body is being inlined */
+} InlineFunc;
+
+/* switch statement being compiled. The case labels are collected while
+   the body is compiled and the code choosing one of them is put after
+   the body. */
+typedef struct SwitchState {
+    CType type;                 /* of the switch value: int or long long */
+    int reg, reg2;              /* registers holding the switch value */
+    CaseLabel *cases;           /* in the arena */
+    int nb_cases;
+    int def_addr;               /* code offset of 'default', or 0 */
+} SwitchState;
+
 /* include file cache, used to find files faster and also to eliminate
    inclusion if the include file is protected by #ifndef ... #endif */
 typedef struct CachedInclude {
     int ifndef_macro;
     int hash_next; /* -1 if none */
+    int path_index; /* include path it was found in */
+    int generation; /* of the include cache path_index is valid for */
     char type; /* '"' or '>' to give include type */
     char filename[1]; /* path specified in #include */
 } CachedInclude;
 
 #define CACHED_INCLUDES_HASH_SIZE 512
 
+/* precompiled header, see tccpch.c */
+typedef struct TCCPch {
+    int refcount;               /* users, see tcltcc.c */
+    char *options;              /* compile options it was created with */
+    char digest[33];            /* of these options and its code */
+    char **tokens;              /* identifiers, from TOK_IDENT */
+    int nb_tokens;
+    Sym *defines;               /* define stack, bottom first */
+    int *define_links;          /* 'next' of each define */
+    int nb_defines;
+    Sym *syms;                  /* global stack, bottom first */
+    int *sym_links;             /* 'type.ref' and 'next' of each symbol */
+    int nb_syms;
+    int anon_sym;
+    CachedInclude **includes;
+    int nb_includes;
+} TCCPch;
+
+/* code shared by the compile cache, see tcltcc.c */
+typedef struct TCCCachedCode TCCCachedCode;
+
 /* additional information about token */
 #define TOK_FLAG_BOW   0x0001 /* beginning of word before */
 #define TOK_FLAG_BOL   0x0002 /* beginning of line before */
@@ -319,6 +465,19 @@ struct TCCState {
     int output_type;
     int relocated;
     Tcl_Obj * tcc_lib_path;
+    /* options given from Tcl, part of the digest */
+    Tcl_Obj * options;
+    /* compile cache, see tcltcc.c */
+    int nb_compiled;            /* compile and add_file calls */
+    char cache_key[33];         /* digest of the code, if it is all there is */
+    TCCCachedCode * cached;     /* symbols of the code that is reused */
+    Tcl_Obj * cached_code;      /* code not compiled because of that */
+    int compile_cache;          /* the set_flag turning it on */
+    OpenedHeader **opened_headers; /* by the code, if it is turned on */
+    int nb_opened_headers;
+    /* precompiled headers */
+    TCCPch *pch;                /* restored before each compilation */
+    TCCPch *pch_out;            /* saved at the end of the next one */
  
     BufferedFile **include_stack_ptr;
     int *ifdef_stack_ptr;
@@ -330,6 +489,12 @@ struct TCCState {
     int nb_sysinclude_paths;
     CachedInclude **cached_includes;
     int nb_cached_includes;
+    /* in the arena: the include cache entries of the include paths,
+       checked once per compilation, and of the headers included */
+    IncludeDir **include_dirs;
+    int include_generation;
+    IncludeFile **included_files;
+    int nb_included_files;
 
     char **library_paths;
     int nb_library_paths;
@@ -348,6 +513,14 @@ struct TCCState {
     Section *plt;
     unsigned long *got_offsets;
     int nb_got_offsets;
+#ifdef TCC_TARGET_X86_64
+    /* in memory, block of the relocated sections and of the jump table
+       of the far calls (see alloc_runtime_mem()) */
+    unsigned char *runtime_mem;
+    unsigned char *jmp_table;
+    int *jmp_offsets; /* jump table entry + 1 of each symbol or 0 */
+    int nb_jmp_entries;
+#endif
     /* give the correspondance from symtab indexes to dynsym indexes */
     int *symtab_to_dynsym;
 
@@ -380,6 +553,10 @@ struct TCCState {
     /* C language options */
     int char_is_unsigned;
     int leading_underscore;
+
+    /* code generation options */
+    int sse2; /* i386: float and double in the sse2 registers */
+    int optimize; /* optimization level */
     
     /* warning switches */
     int warn_write_strings;
@@ -413,6 +590,137 @@ struct TCCState {
 
     /* output file for preprocessing */
     FILE *outfile;
+
+    /* compile with built-in memory and bounds checker */
+    int do_bounds_check;
+    /* compile with debug symbol (and use them if error during execution) */
+    int do_debug;
+    /* use GNU C extensions */
+    int gnu_ext;
+    /* use Tiny C extensions */
+    int tcc_ext;
+    /* max number of callers shown if error */
+    int num_callers;
+    const char **rt_bound_error_msg;
+    int total_lines;
+    int total_bytes;
+
+    /* code generation backend */
+    int ind; /* output code index */
+    int loc; /* local variable index */
+    Section *cur_text_section; /* current section where function code is generated */
+    SValue *vtop;
+    CType func_vt; /* current function return type (used by return instruction) */
+    int func_vc;
+    unsigned long func_sub_sp_offset;
+    unsigned long func_bound_offset;
+    int func_ret_sub;
+    int func_regs_used; /* mask of the registers allocated in the function */
+    int func_no_opt; /* the function has code the optimizer cannot follow */
+    int func_addr_taken; /* the address of a local or of the stack was taken */
+    /* offsets in the data section of the code addresses of the function,
+       such as the entries of its switch tables */
+    unsigned long *func_code_refs;
+    int nb_func_code_refs;
+    /* stack slots of the function, recorded for the optimizer */
+    LocalSlot *func_locals;
+    int nb_func_locals;
+    /* i386: slot kept in each register by the optimizer, 0 if none */
+    int func_reg_slot[8];
+    /* functions whose calls can be inlined */
+    InlineFunc *inline_funcs;
+    int nb_inline_funcs;
+    int inline_depth;
+    int tail_call; /* the expression of a 'return' is starting */
+    /* calls in tail position, finished by the epilog */
+    TailCall *func_tail_calls;
+    int nb_func_tail_calls;
+#ifdef TCC_TARGET_I386
+    /* size of the parameters on the stack */
+    int func_args_size;
+#endif
+#ifdef TCC_TARGET_X86_64
+    /* initial va_list of the current variadic function */
+    int func_va_gp_offset;
+    int func_va_fp_offset;
+    int func_va_overflow;
+#endif
+    /* predefined types */
+    CType char_pointer_type;
+    CType func_old_type;
+    CType int_type;
+    SValue vstack[VSTACK_SIZE];
+
+    /* predefined sections */
+    Section *text_section, *data_section, *bss_section;
+    Section *last_text_section; /* to handle .previous asm directive */
+    /* bound check related sections */
+    Section *bounds_section; /* contains global data bound description */
+    Section *lbounds_section; /* contains local data bound description */
+    /* symbol sections */
+    Section *symtab_section, *strtab_section;
+    /* debug sections */
+    Section *stab_section, *stabstr_section;
+
+    /* parser */
+    struct BufferedFile *file;
+    int fch, tok;
+    CValue tokc;
+    CString tokcstr; /* current parsed string, if any */
+    /* additional informations about token */
+    int tok_flags, next_tok_flags;
+    int *macro_ptr, *macro_ptr_allocated;
+    int *unget_saved_macro_ptr;
+    int unget_saved_buffer[TOK_MAX_SIZE + 1];
+    int unget_buffer_enabled;
+    int parse_flags;
+
+    /*
+       rsym: return symbol
+       anon_sym: anonymous symbol index
+    */
+    int rsym, anon_sym;
+    /* expression generation modifiers */
+    int const_wanted; /* true if constant wanted */
+    int global_expr;  /* true if compound literals must be allocated
+                         globally (used during initializers parsing */
+    int last_line_num, last_ind, func_ind; /* debug last line number and pc */
+    char *funcname;
+
+    /* token and symbol tables */
+    int tok_ident;
+    TokenSym **table_ident;
+    TokenHash *hash_ident;      /* open addressing, kept half empty */
+    int hash_ident_mask;        /* number of slots - 1 */
+    char token_buf[STRING_MAX_SIZE + 1];
+    Sym *global_stack, *local_stack;
+    Sym *define_stack;
+    Sym *global_label_stack, *local_label_stack;
+    /* symbol allocator */
+    Sym *sym_free_first;
+    void **sym_pools;
+    int nb_sym_pools;
+    /* token strings of the current compilation, freed at its end */
+    ArenaChunk *arena;
+    int arena_enabled;
+    /* macro expansion buffers, and the number of expansions and the
+       bytes allocated for their buffers by the current compilation */
+    ExpandBuffer **expand_buffers;
+    int nb_expand_buffers;
+    ExpandBuffer *expand_free;
+    int nb_expansions;
+    unsigned long expand_bytes;
+
+    /* get_tok_str() result buffer */
+    char tok_str_buf[STRING_MAX_SIZE + 1];
+    CString tok_str_cstr;
+
+#ifdef WIN32
+    /* PE output type and imported symbol slots */
+    char pe_type;
+    void **pe_imp;
+    int nb_pe_imp;
+#endif
 };
 
 /* The current value can be: */
@@ -657,8 +965,8 @@ extern float strtof (const char *__nptr, char **__endptr);
 extern long double strtold (const char *__nptr, char **__endptr);
 #endif
 
-static char *pstrcpy(TCCState *st, char *buf, int buf_size, const char *s);
-static char *pstrcat(TCCState *st, char *buf, int buf_size, const char *s);
+static char *pstrcpy(char *buf, int buf_size, const char *s);
+static char *pstrcat(char *buf, int buf_size, const char *s);
 static const char *tcc_basename(const char *name);
 
 static void next(TCCState *st);
@@ -666,13 +974,18 @@ static void next_nomacro(TCCState *st);
 static void parse_expr_type(TCCState *st, CType *type);
 static void expr_type(TCCState *st, CType *type);
 static void unary_type(TCCState *st, CType *type);
-static void block(TCCState *st, int *bsym, int *csym, int *case_sym, int *def_sym, 
-                  int case_reg, int is_expr);
+static void block(TCCState *st, int *bsym, int *csym, SwitchState *sw,
+                  int is_expr);
 static int expr_const(TCCState *st);
 static void expr_eq(TCCState *st);
 static void gexpr(TCCState *st);
 static void gen_inline_functions(TCCState *st);
+static InlineFunc *inline_find(TCCState *st, Sym *sym);
+static void gen_inline_call(TCCState *st, InlineFunc *f);
 static void decl(TCCState *st, int l);
+static void pch_save(TCCState *st, TCCPch *pch, Sym *define_start,
+                     Sym *global_start, unsigned long symtab_start);
+static void pch_restore(TCCState *st, TCCPch *pch);
 static void decl_initializer(TCCState *st, CType *type, Section *sec, unsigned long c, 
                              int first, int size_only);
 static void decl_initializer_alloc(TCCState *st, CType *type, AttributeDef *ad, int r, 
@@ -685,6 +998,7 @@ void save_reg(TCCState *st, int r);
 void vpop(TCCState *st);
 void vswap(TCCState *st);
 void vdup(TCCState *st);
+void vpushv(TCCState *st, SValue *v);
 int get_reg(TCCState *st, int rc);
 int get_reg_ex(TCCState *st, int rc,int rc2);
 
@@ -712,7 +1026,7 @@ static void type_decl(TCCState *st, CType *type, AttributeDef *ad, int *v, int t
 static int is_compatible_types(TCCState *st, CType *type1, CType *type2);
 static void expr_const1(TCCState *st);
 
-int ieee_finite(TCCState *st, double d);
+int ieee_finite(double d);
 void tcc_error(TCCState *st, const char *fmt, ...);
 void vpushi(TCCState *st, int v);
 void vrott(TCCState *st, int n);
@@ -801,6 +1115,15 @@ static int tcc_assemble(TCCState *st, int do_preprocess);
 static void asm_instr(TCCState *st);
 static void asm_global_instr(TCCState *st);
 
+static void *arena_realloc(TCCState *st, void *ptr, unsigned long old_size,
+                           unsigned long size);
+static void func_local(TCCState *st, int addr, int size, CType *type);
+static int div_magic(unsigned int d, int is_signed, unsigned int *m, int *s);
+#ifdef TCC_TARGET_I386
+static void gen_promote(TCCState *st);
+static void gen_peephole(TCCState *st);
+#endif
+
 /* true if float/double/long double type */
 static inline int is_float(TCCState *st, int t)
 {
@@ -39,9 +39,9 @@ static void asm_expr_unary(TCCState *s1, ExprValue *pe)
     int op, n, label;
     const char *p;
 
-    switch(tok) {
+    switch(s1->tok) {
     case TOK_PPNUM:
-        p = tokc.cstr->data;
+        p = s1->tokc.cstr->data;
         n = strtoul(p, (char **)&p, 0);
         if (*p == 'b' || *p == 'f') {
             /* backward or forward label */
@@ -77,7 +77,7 @@ static void asm_expr_unary(TCCState *s1, ExprValue *pe)
         break;
     case '-':
     case '~':
-        op = tok;
+        op = s1->tok;
         next(s1);
         asm_expr_unary(s1, pe);
         if (pe->sym)
@@ -89,7 +89,7 @@ static void asm_expr_unary(TCCState *s1, ExprValue *pe)
         break;
     case TOK_CCHAR:
     case TOK_LCHAR:
-	pe->v = tokc.i;
+	pe->v = s1->tokc.i;
 	pe->sym = NULL;
 	next(s1);
 	break;
@@ -99,11 +99,11 @@ static void asm_expr_unary(TCCState *s1, ExprValue *pe)
         skip(s1, ')');
         break;
     default:
-        if (tok >= TOK_IDENT) {
+        if (s1->tok >= TOK_IDENT) {
             /* label case : if the label was not found, add one */
-            sym = label_find(s1, tok);
+            sym = label_find(s1, s1->tok);
             if (!sym) {
-                sym = label_push(s1, &s1->asm_labels, tok, 0);
+                sym = label_push(s1, &s1->asm_labels, s1->tok, 0);
                 /* NOTE: by default, the symbol is global */
                 sym->type.t = VT_VOID;
             }
@@ -117,7 +117,7 @@ static void asm_expr_unary(TCCState *s1, ExprValue *pe)
             }
             next(s1);
         } else {
-           tcc_error(s1, "bad expression syntax [%s]", get_tok_str(s1, tok, &tokc));
+           tcc_error(s1, "bad expression syntax [%s]", get_tok_str(s1, s1->tok, &s1->tokc));
         }
         break;
     }
@@ -130,7 +130,7 @@ static void asm_expr_prod(TCCState *s1, ExprValue *pe)
 
     asm_expr_unary(s1, pe);
     for(;;) {
-        op = tok;
+        op = s1->tok;
         if (op != '*' && op != '/' && op != '%' && 
             op != TOK_SHL && op != TOK_SAR)
             break;
@@ -172,7 +172,7 @@ static void asm_expr_logic(TCCState *s1, ExprValue *pe)
 
     asm_expr_prod(s1, pe);
     for(;;) {
-        op = tok;
+        op = s1->tok;
         if (op != '&' && op != '|' && op != '^')
             break;
         next(s1);
@@ -201,7 +201,7 @@ static inline void asm_expr_sum(TCCState *s1, ExprValue *pe)
 
     asm_expr_logic(s1, pe);
     for(;;) {
-        op = tok;
+        op = s1->tok;
         if (op != '+' && op != '-')
             break;
         next(s1);
@@ -282,7 +282,7 @@ static void asm_new_label1(TCCState *s1, int label, int is_local,
 
 static void asm_new_label(TCCState *s1, int label, int is_local)
 {
-    asm_new_label1(s1, label, is_local, cur_text_section->sh_num, ind);
+    asm_new_label1(s1, label, is_local, s1->cur_text_section->sh_num, s1->ind);
 }
 
 static void asm_free_labels(TCCState *st)
@@ -301,7 +301,7 @@ static void asm_free_labels(TCCState *st)
             put_extern_sym2(st, s, sec, (long)s->next, 0, 0);
         }
         /* remove label */
-        table_ident[s->v - TOK_IDENT]->sym_label = NULL;
+        st->table_ident[s->v - TOK_IDENT]->sym_label = NULL;
         sym_free(st,s);
     }
     st->asm_labels = NULL;
@@ -309,9 +309,9 @@ static void asm_free_labels(TCCState *st)
 
 static void use_section1(TCCState *s1, Section *sec)
 {
-    cur_text_section->data_offset = ind;
-    cur_text_section = sec;
-    ind = cur_text_section->data_offset;
+    s1->cur_text_section->data_offset = s1->ind;
+    s1->cur_text_section = sec;
+    s1->ind = s1->cur_text_section->data_offset;
 }
 
 static void use_section(TCCState *s1, const char *name)
@@ -329,19 +329,19 @@ static void asm_parse_directive(TCCState *s1)
 
     /* assembler directive */
     next(s1);
-    sec = cur_text_section;
-    switch(tok) {
+    sec = s1->cur_text_section;
+    switch(s1->tok) {
     case TOK_ASM_align:
     case TOK_ASM_skip:
     case TOK_ASM_space:
-        tok1 = tok;
+        tok1 = s1->tok;
         next(s1);
         n = asm_int_expr(s1);
         if (tok1 == TOK_ASM_align) {
             if (n < 0 || (n & (n-1)) != 0)
                tcc_error(s1, "alignment must be a positive power of two");
-            offset = (ind + n - 1) & -n;
-            size = offset - ind;
+            offset = (s1->ind + n - 1) & -n;
+            size = offset - s1->ind;
             /* the section must have a compatible alignment */
             if (sec->sh_addralign < n)
                 sec->sh_addralign = n;
@@ -349,17 +349,17 @@ static void asm_parse_directive(TCCState *s1)
             size = n;
         }
         v = 0;
-        if (tok == ',') {
+        if (s1->tok == ',') {
             next(s1);
             v = asm_int_expr(s1);
         }
     zero_pad:
         if (sec->sh_type != SHT_NOBITS) {
-            sec->data_offset = ind;
+            sec->data_offset = s1->ind;
             ptr = section_ptr_add(s1, sec, size);
             memset(ptr, v, size);
         }
-        ind += size;
+        s1->ind += size;
         break;
     case TOK_ASM_quad:
         next(s1);
@@ -367,8 +367,8 @@ static void asm_parse_directive(TCCState *s1)
             uint64_t vl;
             const char *p;
 
-            p = tokc.cstr->data;
-            if (tok != TOK_PPNUM) {
+            p = s1->tokc.cstr->data;
+            if (s1->tok != TOK_PPNUM) {
             error_constant:
                tcc_error(s1, "64 bit constant");
             }
@@ -381,9 +381,9 @@ static void asm_parse_directive(TCCState *s1)
                 gen_le32(s1, vl);
                 gen_le32(s1, vl >> 32);
             } else {
-                ind += 8;
+                s1->ind += 8;
             }
-            if (tok != ',')
+            if (s1->tok != ',')
                 break;
             next(s1);
         }
@@ -415,9 +415,9 @@ static void asm_parse_directive(TCCState *s1)
                         gen_le16(s1, e.v);
                 }
             } else {
-                ind += size;
+                s1->ind += size;
             }
-            if (tok != ',')
+            if (s1->tok != ',')
                 break;
             next(s1);
         }
@@ -434,7 +434,7 @@ static void asm_parse_directive(TCCState *s1)
             }
             size = 1;
             val = 0;
-            if (tok == ',') {
+            if (s1->tok == ',') {
                 next(s1);
                 size = asm_int_expr(s1);
                 if (size < 0) {
@@ -443,7 +443,7 @@ static void asm_parse_directive(TCCState *s1)
                 }
                 if (size > 8)
                     size = 8;
-                if (tok == ',') {
+                if (s1->tok == ',') {
                     next(s1);
                     val = asm_int_expr(s1);
                 }
@@ -470,10 +470,10 @@ static void asm_parse_directive(TCCState *s1)
             next(s1);
             /* XXX: handle section symbols too */
             n = asm_int_expr(s1);
-            if (n < ind)
+            if (n < s1->ind)
                tcc_error(s1, "attempt to .org backwards");
             v = 0;
-            size = n - ind;
+            size = n - s1->ind;
             goto zero_pad;
         }
         break;
@@ -483,9 +483,9 @@ static void asm_parse_directive(TCCState *s1)
             Sym *sym;
 
             next(s1);
-            sym = label_find(s1, tok);
+            sym = label_find(s1, s1->tok);
             if (!sym) {
-                sym = label_push(s1, &s1->asm_labels, tok, 0);
+                sym = label_push(s1, &s1->asm_labels, s1->tok, 0);
                 sym->type.t = VT_VOID;
             }
             sym->type.t &= ~VT_STATIC;
@@ -499,21 +499,21 @@ static void asm_parse_directive(TCCState *s1)
             const uint8_t *p;
             int i, size, t;
 
-            t = tok;
+            t = s1->tok;
             next(s1);
             for(;;) {
-                if (tok != TOK_STR)
+                if (s1->tok != TOK_STR)
                     expect(s1, "string constant");
-                p = tokc.cstr->data;
-                size = tokc.cstr->size;
+                p = s1->tokc.cstr->data;
+                size = s1->tokc.cstr->size;
                 if (t == TOK_ASM_ascii && size > 0)
                     size--;
                 for(i = 0; i < size; i++)
                     g(s1, p[i]);
                 next(s1);
-                if (tok == ',') {
+                if (s1->tok == ',') {
                     next(s1);
-                } else if (tok != TOK_STR) {
+                } else if (s1->tok != TOK_STR) {
                     break;
                 }
             }
@@ -524,10 +524,10 @@ static void asm_parse_directive(TCCState *s1)
     case TOK_ASM_bss:
 	{ 
             char sname[64];
-            tok1 = tok;
+            tok1 = s1->tok;
             n = 0;
             next(s1);
-            if (tok != ';' && tok != TOK_LINEFEED) {
+            if (s1->tok != ';' && s1->tok != TOK_LINEFEED) {
 		n = asm_int_expr(s1);
 		next(s1);
             }
@@ -542,21 +542,21 @@ static void asm_parse_directive(TCCState *s1)
             /* XXX: support more options */
             next(s1);
             sname[0] = '\0';
-            while (tok != ';' && tok != TOK_LINEFEED && tok != ',') {
-                if (tok == TOK_STR)
-                    pstrcat(s1, sname, sizeof(sname), tokc.cstr->data);
+            while (s1->tok != ';' && s1->tok != TOK_LINEFEED && s1->tok != ',') {
+                if (s1->tok == TOK_STR)
+                    pstrcat(sname, sizeof(sname), s1->tokc.cstr->data);
                 else
-                    pstrcat(s1, sname, sizeof(sname), get_tok_str(s1, tok, NULL));
+                    pstrcat(sname, sizeof(sname), get_tok_str(s1, s1->tok, NULL));
                 next(s1);
             }
-            if (tok == ',') {
+            if (s1->tok == ',') {
                 /* skip section options */
                 next(s1);
-                if (tok != TOK_STR)
+                if (s1->tok != TOK_STR)
                     expect(s1, "string constant");
                 next(s1);
             }
-            last_text_section = cur_text_section;
+            s1->last_text_section = s1->cur_text_section;
             use_section(s1, sname);
         }
         break;
@@ -564,15 +564,15 @@ static void asm_parse_directive(TCCState *s1)
         { 
             Section *sec;
             next(s1);
-            if (!last_text_section)
+            if (!s1->last_text_section)
                tcc_error(s1, "no previous section referenced");
-            sec = cur_text_section;
-            use_section1(s1, last_text_section);
-            last_text_section = sec;
+            sec = s1->cur_text_section;
+            use_section1(s1, s1->last_text_section);
+            s1->last_text_section = sec;
         }
         break;
     default:
-       tcc_error(s1, "unknown assembler directive '.%s'", get_tok_str(s1, tok, NULL));
+       tcc_error(s1, "unknown assembler directive '.%s'", get_tok_str(s1, s1->tok, NULL));
         break;
     }
 }
@@ -617,27 +617,27 @@ static int tcc_assemble_internal(TCCState *s1, int do_preprocess)
 
     /* XXX: undefine C labels */
 
-    fch = file->buf_ptr[0];
-    next_tok_flags = TOK_FLAG_BOW | TOK_FLAG_BOL | TOK_FLAG_BOF;
-    parse_flags = PARSE_FLAG_ASM_COMMENTS;
+    s1->fch = s1->file->buf_ptr[0];
+    s1->next_tok_flags = TOK_FLAG_BOW | TOK_FLAG_BOL | TOK_FLAG_BOF;
+    s1->parse_flags = PARSE_FLAG_ASM_COMMENTS;
     if (do_preprocess)
-        parse_flags |= PARSE_FLAG_PREPROCESS;
+        s1->parse_flags |= PARSE_FLAG_PREPROCESS;
     next(s1);
     for(;;) {
-        if (tok == TOK_EOF)
+        if (s1->tok == TOK_EOF)
             break;
-        parse_flags |= PARSE_FLAG_LINEFEED; /* XXX: suppress that hack */
+        s1->parse_flags |= PARSE_FLAG_LINEFEED; /* XXX: suppress that hack */
     redo:
-        if (tok == '#') {
+        if (s1->tok == '#') {
             /* horrible gas comment */
-            while (tok != TOK_LINEFEED)
+            while (s1->tok != TOK_LINEFEED)
                 next(s1);
-        } else if (tok == '.') {
+        } else if (s1->tok == '.') {
             asm_parse_directive(s1);
-        } else if (tok == TOK_PPNUM) {
+        } else if (s1->tok == TOK_PPNUM) {
             const char *p;
             int n;
-            p = tokc.cstr->data;
+            p = s1->tokc.cstr->data;
             n = strtoul(p, (char **)&p, 10);
             if (*p != '\0')
                 expect(s1, "':'");
@@ -646,16 +646,16 @@ static int tcc_assemble_internal(TCCState *s1, int do_preprocess)
             next(s1);
             skip(s1, ':');
             goto redo;
-        } else if (tok >= TOK_IDENT) {
+        } else if (s1->tok >= TOK_IDENT) {
             /* instruction or label */
-            opcode = tok;
+            opcode = s1->tok;
             next(s1);
-            if (tok == ':') {
+            if (s1->tok == ':') {
                 /* new label */
                 asm_new_label(s1, opcode, 0);
                 next(s1);
                 goto redo;
-            } else if (tok == '=') {
+            } else if (s1->tok == '=') {
                 int n;
                 next(s1);
                 n = asm_int_expr(s1);
@@ -666,10 +666,10 @@ static int tcc_assemble_internal(TCCState *s1, int do_preprocess)
             }
         }
         /* end of line */
-        if (tok != ';' && tok != TOK_LINEFEED){
+        if (s1->tok != ';' && s1->tok != TOK_LINEFEED){
             expect(s1, "end of line");
         }
-        parse_flags &= ~PARSE_FLAG_LINEFEED; /* XXX: suppress that hack */
+        s1->parse_flags &= ~PARSE_FLAG_LINEFEED; /* XXX: suppress that hack */
         next(s1);
     }
 
@@ -687,14 +687,14 @@ static int tcc_assemble(TCCState *s1, int do_preprocess)
     preprocess_init(s1);
 
     /* default section is text */
-    cur_text_section = text_section;
-    ind = cur_text_section->data_offset;
+    s1->cur_text_section = s1->text_section;
+    s1->ind = s1->cur_text_section->data_offset;
 
-    define_start = define_stack;
+    define_start = s1->define_stack;
 
     ret = tcc_assemble_internal(s1, do_preprocess);
 
-    cur_text_section->data_offset = ind;
+    s1->cur_text_section->data_offset = s1->ind;
 
     free_defines(s1, define_start); 
 
@@ -720,19 +720,19 @@ static void tcc_assemble_inline(TCCState *s1, char *str, int len)
     str[len] = CH_EOB;
     /* same name as current file so that errors are correctly
        reported */
-    pstrcpy(s1, bf->filename, sizeof(bf->filename), file->filename);
-    bf->line_num = file->line_num;
-    saved_file = file;
-    file = bf;
-    saved_parse_flags = parse_flags;
-    saved_macro_ptr = macro_ptr;
-    macro_ptr = NULL;
+    pstrcpy(bf->filename, sizeof(bf->filename), s1->file->filename);
+    bf->line_num = s1->file->line_num;
+    saved_file = s1->file;
+    s1->file = bf;
+    saved_parse_flags = s1->parse_flags;
+    saved_macro_ptr = s1->macro_ptr;
+    s1->macro_ptr = NULL;
     
     tcc_assemble_internal(s1, 0);
 
-    parse_flags = saved_parse_flags;
-    macro_ptr = saved_macro_ptr;
-    file = saved_file;
+    s1->parse_flags = saved_parse_flags;
+    s1->macro_ptr = saved_macro_ptr;
+    s1->file = saved_file;
     ckfree((char *)bf);
 }
 
@@ -829,25 +829,25 @@ static void parse_asm_operands(TCCState *s1,
     ASMOperand *op;
     int nb_operands;
 
-    if (tok != ':') {
+    if (s1->tok != ':') {
         nb_operands = *nb_operands_ptr;
         for(;;) {
             if (nb_operands >= MAX_ASM_OPERANDS)
                tcc_error(s1, "too many asm operands");
             op = &operands[nb_operands++];
             op->id = 0;
-            if (tok == '[') {
+            if (s1->tok == '[') {
                 next(s1);
-                if (tok < TOK_IDENT)
+                if (s1->tok < TOK_IDENT)
                     expect(s1, "identifier");
-                op->id = tok;
+                op->id = s1->tok;
                 next(s1);
                 skip(s1, ']');
             }
-            if (tok != TOK_STR)
+            if (s1->tok != TOK_STR)
                 expect(s1, "string constant");
-            op->constraint = tcc_malloc(s1, tokc.cstr->size);
-            strcpy(op->constraint, tokc.cstr->data);
+            op->constraint = tcc_malloc(s1, s1->tokc.cstr->size);
+            strcpy(op->constraint, s1->tokc.cstr->data);
             next(s1);
             skip(s1, '(');
             gexpr(s1);
@@ -858,16 +858,16 @@ static void parse_asm_operands(TCCState *s1,
                    constraint is used. Note that it may come from
                    register storage, so we need to convert (reg)
                    case */
-                if ((vtop->r & VT_LVAL) &&
-                    ((vtop->r & VT_VALMASK) == VT_LLOCAL ||
-                     (vtop->r & VT_VALMASK) < VT_CONST) &&
+                if ((s1->vtop->r & VT_LVAL) &&
+                    ((s1->vtop->r & VT_VALMASK) == VT_LLOCAL ||
+                     (s1->vtop->r & VT_VALMASK) < VT_CONST) &&
                     !strchr(op->constraint, 'm')) {
                     gv(s1, RC_INT);
                 }
             }
-            op->vt = vtop;
+            op->vt = s1->vtop;
             skip(s1, ')');
-            if (tok == ',') {
+            if (s1->tok == ',') {
                 next(s1);
             } else {
                 break;
@@ -882,12 +882,12 @@ static void parse_asm_str(TCCState *s1,
 {
     skip(s1, '(');
     /* read the string */
-    if (tok != TOK_STR)
+    if (s1->tok != TOK_STR)
         expect(s1, "string constant");
     cstr_new(s1, astr);
-    while (tok == TOK_STR) {
+    while (s1->tok == TOK_STR) {
         /* XXX: add \0 handling too ? */
-        cstr_cat(s1, astr, tokc.cstr->data);
+        cstr_cat(s1, astr, s1->tokc.cstr->data);
         next(s1);
     }
     cstr_ccat(s1, astr, '\0');
@@ -904,7 +904,7 @@ static void asm_instr(TCCState *s1)
     next(s1);
     /* since we always generate the asm() instruction, we can ignore
        volatile */
-    if (tok == TOK_VOLATILE1 || tok == TOK_VOLATILE2 || tok == TOK_VOLATILE3) {
+    if (s1->tok == TOK_VOLATILE1 || s1->tok == TOK_VOLATILE2 || s1->tok == TOK_VOLATILE3) {
         next(s1);
     }
     parse_asm_str(s1, &astr);
@@ -912,27 +912,27 @@ static void asm_instr(TCCState *s1)
     nb_outputs = 0;
     must_subst = 0;
     memset(clobber_regs, 0, sizeof(clobber_regs));
-    if (tok == ':') {
+    if (s1->tok == ':') {
         next(s1);
         must_subst = 1;
         /* output args */
         parse_asm_operands(s1, operands, &nb_operands, 1);
         nb_outputs = nb_operands;
-        if (tok == ':') {
+        if (s1->tok == ':') {
             next(s1);
-            if (tok != ')') {
+            if (s1->tok != ')') {
                 /* input args */
                 parse_asm_operands(s1, operands, &nb_operands, 0);
-                if (tok == ':') {
+                if (s1->tok == ':') {
                     /* clobber list */
                     /* XXX: handle registers */
                     next(s1);
                     for(;;) {
-                        if (tok != TOK_STR)
+                        if (s1->tok != TOK_STR)
                             expect(s1, "string constant");
-                        asm_clobber(s1, clobber_regs, tokc.cstr->data);
+                        asm_clobber(s1, clobber_regs, s1->tokc.cstr->data);
                         next(s1);
-                        if (tok == ',') {
+                        if (s1->tok == ',') {
                             next(s1);
                         } else {
                             break;
@@ -945,7 +945,7 @@ static void asm_instr(TCCState *s1)
     skip(s1, ')');
     /* NOTE: we do not eat the ';' so that we can restore the current
        token after the assembler parsing */
-    if (tok != ';')
+    if (s1->tok != ';')
         expect(s1, "';'");
     nb_inputs = nb_operands - nb_outputs;
     
@@ -1004,19 +1004,19 @@ static void asm_global_instr(TCCState *s1)
     skip(s1, ')');
     /* NOTE: we do not eat the ';' so that we can restore the current
        token after the assembler parsing */
-    if (tok != ';')
+    if (s1->tok != ';')
         expect(s1, "';'");
     
 #ifdef ASM_DEBUG
     printf("asm_global: \"%s\"\n", (char *)astr.data);
 #endif
-    cur_text_section = text_section;
-    ind = cur_text_section->data_offset;
+    s1->cur_text_section = s1->text_section;
+    s1->ind = s1->cur_text_section->data_offset;
 
     /* assemble the string with tcc internal assembler */
     tcc_assemble_inline(s1, astr.data, astr.size - 1);
     
-    cur_text_section->data_offset = ind;
+    s1->cur_text_section->data_offset = s1->ind;
 
     /* restore the current C token */
     next(s1);
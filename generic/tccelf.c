@@ -51,12 +51,12 @@ static unsigned long elf_hash(const unsigned char *name)
 /* NOTE: we do factorize the hash table code to go faster */
 static void rebuild_hash(TCCState *st, Section *s, unsigned int nb_buckets)
 {
-    Elf32_Sym *sym;
+    ElfW(Sym) *sym;
     int *ptr, *hash, nb_syms, sym_index, h;
     char *strtab;
 
     strtab = s->link->data;
-    nb_syms = s->data_offset / sizeof(Elf32_Sym);
+    nb_syms = s->data_offset / sizeof(ElfW(Sym));
 
     s->hash->data_offset = 0;
     ptr = section_ptr_add(st, s->hash, (2 + nb_buckets + nb_syms) * sizeof(int));
@@ -67,9 +67,9 @@ static void rebuild_hash(TCCState *st, Section *s, unsigned int nb_buckets)
     memset(hash, 0, (nb_buckets + 1) * sizeof(int));
     ptr += nb_buckets + 1;
 
-    sym = (Elf32_Sym *)s->data + 1;
+    sym = (ElfW(Sym) *)s->data + 1;
     for(sym_index = 1; sym_index < nb_syms; sym_index++) {
-        if (ELF32_ST_BIND(sym->st_info) != STB_LOCAL) {
+        if (ELFW(ST_BIND)(sym->st_info) != STB_LOCAL) {
             h = elf_hash(strtab + sym->st_name) % nb_buckets;
             *ptr = hash[h];
             hash[h] = sym_index;
@@ -89,10 +89,10 @@ static int put_elf_sym(TCCState *st,
 {
     int name_offset, sym_index;
     int nbuckets, h;
-    Elf32_Sym *sym;
+    ElfW(Sym) *sym;
     Section *hs;
     
-    sym = section_ptr_add(st, s, sizeof(Elf32_Sym));
+    sym = section_ptr_add(st, s, sizeof(ElfW(Sym)));
     if (name)
         name_offset = put_elf_str(st, s->link, name);
     else
@@ -104,14 +104,14 @@ static int put_elf_sym(TCCState *st,
     sym->st_info = info;
     sym->st_other = other;
     sym->st_shndx = shndx;
-    sym_index = sym - (Elf32_Sym *)s->data;
+    sym_index = sym - (ElfW(Sym) *)s->data;
     hs = s->hash;
     if (hs) {
         int *ptr, *base;
         ptr = section_ptr_add(st, hs, sizeof(int));
         base = (int *)hs->data;
         /* only add global or weak symbols */
-        if (ELF32_ST_BIND(info) != STB_LOCAL) {
+        if (ELFW(ST_BIND)(info) != STB_LOCAL) {
             /* add another hashing entry */
             nbuckets = base[0];
             h = elf_hash(name) % nbuckets;
@@ -135,7 +135,7 @@ static int put_elf_sym(TCCState *st,
    found. */
 static int find_elf_sym(Section *s, const char *name)
 {
-    Elf32_Sym *sym;
+    ElfW(Sym) *sym;
     Section *hs;
     int nbuckets, sym_index, h;
     const char *name1;
@@ -147,7 +147,7 @@ static int find_elf_sym(Section *s, const char *name)
     h = elf_hash(name) % nbuckets;
     sym_index = ((int *)hs->data)[2 + h];
     while (sym_index != 0) {
-        sym = &((Elf32_Sym *)s->data)[sym_index];
+        sym = &((ElfW(Sym) *)s->data)[sym_index];
         name1 = s->link->data + sym->st_name;
         if (!strcmp(name, name1))
             return sym_index;
@@ -160,12 +160,12 @@ static int find_elf_sym(Section *s, const char *name)
 int tcc_get_symbol(TCCState *st, unsigned long *pval, const char *name)
 {
     int sym_index;
-    Elf32_Sym *sym;
+    ElfW(Sym) *sym;
     
-    sym_index = find_elf_sym(symtab_section, name);
+    sym_index = find_elf_sym(st->symtab_section, name);
     if (!sym_index)
         return -1;
-    sym = &((Elf32_Sym *)symtab_section->data)[sym_index];
+    sym = &((ElfW(Sym) *)st->symtab_section->data)[sym_index];
     *pval = sym->st_value;
     return 0;
 }
@@ -183,25 +183,25 @@ void *tcc_get_symbol_err(TCCState *st, const char *name)
 static int add_elf_sym(TCCState *st, Section *s, unsigned long value, unsigned long size,
                        int info, int other, int sh_num, const char *name)
 {
-    Elf32_Sym *esym;
+    ElfW(Sym) *esym;
     int sym_bind, sym_index, sym_type, esym_bind;
     unsigned char sym_vis, esym_vis, new_vis;
 
-    sym_bind = ELF32_ST_BIND(info);
-    sym_type = ELF32_ST_TYPE(info);
-    sym_vis = ELF32_ST_VISIBILITY(other);
+    sym_bind = ELFW(ST_BIND)(info);
+    sym_type = ELFW(ST_TYPE)(info);
+    sym_vis = ELFW(ST_VISIBILITY)(other);
         
     if (sym_bind != STB_LOCAL) {
         /* we search global or weak symbols */
         sym_index = find_elf_sym(s, name);
         if (!sym_index)
             goto do_def;
-        esym = &((Elf32_Sym *)s->data)[sym_index];
+        esym = &((ElfW(Sym) *)s->data)[sym_index];
         if (esym->st_shndx != SHN_UNDEF) {
-            esym_bind = ELF32_ST_BIND(esym->st_info);
+            esym_bind = ELFW(ST_BIND)(esym->st_info);
             /* propagate the most constraining visibility */
             /* STV_DEFAULT(0)<STV_PROTECTED(3)<STV_HIDDEN(2)<STV_INTERNAL(1) */
-            esym_vis = ELF32_ST_VISIBILITY(esym->st_other);
+            esym_vis = ELFW(ST_VISIBILITY)(esym->st_other);
             if (esym_vis == STV_DEFAULT) {
                 new_vis = sym_vis;
             } else if (sym_vis == STV_DEFAULT) {
@@ -209,7 +209,7 @@ static int add_elf_sym(TCCState *st, Section *s, unsigned long value, unsigned l
             } else {
                 new_vis = (esym_vis < sym_vis) ? esym_vis : sym_vis;
             }
-            esym->st_other = (esym->st_other & ~ELF32_ST_VISIBILITY(UCHAR_MAX))
+            esym->st_other = (esym->st_other & ~ELFW(ST_VISIBILITY)(UCHAR_MAX))
                              | new_vis;
             other = esym->st_other; /* in case we have to patch esym */
             if (sh_num == SHN_UNDEF) {
@@ -233,7 +233,7 @@ static int add_elf_sym(TCCState *st, Section *s, unsigned long value, unsigned l
             }
         } else {
         do_patch:
-            esym->st_info = ELF32_ST_INFO(sym_bind, sym_type);
+            esym->st_info = ELFW(ST_INFO)(sym_bind, sym_type);
             esym->st_shndx = sh_num;
             esym->st_value = value;
             esym->st_size = size;
@@ -242,7 +242,7 @@ static int add_elf_sym(TCCState *st, Section *s, unsigned long value, unsigned l
     } else {
     do_def:
         sym_index = put_elf_sym(st, s, value, size, 
-                                ELF32_ST_INFO(sym_bind, sym_type), other, 
+                                ELFW(ST_INFO)(sym_bind, sym_type), other, 
                                 sh_num, name);
     }
     return sym_index;
@@ -254,23 +254,28 @@ static void put_elf_reloc(TCCState * st, Section *symtab, Section *s, unsigned l
 {
     char buf[256];
     Section *sr;
-    Elf32_Rel *rel;
+    ElfW_Rel *rel;
 
     sr = s->reloc;
     if (!sr) {
         /* if no relocation section, create it */
-        snprintf(buf, sizeof(buf), ".rel%s", s->name);
+        snprintf(buf, sizeof(buf), REL_SECTION_FMT, s->name);
         /* if the symtab is allocated, then we consider the relocation
            are also */
-        sr = new_section(st, buf, SHT_REL, symtab->sh_flags);
-        sr->sh_entsize = sizeof(Elf32_Rel);
+        sr = new_section(st, buf, SHT_RELX, symtab->sh_flags);
+        sr->sh_entsize = sizeof(ElfW_Rel);
         sr->link = symtab;
         sr->sh_info = s->sh_num;
         s->reloc = sr;
     }
-    rel = section_ptr_add(st, sr, sizeof(Elf32_Rel));
+    rel = section_ptr_add(st, sr, sizeof(ElfW_Rel));
     rel->r_offset = offset;
-    rel->r_info = ELF32_R_INFO(symbol, type);
+    rel->r_info = ELFW(R_INFO)(symbol, type);
+#ifdef TCC_TARGET_X86_64
+    /* the addend is kept in the relocated field as for REL, see
+       move_addends() */
+    rel->r_addend = 0;
+#endif
 }
 
 /* put stab debug information */
@@ -289,9 +294,9 @@ static void put_stabs(TCCState *st,
 {
     Stab_Sym *sym;
 
-    sym = section_ptr_add(st, stab_section, sizeof(Stab_Sym));
+    sym = section_ptr_add(st, st->stab_section, sizeof(Stab_Sym));
     if (str) {
-        sym->n_strx = put_elf_str(st, stabstr_section, str);
+        sym->n_strx = put_elf_str(st, st->stabstr_section, str);
     } else {
         sym->n_strx = 0;
     }
@@ -306,8 +311,8 @@ static void put_stabs_r(TCCState *st,
                         unsigned long value, Section *sec, int sym_index)
 {
     put_stabs(st, str, type, other, desc, value);
-    put_elf_reloc(st, symtab_section, stab_section, 
-                  stab_section->data_offset - sizeof(unsigned long),
+    put_elf_reloc(st, st->symtab_section, st->stab_section, 
+                  st->stab_section->data_offset - sizeof(unsigned long),
                   R_DATA_32, sym_index);
 }
 
@@ -328,22 +333,22 @@ static void put_stabd(TCCState *st, int type, int other, int desc)
 static void sort_syms(TCCState *st, Section *s)
 {
     int *old_to_new_syms;
-    Elf32_Sym *new_syms;
+    ElfW(Sym) *new_syms;
     int nb_syms, i;
-    Elf32_Sym *p, *q;
-    Elf32_Rel *rel, *rel_end;
+    ElfW(Sym) *p, *q;
+    ElfW_Rel *rel, *rel_end;
     Section *sr;
     int type, sym_index;
 
-    nb_syms = s->data_offset / sizeof(Elf32_Sym);
-    new_syms = tcc_malloc(st, nb_syms * sizeof(Elf32_Sym));
+    nb_syms = s->data_offset / sizeof(ElfW(Sym));
+    new_syms = tcc_malloc(st, nb_syms * sizeof(ElfW(Sym)));
     old_to_new_syms = tcc_malloc(st, nb_syms * sizeof(int));
 
     /* first pass for local symbols */
-    p = (Elf32_Sym *)s->data;
+    p = (ElfW(Sym) *)s->data;
     q = new_syms;
     for(i = 0; i < nb_syms; i++) {
-        if (ELF32_ST_BIND(p->st_info) == STB_LOCAL) {
+        if (ELFW(ST_BIND)(p->st_info) == STB_LOCAL) {
             old_to_new_syms[i] = q - new_syms;
             *q++ = *p;
         }
@@ -353,9 +358,9 @@ static void sort_syms(TCCState *st, Section *s)
     s->sh_info = q - new_syms;
 
     /* then second pass for non local symbols */
-    p = (Elf32_Sym *)s->data;
+    p = (ElfW(Sym) *)s->data;
     for(i = 0; i < nb_syms; i++) {
-        if (ELF32_ST_BIND(p->st_info) != STB_LOCAL) {
+        if (ELFW(ST_BIND)(p->st_info) != STB_LOCAL) {
             old_to_new_syms[i] = q - new_syms;
             *q++ = *p;
         }
@@ -363,21 +368,21 @@ static void sort_syms(TCCState *st, Section *s)
     }
     
     /* we copy the new symbols to the old */
-    memcpy(s->data, new_syms, nb_syms * sizeof(Elf32_Sym));
+    memcpy(s->data, new_syms, nb_syms * sizeof(ElfW(Sym)));
     ckfree((char *)new_syms);
 
     /* now we modify all the relocations */
     for(i = 1; i < st->nb_sections; i++) {
         sr = st->sections[i];
-        if (sr->sh_type == SHT_REL && sr->link == s) {
-            rel_end = (Elf32_Rel *)(sr->data + sr->data_offset);
-            for(rel = (Elf32_Rel *)sr->data;
+        if (sr->sh_type == SHT_RELX && sr->link == s) {
+            rel_end = (ElfW_Rel *)(sr->data + sr->data_offset);
+            for(rel = (ElfW_Rel *)sr->data;
                 rel < rel_end;
                 rel++) {
-                sym_index = ELF32_R_SYM(rel->r_info);
-                type = ELF32_R_TYPE(rel->r_info);
+                sym_index = ELFW(R_SYM)(rel->r_info);
+                type = ELFW(R_TYPE)(rel->r_info);
                 sym_index = old_to_new_syms[sym_index];
-                rel->r_info = ELF32_R_INFO(sym_index, type);
+                rel->r_info = ELFW(R_INFO)(sym_index, type);
             }
         }
     }
@@ -386,24 +391,24 @@ static void sort_syms(TCCState *st, Section *s)
 }
 
 /* relocate common symbols in the .bss section */
-static void relocate_common_syms(void)
+static void relocate_common_syms(TCCState *st)
 {
-    Elf32_Sym *sym, *sym_end;
+    ElfW(Sym) *sym, *sym_end;
     unsigned long offset, align;
     
-    sym_end = (Elf32_Sym *)(symtab_section->data + symtab_section->data_offset);
-    for(sym = (Elf32_Sym *)symtab_section->data + 1; 
+    sym_end = (ElfW(Sym) *)(st->symtab_section->data + st->symtab_section->data_offset);
+    for(sym = (ElfW(Sym) *)st->symtab_section->data + 1; 
         sym < sym_end;
         sym++) {
         if (sym->st_shndx == SHN_COMMON) {
             /* align symbol */
             align = sym->st_value;
-            offset = bss_section->data_offset;
+            offset = st->bss_section->data_offset;
             offset = (offset + align - 1) & -align;
             sym->st_value = offset;
-            sym->st_shndx = bss_section->sh_num;
+            sym->st_shndx = st->bss_section->sh_num;
             offset += sym->st_size;
-            bss_section->data_offset = offset;
+            st->bss_section->data_offset = offset;
         }
     }
 }
@@ -412,21 +417,21 @@ static void relocate_common_syms(void)
    true and output error if undefined symbol. */
 static void relocate_syms(TCCState *st, int do_resolve)
 {
-    Elf32_Sym *sym, *esym, *sym_end;
+    ElfW(Sym) *sym, *esym, *sym_end;
     int sym_bind, sh_num, sym_index;
     const char *name;
     unsigned long addr;
 
-    sym_end = (Elf32_Sym *)(symtab_section->data + symtab_section->data_offset);
-    for(sym = (Elf32_Sym *)symtab_section->data + 1; 
+    sym_end = (ElfW(Sym) *)(st->symtab_section->data + st->symtab_section->data_offset);
+    for(sym = (ElfW(Sym) *)st->symtab_section->data + 1; 
         sym < sym_end;
         sym++) {
         sh_num = sym->st_shndx;
         if (sh_num == SHN_UNDEF) {
-            name = strtab_section->data + sym->st_name;
+            name = st->strtab_section->data + sym->st_name;
             if (do_resolve) {
-                name = symtab_section->link->data + sym->st_name;
-                addr = (unsigned long)resolve_sym(st, name, ELF32_ST_TYPE(sym->st_info));
+                name = st->symtab_section->link->data + sym->st_name;
+                addr = (unsigned long)resolve_sym(st, name, ELFW(ST_TYPE)(sym->st_info));
                 if (addr) {
                     sym->st_value = addr;
                     goto found;
@@ -435,7 +440,7 @@ static void relocate_syms(TCCState *st, int do_resolve)
                 /* if dynamic symbol exist, then use it */
                 sym_index = find_elf_sym(st->dynsym, name);
                 if (sym_index) {
-                    esym = &((Elf32_Sym *)st->dynsym->data)[sym_index];
+                    esym = &((ElfW(Sym) *)st->dynsym->data)[sym_index];
                     sym->st_value = esym->st_value;
                     goto found;
                 }
@@ -446,7 +451,7 @@ static void relocate_syms(TCCState *st, int do_resolve)
                 goto found;
             /* only weak symbols are accepted to be undefined. Their
                value is zero */
-            sym_bind = ELF32_ST_BIND(sym->st_info);
+            sym_bind = ELFW(ST_BIND)(sym->st_info);
             if (sym_bind == STB_WEAK) {
                 sym->st_value = 0;
             } else {
@@ -460,32 +465,144 @@ static void relocate_syms(TCCState *st, int do_resolve)
     }
 }
 
+#ifdef TCC_TARGET_X86_64
+/* The code reaches its data and the other functions with 32 bit pc
+   relative offsets. In memory, the sections are therefore relocated
+   for one block that holds all of them, followed by a table of 'jmp
+   *0(%rip)' entries for the calls to functions out of that range. */
+#define JMP_TABLE_ENTRY_SIZE 16
+
+/* return the address of the block for the sections of 'st' and the
+   jump table, or NULL if out of memory. Sets the section addresses. */
+static unsigned char *alloc_runtime_mem(TCCState *st)
+{
+    Section *s;
+    ElfW(Sym) *sym, *sym_end;
+    unsigned long offset, align;
+    int i, nb_far;
+
+    offset = 0;
+    for(i = 1; i < st->nb_sections; i++) {
+        s = st->sections[i];
+        if (s->sh_flags & SHF_ALLOC) {
+            align = s->sh_addralign > 16 ? s->sh_addralign : 16;
+            offset = (offset + align - 1) & -align;
+            s->sh_addr = offset;
+            offset += s->data_offset;
+        }
+    }
+    /* only functions not defined by the code can be far */
+    nb_far = 0;
+    sym_end = (ElfW(Sym) *)(st->symtab_section->data + 
+                            st->symtab_section->data_offset);
+    for(sym = (ElfW(Sym) *)st->symtab_section->data + 1; sym < sym_end; sym++) {
+        if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= SHN_LORESERVE)
+            nb_far++;
+    }
+    offset = (offset + JMP_TABLE_ENTRY_SIZE - 1) & -JMP_TABLE_ENTRY_SIZE;
+    st->runtime_mem = attemptckalloc(offset + nb_far * JMP_TABLE_ENTRY_SIZE);
+    if (!st->runtime_mem)
+        return NULL;
+    st->jmp_table = st->runtime_mem + offset;
+    st->nb_jmp_entries = 0;
+    st->jmp_offsets = tcc_mallocz(st, (sym_end - (ElfW(Sym) *)
+                                       st->symtab_section->data) * sizeof(int));
+    for(i = 1; i < st->nb_sections; i++) {
+        s = st->sections[i];
+        if (s->sh_flags & SHF_ALLOC)
+            s->sh_addr += (unsigned long)st->runtime_mem;
+    }
+    return st->runtime_mem;
+}
+
+/* return the address of the jump table entry for symbol 'sym_index'
+   at address 'val' */
+static unsigned long add_jmp_table(TCCState *st, int sym_index, 
+                                   unsigned long val)
+{
+    unsigned char *p;
+
+    if (!st->jmp_offsets[sym_index]) {
+        p = st->jmp_table + st->nb_jmp_entries * JMP_TABLE_ENTRY_SIZE;
+        st->jmp_offsets[sym_index] = ++st->nb_jmp_entries;
+        p[0] = 0xff; /* jmp *0(%rip) */
+        p[1] = 0x25;
+        *(int *)(p + 2) = 0;
+        *(unsigned long *)(p + 6) = val;
+    }
+    return (unsigned long)(st->jmp_table + 
+                           (st->jmp_offsets[sym_index] - 1) * JMP_TABLE_ENTRY_SIZE);
+}
+
+/* move the relocated sections to the block of alloc_runtime_mem() and
+   make it executable. If 'ok' is zero, the block is freed instead. */
+static void move_runtime_mem(TCCState *st, int ok)
+{
+    Section *s;
+    unsigned long start, end;
+    int i;
+
+    ckfree((char *)st->jmp_offsets);
+    st->jmp_offsets = NULL;
+    if (!ok) {
+        ckfree((char *)st->runtime_mem);
+        st->runtime_mem = NULL;
+        return;
+    }
+    for(i = 1; i < st->nb_sections; i++) {
+        s = st->sections[i];
+        if (s->sh_flags & SHF_ALLOC) {
+            if (s->sh_type == SHT_NOBITS) {
+                memset((void *)s->sh_addr, 0, s->data_offset);
+            } else {
+                memcpy((void *)s->sh_addr, s->data, s->data_offset);
+                ckfree((char *)s->data);
+            }
+            s->data = (unsigned char *)s->sh_addr;
+            s->data_allocated = s->data_offset;
+        }
+    }
+    start = (unsigned long)st->runtime_mem & ~(PAGESIZE - 1);
+    end = (unsigned long)(st->jmp_table + 
+                          st->nb_jmp_entries * JMP_TABLE_ENTRY_SIZE);
+    end = (end + PAGESIZE - 1) & ~(PAGESIZE - 1);
+    mprotect((void *)start, end - start, PROT_READ | PROT_WRITE | PROT_EXEC);
+}
+#endif
+
 /* relocate a given section (CPU dependent) */
 static void relocate_section(TCCState *st, Section *s)
 {
     Section *sr;
-    Elf32_Rel *rel, *rel_end, *qrel;
-    Elf32_Sym *sym;
+    ElfW_Rel *rel, *rel_end, *qrel;
+    ElfW(Sym) *sym;
     int type, sym_index;
     unsigned char *ptr;
     unsigned long val, addr;
 #if defined(TCC_TARGET_I386)
     int esym_index;
+#elif defined(TCC_TARGET_X86_64)
+    int esym_index;
+    long long addend, diff;
 #endif
 
     sr = s->reloc;
-    rel_end = (Elf32_Rel *)(sr->data + sr->data_offset);
-    qrel = (Elf32_Rel *)sr->data;
+    rel_end = (ElfW_Rel *)(sr->data + sr->data_offset);
+    qrel = (ElfW_Rel *)sr->data;
     for(rel = qrel;
         rel < rel_end;
         rel++) {
         ptr = s->data + rel->r_offset;
 
-        sym_index = ELF32_R_SYM(rel->r_info);
-        sym = &((Elf32_Sym *)symtab_section->data)[sym_index];
+        sym_index = ELFW(R_SYM)(rel->r_info);
+        sym = &((ElfW(Sym) *)st->symtab_section->data)[sym_index];
         val = sym->st_value;
-        type = ELF32_R_TYPE(rel->r_info);
+        type = ELFW(R_TYPE)(rel->r_info);
         addr = s->sh_addr + rel->r_offset;
+#ifdef TCC_TARGET_X86_64
+        addend = rel->r_addend;
+        val += addend;
+#endif
 
         /* CPU specific */
         switch(type) {
@@ -495,11 +612,11 @@ static void relocate_section(TCCState *st, Section *s)
                 esym_index = st->symtab_to_dynsym[sym_index];
                 qrel->r_offset = rel->r_offset;
                 if (esym_index) {
-                    qrel->r_info = ELF32_R_INFO(esym_index, R_386_32);
+                    qrel->r_info = ELFW(R_INFO)(esym_index, R_386_32);
                     qrel++;
                     break;
                 } else {
-                    qrel->r_info = ELF32_R_INFO(0, R_386_RELATIVE);
+                    qrel->r_info = ELFW(R_INFO)(0, R_386_RELATIVE);
                     qrel++;
                 }
             }
@@ -511,7 +628,7 @@ static void relocate_section(TCCState *st, Section *s)
                 esym_index = st->symtab_to_dynsym[sym_index];
                 if (esym_index) {
                     qrel->r_offset = rel->r_offset;
-                    qrel->r_info = ELF32_R_INFO(esym_index, R_386_PC32);
+                    qrel->r_info = ELFW(R_INFO)(esym_index, R_386_PC32);
                     qrel++;
                     break;
                 }
@@ -535,6 +652,84 @@ static void relocate_section(TCCState *st, Section *s)
             /* we load the got offset */
             *(int *)ptr += st->got_offsets[sym_index];
             break;
+#elif defined(TCC_TARGET_X86_64)
+        case R_X86_64_64:
+            if (st->output_type == TCC_OUTPUT_DLL) {
+                esym_index = st->symtab_to_dynsym[sym_index];
+                addend += *(long long *)ptr;
+                qrel->r_offset = rel->r_offset;
+                if (esym_index) {
+                    qrel->r_info = ELFW(R_INFO)(esym_index, R_X86_64_64);
+                    qrel->r_addend = addend;
+                    qrel++;
+                    break;
+                } else {
+                    qrel->r_info = ELFW(R_INFO)(0, R_X86_64_RELATIVE);
+                    qrel->r_addend = *(long long *)ptr + val;
+                    qrel++;
+                }
+            }
+            *(long long *)ptr += val;
+            break;
+        case R_X86_64_32:
+        case R_X86_64_32S:
+            *(int *)ptr += val;
+            break;
+        case R_X86_64_PC32:
+            if (st->output_type == TCC_OUTPUT_DLL) {
+                /* DLL relocation */
+                esym_index = st->symtab_to_dynsym[sym_index];
+                if (esym_index) {
+                    qrel->r_offset = rel->r_offset;
+                    qrel->r_info = ELFW(R_INFO)(esym_index, R_X86_64_PC32);
+                    qrel->r_addend = addend + *(int *)ptr;
+                    qrel++;
+                    break;
+                }
+            }
+            /* fall through */
+        case R_X86_64_PLT32:
+            diff = (long long)(val - addr);
+            if (diff != (int)diff && st->output_type == TCC_OUTPUT_MEMORY &&
+                (type == R_X86_64_PLT32 || 
+                 ELFW(ST_TYPE)(sym->st_info) == STT_FUNC)) {
+                /* jump through the table at the end of the code */
+                diff = (long long)(add_jmp_table(st, sym_index, 
+                                                 sym->st_value) + addend - addr);
+            }
+            if (diff != (int)diff)
+                error_noabort(st, "relocation to '%s' out of range",
+                              st->strtab_section->data + sym->st_name);
+            *(int *)ptr += diff;
+            break;
+        case R_X86_64_GLOB_DAT:
+        case R_X86_64_JUMP_SLOT:
+            *(long long *)ptr = val;
+            break;
+        case R_X86_64_GOTPCRELX:
+        case R_X86_64_REX_GOTPCRELX:
+            /* a 'mov sym@GOTPCREL(%rip), r' can load the address
+               directly if the symbol is close enough */
+            diff = (long long)(val - addr);
+            if (st->output_type == TCC_OUTPUT_MEMORY && 
+                ptr[-2] == 0x8b && diff == (int)diff) {
+                ptr[-2] = 0x8d; /* lea sym(%rip), r */
+                *(int *)ptr += diff;
+                break;
+            }
+            /* fall through */
+        case R_X86_64_GOTPCREL:
+            if (st->output_type == TCC_OUTPUT_MEMORY) {
+                /* no dynamic linker to fill the entry */
+                *(unsigned long *)(st->got->data + 
+                                   st->got_offsets[sym_index]) = sym->st_value;
+            }
+            *(int *)ptr += st->got->sh_addr + st->got_offsets[sym_index] + 
+                addend - addr;
+            break;
+        default:
+            error_noabort(st, "unsupported relocation type %d", type);
+            break;
 #elif defined(TCC_TARGET_ARM)
 	case R_ARM_PC24:
 	case R_ARM_CALL:
@@ -625,30 +820,78 @@ static void relocate_section(TCCState *st, Section *s)
 static void relocate_rel(TCCState *st, Section *sr)
 {
     Section *s;
-    Elf32_Rel *rel, *rel_end;
+    ElfW_Rel *rel, *rel_end;
     
     s = st->sections[sr->sh_info];
-    rel_end = (Elf32_Rel *)(sr->data + sr->data_offset);
-    for(rel = (Elf32_Rel *)sr->data;
+    rel_end = (ElfW_Rel *)(sr->data + sr->data_offset);
+    for(rel = (ElfW_Rel *)sr->data;
         rel < rel_end;
         rel++) {
         rel->r_offset += s->sh_addr;
     }
 }
 
+#ifdef TCC_TARGET_X86_64
+/* the code generator leaves the addends in the relocated fields, as
+   with REL relocations: move them to the relocation entries for the
+   other linkers */
+static void move_addends(TCCState *st, Section *sr)
+{
+    Section *s;
+    ElfW_Rel *rel, *rel_end;
+    unsigned char *ptr;
+
+    s = st->sections[sr->sh_info];
+    rel_end = (ElfW_Rel *)(sr->data + sr->data_offset);
+    for(rel = (ElfW_Rel *)sr->data;
+        rel < rel_end;
+        rel++) {
+        ptr = s->data + rel->r_offset;
+        switch(ELFW(R_TYPE)(rel->r_info)) {
+        case R_X86_64_64:
+            rel->r_addend += *(long long *)ptr;
+            *(long long *)ptr = 0;
+            break;
+        case R_X86_64_32:
+        case R_X86_64_32S:
+        case R_X86_64_PC32:
+        case R_X86_64_PLT32:
+        case R_X86_64_GOTPCREL:
+        case R_X86_64_GOTPCRELX:
+        case R_X86_64_REX_GOTPCRELX:
+            rel->r_addend += *(int *)ptr;
+            *(int *)ptr = 0;
+            break;
+        default:
+            break;
+        }
+    }
+}
+#endif
+
 /* count the number of dynamic relocations so that we can reserve
    their space */
 static int prepare_dynamic_rel(TCCState *st, Section *sr)
 {
-    Elf32_Rel *rel, *rel_end;
+    ElfW_Rel *rel, *rel_end;
     int sym_index, esym_index, type, count;
 
     count = 0;
-    rel_end = (Elf32_Rel *)(sr->data + sr->data_offset);
-    for(rel = (Elf32_Rel *)sr->data; rel < rel_end; rel++) {
-        sym_index = ELF32_R_SYM(rel->r_info);
-        type = ELF32_R_TYPE(rel->r_info);
+    rel_end = (ElfW_Rel *)(sr->data + sr->data_offset);
+    for(rel = (ElfW_Rel *)sr->data; rel < rel_end; rel++) {
+        sym_index = ELFW(R_SYM)(rel->r_info);
+        type = ELFW(R_TYPE)(rel->r_info);
         switch(type) {
+#ifdef TCC_TARGET_X86_64
+        case R_X86_64_64:
+            count++;
+            break;
+        case R_X86_64_PC32:
+            esym_index = st->symtab_to_dynsym[sym_index];
+            if (esym_index)
+                count++;
+            break;
+#else
         case R_386_32:
             count++;
             break;
@@ -657,6 +900,7 @@ static int prepare_dynamic_rel(TCCState *st, Section *sr)
             if (esym_index)
                 count++;
             break;
+#endif
         default:
             break;
         }
@@ -664,7 +908,7 @@ static int prepare_dynamic_rel(TCCState *st, Section *sr)
     if (count) {
         /* allocate the section */
         sr->sh_flags |= SHF_ALLOC;
-        sr->sh_size = count * sizeof(Elf32_Rel);
+        sr->sh_size = count * sizeof(ElfW_Rel);
     }
     return count;
 }
@@ -699,7 +943,8 @@ static void put32(unsigned char *p, uint32_t val)
     p[3] = val >> 24;
 }
 
-#if defined(TCC_TARGET_I386) || defined(TCC_TARGET_ARM)
+#if defined(TCC_TARGET_I386) || defined(TCC_TARGET_ARM) || \
+    defined(TCC_TARGET_X86_64)
 static uint32_t get32(unsigned char *p)
 {
     return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
@@ -712,15 +957,13 @@ static void build_got(TCCState *st)
 
     /* if no got, then create it */
     st->got = new_section(st, ".got", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE);
-    st->got->sh_entsize = 4;
-    add_elf_sym(st, symtab_section, 0, 4, ELF32_ST_INFO(STB_GLOBAL, STT_OBJECT), 
+    st->got->sh_entsize = PTR_SIZE;
+    add_elf_sym(st, st->symtab_section, 0, PTR_SIZE, ELFW(ST_INFO)(STB_GLOBAL, STT_OBJECT), 
                 0, st->got->sh_num, "_GLOBAL_OFFSET_TABLE_");
-    ptr = section_ptr_add(st, st->got, 3 * sizeof(int));
-    /* keep space for _DYNAMIC pointer, if present */
-    put32(ptr, 0);
-    /* two dummy got entries */
-    put32(ptr + 4, 0);
-    put32(ptr + 8, 0);
+    ptr = section_ptr_add(st, st->got, 3 * PTR_SIZE);
+    /* keep space for _DYNAMIC pointer, if present, and two dummy got
+       entries */
+    memset(ptr, 0, 3 * PTR_SIZE);
 }
 
 /* put a got entry corresponding to a symbol in symtab_section. 'size'
@@ -731,9 +974,9 @@ static void put_got_entry(TCCState *st,
 {
     int index;
     const char *name;
-    Elf32_Sym *sym;
+    ElfW(Sym) *sym;
     unsigned long offset;
-    int *ptr;
+    unsigned char *ptr;
 
     if (!st->got)
         build_got(st);
@@ -746,8 +989,8 @@ static void put_got_entry(TCCState *st,
     put_got_offset(st, sym_index, st->got->data_offset);
 
     if (st->dynsym) {
-        sym = &((Elf32_Sym *)symtab_section->data)[sym_index];
-        name = symtab_section->link->data + sym->st_name;
+        sym = &((ElfW(Sym) *)st->symtab_section->data)[sym_index];
+        name = st->symtab_section->link->data + sym->st_name;
         offset = sym->st_value;
 #ifdef TCC_TARGET_I386
         if (reloc_type == R_386_JMP_SLOT) {
@@ -788,6 +1031,40 @@ static void put_got_entry(TCCState *st,
             if (st->output_type == TCC_OUTPUT_EXE)
                 offset = plt->data_offset - 16;
         }
+#elif defined(TCC_TARGET_X86_64)
+        if (reloc_type == R_X86_64_JUMP_SLOT) {
+            Section *plt;
+            uint8_t *p;
+
+            /* add a PLT entry. The got offsets are made %rip relative
+               in tcc_output_file() */
+            plt = st->plt;
+            if (plt->data_offset == 0) {
+                /* first plt entry */
+                p = section_ptr_add(st, plt, 16);
+                p[0] = 0xff; /* pushq got + 8(%rip) */
+                p[1] = 0x35;
+                put32(p + 2, 8);
+                p[6] = 0xff; /* jmp *got + 16(%rip) */
+                p[7] = 0x25;
+                put32(p + 8, 16);
+                put32(p + 12, 0x00401f0f); /* nopl 0(%rax) */
+            }
+
+            p = section_ptr_add(st, plt, 16);
+            p[0] = 0xff; /* jmp *got + x(%rip) */
+            p[1] = 0x25;
+            put32(p + 2, st->got->data_offset);
+            p[6] = 0x68; /* push $xxx */
+            put32(p + 7, (plt->data_offset - 32) >> 4);
+            p[11] = 0xe9; /* jmp plt_start */
+            put32(p + 12, -(plt->data_offset));
+
+            /* the symbol is modified so that it will be relocated to
+               the PLT. The calls of a DLL also go through the PLT: the
+               value is then cleared once the sections are relocated */
+            offset = plt->data_offset - 16;
+        }
 #elif defined(TCC_TARGET_ARM)
 	if (reloc_type == R_ARM_JUMP_SLOT) {
             Section *plt;
@@ -831,31 +1108,31 @@ static void put_got_entry(TCCState *st,
                       st->got->data_offset, 
                       reloc_type, index);
     }
-    ptr = section_ptr_add(st, st->got, sizeof(int));
-    *ptr = 0;
+    ptr = section_ptr_add(st, st->got, PTR_SIZE);
+    memset(ptr, 0, PTR_SIZE);
 }
 
 /* build GOT and PLT entries */
 static void build_got_entries(TCCState *st)
 {
     Section *s, *symtab;
-    Elf32_Rel *rel, *rel_end;
-    Elf32_Sym *sym;
+    ElfW_Rel *rel, *rel_end;
+    ElfW(Sym) *sym;
     int i, type, reloc_type, sym_index;
 
     for(i = 1; i < st->nb_sections; i++) {
         s = st->sections[i];
-        if (s->sh_type != SHT_REL)
+        if (s->sh_type != SHT_RELX)
             continue;
         /* no need to handle got relocations */
-        if (s->link != symtab_section)
+        if (s->link != st->symtab_section)
             continue;
         symtab = s->link;
-        rel_end = (Elf32_Rel *)(s->data + s->data_offset);
-        for(rel = (Elf32_Rel *)s->data;
+        rel_end = (ElfW_Rel *)(s->data + s->data_offset);
+        for(rel = (ElfW_Rel *)s->data;
             rel < rel_end;
             rel++) {
-            type = ELF32_R_TYPE(rel->r_info);
+            type = ELFW(R_TYPE)(rel->r_info);
             switch(type) {
 #if defined(TCC_TARGET_I386)
             case R_386_GOT32:
@@ -865,8 +1142,8 @@ static void build_got_entries(TCCState *st)
                 if (!st->got)
                     build_got(st);
                 if (type == R_386_GOT32 || type == R_386_PLT32) {
-                    sym_index = ELF32_R_SYM(rel->r_info);
-                    sym = &((Elf32_Sym *)symtab_section->data)[sym_index];
+                    sym_index = ELFW(R_SYM)(rel->r_info);
+                    sym = &((ElfW(Sym) *)st->symtab_section->data)[sym_index];
                     /* look at the symbol got offset. If none, then add one */
                     if (type == R_386_GOT32)
                         reloc_type = R_386_GLOB_DAT;
@@ -876,6 +1153,28 @@ static void build_got_entries(TCCState *st)
                                   sym_index);
                 }
                 break;
+#elif defined(TCC_TARGET_X86_64)
+            case R_X86_64_GOTPCREL:
+            case R_X86_64_GOTPCRELX:
+            case R_X86_64_REX_GOTPCRELX:
+            case R_X86_64_PLT32:
+                if (!st->got)
+                    build_got(st);
+                sym_index = ELFW(R_SYM)(rel->r_info);
+                sym = &((ElfW(Sym) *)st->symtab_section->data)[sym_index];
+                /* in memory, the calls reach far functions through
+                   the jump table of add_jmp_table() instead of a PLT */
+                if (type == R_X86_64_PLT32) {
+                    if (st->output_type == TCC_OUTPUT_MEMORY ||
+                        sym->st_shndx != SHN_UNDEF)
+                        break;
+                    reloc_type = R_X86_64_JUMP_SLOT;
+                } else {
+                    reloc_type = R_X86_64_GLOB_DAT;
+                }
+                put_got_entry(st, reloc_type, sym->st_size, sym->st_info, 
+                              sym_index);
+                break;
 #elif defined(TCC_TARGET_ARM)
 	    case R_ARM_GOT_BREL:
             case R_ARM_GOTOFF32:
@@ -884,8 +1183,8 @@ static void build_got_entries(TCCState *st)
                 if (!st->got)
                     build_got(st);
                 if (type == R_ARM_GOT_BREL || type == R_ARM_PLT32) {
-                    sym_index = ELF32_R_SYM(rel->r_info);
-                    sym = &((Elf32_Sym *)symtab_section->data)[sym_index];
+                    sym_index = ELFW(R_SYM)(rel->r_info);
+                    sym = &((ElfW(Sym) *)st->symtab_section->data)[sym_index];
                     /* look at the symbol got offset. If none, then add one */
                     if (type == R_ARM_GOT_BREL)
                         reloc_type = R_ARM_GLOB_DAT;
@@ -903,8 +1202,8 @@ static void build_got_entries(TCCState *st)
                 if (!st->got)
                     build_got(st);
                 if (type == R_C60_GOT32 || type == R_C60_PLT32) {
-                    sym_index = ELF32_R_SYM(rel->r_info);
-                    sym = &((Elf32_Sym *)symtab_section->data)[sym_index];
+                    sym_index = ELFW(R_SYM)(rel->r_info);
+                    sym = &((ElfW(Sym) *)st->symtab_section->data)[sym_index];
                     /* look at the symbol got offset. If none, then add one */
                     if (type == R_C60_GOT32)
                         reloc_type = R_C60_GLOB_DAT;
@@ -933,7 +1232,7 @@ static Section *new_symtab(TCCState *st,
     int *ptr, nb_buckets;
 
     symtab = new_section(st, symtab_name, sh_type, sh_flags);
-    symtab->sh_entsize = sizeof(Elf32_Sym);
+    symtab->sh_entsize = sizeof(ElfW(Sym));
     strtab = new_section(st, strtab_name, SHT_STRTAB, sh_flags);
     put_elf_str(st, strtab, "");
     symtab->link = strtab;
@@ -956,8 +1255,8 @@ static Section *new_symtab(TCCState *st,
 /* put dynamic tag */
 static void put_dt(TCCState *st, Section *dynamic, int dt, unsigned long val)
 {
-    Elf32_Dyn *dyn;
-    dyn = section_ptr_add(st, dynamic, sizeof(Elf32_Dyn));
+    ElfW(Dyn) *dyn;
+    dyn = section_ptr_add(st, dynamic, sizeof(ElfW(Dyn)));
     dyn->d_tag = dt;
     dyn->d_un.d_val = val;
 }
@@ -975,39 +1274,41 @@ static void add_init_array_defines(TCCState *st, const char *section_name)
     s = find_section(st, section_name);
     if (!s) {
         end_offset = 0;
-        s = data_section;
+        s = st->data_section;
     } else {
         end_offset = s->data_offset;
     }
 
-    add_elf_sym(st, symtab_section, 
+    add_elf_sym(st, st->symtab_section, 
                 0, 0,
-                ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
+                ELFW(ST_INFO)(STB_GLOBAL, STT_NOTYPE), 0,
                 s->sh_num, sym_start);
-    add_elf_sym(st, symtab_section, 
+    add_elf_sym(st, st->symtab_section, 
                 end_offset, 0,
-                ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
+                ELFW(ST_INFO)(STB_GLOBAL, STT_NOTYPE), 0,
                 s->sh_num, sym_end);
 }
 
 /* add tcc runtime libraries */
 static void tcc_add_runtime(TCCState *st)
 {
+#ifndef TCC_TARGET_X86_64
     char buf[1024];
+#endif
 
 #if 0
-    if (do_bounds_check) {
+    if (st->do_bounds_check) {
         unsigned long *ptr;
         Section *init_section;
         unsigned char *pinit;
         int sym_index;
 
         /* XXX: add an object file to do that */
-        ptr = section_ptr_add(st, bounds_section, sizeof(unsigned long));
+        ptr = section_ptr_add(st, st->bounds_section, sizeof(unsigned long));
         *ptr = 0;
-        add_elf_sym(st, symtab_section, 0, 0, 
-                    ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
-                    bounds_section->sh_num, "__bounds_start");
+        add_elf_sym(st, st->symtab_section, 0, 0, 
+                    ELFW(ST_INFO)(STB_GLOBAL, STT_NOTYPE), 0,
+                    st->bounds_section->sh_num, "__bounds_start");
         /* add bound check code */
         snprintf(buf, sizeof(buf), "%s/%s", Tcl_GetString(tcc_lib_path), "bcheck.o");
         tcc_add_file(st, buf);
@@ -1018,8 +1319,8 @@ static void tcc_add_runtime(TCCState *st)
             pinit = section_ptr_add(st, init_section, 5);
             pinit[0] = 0xe8;
             put32(pinit + 1, -4);
-            sym_index = find_elf_sym(symtab_section, "__bound_init");
-            put_elf_reloc(st, symtab_section, init_section, 
+            sym_index = find_elf_sym(st->symtab_section, "__bound_init");
+            put_elf_reloc(st, st->symtab_section, init_section, 
                           init_section->data_offset - 4, R_386_PC32, sym_index);
         }
 #endif
@@ -1029,8 +1330,11 @@ static void tcc_add_runtime(TCCState *st)
     if (!st->nostdlib) {
         tcc_add_library(st, "c");
 
+#ifndef TCC_TARGET_X86_64
+        /* the x86_64 code does not call helper functions */
         snprintf(buf, sizeof(buf), "%s/lib/%s", Tcl_GetString(st->tcc_lib_path), "libtcc1.a");
         tcc_add_file(st, buf);
+#endif
     }
     /* add crt end if not memory output */
     if (st->output_type != TCC_OUTPUT_MEMORY && !st->nostdlib) {
@@ -1047,18 +1351,18 @@ static void tcc_add_linker_symbols(TCCState *st)
     int i;
     Section *s;
 
-    add_elf_sym(st, symtab_section, 
-                text_section->data_offset, 0,
-                ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
-                text_section->sh_num, "_etext");
-    add_elf_sym(st, symtab_section, 
-                data_section->data_offset, 0,
-                ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
-                data_section->sh_num, "_edata");
-    add_elf_sym(st, symtab_section, 
-                bss_section->data_offset, 0,
-                ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
-                bss_section->sh_num, "_end");
+    add_elf_sym(st, st->symtab_section, 
+                st->text_section->data_offset, 0,
+                ELFW(ST_INFO)(STB_GLOBAL, STT_NOTYPE), 0,
+                st->text_section->sh_num, "_etext");
+    add_elf_sym(st, st->symtab_section, 
+                st->data_section->data_offset, 0,
+                ELFW(ST_INFO)(STB_GLOBAL, STT_NOTYPE), 0,
+                st->data_section->sh_num, "_edata");
+    add_elf_sym(st, st->symtab_section, 
+                st->bss_section->data_offset, 0,
+                ELFW(ST_INFO)(STB_GLOBAL, STT_NOTYPE), 0,
+                st->bss_section->sh_num, "_end");
     /* horrible new standard ldscript defines */
     add_init_array_defines(st, ".preinit_array");
     add_init_array_defines(st, ".init_array");
@@ -1084,14 +1388,14 @@ static void tcc_add_linker_symbols(TCCState *st)
                 p++;
             }
             snprintf(buf, sizeof(buf), "__start_%s", s->name);
-            add_elf_sym(st, symtab_section, 
+            add_elf_sym(st, st->symtab_section, 
                         0, 0,
-                        ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
+                        ELFW(ST_INFO)(STB_GLOBAL, STT_NOTYPE), 0,
                         s->sh_num, buf);
             snprintf(buf, sizeof(buf), "__stop_%s", s->name);
-            add_elf_sym(st, symtab_section,
+            add_elf_sym(st, st->symtab_section,
                         s->data_offset, 0,
-                        ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
+                        ELFW(ST_INFO)(STB_GLOBAL, STT_NOTYPE), 0,
                         s->sh_num, buf);
         }
     next_sec: ;
@@ -1104,6 +1408,8 @@ static char elf_interp[] = "/usr/libexec/ld-elf.so.1";
 #else
 #ifdef TCC_ARM_EABI
 static char elf_interp[] = "/lib/ld-linux.so.3";
+#elif defined(TCC_TARGET_X86_64)
+static char elf_interp[] = "/lib64/ld-linux-x86-64.so.2";
 #else
 static char elf_interp[] = "/lib/ld-linux.so.2";
 #endif
@@ -1135,18 +1441,18 @@ static void tcc_output_binary(TCCState *st, FILE *f,
 /* XXX: suppress unneeded sections */
 int tcc_output_file(TCCState *st, const char *filename)
 {
-    Elf32_Ehdr ehdr;
+    ElfW(Ehdr) ehdr;
     FILE *f;
     int fd, mode, ret;
     int *section_order;
     int shnum, i, phnum, file_offset, offset, size, j, tmp, sh_order_index, k;
     unsigned long addr;
     Section *strsec, *s;
-    Elf32_Shdr shdr, *sh;
-    Elf32_Phdr *phdr, *ph;
+    ElfW(Shdr) shdr, *sh;
+    ElfW(Phdr) *phdr, *ph;
     Section *interp, *dynamic, *dynstr;
     unsigned long saved_dynamic_data_offset;
-    Elf32_Sym *sym;
+    ElfW(Sym) *sym;
     int type, file_type;
     unsigned long rel_addr, rel_size;
     
@@ -1165,14 +1471,14 @@ int tcc_output_file(TCCState *st, const char *filename)
     saved_dynamic_data_offset = 0; /* avoid warning */
     
     if (file_type != TCC_OUTPUT_OBJ) {
-        relocate_common_syms();
+        relocate_common_syms(st);
 
         tcc_add_linker_symbols(st);
 
         if (!st->static_link) {
             const char *name;
             int sym_index, index;
-            Elf32_Sym *esym, *sym_end;
+            ElfW(Sym) *esym, *sym_end;
             
             if (file_type == TCC_OUTPUT_EXE) {
                 char *ptr;
@@ -1193,7 +1499,7 @@ int tcc_output_file(TCCState *st, const char *filename)
             dynamic = new_section(st, ".dynamic", SHT_DYNAMIC, 
                                   SHF_ALLOC | SHF_WRITE);
             dynamic->link = dynstr;
-            dynamic->sh_entsize = sizeof(Elf32_Dyn);
+            dynamic->sh_entsize = sizeof(ElfW(Dyn));
         
             /* add PLT */
             st->plt = new_section(st, ".plt", SHT_PROGBITS, 
@@ -1206,50 +1512,50 @@ int tcc_output_file(TCCState *st, const char *filename)
                dynamic symbols. If a symbol STT_FUNC is found, then we
                add it in the PLT. If a symbol STT_OBJECT is found, we
                add it in the .bss section with a suitable relocation */
-            sym_end = (Elf32_Sym *)(symtab_section->data + 
-                                    symtab_section->data_offset);
+            sym_end = (ElfW(Sym) *)(st->symtab_section->data + 
+                                    st->symtab_section->data_offset);
             if (file_type == TCC_OUTPUT_EXE) {
-                for(sym = (Elf32_Sym *)symtab_section->data + 1; 
+                for(sym = (ElfW(Sym) *)st->symtab_section->data + 1; 
                     sym < sym_end;
                     sym++) {
                     if (sym->st_shndx == SHN_UNDEF) {
-                        name = symtab_section->link->data + sym->st_name;
+                        name = st->symtab_section->link->data + sym->st_name;
                         sym_index = find_elf_sym(st->dynsymtab_section, name);
                         if (sym_index) {
-                            esym = &((Elf32_Sym *)st->dynsymtab_section->data)[sym_index];
-                            type = ELF32_ST_TYPE(esym->st_info);
+                            esym = &((ElfW(Sym) *)st->dynsymtab_section->data)[sym_index];
+                            type = ELFW(ST_TYPE)(esym->st_info);
                             if (type == STT_FUNC) {
                                 put_got_entry(st, R_JMP_SLOT, esym->st_size, 
                                               esym->st_info, 
-                                              sym - (Elf32_Sym *)symtab_section->data);
+                                              sym - (ElfW(Sym) *)st->symtab_section->data);
                             } else if (type == STT_OBJECT) {
                                 unsigned long offset;
-                                offset = bss_section->data_offset;
+                                offset = st->bss_section->data_offset;
                                 /* XXX: which alignment ? */
                                 offset = (offset + 16 - 1) & -16;
                                 index = put_elf_sym(st, st->dynsym, offset, esym->st_size, 
                                                     esym->st_info, 0, 
-                                                    bss_section->sh_num, name);
-                                put_elf_reloc(st, st->dynsym, bss_section, 
+                                                    st->bss_section->sh_num, name);
+                                put_elf_reloc(st, st->dynsym, st->bss_section, 
                                               offset, R_COPY, index);
                                 offset += esym->st_size;
-                                bss_section->data_offset = offset;
+                                st->bss_section->data_offset = offset;
                             }
                         } else {
                                 /* STB_WEAK undefined symbols are accepted */
                                 /* XXX: _fp_hw seems to be part of the ABI, so we ignore
                                    it */
-                            if (ELF32_ST_BIND(sym->st_info) == STB_WEAK ||
+                            if (ELFW(ST_BIND)(sym->st_info) == STB_WEAK ||
                                 !strcmp(name, "_fp_hw")) {
                             } else {
                                 error_noabort(st, "undefined symbol '%s'", name);
                             }
                         }
                     } else if (st->rdynamic && 
-                               ELF32_ST_BIND(sym->st_info) != STB_LOCAL) {
+                               ELFW(ST_BIND)(sym->st_info) != STB_LOCAL) {
                         /* if -rdynamic option, then export all non
                            local symbols */
-                        name = symtab_section->link->data + sym->st_name;
+                        name = st->symtab_section->link->data + sym->st_name;
                         put_elf_sym(st, st->dynsym, sym->st_value, sym->st_size, 
                                     sym->st_info, 0, 
                                     sym->st_shndx, name);
@@ -1261,23 +1567,23 @@ int tcc_output_file(TCCState *st, const char *filename)
 
                 /* now look at unresolved dynamic symbols and export
                    corresponding symbol */
-                sym_end = (Elf32_Sym *)(st->dynsymtab_section->data + 
+                sym_end = (ElfW(Sym) *)(st->dynsymtab_section->data + 
                                         st->dynsymtab_section->data_offset);
-                for(esym = (Elf32_Sym *)st->dynsymtab_section->data + 1; 
+                for(esym = (ElfW(Sym) *)st->dynsymtab_section->data + 1; 
                     esym < sym_end;
                     esym++) {
                     if (esym->st_shndx == SHN_UNDEF) {
                         name = st->dynsymtab_section->link->data + esym->st_name;
-                        sym_index = find_elf_sym(symtab_section, name);
+                        sym_index = find_elf_sym(st->symtab_section, name);
                         if (sym_index) {
                             /* XXX: avoid adding a symbol if already
                                present because of -rdynamic ? */
-                            sym = &((Elf32_Sym *)symtab_section->data)[sym_index];
+                            sym = &((ElfW(Sym) *)st->symtab_section->data)[sym_index];
                             put_elf_sym(st, st->dynsym, sym->st_value, sym->st_size, 
                                         sym->st_info, 0, 
                                         sym->st_shndx, name);
                         } else {
-                            if (ELF32_ST_BIND(esym->st_info) == STB_WEAK) {
+                            if (ELFW(ST_BIND)(esym->st_info) == STB_WEAK) {
                                 /* weak symbols can stay undefined */
                             } else {
                                 warning(st, "undefined dynamic symbol '%s'", name);
@@ -1288,18 +1594,18 @@ int tcc_output_file(TCCState *st, const char *filename)
             } else {
                 int nb_syms;
                 /* shared library case : we simply export all the global symbols */
-                nb_syms = symtab_section->data_offset / sizeof(Elf32_Sym);
+                nb_syms = st->symtab_section->data_offset / sizeof(ElfW(Sym));
                 st->symtab_to_dynsym = tcc_mallocz(st, sizeof(int) * nb_syms);
-                for(sym = (Elf32_Sym *)symtab_section->data + 1; 
+                for(sym = (ElfW(Sym) *)st->symtab_section->data + 1; 
                     sym < sym_end;
                     sym++) {
-                    if (ELF32_ST_BIND(sym->st_info) != STB_LOCAL) {
-                        name = symtab_section->link->data + sym->st_name;
+                    if (ELFW(ST_BIND)(sym->st_info) != STB_LOCAL) {
+                        name = st->symtab_section->link->data + sym->st_name;
                         index = put_elf_sym(st, st->dynsym, sym->st_value, sym->st_size, 
                                             sym->st_info, 0, 
                                             sym->st_shndx, name);
                         st->symtab_to_dynsym[sym - 
-                                            (Elf32_Sym *)symtab_section->data] = 
+                                            (ElfW(Sym) *)st->symtab_section->data] = 
                             index;
                     }
                 }
@@ -1320,7 +1626,7 @@ int tcc_output_file(TCCState *st, const char *filename)
 
             /* add necessary space for other entries */
             saved_dynamic_data_offset = dynamic->data_offset;
-            dynamic->data_offset += 8 * 9;
+            dynamic->data_offset += sizeof(ElfW(Dyn)) * 9;
         } else {
             /* still need to build got entries in case of static link */
             build_got_entries(st);
@@ -1368,10 +1674,10 @@ int tcc_output_file(TCCState *st, const char *filename)
         /* when generating a DLL, we include relocations but we may
            patch them */
         if (file_type == TCC_OUTPUT_DLL && 
-            s->sh_type == SHT_REL && 
+            s->sh_type == SHT_RELX && 
             !(s->sh_flags & SHF_ALLOC)) {
             prepare_dynamic_rel(st, s);
-        } else if (do_debug || 
+        } else if (st->do_debug || 
             file_type == TCC_OUTPUT_OBJ || 
             (s->sh_flags & SHF_ALLOC) ||
             i == (st->nb_sections - 1)) {
@@ -1381,10 +1687,10 @@ int tcc_output_file(TCCState *st, const char *filename)
     }
 
     /* allocate program segment headers */
-    phdr = tcc_mallocz(st, phnum * sizeof(Elf32_Phdr));
+    phdr = tcc_mallocz(st, phnum * sizeof(ElfW(Phdr)));
         
     if (st->output_format == TCC_OUTPUT_FORMAT_ELF) {
-        file_offset = sizeof(Elf32_Ehdr) + phnum * sizeof(Elf32_Phdr);
+        file_offset = sizeof(ElfW(Ehdr)) + phnum * sizeof(ElfW(Phdr));
     } else {
         file_offset = 0;
     }
@@ -1450,7 +1756,7 @@ int tcc_output_file(TCCState *st, const char *filename)
                                s->sh_type == SHT_HASH) {
                         if (k != 1)
                             continue;
-                    } else if (s->sh_type == SHT_REL) {
+                    } else if (s->sh_type == SHT_RELX) {
                         if (k != 2)
                             continue;
                     } else if (s->sh_type == SHT_NOBITS) {
@@ -1477,7 +1783,7 @@ int tcc_output_file(TCCState *st, const char *filename)
                         ph->p_paddr = ph->p_vaddr;
                     }
                     /* update dynamic relocation infos */
-                    if (s->sh_type == SHT_REL) {
+                    if (s->sh_type == SHT_RELX) {
                         if (rel_size == 0)
                             rel_addr = addr;
                         rel_size += s->sh_size;
@@ -1520,7 +1826,7 @@ int tcc_output_file(TCCState *st, const char *filename)
         
         /* if dynamic section, then add corresponing program header */
         if (dynamic) {
-            Elf32_Sym *sym_end;
+            ElfW(Sym) *sym_end;
 
             ph = &phdr[phnum - 1];
             
@@ -1537,7 +1843,12 @@ int tcc_output_file(TCCState *st, const char *filename)
             put32(st->got->data, dynamic->sh_addr);
 
             /* relocate the PLT */
+#ifdef TCC_TARGET_X86_64
+            /* %rip relative, so also in a DLL */
+            if (file_type == TCC_OUTPUT_EXE || file_type == TCC_OUTPUT_DLL) {
+#else
             if (file_type == TCC_OUTPUT_EXE) {
+#endif
                 uint8_t *p, *p_end;
 
                 p = st->plt->data;
@@ -1551,6 +1862,17 @@ int tcc_output_file(TCCState *st, const char *filename)
                         put32(p + 2, get32(p + 2) + st->got->sh_addr);
                         p += 16;
                     }
+#elif defined(TCC_TARGET_X86_64)
+                    /* got offsets relative to the end of the instruction */
+                    long x;
+                    x = st->got->sh_addr - st->plt->sh_addr;
+                    put32(p + 2, get32(p + 2) + x - 6);
+                    put32(p + 8, get32(p + 8) + x - 12);
+                    p += 16;
+                    while (p < p_end) {
+                        put32(p + 2, get32(p + 2) + x - (p - st->plt->data) - 6);
+                        p += 16;
+                    }
 #elif defined(TCC_TARGET_ARM)
 		    int x;
 		    x=st->got->sh_addr - st->plt->sh_addr - 12;
@@ -1568,8 +1890,8 @@ int tcc_output_file(TCCState *st, const char *filename)
             }
 
             /* relocate symbols in .dynsym */
-            sym_end = (Elf32_Sym *)(st->dynsym->data + st->dynsym->data_offset);
-            for(sym = (Elf32_Sym *)st->dynsym->data + 1; 
+            sym_end = (ElfW(Sym) *)(st->dynsym->data + st->dynsym->data_offset);
+            for(sym = (ElfW(Sym) *)st->dynsym->data + 1; 
                 sym < sym_end;
                 sym++) {
                 if (sym->st_shndx == SHN_UNDEF) {
@@ -1589,16 +1911,22 @@ int tcc_output_file(TCCState *st, const char *filename)
             put_dt(st, dynamic, DT_STRTAB, dynstr->sh_addr);
             put_dt(st, dynamic, DT_SYMTAB, st->dynsym->sh_addr);
             put_dt(st, dynamic, DT_STRSZ, dynstr->data_offset);
-            put_dt(st, dynamic, DT_SYMENT, sizeof(Elf32_Sym));
+            put_dt(st, dynamic, DT_SYMENT, sizeof(ElfW(Sym)));
+#ifdef TCC_TARGET_X86_64
+            put_dt(st, dynamic, DT_RELA, rel_addr);
+            put_dt(st, dynamic, DT_RELASZ, rel_size);
+            put_dt(st, dynamic, DT_RELAENT, sizeof(ElfW_Rel));
+#else
             put_dt(st, dynamic, DT_REL, rel_addr);
             put_dt(st, dynamic, DT_RELSZ, rel_size);
-            put_dt(st, dynamic, DT_RELENT, sizeof(Elf32_Rel));
+            put_dt(st, dynamic, DT_RELENT, sizeof(ElfW_Rel));
+#endif
             put_dt(st, dynamic, DT_NULL, 0);
         }
 
-        ehdr.e_phentsize = sizeof(Elf32_Phdr);
+        ehdr.e_phentsize = sizeof(ElfW(Phdr));
         ehdr.e_phnum = phnum;
-        ehdr.e_phoff = sizeof(Elf32_Ehdr);
+        ehdr.e_phoff = sizeof(ElfW(Ehdr));
     }
 
     /* all other sections come after */
@@ -1615,6 +1943,16 @@ int tcc_output_file(TCCState *st, const char *filename)
             file_offset += s->sh_size;
     }
     
+#ifdef TCC_TARGET_X86_64
+    if (file_type == TCC_OUTPUT_OBJ) {
+        for(i = 1; i < st->nb_sections; i++) {
+            s = st->sections[i];
+            if (s->sh_type == SHT_RELX && s->link == st->symtab_section)
+                move_addends(st, s);
+        }
+    }
+#endif
+
     /* if building executable or DLL, then relocate each section
        except the GOT which is already relocated */
     if (file_type != TCC_OUTPUT_OBJ) {
@@ -1634,12 +1972,24 @@ int tcc_output_file(TCCState *st, const char *filename)
                 relocate_section(st, s);
         }
 
+#ifdef TCC_TARGET_X86_64
+        /* undefined symbols of a DLL must not look defined */
+        if (file_type == TCC_OUTPUT_DLL) {
+            ElfW(Sym) *sym_end;
+            sym_end = (ElfW(Sym) *)(st->dynsym->data + st->dynsym->data_offset);
+            for(sym = (ElfW(Sym) *)st->dynsym->data + 1; sym < sym_end; sym++) {
+                if (sym->st_shndx == SHN_UNDEF)
+                    sym->st_value = 0;
+            }
+        }
+#endif
+
         /* relocate relocation entries if the relocation tables are
            allocated in the executable */
         for(i = 1; i < st->nb_sections; i++) {
             s = st->sections[i];
             if ((s->sh_flags & SHF_ALLOC) &&
-                s->sh_type == SHT_REL) {
+                s->sh_type == SHT_RELX) {
                 relocate_rel(st, s);
             }
         }
@@ -1648,7 +1998,7 @@ int tcc_output_file(TCCState *st, const char *filename)
         if (file_type == TCC_OUTPUT_EXE)
             ehdr.e_entry = (unsigned long)tcc_get_symbol_err(st, "_start");
         else
-            ehdr.e_entry = text_section->sh_addr; /* XXX: is it correct ? */
+            ehdr.e_entry = st->text_section->sh_addr; /* XXX: is it correct ? */
     }
 
     /* write elf file */
@@ -1669,7 +2019,7 @@ int tcc_output_file(TCCState *st, const char *filename)
     } else
 #endif
     if (st->output_format == TCC_OUTPUT_FORMAT_ELF) {
-        sort_syms(st, symtab_section);
+        sort_syms(st, st->symtab_section);
         
         /* align to 4 */
         file_offset = (file_offset + 3) & -4;
@@ -1679,7 +2029,7 @@ int tcc_output_file(TCCState *st, const char *filename)
         ehdr.e_ident[1] = ELFMAG1;
         ehdr.e_ident[2] = ELFMAG2;
         ehdr.e_ident[3] = ELFMAG3;
-        ehdr.e_ident[4] = ELFCLASS32;
+        ehdr.e_ident[4] = ELFCLASSW;
         ehdr.e_ident[5] = ELFDATA2LSB;
         ehdr.e_ident[6] = EV_CURRENT;
 #ifdef __FreeBSD__
@@ -1708,14 +2058,14 @@ int tcc_output_file(TCCState *st, const char *filename)
         ehdr.e_machine = EM_TCC_TARGET;
         ehdr.e_version = EV_CURRENT;
         ehdr.e_shoff = file_offset;
-        ehdr.e_ehsize = sizeof(Elf32_Ehdr);
-        ehdr.e_shentsize = sizeof(Elf32_Shdr);
+        ehdr.e_ehsize = sizeof(ElfW(Ehdr));
+        ehdr.e_shentsize = sizeof(ElfW(Shdr));
         ehdr.e_shnum = shnum;
         ehdr.e_shstrndx = shnum - 1;
         
-        fwrite(&ehdr, 1, sizeof(Elf32_Ehdr), f);
-        fwrite(phdr, 1, phnum * sizeof(Elf32_Phdr), f);
-        offset = sizeof(Elf32_Ehdr) + phnum * sizeof(Elf32_Phdr);
+        fwrite(&ehdr, 1, sizeof(ElfW(Ehdr)), f);
+        fwrite(phdr, 1, phnum * sizeof(ElfW(Phdr)), f);
+        offset = sizeof(ElfW(Ehdr)) + phnum * sizeof(ElfW(Phdr));
 
         for(i=1;i<st->nb_sections;i++) {
             s = st->sections[section_order[i]];
@@ -1738,7 +2088,7 @@ int tcc_output_file(TCCState *st, const char *filename)
     
         for(i=0;i<st->nb_sections;i++) {
             sh = &shdr;
-            memset(sh, 0, sizeof(Elf32_Shdr));
+            memset(sh, 0, sizeof(ElfW(Shdr)));
             s = st->sections[i];
             if (s) {
                 sh->sh_name = s->sh_name;
@@ -1753,7 +2103,7 @@ int tcc_output_file(TCCState *st, const char *filename)
                 sh->sh_offset = s->sh_offset;
                 sh->sh_size = s->sh_size;
             }
-            fwrite(sh, 1, sizeof(Elf32_Shdr), f);
+            fwrite(sh, 1, sizeof(ElfW(Shdr)), f);
         }
     } else {
         tcc_output_binary(st, f, section_order);
@@ -1771,12 +2121,10 @@ int tcc_output_file(TCCState *st, const char *filename)
 
 static void *load_data(TCCState *st, Tcl_Channel fd, unsigned long file_offset, unsigned long size)
 {
-    void * ret = ckalloc(size);
-    Tcl_Obj * ba = Tcl_NewByteArrayObj(ret,size);
+    void * ret = tcc_malloc(st, size);
 
-    Tcl_SetChannelOption(NULL,fd,"translation", "binary");
     Tcl_Seek(fd, file_offset, SEEK_SET);
-    Tcl_ReadChars(fd, ba, size, 0);
+    Tcl_Read(fd, ret, size);
     return ret;
 }
 
@@ -1787,54 +2135,32 @@ typedef struct SectionMergeInfo {
     uint8_t link_once;         /* true if link once section */
 } SectionMergeInfo;
 
-/* load an object file and merge it with current files */
+/* merge an object with current files. 'shdr' has 'shnum' section
+   headers, the data of section i being at data[i] (NULL if it has
+   none). The symbol table is modified. */
 /* XXX: handle correctly stab (debug) info */
-static int tcc_load_object_file(TCCState *st, 
-                                Tcl_Channel fd, unsigned long file_offset)
+static int tcc_merge_object(TCCState *st, int shnum, int shstrndx,
+                            ElfW(Shdr) *shdr, unsigned char *strsec,
+                            unsigned char **data)
 { 
-    Elf32_Ehdr ehdr;
-    Elf32_Shdr *shdr, *sh;
+    ElfW(Shdr) *sh;
     int size, i, j, offset, offseti, nb_syms, sym_index, ret;
-    unsigned char *strsec, *strtab;
+    unsigned char *strtab;
     int *old_to_new_syms;
     char *sh_name, *name;
     SectionMergeInfo *sm_table, *sm;
-    Elf32_Sym *sym, *symtab;
-    Elf32_Rel *rel, *rel_end;
+    ElfW(Sym) *sym, *symtab;
+    ElfW_Rel *rel, *rel_end;
     Section *s;
 
-    if (Tcl_Read(fd, (char *)&ehdr, sizeof(ehdr)) != sizeof(ehdr))
-        goto fail1;
-    if (ehdr.e_ident[0] != ELFMAG0 ||
-        ehdr.e_ident[1] != ELFMAG1 ||
-        ehdr.e_ident[2] != ELFMAG2 ||
-        ehdr.e_ident[3] != ELFMAG3)
-        goto fail1;
-    /* test if object file */
-    if (ehdr.e_type != ET_REL)
-        goto fail1;
-    /* test CPU specific stuff */
-    if (ehdr.e_ident[5] != ELFDATA2LSB ||
-        ehdr.e_machine != EM_TCC_TARGET) {
-    fail1:
-        error_noabort(st, "invalid object file");
-        return -1;
-    }
-    /* read sections */
-    shdr = load_data(st, fd, file_offset + ehdr.e_shoff, 
-                     sizeof(Elf32_Shdr) * ehdr.e_shnum);
-    sm_table = tcc_mallocz(st, sizeof(SectionMergeInfo) * ehdr.e_shnum);
-    
-    /* load section names */
-    sh = &shdr[ehdr.e_shstrndx];
-    strsec = load_data(st, fd, file_offset + sh->sh_offset, sh->sh_size);
+    sm_table = tcc_mallocz(st, sizeof(SectionMergeInfo) * shnum);
 
-    /* load symtab and strtab */
+    /* find symtab and strtab */
     old_to_new_syms = NULL;
     symtab = NULL;
     strtab = NULL;
     nb_syms = 0;
-    for(i = 1; i < ehdr.e_shnum; i++) {
+    for(i = 1; i < shnum; i++) {
         sh = &shdr[i];
         if (sh->sh_type == SHT_SYMTAB) {
             if (symtab) {
@@ -1843,27 +2169,26 @@ static int tcc_load_object_file(TCCState *st,
                 ret = -1;
                 goto the_end;
             }
-            nb_syms = sh->sh_size / sizeof(Elf32_Sym);
-            symtab = load_data(st, fd, file_offset + sh->sh_offset, sh->sh_size);
-            sm_table[i].s = symtab_section;
+            nb_syms = sh->sh_size / sizeof(ElfW(Sym));
+            symtab = (ElfW(Sym) *)data[i];
+            sm_table[i].s = st->symtab_section;
 
-            /* now load strtab */
-            sh = &shdr[sh->sh_link];
-            strtab = load_data(st, fd, file_offset + sh->sh_offset, sh->sh_size);
+            /* now strtab */
+            strtab = data[sh->sh_link];
         }
     }
         
     /* now examine each section and try to merge its content with the
        ones in memory */
-    for(i = 1; i < ehdr.e_shnum; i++) {
+    for(i = 1; i < shnum; i++) {
         /* no need to examine section name strtab */
-        if (i == ehdr.e_shstrndx)
+        if (i == shstrndx)
             continue;
         sh = &shdr[i];
         sh_name = strsec + sh->sh_name;
         /* ignore sections types we do not handle */
         if (sh->sh_type != SHT_PROGBITS &&
-            sh->sh_type != SHT_REL && 
+            sh->sh_type != SHT_RELX && 
 #ifdef TCC_ARM_EABI
 	    sh->sh_type != SHT_ARM_EXIDX &&
 #endif
@@ -1914,9 +2239,8 @@ static int tcc_load_object_file(TCCState *st,
         size = sh->sh_size;
         if (sh->sh_type != SHT_NOBITS) {
             unsigned char *ptr;
-            Tcl_Seek(fd, file_offset + sh->sh_offset, SEEK_SET);
             ptr = section_ptr_add(st, s, size);
-            Tcl_Read(fd, ptr, size);
+            memcpy(ptr, data[i], size);
         } else {
             s->data_offset += size;
         }
@@ -1925,14 +2249,14 @@ static int tcc_load_object_file(TCCState *st,
 
     /* second short pass to update sh_link and sh_info fields of new
        sections */
-    for(i = 1; i < ehdr.e_shnum; i++) {
+    for(i = 1; i < shnum; i++) {
         s = sm_table[i].s;
         if (!s || !sm_table[i].new_section)
             continue;
         sh = &shdr[i];
         if (sh->sh_link > 0)
             s->link = sm_table[sh->sh_link].s;
-        if (sh->sh_type == SHT_REL) {
+        if (sh->sh_type == SHT_RELX) {
             s->sh_info = sm_table[sh->sh_info].s->sh_num;
             /* update backward link */
             st->sections[s->sh_info]->reloc = s;
@@ -1952,9 +2276,9 @@ static int tcc_load_object_file(TCCState *st,
                 /* if a symbol is in a link once section, we use the
                    already defined symbol. It is very important to get
                    correct relocations */
-                if (ELF32_ST_BIND(sym->st_info) != STB_LOCAL) {
+                if (ELFW(ST_BIND)(sym->st_info) != STB_LOCAL) {
                     name = strtab + sym->st_name;
-                    sym_index = find_elf_sym(symtab_section, name);
+                    sym_index = find_elf_sym(st->symtab_section, name);
                     if (sym_index)
                         old_to_new_syms[i] = sym_index;
                 }
@@ -1970,32 +2294,32 @@ static int tcc_load_object_file(TCCState *st,
         }
         /* add symbol */
         name = strtab + sym->st_name;
-        sym_index = add_elf_sym(st, symtab_section, sym->st_value, sym->st_size, 
+        sym_index = add_elf_sym(st, st->symtab_section, sym->st_value, sym->st_size, 
                                 sym->st_info, sym->st_other, 
                                 sym->st_shndx, name);
         old_to_new_syms[i] = sym_index;
     }
 
     /* third pass to patch relocation entries */
-    for(i = 1; i < ehdr.e_shnum; i++) {
+    for(i = 1; i < shnum; i++) {
         s = sm_table[i].s;
         if (!s)
             continue;
         sh = &shdr[i];
         offset = sm_table[i].offset;
         switch(s->sh_type) {
-        case SHT_REL:
+        case SHT_RELX:
             /* take relocation offset information */
             offseti = sm_table[sh->sh_info].offset;
-            rel_end = (Elf32_Rel *)(s->data + s->data_offset);
-            for(rel = (Elf32_Rel *)(s->data + offset);
+            rel_end = (ElfW_Rel *)(s->data + s->data_offset);
+            for(rel = (ElfW_Rel *)(s->data + offset);
                 rel < rel_end;
                 rel++) {
                 int type;
                 unsigned sym_index;
                 /* convert symbol index */
-                type = ELF32_R_TYPE(rel->r_info);
-                sym_index = ELF32_R_SYM(rel->r_info);
+                type = ELFW(R_TYPE)(rel->r_info);
+                sym_index = ELFW(R_SYM)(rel->r_info);
                 /* NOTE: only one symtab assumed */
                 if (sym_index >= nb_syms)
                     goto invalid_reloc;
@@ -2007,7 +2331,7 @@ static int tcc_load_object_file(TCCState *st,
                         i, strsec + sh->sh_name, rel->r_offset);
                     goto fail;
                 }
-                rel->r_info = ELF32_R_INFO(sym_index, type);
+                rel->r_info = ELFW(R_INFO)(sym_index, type);
                 /* offset the relocation offset */
                 rel->r_offset += offseti;
             }
@@ -2019,10 +2343,104 @@ static int tcc_load_object_file(TCCState *st,
     
     ret = 0;
  the_end:
-    ckfree((char *)symtab);
-    ckfree((char *)strtab);
     ckfree((char *)old_to_new_syms);
     ckfree((char *)sm_table);
+    return ret;
+}
+
+/* load an object file and merge it with current files */
+static int tcc_load_object_file(TCCState *st, 
+                                Tcl_Channel fd, unsigned long file_offset)
+{ 
+    ElfW(Ehdr) ehdr;
+    ElfW(Shdr) *shdr, *sh;
+    unsigned char *strsec, **data;
+    int i, ret;
+
+    if (Tcl_Read(fd, (char *)&ehdr, sizeof(ehdr)) != sizeof(ehdr))
+        goto fail1;
+    if (ehdr.e_ident[0] != ELFMAG0 ||
+        ehdr.e_ident[1] != ELFMAG1 ||
+        ehdr.e_ident[2] != ELFMAG2 ||
+        ehdr.e_ident[3] != ELFMAG3)
+        goto fail1;
+    /* test if object file */
+    if (ehdr.e_type != ET_REL)
+        goto fail1;
+    /* test CPU specific stuff */
+    if (ehdr.e_ident[5] != ELFDATA2LSB ||
+        ehdr.e_machine != EM_TCC_TARGET) {
+    fail1:
+        error_noabort(st, "invalid object file");
+        return -1;
+    }
+    /* read sections */
+    shdr = load_data(st, fd, file_offset + ehdr.e_shoff, 
+                     sizeof(ElfW(Shdr)) * ehdr.e_shnum);
+    
+    /* load section names */
+    sh = &shdr[ehdr.e_shstrndx];
+    strsec = load_data(st, fd, file_offset + sh->sh_offset, sh->sh_size);
+
+    /* load the sections that are merged or hold symbols */
+    data = tcc_mallocz(st, sizeof(unsigned char *) * ehdr.e_shnum);
+    for(i = 1; i < ehdr.e_shnum; i++) {
+        sh = &shdr[i];
+        if (sh->sh_type == SHT_PROGBITS || sh->sh_type == SHT_RELX ||
+#ifdef TCC_ARM_EABI
+            sh->sh_type == SHT_ARM_EXIDX ||
+#endif
+            sh->sh_type == SHT_SYMTAB || sh->sh_type == SHT_STRTAB)
+            data[i] = load_data(st, fd, file_offset + sh->sh_offset, sh->sh_size);
+    }
+
+    ret = tcc_merge_object(st, ehdr.e_shnum, ehdr.e_shstrndx, shdr, strsec, data);
+
+    for(i = 1; i < ehdr.e_shnum; i++)
+        ckfree((char *)data[i]);
+    ckfree((char *)data);
+    ckfree((char *)strsec);
+    ckfree((char *)shdr);
+    return ret;
+}
+
+/* merge the code, data and symbols compiled by 'src', an object output
+   state, as if its object file was loaded. 'src' must be deleted
+   afterwards. */
+static int tcc_load_state(TCCState *st, TCCState *src)
+{
+    ElfW(Shdr) *shdr, *sh;
+    unsigned char *strsec, **data;
+    Section *s;
+    int i, n, len, ret;
+
+    n = src->nb_sections;
+    shdr = tcc_mallocz(st, sizeof(ElfW(Shdr)) * n);
+    data = tcc_mallocz(st, sizeof(unsigned char *) * n);
+    len = 1;
+    for(i = 1; i < n; i++)
+        len += strlen(src->sections[i]->name) + 1;
+    strsec = tcc_mallocz(st, len);
+    len = 1;
+    for(i = 1; i < n; i++) {
+        s = src->sections[i];
+        sh = &shdr[i];
+        sh->sh_name = len;
+        strcpy((char *)strsec + len, s->name);
+        len += strlen(s->name) + 1;
+        sh->sh_type = s->sh_type;
+        sh->sh_flags = s->sh_flags;
+        sh->sh_size = s->data_offset;
+        sh->sh_link = s->link ? s->link->sh_num : 0;
+        sh->sh_info = s->sh_info;
+        sh->sh_addralign = s->sh_addralign;
+        sh->sh_entsize = s->sh_entsize;
+        data[i] = s->data;
+    }
+
+    ret = tcc_merge_object(st, n, 0, shdr, strsec, data);
+
+    ckfree((char *)data);
     ckfree((char *)strsec);
     ckfree((char *)shdr);
     return ret;
@@ -2052,7 +2470,7 @@ static int tcc_load_alacarte(TCCState *st, Tcl_Channel fd, int size)
     uint8_t *data;
     const char *ar_names, *p;
     const uint8_t *ar_index;
-    Elf32_Sym *sym;
+    ElfW(Sym) *sym;
 
     data = tcc_malloc(st, size);
     if (Tcl_Read(fd, data, size) != size)
@@ -2064,9 +2482,9 @@ static int tcc_load_alacarte(TCCState *st, Tcl_Channel fd, int size)
     do {
 	bound = 0;
 	for(p = ar_names, i = 0; i < nsyms; i++, p += strlen(p)+1) {
-	    sym_index = find_elf_sym(symtab_section, p);
+	    sym_index = find_elf_sym(st->symtab_section, p);
 	    if(sym_index) {
-		sym = &((Elf32_Sym *)symtab_section->data)[sym_index];
+		sym = &((ElfW(Sym) *)st->symtab_section->data)[sym_index];
 		if(sym->st_shndx == SHN_UNDEF) {
 		    off = get_be32(ar_index + i * 4) + sizeof(ArchiveHeader);
 #if 0
@@ -2147,18 +2565,20 @@ static int tcc_load_archive(TCCState *st, Tcl_Channel fd)
 static int tcc_load_dll(TCCState *st, Tcl_Channel fd, const char *filename, int level)
 { 
 
-    Elf32_Ehdr ehdr;
-    Elf32_Shdr *shdr, *sh, *sh1;
+    ElfW(Ehdr) ehdr;
+    ElfW(Shdr) *shdr, *sh, *sh1;
     int i, j, nb_syms, nb_dts, sym_bind, ret;
-    Elf32_Sym *sym, *dynsym;
-    Elf32_Dyn *dt, *dynamic;
+    ElfW(Sym) *sym, *dynsym;
+    ElfW(Dyn) *dt, *dynamic;
     unsigned char *dynstr;
     const char *name, *soname, *p;
     DLLReference *dllref;
     
     Tcl_SetChannelOption(NULL,fd,"translation","binary");
-    Tcl_Obj * ehdrObj = Tcl_NewByteArrayObj(&ehdr,0);
-    Tcl_ReadChars(fd, ehdrObj, sizeof(ehdr),1);
+    if (Tcl_Read(fd, (char *)&ehdr, sizeof(ehdr)) != sizeof(ehdr)) {
+        error_noabort(st, "invalid ELF header");
+        return -1;
+    }
 
 #if 0
     /* XXX This seems to give a bad architecture error on Linux
@@ -2175,7 +2595,7 @@ static int tcc_load_dll(TCCState *st, Tcl_Channel fd, const char *filename, int
 #endif
 
     /* read sections */
-    shdr = load_data(st, fd, ehdr.e_shoff, sizeof(Elf32_Shdr) * ehdr.e_shnum);
+    shdr = load_data(st, fd, ehdr.e_shoff, sizeof(ElfW(Shdr)) * ehdr.e_shnum);
 
     /* load dynamic section and dynamic symbols */
     nb_syms = 0;
@@ -2186,11 +2606,11 @@ static int tcc_load_dll(TCCState *st, Tcl_Channel fd, const char *filename, int
     for(i = 0, sh = shdr; i < ehdr.e_shnum; i++, sh++) {
         switch(sh->sh_type) {
         case SHT_DYNAMIC:
-            nb_dts = sh->sh_size / sizeof(Elf32_Dyn);
+            nb_dts = sh->sh_size / sizeof(ElfW(Dyn));
             dynamic = load_data(st, fd, sh->sh_offset, sh->sh_size);
             break;
         case SHT_DYNSYM:
-            nb_syms = sh->sh_size / sizeof(Elf32_Sym);
+            nb_syms = sh->sh_size / sizeof(ElfW(Sym));
             dynsym = load_data(st, fd, sh->sh_offset, sh->sh_size);
             sh1 = &shdr[sh->sh_link];
             dynstr = load_data(st, fd, sh1->sh_offset, sh1->sh_size);
@@ -2233,7 +2653,7 @@ static int tcc_load_dll(TCCState *st, Tcl_Channel fd, const char *filename, int
 
     /* add dynamic symbols in dynsym_section */
     for(i = 1, sym = dynsym + 1; i < nb_syms; i++, sym++) {
-        sym_bind = ELF32_ST_BIND(sym->st_info);
+        sym_bind = ELFW(ST_BIND)(sym->st_info);
         if (sym_bind == STB_LOCAL)
             continue;
         name = dynstr + sym->st_name;
@@ -2279,7 +2699,7 @@ static int ld_next(TCCState *st, char *name, int name_size)
     char *q;
 
  redo:
-    switch(fch) {
+    switch(st->fch) {
     case ' ':
     case '\t':
     case '\f':
@@ -2290,9 +2710,9 @@ static int ld_next(TCCState *st, char *name, int name_size)
         goto redo;
     case '/':
         minp(st);
-        if (fch == '*') {
-            file->buf_ptr = parse_comment(st, file->buf_ptr);
-            fch = file->buf_ptr[0];
+        if (st->fch == '*') {
+            st->file->buf_ptr = parse_comment(st, st->file->buf_ptr);
+            st->fch = st->file->buf_ptr[0];
             goto redo;
         } else {
             q = name;
@@ -2310,13 +2730,13 @@ static int ld_next(TCCState *st, char *name, int name_size)
         q = name;
     parse_name:
         for(;;) {
-            if (!((fch >= 'a' && fch <= 'z') ||
-                  (fch >= 'A' && fch <= 'Z') ||
-                  (fch >= '0' && fch <= '9') ||
-                  strchr("/.-_+=$:\\,~", fch)))
+            if (!((st->fch >= 'a' && st->fch <= 'z') ||
+                  (st->fch >= 'A' && st->fch <= 'Z') ||
+                  (st->fch >= '0' && st->fch <= '9') ||
+                  strchr("/.-_+=$:\\,~", st->fch)))
                 break;
             if ((q - name) < name_size - 1) {
-                *q++ = fch;
+                *q++ = st->fch;
             }
             minp(st);
         }
@@ -2327,7 +2747,7 @@ static int ld_next(TCCState *st, char *name, int name_size)
         c = LD_TOK_EOF;
         break;
     default:
-        c = fch;
+        c = st->fch;
         inp(st);
         break;
     }
@@ -2384,7 +2804,7 @@ static int tcc_load_ldscript(TCCState *st)
     int t, ret;
     
     /*fch = file->buf_ptr[0]; */
-    fch = handle_eob(st);
+    st->fch = handle_eob(st);
     for(;;) {
         t = ld_next(st, cmd, sizeof(cmd));
         if (t == LD_TOK_EOF)
@@ -0,0 +1,292 @@
+/*
+ *  TCC - Precompiled headers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A precompiled header is a copy of the identifiers, the defines and
+   the global symbols left by compiling a set of headers. It does not
+   depend on the state that compiled it: symbol links are kept as
+   indexes and token strings are copied. Restoring it at the start of
+   a compilation is the same as including the headers first. */
+
+/* encoding of a symbol link in a precompiled header: 0 is NULL, n > 0
+   the n-th saved symbol, or one of the types tcc_compile defines */
+#define PCH_LINK_CHAR_POINTER -1
+#define PCH_LINK_FUNC_OLD     -2
+
+/* does the type use its 'ref' field */
+static int pch_type_has_ref(int t)
+{
+    int bt = t & VT_BTYPE;
+    return bt == VT_PTR || bt == VT_ENUM || bt == VT_FUNC || bt == VT_STRUCT;
+}
+
+/* a symbol of a stack and its position, bottom first */
+typedef struct PchSymIndex {
+    Sym *sym;
+    int index;
+} PchSymIndex;
+
+static int pch_sym_cmp(const void *a, const void *b)
+{
+    const Sym *sa = ((const PchSymIndex *)a)->sym;
+    const Sym *sb = ((const PchSymIndex *)b)->sym;
+    return sa < sb ? -1 : sa > sb;
+}
+
+/* copy the stack 'top' down to 'bottom' as an array, bottom first, and
+   make 'pindex' an array of the same symbols sorted by address */
+static Sym **pch_stack_array(TCCState *st, Sym *top, Sym *bottom, int *pn,
+                             PchSymIndex **pindex)
+{
+    Sym *s, **tab;
+    PchSymIndex *index;
+    int n;
+
+    n = 0;
+    for(s = top; s != bottom; s = s->prev)
+        n++;
+    tab = tcc_malloc(st, (n + 1) * sizeof(Sym *));
+    index = tcc_malloc(st, (n + 1) * sizeof(PchSymIndex));
+    *pn = n;
+    for(s = top; s != bottom; s = s->prev) {
+        n--;
+        tab[n] = s;
+        index[n].sym = s;
+        index[n].index = n;
+    }
+    qsort(index, *pn, sizeof(PchSymIndex), pch_sym_cmp);
+    *pindex = index;
+    return tab;
+}
+
+static int pch_link(TCCState *st, PchSymIndex *index, int n, Sym *s)
+{
+    PchSymIndex key, *found;
+
+    if (!s)
+        return 0;
+    if (s == st->char_pointer_type.ref)
+        return PCH_LINK_CHAR_POINTER;
+    if (s == st->func_old_type.ref)
+        return PCH_LINK_FUNC_OLD;
+    key.sym = s;
+    found = bsearch(&key, index, n, sizeof(PchSymIndex), pch_sym_cmp);
+    if (!found)
+        tcc_error(st, "unsupported declaration in precompiled header");
+    return found->index + 1;
+}
+
+static Sym *pch_unlink(TCCState *st, Sym **map, int link)
+{
+    if (link == PCH_LINK_CHAR_POINTER)
+        return st->char_pointer_type.ref;
+    if (link == PCH_LINK_FUNC_OLD)
+        return st->func_old_type.ref;
+    if (link == 0)
+        return NULL;
+    return map[link - 1];
+}
+
+static int pch_is_inline(Sym *s)
+{
+    return (s->type.t & VT_BTYPE) == VT_FUNC &&
+        (s->type.t & (VT_STATIC | VT_INLINE)) == (VT_STATIC | VT_INLINE);
+}
+
+/* save the state left by a compilation into 'pch'. Called by
+   tcc_compile at the end of the headers, before anything is freed */
+static void pch_save(TCCState *st, TCCPch *pch, Sym *define_start,
+                     Sym *global_start, unsigned long symtab_start)
+{
+    Sym **tab, *s, *s1;
+    PchSymIndex *index;
+    CachedInclude *e, *e1;
+    int i, n;
+
+    if (st->text_section->data_offset != 0 ||
+        st->data_section->data_offset != 0 ||
+        st->bss_section->data_offset != 0 ||
+        st->symtab_section->data_offset != symtab_start)
+        tcc_error(st, "precompiled header must only contain declarations");
+
+    /* identifiers */
+    n = st->tok_ident - TOK_IDENT;
+    pch->tokens = tcc_malloc(st, n * sizeof(char *));
+    for(i = 0; i < n; i++) {
+        pch->tokens[i] = tcc_strdup(st, st->table_ident[i]->str);
+        pch->nb_tokens++;
+    }
+
+    /* defines */
+    tab = pch_stack_array(st, st->define_stack, define_start, &n, &index);
+    pch->defines = tcc_mallocz(st, (n + 1) * sizeof(Sym));
+    pch->define_links = tcc_mallocz(st, (n + 1) * sizeof(int));
+    for(i = 0; i < n; i++) {
+        s = tab[i];
+        s1 = &pch->defines[i];
+        *s1 = *s;
+        s1->next = s1->prev = s1->prev_tok = NULL;
+        if (s->c)
+            s1->c = (long)tok_str_dup(st, (int *)s->c);
+        pch->nb_defines++;
+        pch->define_links[i] = pch_link(st, index, n, s->next);
+    }
+    ckfree((char *)tab);
+    ckfree((char *)index);
+
+    /* global symbols */
+    tab = pch_stack_array(st, st->global_stack, global_start, &n, &index);
+    pch->syms = tcc_mallocz(st, (n + 1) * sizeof(Sym));
+    pch->sym_links = tcc_mallocz(st, (2 * n + 1) * sizeof(int));
+    for(i = 0; i < n; i++) {
+        s = tab[i];
+        s1 = &pch->syms[i];
+        *s1 = *s;
+        s1->next = s1->prev = s1->prev_tok = NULL;
+        s1->type.ref = NULL;
+        if (pch_is_inline(s))
+            s1->r = (long)tok_str_dup(st, (int *)s->r);
+        pch->nb_syms++;
+        if (pch_type_has_ref(s->type.t))
+            pch->sym_links[2 * i] = pch_link(st, index, n, s->type.ref);
+        pch->sym_links[2 * i + 1] = pch_link(st, index, n, s->next);
+    }
+    ckfree((char *)tab);
+    ckfree((char *)index);
+    pch->anon_sym = st->anon_sym;
+
+    /* include files protected by #ifndef */
+    for(i = 0; i < st->nb_cached_includes; i++) {
+        e = st->cached_includes[i];
+        e1 = tcc_malloc(st, sizeof(CachedInclude) + strlen(e->filename));
+        memcpy(e1, e, sizeof(CachedInclude) + strlen(e->filename));
+        dynarray_add(st, (void ***)&pch->includes, &pch->nb_includes, e1);
+    }
+}
+
+/* prepare a state to use 'pch': its identifiers must be a prefix of
+   the ones of the precompiled header. Return non zero if not. */
+static int pch_import(TCCState *st, TCCPch *pch)
+{
+    TokenSym *ts;
+    int i, n;
+
+    n = st->tok_ident - TOK_IDENT;
+    if (n > pch->nb_tokens) {
+        error_noabort(st, "precompiled header does not match the handle");
+        return -1;
+    }
+    for(i = 0; i < n; i++) {
+        if (strcmp(st->table_ident[i]->str, pch->tokens[i]) != 0) {
+            error_noabort(st, "precompiled header does not match the handle");
+            return -1;
+        }
+    }
+    for(; i < pch->nb_tokens; i++) {
+        ts = tok_alloc(st, pch->tokens[i], strlen(pch->tokens[i]));
+        if (ts->tok != TOK_IDENT + i) {
+            error_noabort(st, "precompiled header does not match the handle");
+            return -1;
+        }
+    }
+    for(i = 0; i < pch->nb_includes; i++) {
+        add_cached_include(st, pch->includes[i]->type,
+                           pch->includes[i]->filename,
+                           pch->includes[i]->ifndef_macro);
+    }
+    return 0;
+}
+
+/* push the defines and the global symbols of 'pch', as if the headers
+   had been compiled. Called by tcc_compile before parsing. */
+static void pch_restore(TCCState *st, TCCPch *pch)
+{
+    Sym **map, *s, *s1, **ps;
+    TokenSym *ts;
+    int i, v;
+
+    map = tcc_malloc(st, (pch->nb_defines + 1) * sizeof(Sym *));
+
+    for(i = 0; i < pch->nb_defines; i++) {
+        s1 = &pch->defines[i];
+        s = sym_push2(st, &st->define_stack, s1->v, s1->type.t, 0);
+        s->r = s1->r;
+        if (s1->c)
+            s->c = (long)tok_str_dup(st, (int *)s1->c);
+        v = s->v;
+        if (v >= TOK_IDENT && !(v & SYM_FIELD))
+            st->table_ident[v - TOK_IDENT]->sym_define = s;
+        map[i] = s;
+    }
+    for(i = 0; i < pch->nb_defines; i++)
+        map[i]->next = pch_unlink(st, map, pch->define_links[i]);
+    ckfree((char *)map);
+
+    map = tcc_malloc(st, (pch->nb_syms + 1) * sizeof(Sym *));
+    for(i = 0; i < pch->nb_syms; i++) {
+        s1 = &pch->syms[i];
+        s = sym_push2(st, &st->global_stack, s1->v, s1->type.t, s1->c);
+        s->r = s1->r;
+        if (pch_is_inline(s1))
+            s->r = (long)tok_str_dup(st, (int *)s1->r);
+        v = s->v;
+        /* same as sym_push */
+        if (!(v & SYM_FIELD) && (v & ~SYM_STRUCT) < SYM_FIRST_ANOM) {
+            ts = st->table_ident[(v & ~SYM_STRUCT) - TOK_IDENT];
+            if (v & SYM_STRUCT)
+                ps = &ts->sym_struct;
+            else
+                ps = &ts->sym_identifier;
+            s->prev_tok = *ps;
+            *ps = s;
+        }
+        map[i] = s;
+    }
+    for(i = 0; i < pch->nb_syms; i++) {
+        map[i]->type.ref = pch_unlink(st, map, pch->sym_links[2 * i]);
+        map[i]->next = pch_unlink(st, map, pch->sym_links[2 * i + 1]);
+    }
+    ckfree((char *)map);
+
+    st->anon_sym = pch->anon_sym;
+}
+
+static void pch_free(TCCPch *pch)
+{
+    int i;
+
+    for(i = 0; i < pch->nb_tokens; i++)
+        ckfree(pch->tokens[i]);
+    ckfree((char *)pch->tokens);
+    for(i = 0; i < pch->nb_defines; i++) {
+        if (pch->defines[i].c)
+            ckfree((char *)pch->defines[i].c);
+    }
+    ckfree((char *)pch->defines);
+    ckfree((char *)pch->define_links);
+    for(i = 0; i < pch->nb_syms; i++) {
+        if (pch_is_inline(&pch->syms[i]))
+            ckfree((char *)pch->syms[i].r);
+    }
+    ckfree((char *)pch->syms);
+    ckfree((char *)pch->sym_links);
+    for(i = 0; i < pch->nb_includes; i++)
+        ckfree((char *)pch->includes[i]);
+    ckfree((char *)pch->includes);
+    ckfree(pch->options);
+    ckfree((char *)pch);
+}
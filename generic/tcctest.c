@@ -138,7 +138,7 @@ int qq(int x)
 
 void macro_test(void)
 {
-    printf("macro:\n");
+    printf("macro:\n");
     pf("N=%d\n", N);
     printf("aaa=%d\n", AAA);
 
@@ -1619,6 +1619,14 @@ void longlong_test(void)
         p[0]++;
         printf("%lld\n", *p);
     }
+
+    /* multiply test: the low word of 'a' must survive 'mul' */
+    a = 1;
+    for(ia = 0; ia < 5; ia++)
+        a = a * 7;
+    b = 1LL << 40;
+    c = b * 7;
+    printf("%lld %lld %lld\n", a, c, c / 7 - b);
 }
 
 void vprintf1(const char *fmt, ...)
@@ -1676,14 +1684,15 @@ void whitespace_test(void)
 {
     char *str;
 
-#if 1
+
+#if 1
     pri\
-ntf("whitspace:\n");
+ntf("whitspace:\n");
 #endif
     pf("N=%d\n", 2);
 
 #ifdef CORRECT_CR_HANDLING
-    pri\
+    pri\
 ntf("aaa=%d\n", 3);
 #endif
 
@@ -1695,11 +1704,12 @@ ntf("min=%d\n", 4);
     printf("len1=%d\n", strlen("
 "));
 #ifdef CORRECT_CR_HANDLING
-    str = "
+    str = "
 ";
     printf("len1=%d str[0]=%d\n", strlen(str), str[0]);
 #endif
-    printf("len1=%d\n", strlen("a
+    printf("len1=%d\n", strlen("
+a
 "));
 #endif /* ACCEPT_CR_IN_STRINGS */
 }
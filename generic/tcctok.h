@@ -109,11 +109,16 @@
      DEF(TOK_NORETURN2, "__noreturn__")
      DEF(TOK_builtin_types_compatible_p, "__builtin_types_compatible_p")
      DEF(TOK_builtin_constant_p, "__builtin_constant_p")
+#ifdef TCC_TARGET_X86_64
+     DEF(TOK_builtin_va_start, "__builtin_va_start")
+     DEF(TOK_builtin_va_arg_types, "__builtin_va_arg_types")
+#endif
      DEF(TOK_REGPARM1, "regparm")
      DEF(TOK_REGPARM2, "__regparm__")
 
 /* pragma */
      DEF(TOK_pack, "pack")
+     DEF(TOK_once, "once")
 #if !defined(TCC_TARGET_I386)
      /* already defined for assembler */
      DEF(TOK_ASM_push, "push")
@@ -23,16 +23,771 @@ static void TccErrorFunc(Tcl_Interp * interp, char * msg) {
 }
 
 
+/* Precompiled headers by name, shared by all threads */
+static Tcl_HashTable pch_table;
+static int pch_table_initialized = 0;
+TCL_DECLARE_MUTEX(pch_mutex)
+
+static void TccPchRelease(TCCPch * pch) {
+    int unused;
+
+    Tcl_MutexLock(&pch_mutex);
+    unused = (--pch->refcount == 0);
+    Tcl_MutexUnlock(&pch_mutex);
+    if (unused) {
+        pch_free(pch);
+    }
+}
+
+static void TccCachedCodeRelease(TCCCachedCode * code);
+
 static void TccCCommandDeleteProc (ClientData cdata) {
     TCCState * s ;
     s = (TCCState *)cdata;
     Tcl_DecrRefCount(s->tcc_lib_path);
-    /* We can delete the compiler if the output was not to memory */
-    if (s->output_type != TCC_OUTPUT_MEMORY) {
-        tcc_delete(s);
+    Tcl_DecrRefCount(s->options);
+    if (s->cached) {
+        TccCachedCodeRelease(s->cached);
+    }
+    if (s->cached_code) {
+        Tcl_DecrRefCount(s->cached_code);
+    }
+    if (s->pch) {
+        TccPchRelease(s->pch);
+    }
+    /* relocated code is kept for the commands that use it */
+    tcc_delete(s);
+}
+
+/* 128 bit MurmurHash3 (x64 variant) of len bytes at p, started from
+   seed, written as 32 hex digits to hex and returned in h. Used to name
+   cached object files. */
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static Tcl_WideUInt TccDigestMix(Tcl_WideUInt k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void TccDigest(const unsigned char * p, int len, Tcl_WideUInt seed,
+        char * hex, Tcl_WideUInt * h) {
+    const Tcl_WideUInt c1 = 0x87c37b91114253d5ULL;
+    const Tcl_WideUInt c2 = 0x4cf5ad432745937fULL;
+    Tcl_WideUInt h1 = seed, h2 = seed, k1, k2;
+    int i, n;
+
+    for (n = 0; n + 16 <= len; n += 16) {
+        k1 = k2 = 0;
+        for (i = 7; i >= 0; i--) {
+            k1 = (k1 << 8) | p[n + i];
+            k2 = (k2 << 8) | p[n + 8 + i];
+        }
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    k1 = k2 = 0;
+    for (i = len - n - 1; i >= 0; i--) {
+        if (i >= 8)
+            k2 = (k2 << 8) | p[n + i];
+        else
+            k1 = (k1 << 8) | p[n + i];
+    }
+    if (len - n > 8) {
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    if (len - n > 0) {
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+    h1 ^= (Tcl_WideUInt)len;
+    h2 ^= (Tcl_WideUInt)len;
+    h1 += h2;
+    h2 += h1;
+    h1 = TccDigestMix(h1);
+    h2 = TccDigestMix(h2);
+    h1 += h2;
+    h2 += h1;
+    h[0] = h1;
+    h[1] = h2;
+    for (i = 0; i < 16; i++) {
+        Tcl_WideUInt h = (i < 8) ? h1 : h2;
+        sprintf(hex + 2 * i, "%02x", (int)((h >> (8 * (7 - (i & 7)))) & 0xff));
+    }
+}
+
+/* Digest of ccode as it would be compiled by the handle: the package
+   version and library path, the options given to the handle, the
+   contents of its precompiled header and the code itself. The code is
+   hashed where it is, seeded with the digest of the rest, rather than
+   copied next to it. */
+static void TccCodeDigest(TCCState * s, Tcl_Obj * code, char * hex) {
+    Tcl_DString ds;
+    Tcl_WideUInt h[2];
+    const char * str;
+    int len;
+
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, PACKAGE_VERSION, -1);
+    Tcl_DStringAppend(&ds, "", 1);
+    str = Tcl_GetStringFromObj(s->tcc_lib_path, &len);
+    Tcl_DStringAppend(&ds, str, len);
+    Tcl_DStringAppend(&ds, "", 1);
+    str = Tcl_GetStringFromObj(s->options, &len);
+    Tcl_DStringAppend(&ds, str, len);
+    if (s->pch) {
+        Tcl_DStringAppend(&ds, "", 1);
+        Tcl_DStringAppend(&ds, s->pch->digest, -1);
+    }
+    TccDigest((unsigned char *)Tcl_DStringValue(&ds), Tcl_DStringLength(&ds), 0, hex, h);
+    Tcl_DStringFree(&ds);
+    str = Tcl_GetStringFromObj(code, &len);
+    TccDigest((unsigned char *)str, len, h[0] ^ h[1], hex, h);
+}
+
+/* Compile the string rep of code, in place for the most part */
+static int TccCompileObj(TCCState * s, Tcl_Obj * code) {
+    char * str;
+    int len;
+
+    str = Tcl_GetStringFromObj(code, &len);
+    return tcc_compile_buffer(s, str, len);
+}
+
+/* Process wide cache of relocated code. A memory handle with the
+   compile-cache flag that compiles the same code with the same options
+   as a cached one, while the headers it opened are unchanged, reuses
+   its machine code and symbols instead of compiling. */
+#define TCC_COMPILE_CACHE_SIZE 128
+
+/* The global symbols of relocated code. Relocated code stays in memory
+   when its handle is deleted, so the symbols are all that is needed. */
+struct TCCCachedCode {
+    int refcount;               /* the cache and the handles using it */
+    Tcl_HashTable symbols;      /* name -> address */
+    OpenedHeader ** headers;    /* opened by the code */
+    int nb_headers;
+};
+
+static struct {
+    int initialized;
+    Tcl_HashTable codes;        /* digest -> TCCCachedCode */
+    char keys[TCC_COMPILE_CACHE_SIZE][33]; /* digests, oldest at next */
+    int next;
+    long hits;
+    long misses;
+} compile_cache;
+TCL_DECLARE_MUTEX(compile_cache_mutex)
+
+static TCCCachedCode * TccCachedCodeNew(TCCState * s) {
+    TCCCachedCode * code;
+    ElfW(Sym) * sym, * end;
+    Tcl_HashEntry * entry;
+    int new;
+
+    code = (TCCCachedCode *)ckalloc(sizeof(TCCCachedCode));
+    code->refcount = 1;
+    Tcl_InitHashTable(&code->symbols, TCL_STRING_KEYS);
+    sym = (ElfW(Sym) *)s->symtab_section->data;
+    end = (ElfW(Sym) *)(s->symtab_section->data + s->symtab_section->data_offset);
+    for (sym++; sym < end; sym++) {
+        if (ELFW(ST_BIND)(sym->st_info) != STB_LOCAL) {
+            entry = Tcl_CreateHashEntry(&code->symbols,
+                    (char *)s->symtab_section->link->data + sym->st_name, &new);
+            Tcl_SetHashValue(entry, (ClientData)(unsigned long)sym->st_value);
+        }
+    }
+    code->headers = s->opened_headers;
+    code->nb_headers = s->nb_opened_headers;
+    s->opened_headers = NULL;
+    s->nb_opened_headers = 0;
+    return code;
+}
+
+/* Is every header opened by the cached code still the same file, with
+   the same time and size? */
+static int TccCachedCodeCurrent(TCCCachedCode * code) {
+    OpenedHeader * h;
+    Tcl_StatBuf sb;
+    Tcl_Obj * path;
+    int i, res;
+
+    for (i = 0; i < code->nb_headers; i++) {
+        h = code->headers[i];
+        path = Tcl_NewStringObj(h->path, -1);
+        Tcl_IncrRefCount(path);
+        res = Tcl_FSStat(path, &sb);
+        Tcl_DecrRefCount(path);
+        if (res != 0 || sb.st_dev != h->dev || sb.st_ino != h->ino ||
+            sb.st_mtime != h->mtime || sb.st_size != h->size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void TccCachedCodeRelease(TCCCachedCode * code) {
+    int i, unused;
+
+    Tcl_MutexLock(&compile_cache_mutex);
+    unused = (--code->refcount == 0);
+    Tcl_MutexUnlock(&compile_cache_mutex);
+    if (unused) {
+        Tcl_DeleteHashTable(&code->symbols);
+        for (i = 0; i < code->nb_headers; i++) {
+            ckfree((char *)code->headers[i]);
+        }
+        ckfree((char *)code->headers);
+        ckfree((char *)code);
+    }
+}
+
+static TCCCachedCode * TccCacheLookup(const char * key) {
+    Tcl_HashEntry * entry;
+    TCCCachedCode * code = NULL;
+
+    Tcl_MutexLock(&compile_cache_mutex);
+    if (compile_cache.initialized) {
+        entry = Tcl_FindHashEntry(&compile_cache.codes, key);
+        if (entry) {
+            code = (TCCCachedCode *)Tcl_GetHashValue(entry);
+            code->refcount++;
+        }
+    }
+    Tcl_MutexUnlock(&compile_cache_mutex);
+    /* the headers are looked at without holding the cache */
+    if (code && !TccCachedCodeCurrent(code)) {
+        TccCachedCodeRelease(code);
+        code = NULL;
+    }
+    Tcl_MutexLock(&compile_cache_mutex);
+    if (code) {
+        compile_cache.hits++;
+    } else {
+        compile_cache.misses++;
+    }
+    Tcl_MutexUnlock(&compile_cache_mutex);
+    return code;
+}
+
+static void TccCacheInsert(const char * key, TCCState * s) {
+    Tcl_HashEntry * entry;
+    TCCCachedCode * code, * old = NULL;
+    char * oldest;
+    int new;
+
+    code = TccCachedCodeNew(s);
+    Tcl_MutexLock(&compile_cache_mutex);
+    if (!compile_cache.initialized) {
+        Tcl_InitHashTable(&compile_cache.codes, TCL_STRING_KEYS);
+        compile_cache.initialized = 1;
+    }
+    entry = Tcl_CreateHashEntry(&compile_cache.codes, key, &new);
+    if (new) {
+        /* the cache is full: forget the oldest code */
+        oldest = compile_cache.keys[compile_cache.next];
+        if (oldest[0]) {
+            Tcl_HashEntry * e = Tcl_FindHashEntry(&compile_cache.codes, oldest);
+            old = (TCCCachedCode *)Tcl_GetHashValue(e);
+            Tcl_DeleteHashEntry(e);
+        }
+        strcpy(oldest, key);
+        compile_cache.next = (compile_cache.next + 1) % TCC_COMPILE_CACHE_SIZE;
+    } else {
+        old = (TCCCachedCode *)Tcl_GetHashValue(entry);
+    }
+    Tcl_SetHashValue(entry, code);
+    Tcl_MutexUnlock(&compile_cache_mutex);
+    if (old) {
+        TccCachedCodeRelease(old);
+    }
+}
+
+static Tcl_Obj * TccCacheStats(void) {
+    Tcl_Obj * res = Tcl_NewListObj(0, NULL);
+
+    Tcl_MutexLock(&compile_cache_mutex);
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewStringObj("entries", -1));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewIntObj(compile_cache.initialized ?
+                compile_cache.codes.numEntries : 0));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewStringObj("limit", -1));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewIntObj(TCC_COMPILE_CACHE_SIZE));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewStringObj("hits", -1));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewLongObj(compile_cache.hits));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewStringObj("misses", -1));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewLongObj(compile_cache.misses));
+    Tcl_MutexUnlock(&compile_cache_mutex);
+    return res;
+}
+
+/* macro expansions of the last compilation of 's' */
+static Tcl_Obj * TccMacroStats(TCCState * s) {
+    Tcl_Obj * res = Tcl_NewListObj(0, NULL);
+
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewStringObj("expansions", -1));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewIntObj(s->nb_expansions));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewStringObj("buffers", -1));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewIntObj(s->nb_expand_buffers));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewStringObj("allocated", -1));
+    Tcl_ListObjAppendElement(NULL, res, Tcl_NewLongObj((long)s->expand_bytes));
+    return res;
+}
+
+/* The handle is about to get more input than its cached code: compile
+   the code skipped on a cache hit and stop matching the cache. */
+static int TccCacheDetach(Tcl_Interp * interp, TCCState * s) {
+    Tcl_Obj * code = s->cached_code;
+    int res;
+
+    s->cache_key[0] = '\0';
+    if (!s->cached) {
+        return TCL_OK;
+    }
+    TccCachedCodeRelease(s->cached);
+    s->cached = NULL;
+    s->cached_code = NULL;
+    res = TccCompileObj(s, code);
+    Tcl_DecrRefCount(code);
+    if (res != 0) {
+        Tcl_AppendResult(interp, "compilation failed", NULL);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/* Remember a subcommand that changes how code is compiled or linked */
+static int TccRecordOption(Tcl_Interp * interp, TCCState * s, int objc, Tcl_Obj * CONST objv[]) {
+    if (s->nb_compiled > 0 && TccCacheDetach(interp, s) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    Tcl_ListObjAppendElement(NULL, s->options, Tcl_NewListObj(objc - 1, objv + 1));
+    return TCL_OK;
+}
+
+/* Apply an option recorded by TccRecordOption, args[0] being the
+   subcommand. pch use is left to the caller. */
+static void TccApplyOption(TCCState * s, int objc, Tcl_Obj ** args) {
+    const char * opt = Tcl_GetString(args[0]);
+    long val;
+    int flag;
+
+    if (!strcmp(opt, "add_include_path")) {
+        tcc_add_include_path(s, Tcl_GetString(args[1]));
+    } else if (!strcmp(opt, "add_library")) {
+        tcc_add_library(s, Tcl_GetString(args[1]));
+    } else if (!strcmp(opt, "add_library_path")) {
+        tcc_add_library_path(s, Tcl_GetString(args[1]));
+    } else if (!strcmp(opt, "add_symbol")) {
+        Tcl_GetLongFromObj(NULL, args[2], &val);
+        tcc_add_symbol(s, Tcl_GetString(args[1]), val);
+    } else if (!strcmp(opt, "define")) {
+        tcc_define_symbol(s, Tcl_GetString(args[1]), Tcl_GetString(args[2]));
+    } else if (!strcmp(opt, "undefine")) {
+        tcc_undefine_symbol(s, Tcl_GetString(args[1]));
+    } else if (!strcmp(opt, "set_flag")) {
+        Tcl_GetBooleanFromObj(NULL, args[2], &flag);
+        tcc_set_flag(s, Tcl_GetString(args[1]), flag);
+    } else if (!strcmp(opt, "optimize")) {
+        Tcl_GetIntFromObj(NULL, args[1], &flag);
+        tcc_set_optimize(s, flag);
     }
 }
 
+/* The options that change how code is preprocessed or generated */
+static Tcl_Obj * TccCompileOptions(TCCState * s) {
+    Tcl_Obj * res = Tcl_NewListObj(0, NULL);
+    Tcl_Obj ** opts, ** args;
+    int i, n, m;
+
+    Tcl_ListObjGetElements(NULL, s->options, &n, &opts);
+    for (i = 0; i < n; i++) {
+        Tcl_ListObjGetElements(NULL, opts[i], &m, &args);
+        if (!strcmp(Tcl_GetString(args[0]), "add_include_path") ||
+            !strcmp(Tcl_GetString(args[0]), "define") ||
+            !strcmp(Tcl_GetString(args[0]), "undefine") ||
+            (!strcmp(Tcl_GetString(args[0]), "set_flag") &&
+             strcmp(Tcl_GetString(args[1]), "compile-cache")) ||
+            !strcmp(Tcl_GetString(args[0]), "optimize")) {
+            Tcl_ListObjAppendElement(NULL, res, opts[i]);
+        }
+    }
+    return res;
+}
+
+/* Compile ccode with the compile options of the handle into a
+   precompiled header, registered as name */
+static int TccPchCreate(Tcl_Interp * interp, TCCState * s, Tcl_Obj * name, Tcl_Obj * code) {
+    TCCState * p;
+    TCCPch * pch, * old = NULL;
+    Tcl_Obj * options, ** opts, ** args;
+    Tcl_HashEntry * entry;
+    Tcl_WideUInt h[2];
+    const char * str;
+    int i, n, m, new, res, len;
+
+    p = tcc_new(s->tcc_lib_path);
+    tcc_set_error_func(p, interp, (void *)&TccErrorFunc);
+    tcc_set_output_type(p, TCC_OUTPUT_OBJ);
+    options = TccCompileOptions(s);
+    Tcl_IncrRefCount(options);
+    Tcl_ListObjGetElements(NULL, options, &n, &opts);
+    for (i = 0; i < n; i++) {
+        Tcl_ListObjGetElements(NULL, opts[i], &m, &args);
+        TccApplyOption(p, m, args);
+    }
+
+    pch = (TCCPch *)ckalloc(sizeof(TCCPch));
+    memset(pch, 0, sizeof(TCCPch));
+    pch->refcount = 1;
+    pch->options = ckalloc(strlen(Tcl_GetString(options)) + 1);
+    strcpy(pch->options, Tcl_GetString(options));
+    Tcl_DecrRefCount(options);
+    /* the digest of the code using it must change with its contents */
+    TccDigest((unsigned char *)pch->options, strlen(pch->options), 0, pch->digest, h);
+    str = Tcl_GetStringFromObj(code, &len);
+    TccDigest((unsigned char *)str, len, h[0] ^ h[1], pch->digest, h);
+
+    p->pch_out = pch;
+    res = TccCompileObj(p, code);
+    Tcl_DecrRefCount(p->tcc_lib_path);
+    tcc_delete(p);
+    if (res != 0) {
+        pch_free(pch);
+        Tcl_AppendResult(interp, "compilation failed", NULL);
+        return TCL_ERROR;
+    }
+
+    Tcl_MutexLock(&pch_mutex);
+    if (!pch_table_initialized) {
+        Tcl_InitHashTable(&pch_table, TCL_STRING_KEYS);
+        pch_table_initialized = 1;
+    }
+    entry = Tcl_CreateHashEntry(&pch_table, Tcl_GetString(name), &new);
+    if (!new) {
+        old = (TCCPch *)Tcl_GetHashValue(entry);
+    }
+    Tcl_SetHashValue(entry, pch);
+    Tcl_MutexUnlock(&pch_mutex);
+    if (old) {
+        TccPchRelease(old);
+    }
+    return TCL_OK;
+}
+
+/* Make every compilation of the handle start with the precompiled
+   header name */
+static int TccPchUse(Tcl_Interp * interp, TCCState * s, Tcl_Obj * name) {
+    TCCPch * pch = NULL;
+    Tcl_HashEntry * entry;
+    Tcl_Obj * options;
+    int match;
+
+    if (s->pch) {
+        Tcl_AppendResult(interp, "precompiled header already used", NULL);
+        return TCL_ERROR;
+    }
+    if (s->nb_compiled > 0 || s->output_type == TCC_OUTPUT_PREPROCESS) {
+        Tcl_AppendResult(interp, "precompiled header must be used before compiling", NULL);
+        return TCL_ERROR;
+    }
+    Tcl_MutexLock(&pch_mutex);
+    if (pch_table_initialized) {
+        entry = Tcl_FindHashEntry(&pch_table, Tcl_GetString(name));
+        if (entry) {
+            pch = (TCCPch *)Tcl_GetHashValue(entry);
+            pch->refcount++;
+        }
+    }
+    Tcl_MutexUnlock(&pch_mutex);
+    if (!pch) {
+        Tcl_AppendResult(interp, "precompiled header \"", Tcl_GetString(name),
+                "\" not found", NULL);
+        return TCL_ERROR;
+    }
+    options = TccCompileOptions(s);
+    match = !strcmp(Tcl_GetString(options), pch->options);
+    Tcl_DecrRefCount(options);
+    if (!match) {
+        TccPchRelease(pch);
+        Tcl_AppendResult(interp, "precompiled header was created with other include paths or defines", NULL);
+        return TCL_ERROR;
+    }
+    if (pch_import(s, pch) != 0) {
+        TccPchRelease(pch);
+        return TCL_ERROR;
+    }
+    s->pch = pch;
+    return TCL_OK;
+}
+
+/* Free all the handle compiled and apply its options again, as if it
+   had just been created. Commands already created keep working. If the
+   precompiled header no longer applies, the handle is left without it
+   and an error is returned. */
+static int TccReset(Tcl_Interp * interp, TCCState * s) {
+    Tcl_Obj * options = s->options, ** opts, ** args;
+    TCCPch * pch = s->pch;
+    int i, n, m, res = TCL_OK;
+
+    if (s->cached) {
+        TccCachedCodeRelease(s->cached);
+    }
+    if (s->cached_code) {
+        Tcl_DecrRefCount(s->cached_code);
+    }
+ again:
+    tcc_reset(s);
+    s->options = options;
+    Tcl_ListObjGetElements(NULL, options, &n, &opts);
+    for (i = 0; i < n; i++) {
+        Tcl_ListObjGetElements(NULL, opts[i], &m, &args);
+        if (!strcmp(Tcl_GetString(args[0]), "pch")) {
+            if (pch_import(s, pch) != 0) {
+                /* forget it and start again from a clean state */
+                TccPchRelease(pch);
+                Tcl_ListObjReplace(NULL, options, i, 1, 0, NULL);
+                res = TCL_ERROR;
+                goto again;
+            }
+            s->pch = pch;
+        } else {
+            TccApplyOption(s, m, args);
+        }
+    }
+    return res;
+}
+
+/* add_files: the C files are compiled by worker threads, each into its
+   own object state, then merged into the handle in the order given */
+typedef struct TccJob {
+    const char * filename;
+    int compile;                /* C file, compiled by a worker */
+    TCCState * state;           /* the object it compiled to */
+    int result;
+    Tcl_DString messages;       /* errors and warnings of the compilation */
+} TccJob;
+
+typedef struct TccJobs {
+    TccJob * jobs;
+    int nb_jobs;
+    int next;                   /* next job to look at, under mutex */
+    Tcl_Mutex mutex;
+    const char * lib_path;
+    const char * options;       /* compile options of the handle */
+    TCCPch * pch;
+} TccJobs;
+
+static void TccJobErrorFunc(TccJob * job, char * msg) {
+    Tcl_DStringAppend(&job->messages, msg, -1);
+    Tcl_DStringAppend(&job->messages, "\n", 1);
+}
+
+/* Compile one file with the compile options of the handle. Runs in a
+   worker thread, so it only uses Tcl objects it creates. */
+static void TccJobCompile(TccJobs * jobs, TccJob * job) {
+    TCCState * p;
+    Tcl_Obj * options, ** opts, ** args;
+    int i, n, m;
+
+    p = tcc_new(Tcl_NewStringObj(jobs->lib_path, -1));
+    tcc_set_error_func(p, job, (void *)&TccJobErrorFunc);
+    tcc_set_output_type(p, TCC_OUTPUT_OBJ);
+    options = Tcl_NewStringObj(jobs->options, -1);
+    Tcl_IncrRefCount(options);
+    Tcl_ListObjGetElements(NULL, options, &n, &opts);
+    for (i = 0; i < n; i++) {
+        Tcl_ListObjGetElements(NULL, opts[i], &m, &args);
+        TccApplyOption(p, m, args);
+    }
+    Tcl_DecrRefCount(options);
+    if (jobs->pch && pch_import(p, jobs->pch) == 0) {
+        p->pch = jobs->pch;
+    }
+    job->result = tcc_add_file(p, job->filename);
+    p->pch = NULL;
+    Tcl_DecrRefCount(p->tcc_lib_path);
+    p->tcc_lib_path = NULL;
+    job->state = p;
+}
+
+static void TccJobsRun(TccJobs * jobs) {
+    int i;
+
+    for (;;) {
+        Tcl_MutexLock(&jobs->mutex);
+        while (jobs->next < jobs->nb_jobs && !jobs->jobs[jobs->next].compile) {
+            jobs->next++;
+        }
+        i = jobs->next++;
+        Tcl_MutexUnlock(&jobs->mutex);
+        if (i >= jobs->nb_jobs) {
+            break;
+        }
+        TccJobCompile(jobs, &jobs->jobs[i]);
+    }
+}
+
+static Tcl_ThreadCreateType TccJobsThread(ClientData cdata) {
+    TccJobsRun((TccJobs *)cdata);
+    Tcl_ExitThread(0);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/* does tcc_add_file compile filename as C */
+static int TccIsCFile(const char * filename) {
+    const char * ext;
+
+    ext = strrchr(filename, '/');
+    ext = strrchr(ext ? ext + 1 : filename, '.');
+    return !ext || !strcmp(ext, ".c");
+}
+
+/* Add files as add_file does, compiling the C files in up to
+   nb_threads threads. If one of them fails, or one of the other files
+   cannot be opened, nothing is added. */
+static int TccAddFiles(Tcl_Interp * interp, TCCState * s, int nb_threads,
+        int objc, Tcl_Obj * CONST objv[]) {
+    TccJobs jobs;
+    TccJob * job;
+    Tcl_ThreadId * threads;
+    Tcl_Channel chan;
+    Tcl_Obj * options;
+    int i, n, res = TCL_OK;
+
+    if (TccCacheDetach(interp, s) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    s->nb_compiled += objc;
+    if (nb_threads <= 1 || s->output_type == TCC_OUTPUT_PREPROCESS) {
+        for (i = 0; i < objc; i++) {
+            if (tcc_add_file(s, Tcl_GetString(objv[i])) != 0) {
+                return TCL_ERROR;
+            }
+        }
+        return TCL_OK;
+    }
+
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.jobs = (TccJob *)ckalloc(objc * sizeof(TccJob));
+    jobs.nb_jobs = objc;
+    jobs.lib_path = Tcl_GetString(s->tcc_lib_path);
+    options = TccCompileOptions(s);
+    Tcl_IncrRefCount(options);
+    jobs.options = Tcl_GetString(options);
+    jobs.pch = s->pch;
+    n = 0;
+    for (i = 0; i < objc; i++) {
+        job = &jobs.jobs[i];
+        job->filename = Tcl_GetString(objv[i]);
+        job->compile = TccIsCFile(job->filename);
+        job->state = NULL;
+        job->result = 0;
+        Tcl_DStringInit(&job->messages);
+        n += job->compile;
+    }
+
+    /* the interpreter thread compiles too */
+    if (nb_threads > n) {
+        nb_threads = n;
+    }
+    threads = (Tcl_ThreadId *)ckalloc((nb_threads + 1) * sizeof(Tcl_ThreadId));
+    /* Tcl creates a mutex on first use: do it before the threads race */
+    Tcl_MutexLock(&jobs.mutex);
+    Tcl_MutexUnlock(&jobs.mutex);
+    for (i = 0; i < nb_threads - 1; i++) {
+        if (Tcl_CreateThread(&threads[i], TccJobsThread, &jobs,
+                TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+            break;
+        }
+    }
+    n = i;
+    TccJobsRun(&jobs);
+    for (i = 0; i < n; i++) {
+        Tcl_JoinThread(threads[i], NULL);
+    }
+    ckfree((char *)threads);
+    Tcl_MutexFinalize(&jobs.mutex);
+    Tcl_DecrRefCount(options);
+
+    for (i = 0; i < objc; i++) {
+        job = &jobs.jobs[i];
+        Tcl_AppendResult(interp, Tcl_DStringValue(&job->messages), NULL);
+        if (job->result != 0) {
+            res = TCL_ERROR;
+        }
+    }
+    /* the files loaded as they are must be there before anything is
+       added */
+    for (i = 0; i < objc && res == TCL_OK; i++) {
+        job = &jobs.jobs[i];
+        if (!job->compile) {
+            chan = Tcl_FSOpenFileChannel(NULL, objv[i], "r", 0);
+            if (chan) {
+                Tcl_Close(NULL, chan);
+            } else {
+                error_noabort(s, "file '%s' not found", job->filename);
+                res = TCL_ERROR;
+            }
+        }
+    }
+    for (i = 0; i < objc; i++) {
+        job = &jobs.jobs[i];
+        if (res == TCL_OK) {
+            if (job->compile) {
+                if (tcc_load_state(s, job->state) != 0) {
+                    res = TCL_ERROR;
+                }
+            } else if (tcc_add_file(s, job->filename) != 0) {
+                res = TCL_ERROR;
+            }
+        }
+        if (job->state) {
+            tcc_delete(job->state);
+        }
+        Tcl_DStringFree(&job->messages);
+    }
+    ckfree((char *)jobs.jobs);
+    return res;
+}
+
+static int TccRelocate(Tcl_Interp * interp, TCCState * s) {
+    if (s->relocated) {
+        return TCL_OK;
+    }
+    if (!s->cached) {
+        if (tcc_relocate(s) != 0) {
+            Tcl_AppendResult(interp, "relocating failed", NULL);
+            return TCL_ERROR;
+        }
+        if (s->cache_key[0]) {
+            TccCacheInsert(s->cache_key, s);
+        }
+    }
+    s->relocated = 1;
+    return TCL_OK;
+}
+
+static int TccGetSymbol(Tcl_Interp * interp, TCCState * s, Tcl_Obj * name, unsigned long * val) {
+    if (TccRelocate(interp, s) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (s->cached) {
+        Tcl_HashEntry * entry = Tcl_FindHashEntry(&s->cached->symbols, Tcl_GetString(name));
+        if (entry) {
+            *val = (unsigned long)Tcl_GetHashValue(entry);
+            return TCL_OK;
+        }
+    } else if (tcc_get_symbol(s, val, Tcl_GetString(name)) == 0) {
+        return TCL_OK;
+    }
+    Tcl_AppendResult(interp, "symbol '", Tcl_GetString(name), "' not found", NULL);
+    return TCL_ERROR;
+}
+
 static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj * CONST objv[]){
     unsigned long val;
     int index;
@@ -41,15 +796,17 @@ static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Ob
     Tcl_Obj * sym_addr;
 
     static CONST char *options[] = {
-        "add_include_path", "add_file",  "add_library", 
-        "add_library_path", "add_symbol", "command", "compile",
-        "define", "get_symbol", "output_file", "undefine",
+        "add_include_path", "add_file", "add_files", "add_library", 
+        "add_library_path", "add_symbol", "cache_stats", "command", "compile",
+        "define", "digest", "get_symbol", "macro_stats", "optimize", "options", "output_file", "pch", "reset", "set_flag",
+        "undefine",
        	"tclStubsPtr",    (char *) NULL
     };
     enum options {
-        TCLTCC_ADD_INCLUDE, TCLTCC_ADD_FILE, TCLTCC_ADD_LIBRARY, 
-        TCLTCC_ADD_LIBRARY_PATH, TCLTCC_ADD_SYMBOL, TCLTCC_COMMAND, TCLTCC_COMPILE,
-        TCLTCC_DEFINE, TCLTCC_GET_SYMBOL, TCLTCC_OUTPUT_FILE, TCLTCC_UNDEFINE,
+        TCLTCC_ADD_INCLUDE, TCLTCC_ADD_FILE, TCLTCC_ADD_FILES, TCLTCC_ADD_LIBRARY, 
+        TCLTCC_ADD_LIBRARY_PATH, TCLTCC_ADD_SYMBOL, TCLTCC_CACHE_STATS, TCLTCC_COMMAND, TCLTCC_COMPILE,
+        TCLTCC_DEFINE, TCLTCC_DIGEST, TCLTCC_GET_SYMBOL, TCLTCC_MACRO_STATS, TCLTCC_OPTIMIZE, TCLTCC_OPTIONS, TCLTCC_OUTPUT_FILE, TCLTCC_PCH, TCLTCC_RESET, TCLTCC_SET_FLAG,
+        TCLTCC_UNDEFINE,
 	TCLTCC_STUBS_PTR
     };
 
@@ -69,6 +826,9 @@ static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Ob
                 Tcl_WrongNumArgs(interp, 2, objv, "path");
                 return TCL_ERROR;
             } else {
+                if (TccRecordOption(interp, s, objc, objv) != TCL_OK) {
+                    return TCL_ERROR;
+                }
                 tcc_add_include_path(s, Tcl_GetString(objv[2]));
                 return TCL_OK;
             }
@@ -77,17 +837,37 @@ static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Ob
                 Tcl_WrongNumArgs(interp, 2, objv, "filename");
                 return TCL_ERROR;
             } else {
+                if (TccCacheDetach(interp, s) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                s->nb_compiled++;
                 if(tcc_add_file(s, Tcl_GetString(objv[2]))!=0) {
                     return TCL_ERROR;
                 } else {
                     return TCL_OK;
                 }
             }
+        case TCLTCC_ADD_FILES:
+            if (objc < 3 || (objc < 5 && !strcmp(Tcl_GetString(objv[2]), "-jobs"))) {
+                Tcl_WrongNumArgs(interp, 2, objv, "?-jobs n? filename ?filename ...?");
+                return TCL_ERROR;
+            }
+            if (objc >= 5 && !strcmp(Tcl_GetString(objv[2]), "-jobs")) {
+                int jobs;
+                if (Tcl_GetIntFromObj(interp, objv[3], &jobs) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                return TccAddFiles(interp, s, jobs, objc - 4, objv + 4);
+            }
+            return TccAddFiles(interp, s, 1, objc - 2, objv + 2);
         case TCLTCC_ADD_LIBRARY:
             if (objc != 3) {
                 Tcl_WrongNumArgs(interp, 2, objv, "lib");
                 return TCL_ERROR;
             } else {
+                if (TccRecordOption(interp, s, objc, objv) != TCL_OK) {
+                    return TCL_ERROR;
+                }
                 tcc_add_library(s, Tcl_GetString(objv[2]));
                 return TCL_OK;
             }
@@ -96,6 +876,9 @@ static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Ob
                 Tcl_WrongNumArgs(interp, 2, objv, "path");
                 return TCL_ERROR;
             } else {
+                if (TccRecordOption(interp, s, objc, objv) != TCL_OK) {
+                    return TCL_ERROR;
+                }
                 tcc_add_library_path(s, Tcl_GetString(objv[2]));
                 return TCL_OK;
             }
@@ -105,25 +888,26 @@ static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Ob
                 return TCL_ERROR;
             }
             Tcl_GetLongFromObj(interp,objv[3], &val);
+            if (TccRecordOption(interp, s, objc, objv) != TCL_OK) {
+                return TCL_ERROR;
+            }
             tcc_add_symbol(s,Tcl_GetString(objv[2]),val); 
             return TCL_OK; 
+        case TCLTCC_CACHE_STATS:
+            if (objc != 2) {
+                Tcl_WrongNumArgs(interp, 2, objv, NULL);
+                return TCL_ERROR;
+            }
+            Tcl_SetObjResult(interp, TccCacheStats());
+            return TCL_OK;
         case TCLTCC_COMMAND:
             if (objc != 4) {
                 Tcl_WrongNumArgs(interp, 2, objv, "tclname cname");
                 return TCL_ERROR;
             }
-            if (!s->relocated) {     
-                if(tcc_relocate(s)!=0) {
-                    Tcl_AppendResult(interp, "relocating failed", NULL);
-                    return TCL_ERROR;
-                } else {
-                    s->relocated=1;
-                }
+            if (TccGetSymbol(interp, s, objv[3], &val) != TCL_OK) {
+                return TCL_ERROR;
             }
-            if (tcc_get_symbol(s,&val,Tcl_GetString(objv[3]))!=0) {
-		    Tcl_AppendResult(interp, "symbol '", Tcl_GetString(objv[3]),"' not found", NULL);
-		    return TCL_ERROR;
-	    }
 
             /*printf("symbol: %x\n",val); */
             Tcl_CreateObjCommand(interp,Tcl_GetString(objv[2]),(void *)val,NULL,NULL);
@@ -139,9 +923,25 @@ static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Ob
             } else {
 
                 int i;
-                Tcl_GetString(objv[2]);
-                i = tcc_compile_string(s,Tcl_GetString(objv[2]));
+                if (s->output_type == TCC_OUTPUT_MEMORY && s->nb_compiled == 0 &&
+                    s->compile_cache) {
+                    /* the first code compiled by a memory handle may be in
+                       the compile cache */
+                    TccCodeDigest(s, objv[2], s->cache_key);
+                    s->cached = TccCacheLookup(s->cache_key);
+                    if (s->cached) {
+                        s->cached_code = objv[2];
+                        Tcl_IncrRefCount(s->cached_code);
+                        s->nb_compiled++;
+                        return TCL_OK;
+                    }
+                } else if (TccCacheDetach(interp, s) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                s->nb_compiled++;
+                i = TccCompileObj(s, objv[2]);
                 if (i!=0) {
+                    s->cache_key[0] = '\0';
                     Tcl_AppendResult(interp,"compilation failed",NULL);
                     return TCL_ERROR;
                 } else {
@@ -153,28 +953,61 @@ static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Ob
                 Tcl_WrongNumArgs(interp, 2, objv, "symbol value");
                 return TCL_ERROR;
             }
+            if (TccRecordOption(interp, s, objc, objv) != TCL_OK) {
+                return TCL_ERROR;
+            }
             tcc_define_symbol(s,Tcl_GetString(objv[2]),Tcl_GetString(objv[3]));
             return TCL_OK;
+        case TCLTCC_DIGEST:
+            if (objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "ccode");
+                return TCL_ERROR;
+            } else {
+                char hex[33];
+                TccCodeDigest(s, objv[2], hex);
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(hex, 32));
+                return TCL_OK;
+            }
         case TCLTCC_GET_SYMBOL:
             if (objc != 3) {
                 Tcl_WrongNumArgs(interp, 2, objv, "symbol");
                 return TCL_ERROR;
             }
-            if (!s->relocated) {     
-                if(tcc_relocate(s)!=0) {
-                    Tcl_AppendResult(interp, "relocating failed", NULL);
-                    return TCL_ERROR;
-                } else {
-                    s->relocated=1;
-                }
-            }
-            if(tcc_get_symbol(s,&val,Tcl_GetString(objv[2]))!=0) {
-                Tcl_AppendResult(interp, "symbol '", Tcl_GetString(objv[2]),"' not found", NULL);
+            if (TccGetSymbol(interp, s, objv[2], &val) != TCL_OK) {
                 return TCL_ERROR;
             }
             sym_addr = Tcl_NewLongObj(val);
             Tcl_SetObjResult(interp, sym_addr);
             return TCL_OK; 
+        case TCLTCC_MACRO_STATS:
+            if (objc != 2) {
+                Tcl_WrongNumArgs(interp, 2, objv, NULL);
+                return TCL_ERROR;
+            }
+            Tcl_SetObjResult(interp, TccMacroStats(s));
+            return TCL_OK;
+        case TCLTCC_OPTIMIZE:
+            if (objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "level");
+                return TCL_ERROR;
+            } else {
+                int level;
+                if (Tcl_GetIntFromObj(interp, objv[2], &level) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (TccRecordOption(interp, s, objc, objv) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                tcc_set_optimize(s, level);
+                return TCL_OK;
+            }
+        case TCLTCC_OPTIONS:
+            if (objc != 2) {
+                Tcl_WrongNumArgs(interp, 2, objv, NULL);
+                return TCL_ERROR;
+            }
+            Tcl_SetObjResult(interp, Tcl_DuplicateObj(s->options));
+            return TCL_OK;
         case TCLTCC_OUTPUT_FILE:
             if (objc != 3) {
                 Tcl_WrongNumArgs(interp, 2, objv, "filename");
@@ -189,7 +1022,11 @@ static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Ob
                 return TCL_ERROR;
             }
 #ifdef WIN32
-            res = tcc_output_pe(s,Tcl_GetString(objv[2]));
+            /* objects are always ELF, they can be loaded by add_file */
+            if (s->output_type == TCC_OUTPUT_OBJ)
+                res = tcc_output_file(s,Tcl_GetString(objv[2]));
+            else
+                res = tcc_output_pe(s,Tcl_GetString(objv[2]));
 #else
             res = tcc_output_file(s,Tcl_GetString(objv[2]));
 #endif
@@ -200,11 +1037,57 @@ static int TccHandleCmd ( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Ob
             } else {
                 return TCL_OK;
             }
+        case TCLTCC_PCH:
+            if (objc < 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "create name ccode | use name");
+                return TCL_ERROR;
+            }
+            if (!strcmp(Tcl_GetString(objv[2]), "create") && objc == 5) {
+                return TccPchCreate(interp, s, objv[3], objv[4]);
+            }
+            if (!strcmp(Tcl_GetString(objv[2]), "use") && objc == 4) {
+                if (TccPchUse(interp, s, objv[3]) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                return TccRecordOption(interp, s, objc, objv);
+            }
+            Tcl_WrongNumArgs(interp, 2, objv, "create name ccode | use name");
+            return TCL_ERROR;
+        case TCLTCC_RESET:
+            if (objc != 2) {
+                Tcl_WrongNumArgs(interp, 2, objv, NULL);
+                return TCL_ERROR;
+            }
+            return TccReset(interp, s);
+        case TCLTCC_SET_FLAG:
+            if (objc != 4) {
+                Tcl_WrongNumArgs(interp, 2, objv, "flag value");
+                return TCL_ERROR;
+            } else {
+                int flag, n;
+                if (Tcl_GetBooleanFromObj(interp, objv[3], &flag) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (TccRecordOption(interp, s, objc, objv) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                if (tcc_set_flag(s, Tcl_GetString(objv[2]), flag) != 0) {
+                    Tcl_ListObjLength(NULL, s->options, &n);
+                    Tcl_ListObjReplace(NULL, s->options, n - 1, 1, 0, NULL);
+                    Tcl_AppendResult(interp, "unknown flag \"",
+                                     Tcl_GetString(objv[2]), "\"", NULL);
+                    return TCL_ERROR;
+                }
+                return TCL_OK;
+            }
         case TCLTCC_UNDEFINE:
             if (objc != 3) {
                 Tcl_WrongNumArgs(interp, 2, objv, "symbol");
                 return TCL_ERROR;
             }
+            if (TccRecordOption(interp, s, objc, objv) != TCL_OK) {
+                return TCL_ERROR;
+            }
             tcc_undefine_symbol(s,Tcl_GetString(objv[2]));
             return TCL_OK;
 	case TCLTCC_STUBS_PTR:
@@ -241,6 +1124,8 @@ static int TccCreateCmd( ClientData cdata, Tcl_Interp *interp, int objc, Tcl_Obj
     s = tcc_new(objv[1]);
     tcc_set_error_func(s, interp, (void *)&TccErrorFunc);
     s->relocated = 0;
+    s->options = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(s->options);
     /*printf("type: %d\n", index); */
     tcc_set_output_type(s,index);
     Tcl_CreateObjCommand(interp,Tcl_GetString(objv[objc-1]),TccHandleCmd,s,TccCCommandDeleteProc);
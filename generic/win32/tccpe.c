@@ -373,8 +373,6 @@ struct pe_info {
 
 void error_noabort(TCCState *st, const char *, ...);
 
-ST char pe_type;
-
 #define PE_NUL 0
 #define PE_DLL 1
 #define PE_GUI 2
@@ -398,9 +396,6 @@ ST int pe_find_import(TCCState * s1, const char *symbol, char *ret)
 }
 
 #ifdef WIN32
-ST void **pe_imp;
-ST int nb_pe_imp;
-
 void *resolve_sym(struct TCCState *s1, const char *symbol, int type)
 {
     char buffer[100], *p = buffer;
@@ -421,8 +416,8 @@ void *resolve_sym(struct TCCState *s1, const char *symbol, int type)
             a = GetProcAddress(hm, buffer);
             if (a && STT_OBJECT == type) {
                 /* need to return a pointer to the address for data objects */
-                dynarray_add(s1, &pe_imp, &nb_pe_imp, a);
-                a = &pe_imp[nb_pe_imp - 1];
+                dynarray_add(s1, &s1->pe_imp, &s1->nb_pe_imp, a);
+                a = &s1->pe_imp[s1->nb_pe_imp - 1];
             }
         }
     }
@@ -431,9 +426,9 @@ void *resolve_sym(struct TCCState *s1, const char *symbol, int type)
 #endif
 
 #define for_sym_in_symtab(sym) \
-for (sym = (Elf32_Sym *)symtab_section->data + 1; \
-	 sym < (Elf32_Sym *)(symtab_section->data + \
-		symtab_section->data_offset); \
+for (sym = (Elf32_Sym *)st->symtab_section->data + 1; \
+	 sym < (Elf32_Sym *)(st->symtab_section->data + \
+		st->symtab_section->data_offset); \
 	 ++sym)
 
 #define pe_set_datadir(dir,addr,size) \
@@ -602,9 +597,9 @@ ST int pe_write_pe(TCCState * st, struct pe_info *pe)
     pe_file_hdr.NumberOfSections = sec_index;
     pe_opt_hdr.SizeOfHeaders = pe->sizeofheaders;
     pe_opt_hdr.ImageBase = pe->imagebase;
-    if (PE_DLL == pe_type)
+    if (PE_DLL == st->pe_type)
 	pe_file_hdr.Characteristics = 0x230E;
-    else if (PE_GUI != pe_type)
+    else if (PE_GUI != st->pe_type)
 	pe_opt_hdr.Subsystem = 3;
 
     fseek(op, SEEK_SET, 0);
@@ -708,7 +703,7 @@ ST void pe_build_imports(TCCState *st, struct pe_info *pe)
 
 		if (offset & 0x80000000) {	/* ref to data */
 		    Elf32_Sym *sym =
-			&((Elf32_Sym *) symtab_section->
+			&((Elf32_Sym *) st->symtab_section->
 			  data)[offset & 0x7FFFFFFF];
 		    sym->st_value = thk_ptr;
 		    sym->st_shndx = pe->thunk->sh_num;
@@ -717,11 +712,11 @@ ST void pe_build_imports(TCCState *st, struct pe_info *pe)
 		    char buffer[100];
 		    sprintf(buffer, "IAT.%s", name);
 		    sym_index =
-			put_elf_sym(st, symtab_section, thk_ptr, sizeof(DWORD),
+			put_elf_sym(st, st->symtab_section, thk_ptr, sizeof(DWORD),
 				    ELF32_ST_INFO(STB_GLOBAL, STT_OBJECT),
 				    0, pe->thunk->sh_num, buffer);
 
-		    put_elf_reloc(st, symtab_section, text_section, offset, R_386_32,	/*R_JMP_SLOT, */
+		    put_elf_reloc(st, st->symtab_section, st->text_section, offset, R_386_32,	/*R_JMP_SLOT, */
 				  sym_index);
 		}
 		v = pe->thunk->data_offset + voffset;
@@ -742,15 +737,29 @@ ST void pe_build_imports(TCCState *st, struct pe_info *pe)
 }
 
 /* ------------------------------------------------------------- */
-ST int sym_cmp(const void *va, const void *vb)
+ST int sym_cmp(TCCState *st, int a, int b)
 {
-    Elf32_Sym *sa = (Elf32_Sym *)symtab_section->data + *(int*)va;
-    Elf32_Sym *sb = (Elf32_Sym *)symtab_section->data + *(int*)vb;
-    const char *ca = symtab_section->link->data + sa->st_name;
-    const char *cb = symtab_section->link->data + sb->st_name;
+    Elf32_Sym *sa = (Elf32_Sym *)st->symtab_section->data + a;
+    Elf32_Sym *sb = (Elf32_Sym *)st->symtab_section->data + b;
+    const char *ca = st->symtab_section->link->data + sa->st_name;
+    const char *cb = st->symtab_section->link->data + sb->st_name;
     return strcmp(ca, cb);
 }
 
+/* qsort() has no context argument, so sort the (few) exported symbol
+   indexes by hand */
+ST void sym_sort(TCCState *st, int *sorted, int n)
+{
+    int i, j, v;
+
+    for (i = 1; i < n; ++i) {
+        v = sorted[i];
+        for (j = i; j > 0 && sym_cmp(st, sorted[j - 1], v) > 0; --j)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = v;
+    }
+}
+
 ST void pe_build_exports(TCCState *st, struct pe_info *pe)
 {
     Elf32_Sym *sym;
@@ -765,7 +774,7 @@ ST void pe_build_exports(TCCState *st, struct pe_info *pe)
     for_sym_in_symtab(sym)
     {
         if ((sym->st_other & 1)
-            && sym->st_shndx == text_section->sh_num)
+            && sym->st_shndx == st->text_section->sh_num)
             dynarray_add(st, (void***)&sorted, &sym_count, (void*)n);
         ++n;
     }
@@ -773,7 +782,7 @@ ST void pe_build_exports(TCCState *st, struct pe_info *pe)
     if (0 == sym_count)
 	return;
 
-    qsort (sorted, sym_count, sizeof sorted[0], sym_cmp);
+    sym_sort(st, sorted, sym_count);
     pe_align_section(st, pe->thunk, 16);
 
     pe->exp_offs = pe->thunk->data_offset;
@@ -796,8 +805,8 @@ ST void pe_build_exports(TCCState *st, struct pe_info *pe)
     for (ord = 0; ord < sym_count; ++ord)
     {
         char *name; DWORD *p, *pfunc, *pname; WORD *pord;
-        sym = (Elf32_Sym *)symtab_section->data + sorted[ord];
-        name = symtab_section->link->data + sym->st_name;
+        sym = (Elf32_Sym *)st->symtab_section->data + sorted[ord];
+        name = st->symtab_section->link->data + sym->st_name;
         p = (DWORD*)(pe->thunk->data + func_offset);
         pfunc = p + ord;
         pname = p + sym_count + ord;
@@ -873,10 +882,10 @@ ST int pe_assign_addresses(TCCState *st, struct pe_info *pe)
     int section_order[pe_sec_number];
     struct section_info *si_data = NULL;
 
-    pe->imagebase = PE_DLL == pe_type ? 0x10000000 : 0x00400000;
+    pe->imagebase = PE_DLL == st->pe_type ? 0x10000000 : 0x00400000;
     addr = pe->imagebase + 1;
 
-    if (PE_DLL == pe_type)
+    if (PE_DLL == st->pe_type)
 	pe->reloc = new_section(pe->s1, ".reloc", SHT_DYNAMIC, SHF_ALLOC);
 
     for (n = k = 0; n < pe_sec_number; ++n) {
@@ -931,29 +940,29 @@ ST int pe_check_symbols(TCCState *st, struct pe_info *pe)
     Elf32_Sym *sym;
     int ret = 0;
 
-    pe_align_section(st, text_section, 8);
+    pe_align_section(st, st->text_section, 8);
 
     for_sym_in_symtab(sym) {
 	if (sym->st_shndx == SHN_UNDEF) {
-	    const char *symbol = symtab_section->link->data + sym->st_name;
+	    const char *symbol = st->symtab_section->link->data + sym->st_name;
 	    unsigned type = ELF32_ST_TYPE(sym->st_info);
 	    int sym_index = pe_find_import(pe->s1, symbol, NULL);
 	    if (sym_index) {
 		if (type == STT_FUNC) {
-		    unsigned long offset = text_section->data_offset;
+		    unsigned long offset = st->text_section->data_offset;
 		    if (pe_add_import(st, pe, sym_index, offset + 2)) {
 			/* add the 'jmp IAT[x]' instruction */
-			*(WORD *) section_ptr_add(st, text_section, 8) =
+			*(WORD *) section_ptr_add(st, st->text_section, 8) =
 			    0x25FF;
 			/* patch the symbol */
-			sym->st_shndx = text_section->sh_num;
+			sym->st_shndx = st->text_section->sh_num;
 			sym->st_value = offset;
 			continue;
 		    }
 		} else if (type == STT_OBJECT) {	/* data, ptr to that should be */
 		    if (pe_add_import(st, pe, sym_index,
 				      (sym -
-				      (Elf32_Sym *) symtab_section->data) | 
+				      (Elf32_Sym *) st->symtab_section->data) | 
                                       0x80000000))
 			continue;
 		}
@@ -1105,7 +1114,7 @@ int pe_load_def_file(TCCState * st, Tcl_Channel fp)
                         return -1;
                     while (is_space(st, *p))
                         p++;
-                    pstrcpy(st, dllname, sizeof(dllname), p);
+                    pstrcpy(dllname, sizeof(dllname), p);
                     ++f;
                     continue;
 
@@ -1131,7 +1140,7 @@ int pe_load_def_file(TCCState * st, Tcl_Channel fp)
                             0, 0, ELF32_ST_INFO(STB_GLOBAL,
                                 STT_FUNC),
                             st->nb_loaded_dlls - 1,
-                            text_section->sh_num, p);
+                            st->text_section->sh_num, p);
                     continue;
             }
     }
@@ -1162,25 +1171,25 @@ unsigned long pe_add_runtime(TCCState * st)
     const char *start_symbol;
     unsigned long addr;
 
-    if (find_elf_sym(symtab_section, "WinMain"))
-	pe_type = PE_GUI;
+    if (find_elf_sym(st->symtab_section, "WinMain"))
+	st->pe_type = PE_GUI;
     else
     if (TCC_OUTPUT_DLL == st->output_type)
     {
-        pe_type = PE_DLL;
+        st->pe_type = PE_DLL;
         /* need this for 'tccelf.c:relocate_section()' */
         st->output_type = TCC_OUTPUT_EXE;
     }
 
     start_symbol =
 	TCC_OUTPUT_MEMORY == st->output_type
-	? PE_GUI == pe_type ? "_runwinmain" : NULL
-	: PE_DLL == pe_type ? "_dllstart"
-	: PE_GUI == pe_type ? "_winstart" : "_start";
+	? PE_GUI == st->pe_type ? "_runwinmain" : NULL
+	: PE_DLL == st->pe_type ? "_dllstart"
+	: PE_GUI == st->pe_type ? "_winstart" : "_start";
 
     /* grab the startup code from libtcc1 */
     if (start_symbol)
-	add_elf_sym(st, symtab_section,
+	add_elf_sym(st, st->symtab_section,
 		    0, 0,
 		    ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
 		    SHN_UNDEF, start_symbol);
@@ -1188,7 +1197,7 @@ unsigned long pe_add_runtime(TCCState * st)
     if (0 == st->nostdlib) {
 	tcc_add_library(st, "tcc1");
 	tcc_add_library(st, "msvcrt");
-	if (PE_DLL == pe_type || PE_GUI == pe_type) {
+	if (PE_DLL == st->pe_type || PE_GUI == st->pe_type) {
 	    tcc_add_library(st, "kernel32");
 	    tcc_add_library(st, "user32");
 	    tcc_add_library(st, "gdi32");
@@ -1200,10 +1209,10 @@ unsigned long pe_add_runtime(TCCState * st)
 
     if (st->output_type == TCC_OUTPUT_MEMORY && addr) {
 	/* for -run GUI's, put '_runwinmain' instead of 'main' */
-	add_elf_sym(st, symtab_section,
+	add_elf_sym(st, st->symtab_section,
 		    addr, 0,
 		    ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0,
-		    text_section->sh_num, "main");
+		    st->text_section->sh_num, "main");
 
 	/* FreeConsole(); */
     }
@@ -1220,7 +1229,7 @@ int tcc_output_pe(TCCState * s1, const char *filename)
     pe.s1 = s1;
     pe.start_addr = pe_add_runtime(s1);
 
-    relocate_common_syms();	/* assign bss adresses */
+    relocate_common_syms(s1);	/* assign bss adresses */
     ret = pe_check_symbols(s1, &pe);
     if (0 == ret) {
 	pe_assign_addresses(s1, &pe);
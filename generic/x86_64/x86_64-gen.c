@@ -0,0 +1,1776 @@
+/*
+ *  x86-64 code generator for TCC
+ *
+ *  Copyright (c) 2001-2004 Fabrice Bellard
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* number of available registers */
+#define NB_REGS             25
+
+/* a register can belong to several classes. The classes must be
+   sorted from more general to more precise (see gv2() code which does
+   assumptions on it). */
+#define RC_INT     0x0001 /* generic integer register */
+#define RC_FLOAT   0x0002 /* generic float register */
+#define RC_RAX     0x0004
+#define RC_RCX     0x0008
+#define RC_RDX     0x0010
+#define RC_RSI     0x0020
+#define RC_RDI     0x0040
+#define RC_R8      0x0080
+#define RC_R9      0x0100
+#define RC_R10     0x0200
+#define RC_R11     0x0400
+#define RC_XMM0    0x0800
+#define RC_XMM1    0x1000
+#define RC_XMM2    0x2000
+#define RC_XMM3    0x4000
+#define RC_XMM4    0x8000
+#define RC_XMM5    0x10000
+#define RC_XMM6    0x20000
+#define RC_XMM7    0x40000
+#define RC_ST0     0x80000 /* long double register */
+#define RC_IRET    RC_RAX /* function return: integer register */
+#define RC_LRET    RC_RDX /* function return: second integer register */
+#define RC_FRET    RC_XMM0 /* function return: float register */
+
+/* pretty names for the registers. The integer registers use their
+   hardware numbers. */
+enum {
+    TREG_RAX = 0,
+    TREG_RCX = 1,
+    TREG_RDX = 2,
+    TREG_RSI = 6,
+    TREG_RDI = 7,
+    TREG_R8 = 8,
+    TREG_R9 = 9,
+    TREG_R10 = 10,
+    TREG_R11 = 11,
+    TREG_XMM0 = 16,
+    TREG_XMM7 = 23,
+    TREG_ST0 = 24,
+};
+
+/* r11 is not allocatable: it is the scratch register used to reach
+   the GOT and for indirect calls */
+int reg_classes[NB_REGS] = {
+    /* rax */ RC_INT | RC_RAX,
+    /* rcx */ RC_INT | RC_RCX,
+    /* rdx */ RC_INT | RC_RDX,
+    0,
+    0,
+    0,
+    /* rsi */ RC_INT | RC_RSI,
+    /* rdi */ RC_INT | RC_RDI,
+    /* r8 */  RC_INT | RC_R8,
+    /* r9 */  RC_INT | RC_R9,
+    /* r10 */ RC_INT | RC_R10,
+    /* r11 */ RC_R11,
+    0,
+    0,
+    0,
+    0,
+    /* xmm0 */ RC_FLOAT | RC_XMM0,
+    /* xmm1 */ RC_FLOAT | RC_XMM1,
+    /* xmm2 */ RC_FLOAT | RC_XMM2,
+    /* xmm3 */ RC_FLOAT | RC_XMM3,
+    /* xmm4 */ RC_FLOAT | RC_XMM4,
+    /* xmm5 */ RC_FLOAT | RC_XMM5,
+    /* xmm6 */ RC_FLOAT | RC_XMM6,
+    /* xmm7 */ RC_FLOAT | RC_XMM7,
+    /* st0 */  RC_ST0,
+};
+
+/* return registers for function */
+#define REG_IRET TREG_RAX /* single word int return register */
+#define REG_LRET TREG_RDX /* second word return register (for long long) */
+#define REG_FRET TREG_XMM0 /* float return register */
+
+/* defined if structures are passed as pointers. Otherwise structures
+   are directly pushed on stack. */
+/*#define FUNC_STRUCT_PARAM_AS_PTR */
+
+/* pointer size, in bytes */
+#define PTR_SIZE 8
+
+/* long double size and alignment, in bytes */
+#define LDOUBLE_SIZE  16
+#define LDOUBLE_ALIGN 16
+/* maximum alignment (for aligned attribute support) */
+#define MAX_ALIGN     16
+
+/******************************************************/
+/* ELF defines */
+
+#define EM_TCC_TARGET EM_X86_64
+
+/* relocation type for 32 bit data relocation */
+#define R_DATA_32   R_X86_64_32
+#define R_DATA_PTR  R_X86_64_64
+#define R_JMP_SLOT  R_X86_64_JUMP_SLOT
+#define R_COPY      R_X86_64_COPY
+
+#define ELF_START_ADDR 0x400000
+#define ELF_PAGE_SIZE  0x1000
+
+/******************************************************/
+
+/* XXX: make it faster ? */
+void g(TCCState *st, int c)
+{
+    int ind1;
+
+    if (!st->cur_text_section) return;
+    ind1 = st->ind + 1;
+    if (ind1 > st->cur_text_section->data_allocated)
+        section_realloc(st, st->cur_text_section, ind1);
+    st->cur_text_section->data[st->ind] = c;
+    st->ind = ind1;
+}
+
+void o(TCCState *st, unsigned int c)
+{
+    while (c) {
+        g(st, c);
+        c = c >> 8;
+    }
+}
+
+void gen_le32(TCCState *st, int c)
+{
+    g(st,c);
+    g(st,c >> 8);
+    g(st,c >> 16);
+    g(st,c >> 24);
+}
+
+static void gen_le64(TCCState *st, long long c)
+{
+    gen_le32(st, (int)c);
+    gen_le32(st, (int)(c >> 32));
+}
+
+/* output a symbol and patch all calls to it */
+void gsym_addr(TCCState *st, int t, int a)
+{
+    int n, *ptr;
+    if (!st->cur_text_section) return;
+    while (t) {
+        ptr = (int *)(st->cur_text_section->data + t);
+        n = *ptr; /* next value */
+        *ptr = a - t - 4;
+        t = n;
+    }
+}
+
+void gsym(TCCState *st, int t)
+{
+    gsym_addr(st, t, st->ind);
+}
+
+/* psym is used to put an instruction with a data field which is a
+   reference to a symbol. It is in fact the same as oad ! */
+#define psym oad
+
+/* instruction + 4 bytes data. Return the address of the data */
+static int oad(TCCState *st, int c, int s)
+{
+    int ind1;
+
+    if (!st->cur_text_section) return 0;
+    o(st, c);
+    ind1 = st->ind + 4;
+    if (ind1 > st->cur_text_section->data_allocated)
+        section_realloc(st, st->cur_text_section, ind1);
+    *(int *)(st->cur_text_section->data + st->ind) = s;
+    s = st->ind;
+    st->ind = ind1;
+    return s;
+}
+
+/* patch the 8 bit jump displacement at 'p' to the current position */
+static void gsym_rel8(TCCState *st, int p)
+{
+    if (st->cur_text_section)
+        st->cur_text_section->data[p] = st->ind - p - 1;
+}
+
+/* return true if 'r' is one of r8-r15 */
+static int is_ext_reg(int r)
+{
+    r &= VT_VALMASK;
+    return r >= 8 && r < 16;
+}
+
+/* return true if values of type 't' use full 64 bit registers */
+static int is_64bit(int t)
+{
+    t &= VT_BTYPE;
+    return t == VT_LLONG || t == VT_PTR || t == VT_FUNC;
+}
+
+/* output the REX prefix needed by the opcode 'b' (then output) for
+   the registers 'r' (modrm reg field) and 'm' (modrm r/m field or
+   register in opcode). 'll' is 1 for a 64 bit operation, 2 for an
+   operation on a byte register. */
+static void orex(TCCState *st, int ll, int r, int m, int b)
+{
+    int rex;
+
+    rex = 0;
+    if (ll == 1)
+        rex |= 0x48;
+    if (is_ext_reg(r))
+        rex |= 0x44;
+    if (is_ext_reg(m))
+        rex |= 0x41;
+    /* spl, bpl, sil and dil are only reachable with a REX prefix */
+    if (ll == 2 && (((r & VT_VALMASK) >= 4 && (r & VT_VALMASK) < 8) ||
+                    ((m & VT_VALMASK) >= 4 && (m & VT_VALMASK) < 8)))
+        rex |= 0x40;
+    if (rex)
+        g(st, rex);
+    o(st, b);
+}
+
+/* load the address of the global symbol 'sym' from the GOT */
+static void gen_got_load(TCCState *st, int r, Sym *sym)
+{
+    orex(st, 1, r, 0, 0x8b); /* mov xxx@GOTPCREL(%rip), r */
+    g(st, 0x05 | ((r & 7) << 3));
+    greloc(st, st->cur_text_section, sym, st->ind, R_X86_64_REX_GOTPCRELX);
+    gen_le32(st, -4);
+}
+
+/* generate the instruction 'opc', preceded by the prefix 'pfx' if not
+   zero, with a modrm reference to the memory 'r' at offset 'c'. 'll'
+   is as for orex() and 'op_reg' contains the register or the
+   additionnal 3 opcode bits. The non static symbols are reached
+   through the GOT, with r11 as base register. No immediate may follow
+   the modrm reference (%rip relative addressing). */
+static void gen_modrm(TCCState *st, int pfx, int ll, int opc, int op_reg,
+                      int r, Sym *sym, long long c)
+{
+    int v;
+
+    v = r & VT_VALMASK;
+    if (v == VT_CONST && (r & VT_SYM) && !(sym->type.t & VT_STATIC)) {
+        gen_got_load(st, TREG_R11, sym);
+        v = TREG_R11;
+    } else if (v == VT_CONST && !(r & VT_SYM) && c != (int)c) {
+        orex(st, 1, 0, TREG_R11, 0xb8 + (TREG_R11 & 7)); /* movabs $xx, %r11 */
+        gen_le64(st, c);
+        v = TREG_R11;
+        c = 0;
+    }
+    if (pfx)
+        g(st, pfx);
+    orex(st, ll, op_reg, v, opc);
+    op_reg = (op_reg & 7) << 3;
+    if (v == VT_CONST) {
+        if (r & VT_SYM) {
+            /* %rip relative reference */
+            g(st, 0x05 | op_reg);
+            greloc(st, st->cur_text_section, sym, st->ind, R_X86_64_PC32);
+            gen_le32(st, c - 4);
+        } else {
+            /* absolute address */
+            g(st, 0x04 | op_reg);
+            g(st, 0x25);
+            gen_le32(st, c);
+        }
+    } else if (v == VT_LOCAL) {
+        /* currently, we use only rbp as base */
+        if (c == (char)c) {
+            /* short reference */
+            g(st, 0x45 | op_reg);
+            g(st, c);
+        } else {
+            g(st, 0x85 | op_reg);
+            gen_le32(st, c);
+        }
+    } else if (c == 0) {
+        g(st, op_reg | (v & 7));
+    } else if (c == (char)c) {
+        g(st, 0x40 | op_reg | (v & 7));
+        g(st, c);
+    } else {
+        g(st, 0x80 | op_reg | (v & 7));
+        gen_le32(st, c);
+    }
+}
+
+/* generate the instruction 'opc' with a reference to 'c'(%rsp) */
+static void gen_modrm_rsp(TCCState *st, int pfx, int ll, int opc,
+                          int op_reg, int c)
+{
+    if (pfx)
+        g(st, pfx);
+    orex(st, ll, op_reg, 0, opc);
+    g(st, 0x84 | ((op_reg & 7) << 3));
+    g(st, 0x24);
+    gen_le32(st, c);
+}
+
+/* return the memory offset of the lvalue 'sv' for gen_modrm() */
+static long long lvalue_offset(SValue *sv)
+{
+    int v;
+
+    v = sv->r & VT_VALMASK;
+    if (v == VT_CONST && !(sv->r & VT_SYM))
+        return sv->c.ll;
+    if (v < VT_CONST)
+        return 0; /* the register holds the address */
+    return sv->c.i;
+}
+
+/* load 'r' from value 'sv' */
+void load(TCCState *st, int r, SValue *sv)
+{
+    int v, t, ft, fr, ll;
+    long long fc;
+    SValue v1;
+
+    fr = sv->r;
+    ft = sv->type.t;
+    ll = is_64bit(ft);
+
+    v = fr & VT_VALMASK;
+    if (fr & VT_LVAL) {
+        fc = lvalue_offset(sv);
+        if (v == VT_LLOCAL) {
+            v1.type.t = VT_PTR;
+            v1.r = VT_LOCAL | VT_LVAL;
+            v1.c.i = sv->c.i;
+            fr = r;
+            if (r >= TREG_XMM0)
+                fr = TREG_R11;
+            load(st, fr, &v1);
+            fc = 0;
+        }
+        if ((ft & VT_BTYPE) == VT_FLOAT) {
+            gen_modrm(st, 0xf3, 0, 0x100f, r, fr, sv->sym, fc); /* movss */
+        } else if ((ft & VT_BTYPE) == VT_DOUBLE) {
+            gen_modrm(st, 0xf2, 0, 0x100f, r, fr, sv->sym, fc); /* movsd */
+        } else if ((ft & VT_BTYPE) == VT_LDOUBLE) {
+            gen_modrm(st, 0, 0, 0xdb, 5, fr, sv->sym, fc); /* fldt */
+        } else if ((ft & VT_TYPE) == VT_BYTE) {
+            gen_modrm(st, 0, 0, 0xbe0f, r, fr, sv->sym, fc); /* movsbl */
+        } else if ((ft & VT_TYPE) == (VT_BYTE | VT_UNSIGNED)) {
+            gen_modrm(st, 0, 0, 0xb60f, r, fr, sv->sym, fc); /* movzbl */
+        } else if ((ft & VT_TYPE) == VT_SHORT) {
+            gen_modrm(st, 0, 0, 0xbf0f, r, fr, sv->sym, fc); /* movswl */
+        } else if ((ft & VT_TYPE) == (VT_SHORT | VT_UNSIGNED)) {
+            gen_modrm(st, 0, 0, 0xb70f, r, fr, sv->sym, fc); /* movzwl */
+        } else {
+            gen_modrm(st, 0, ll, 0x8b, r, fr, sv->sym, fc); /* mov */
+        }
+    } else {
+        if (v == VT_CONST) {
+            if (fr & VT_SYM) {
+                if (sv->sym->type.t & VT_STATIC) {
+                    /* lea xxx(%rip), r */
+                    gen_modrm(st, 0, 1, 0x8d, r, fr, sv->sym, sv->c.i);
+                } else {
+                    gen_got_load(st, r, sv->sym);
+                    if (sv->c.i) {
+                        orex(st, 1, 0, r, 0x81); /* add $xxx, r */
+                        oad(st, 0xc0 | (r & 7), sv->c.i);
+                    }
+                }
+            } else if (ll && sv->c.ll != (int)sv->c.ll) {
+                orex(st, 1, 0, r, 0xb8 + (r & 7)); /* movabs $xx, r */
+                gen_le64(st, sv->c.ll);
+            } else if (ll) {
+                orex(st, 1, 0, r, 0xc7); /* mov $xx, r (sign extended) */
+                oad(st, 0xc0 | (r & 7), sv->c.i);
+            } else {
+                orex(st, 0, 0, r, 0xb8 + (r & 7)); /* mov $xx, r */
+                gen_le32(st, sv->c.i);
+            }
+        } else if (v == VT_LOCAL) {
+            st->func_addr_taken = 1;
+            /* lea xxx(%rbp), r */
+            gen_modrm(st, 0, 1, 0x8d, r, VT_LOCAL, NULL, sv->c.i);
+        } else if (v == VT_CMP) {
+            orex(st, 0, 0, r, 0xb8 + (r & 7)); /* mov $0, r */
+            gen_le32(st, 0);
+            orex(st, 2, 0, r, 0x0f); /* setxx %br */
+            o(st, sv->c.i);
+            o(st, 0xc0 + (r & 7));
+        } else if (v == VT_JMP || v == VT_JMPI) {
+            t = v & 1;
+            orex(st, 0, 0, r, 0xb8 + (r & 7)); /* mov $1, r */
+            gen_le32(st, t);
+            g(st, 0xeb); /* jmp after */
+            g(st, is_ext_reg(r) ? 6 : 5);
+            gsym(st, sv->c.i);
+            orex(st, 0, 0, r, 0xb8 + (r & 7)); /* mov $0, r */
+            gen_le32(st, t ^ 1);
+        } else if (v != r) {
+            if (r >= TREG_XMM0) {
+                o(st, 0x280f); /* movaps v, r */
+                o(st, 0xc0 + (v & 7) + (r & 7) * 8);
+            } else {
+                orex(st, 1, v, r, 0x89); /* mov v, r */
+                o(st, 0xc0 + (r & 7) + (v & 7) * 8);
+            }
+        }
+    }
+}
+
+/* store register 'r' in lvalue 'v' */
+void store(TCCState *st, int r, SValue *v)
+{
+    int fr, bt, ft;
+    long long fc;
+
+    ft = v->type.t;
+    fr = v->r & VT_VALMASK;
+    bt = ft & VT_BTYPE;
+    if (fr == VT_CONST ||
+        fr == VT_LOCAL ||
+        (v->r & VT_LVAL)) {
+        fc = lvalue_offset(v);
+        if (bt == VT_FLOAT) {
+            gen_modrm(st, 0xf3, 0, 0x110f, r, v->r, v->sym, fc); /* movss */
+        } else if (bt == VT_DOUBLE) {
+            gen_modrm(st, 0xf2, 0, 0x110f, r, v->r, v->sym, fc); /* movsd */
+        } else if (bt == VT_LDOUBLE) {
+            o(st, 0xc0d9); /* fld %st(0) */
+            gen_modrm(st, 0, 0, 0xdb, 7, v->r, v->sym, fc); /* fstpt */
+        } else if (bt == VT_SHORT) {
+            gen_modrm(st, 0x66, 0, 0x89, r, v->r, v->sym, fc);
+        } else if (bt == VT_BYTE || bt == VT_BOOL) {
+            gen_modrm(st, 0, 2, 0x88, r, v->r, v->sym, fc);
+        } else {
+            gen_modrm(st, 0, is_64bit(ft), 0x89, r, v->r, v->sym, fc);
+        }
+    } else if (fr != r) {
+        if (r >= TREG_XMM0) {
+            o(st, 0x280f); /* movaps r, fr */
+            o(st, 0xc0 + (r & 7) + (fr & 7) * 8);
+        } else {
+            orex(st, 1, r, fr, 0x89); /* mov r, fr */
+            o(st, 0xc0 + (fr & 7) + (r & 7) * 8);
+        }
+    }
+}
+
+/* store the 'size' low bytes of the integer register 'r' at
+   'c'(%rbp). 'r' is clobbered. */
+static void gen_store_bytes(TCCState *st, int r, int c, int size)
+{
+    if (size >= 8) {
+        gen_modrm(st, 0, 1, 0x89, r, VT_LOCAL, NULL, c);
+        return;
+    }
+    if (size & 4) {
+        gen_modrm(st, 0, 0, 0x89, r, VT_LOCAL, NULL, c);
+        orex(st, 1, 0, r, 0xc1); /* shr $32, r */
+        o(st, 0xe8 + (r & 7));
+        g(st, 32);
+        c += 4;
+    }
+    if (size & 2) {
+        gen_modrm(st, 0x66, 0, 0x89, r, VT_LOCAL, NULL, c);
+        orex(st, 0, 0, r, 0xc1); /* shr $16, r */
+        o(st, 0xe8 + (r & 7));
+        g(st, 16);
+        c += 2;
+    }
+    if (size & 1)
+        gen_modrm(st, 0, 2, 0x88, r, VT_LOCAL, NULL, c);
+}
+
+static void gadd_sp(TCCState *st, int val)
+{
+    if (val == (char)val) {
+        o(st, 0xc48348);
+        g(st, val);
+    } else {
+        oad(st, 0xc48148, val); /* add $xxx, %rsp */
+    }
+}
+
+/* 'is_jmp' is '1' if it is a jump */
+static void gcall_or_jmp(TCCState *st, int is_jmp)
+{
+    int r;
+    if ((st->vtop->r & (VT_VALMASK | VT_LVAL)) == VT_CONST &&
+        (st->vtop->r & VT_SYM)) {
+        /* relocation case */
+        greloc(st, st->cur_text_section, st->vtop->sym,
+               st->ind + 1, R_X86_64_PLT32);
+        oad(st, 0xe8 + is_jmp, st->vtop->c.i - 4); /* call/jmp im */
+    } else {
+        /* otherwise, indirect call through r11 which never holds
+           arguments */
+        r = gv(st, RC_R11);
+        orex(st, 0, 0, r, 0xff); /* call/jmp *r */
+        o(st, 0xd0 + (r & 7) + (is_jmp << 4));
+    }
+}
+
+/* argument classes of the System V ABI */
+#define X86_64_NONE    0
+#define X86_64_INTEGER 1
+#define X86_64_SSE     2
+#define X86_64_MEMORY  3
+
+/* size of the register save area of the variadic functions */
+#define REG_SAVE_AREA_SIZE (6 * 8 + 8 * 16)
+
+static uint8_t arg_regs[6] = {
+    TREG_RDI, TREG_RSI, TREG_RDX, TREG_RCX, TREG_R8, TREG_R9
+};
+
+/* merge the class 'c' of a scalar into the class 'cls' of an
+   eightbyte */
+static int merge_class(int cls, int c)
+{
+    if (cls == c || cls == X86_64_NONE)
+        return c;
+    if (cls == X86_64_MEMORY || c == X86_64_MEMORY)
+        return X86_64_MEMORY;
+    return X86_64_INTEGER;
+}
+
+/* classify the scalars of 'type' at 'offset' in the eightbyte classes
+   'cls' */
+static void classify_fields(TCCState *st, CType *type, int offset,
+                            int *cls)
+{
+    int size, align, i;
+    Sym *s;
+
+    if ((type->t & VT_BTYPE) == VT_STRUCT) {
+        for(s = type->ref->next; s != NULL; s = s->next)
+            classify_fields(st, &s->type, offset + s->c, cls);
+    } else if (type->t & VT_ARRAY) {
+        size = type_size(st, &type->ref->type, &align);
+        for(i = 0; i < type->ref->c && offset + i * size < 16; i++)
+            classify_fields(st, &type->ref->type, offset + i * size, cls);
+    } else {
+        size = type_size(st, type, &align);
+        if ((type->t & VT_BTYPE) == VT_LDOUBLE || (offset & (align - 1)))
+            cls[offset >> 3] = X86_64_MEMORY;
+        else if (is_float(st, type->t))
+            cls[offset >> 3] = merge_class(cls[offset >> 3], X86_64_SSE);
+        else
+            cls[offset >> 3] = merge_class(cls[offset >> 3], X86_64_INTEGER);
+    }
+}
+
+/* return the number of eightbytes (at most 2) of a value of type
+   'type' passed in registers and set their classes in 'cls'. Return
+   zero if the value is passed in memory. */
+static int classify_arg(TCCState *st, CType *type, int *cls)
+{
+    int size, align, n, i;
+
+    cls[0] = cls[1] = X86_64_NONE;
+    if ((type->t & VT_BTYPE) == VT_STRUCT) {
+        size = type_size(st, type, &align);
+        if (size <= 0 || size > 16)
+            return 0;
+        classify_fields(st, type, 0, cls);
+        n = (size + 7) >> 3;
+        for(i = 0; i < n; i++) {
+            if (cls[i] == X86_64_MEMORY)
+                return 0;
+            if (cls[i] == X86_64_NONE)
+                cls[i] = X86_64_INTEGER;
+        }
+        return n;
+    }
+    if ((type->t & VT_BTYPE) == VT_LDOUBLE)
+        return 0;
+    cls[0] = is_float(st, type->t) ? X86_64_SSE : X86_64_INTEGER;
+    return 1;
+}
+
+/* return the number of eightbytes of class 'c' in the 'n' first
+   classes of 'cls' */
+static int count_class(int *cls, int n, int c)
+{
+    int i, count;
+
+    count = 0;
+    for(i = 0; i < n; i++) {
+        if (cls[i] == c)
+            count++;
+    }
+    return count;
+}
+
+/* return the type class used by va_arg() for 'type': 0 for the integer
+   registers, 1 for the SSE registers and 2 for memory */
+int gen_va_arg_class(TCCState *st, CType *type)
+{
+    int cls[2], n;
+
+    n = classify_arg(st, type, cls);
+    if (n == 0)
+        return 2;
+    if (count_class(cls, n, X86_64_SSE) == n)
+        return 1;
+    return 0;
+}
+
+/* generate the call of the function below the 'nb_args' parameters
+   on top of the value stack and pop them all. If 'is_jmp', the frame
+   is released and the function jumped to, which is only possible, and
+   only done, if no parameter is passed on the stack and no structure
+   returned: return 0 without generating the call otherwise. */
+static int gen_call(TCCState *st, int nb_args, int is_jmp)
+{
+    int size, align, r, args_size, i, k, n, nb_int, nb_sse, nb_moved;
+    int first, ret_nb, bt, cls[2], ret_cls[2];
+    int arg_nb[VSTACK_SIZE], arg_offset[VSTACK_SIZE];
+    uint8_t arg_reg[VSTACK_SIZE][2];
+    SValue *args, v1;
+    Sym *func_sym;
+    TailCall *t;
+
+    /* the flags do not survive the argument moves */
+    r = st->vtop->r & VT_VALMASK;
+    if (nb_args && (r == VT_CMP || (r & ~1) == VT_JMP))
+        gv(st, RC_INT);
+
+    args = st->vtop - nb_args + 1;
+    func_sym = args[-1].type.ref;
+    /* a structure returned in registers has no implicit pointer
+       argument: it is copied from the registers after the call */
+    first = 0;
+    ret_nb = 0;
+    if ((func_sym->type.t & VT_BTYPE) == VT_STRUCT) {
+        ret_nb = classify_arg(st, &func_sym->type, ret_cls);
+        if (ret_nb)
+            first = 1;
+    }
+
+    /* assign the registers and the stack slots */
+    nb_int = 0;
+    nb_sse = 0;
+    args_size = 0;
+    for(i = first; i < nb_args; i++) {
+        n = classify_arg(st, &args[i].type, cls);
+        if (n && nb_int + count_class(cls, n, X86_64_INTEGER) <= 6 &&
+            nb_sse + count_class(cls, n, X86_64_SSE) <= 8) {
+            for(k = 0; k < n; k++) {
+                if (cls[k] == X86_64_SSE)
+                    arg_reg[i][k] = TREG_XMM0 + nb_sse++;
+                else
+                    arg_reg[i][k] = arg_regs[nb_int++];
+            }
+        } else {
+            n = 0;
+            size = type_size(st, &args[i].type, &align);
+            if (align > 8)
+                args_size = (args_size + 15) & -16;
+            arg_offset[i] = args_size;
+            args_size += (size + 7) & -8;
+        }
+        arg_nb[i] = n;
+    }
+    args_size = (args_size + 15) & -16;
+    if (is_jmp && (args_size || (func_sym->type.t & VT_BTYPE) == VT_STRUCT))
+        return 0;
+    if (args_size)
+        oad(st, 0xec8148, args_size); /* sub $xxx, %rsp */
+
+    /* store the memory arguments, and copy the structures passed in
+       registers to memory they can be loaded from */
+    for(i = first; i < nb_args; i++) {
+        bt = args[i].type.t & VT_BTYPE;
+        if (arg_nb[i] == 0) {
+            vpushv(st, &args[i]);
+            if (bt == VT_STRUCT) {
+                r = get_reg(st, RC_INT);
+                orex(st, 1, r, 0, 0x8d); /* lea xxx(%rsp), r */
+                o(st, 0x2484 + ((r & 7) << 3));
+                gen_le32(st, arg_offset[i]);
+                vset(st, &args[i].type, r | VT_LVAL, 0);
+                vswap(st);
+                vstore(st);
+            } else if (bt == VT_LDOUBLE) {
+                gv(st, RC_ST0);
+                gen_modrm_rsp(st, 0, 0, 0xdb, 7, arg_offset[i]); /* fstpt */
+            } else if (bt == VT_FLOAT) {
+                r = gv(st, RC_FLOAT);
+                gen_modrm_rsp(st, 0xf3, 0, 0x110f, r, arg_offset[i]);
+            } else if (bt == VT_DOUBLE) {
+                r = gv(st, RC_FLOAT);
+                gen_modrm_rsp(st, 0xf2, 0, 0x110f, r, arg_offset[i]);
+            } else {
+                r = gv(st, RC_INT);
+                gen_modrm_rsp(st, 0, 1, 0x89, r, arg_offset[i]);
+            }
+            st->vtop--;
+            args[i].r = VT_CONST;
+        } else if (bt == VT_STRUCT) {
+            r = args[i].r & VT_VALMASK;
+            if (!(args[i].r & VT_LVAL) || (r != VT_LOCAL && r != VT_CONST)) {
+                st->loc = (st->loc - 16) & -16;
+                vset(st, &args[i].type, VT_LOCAL | VT_LVAL, st->loc);
+                vpushv(st, &args[i]);
+                vstore(st);
+                st->vtop--;
+                args[i].r = VT_LOCAL | VT_LVAL;
+                args[i].c.ul = st->loc;
+            }
+        }
+    }
+    save_regs(st, nb_args + 1); /* save used temporary registers */
+
+    /* move the scalar arguments to their registers. Loading one may
+       spill another one, so iterate until all are in place */
+    do {
+        nb_moved = 0;
+        for(i = first; i < nb_args; i++) {
+            if (arg_nb[i] == 0 || (args[i].type.t & VT_BTYPE) == VT_STRUCT)
+                continue;
+            r = arg_reg[i][0];
+            if (args[i].r != r) {
+                vpushv(st, &args[i]);
+                gv(st, reg_classes[r] & ~(RC_INT | RC_FLOAT));
+                args[i] = *st->vtop;
+                st->vtop--;
+                nb_moved++;
+            }
+        }
+    } while (nb_moved);
+
+    /* then the eightbytes of the structures */
+    for(i = first; i < nb_args; i++) {
+        if (arg_nb[i] == 0 || (args[i].type.t & VT_BTYPE) != VT_STRUCT)
+            continue;
+        size = type_size(st, &args[i].type, &align);
+        for(k = 0; k < arg_nb[i]; k++) {
+            v1 = args[i];
+            v1.c.ll = args[i].c.ll + 8 * k;
+            n = size - 8 * k;
+            if (arg_reg[i][k] >= TREG_XMM0)
+                v1.type.t = n > 4 ? VT_DOUBLE : VT_FLOAT;
+            else if (n > 4)
+                v1.type.t = VT_LLONG;
+            else if (n > 2)
+                v1.type.t = VT_INT;
+            else if (n == 2)
+                v1.type.t = VT_SHORT | VT_UNSIGNED;
+            else
+                v1.type.t = VT_BYTE | VT_UNSIGNED;
+            load(st, arg_reg[i][k], &v1);
+        }
+    }
+
+    st->vtop = args - 1;
+    if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) != (VT_CONST | VT_SYM))
+        gv(st, RC_R11);
+    /* %al holds the number of vector registers for the variadic
+       functions */
+    if (func_sym->c != FUNC_NEW)
+        oad(st, 0xb8, nb_sse); /* mov $xxx, %eax */
+    if (is_jmp) {
+        if ((st->nb_func_tail_calls & (st->nb_func_tail_calls - 1)) == 0)
+            st->func_tail_calls = arena_realloc(st, st->func_tail_calls,
+                                                st->nb_func_tail_calls * sizeof(TailCall),
+                                                (st->nb_func_tail_calls ? st->nb_func_tail_calls * 2 : 1) *
+                                                sizeof(TailCall));
+        t = &st->func_tail_calls[st->nb_func_tail_calls++];
+        t->start = st->ind;
+        o(st, 0xc9); /* leave */
+        t->jump = st->ind;
+        gcall_or_jmp(st, 1);
+        st->vtop--;
+        return 1;
+    }
+    gcall_or_jmp(st, 0);
+    if (args_size)
+        gadd_sp(st, args_size);
+
+    if (ret_nb) {
+        /* store the structure returned in registers */
+        size = type_size(st, &func_sym->type, &align);
+        nb_int = 0;
+        nb_sse = 0;
+        for(k = 0; k < ret_nb; k++) {
+            n = size - 8 * k;
+            if (ret_cls[k] == X86_64_SSE) {
+                gen_modrm(st, n > 4 ? 0xf2 : 0xf3, 0, 0x110f,
+                          TREG_XMM0 + nb_sse++, VT_LOCAL, NULL,
+                          args[0].c.i + 8 * k);
+            } else {
+                gen_store_bytes(st, nb_int++ ? TREG_RDX : TREG_RAX,
+                                args[0].c.i + 8 * k, n);
+            }
+        }
+    }
+    st->vtop--;
+    return 1;
+}
+
+/* Generate function call. The function address is pushed first, then
+   all the parameters in call order. This functions pops all the
+   parameters and the function address. */
+void gfunc_call(TCCState *st, int nb_args)
+{
+    gen_call(st, nb_args, 0);
+}
+
+/* Generate a function call in tail position as a jump, the frame of
+   the current function being released first. Return 0 without
+   generating any code if it is not possible. */
+int gfunc_tail_call(TCCState *st, int nb_args)
+{
+    return gen_call(st, nb_args, 1);
+}
+
+/* once the function is compiled, call the function of the tail call
+   't' instead of jumping to it if the frame may still be in use. The
+   value it returns then goes to the epilog through the code of the
+   'return' after the jump. */
+static void gtail_call_end(TCCState *st, TailCall *t)
+{
+    unsigned char *p;
+
+    if (!st->func_addr_taken)
+        return;
+    p = st->cur_text_section->data;
+    p[t->start] = 0x90; /* nop instead of leave */
+    p += t->jump;
+    if ((*p & 0xf0) == 0x40)
+        p++; /* rex prefix */
+    if (*p == 0xe9)
+        *p = 0xe8; /* call im */
+    else
+        p[1] ^= 0x30; /* call *r */
+}
+
+#define FUNC_PROLOG_SIZE 11
+
+/* generate function prolog of type 't' */
+void gfunc_prolog(TCCState *st, CType *func_type)
+{
+    int addr, align, size, n, k, nb_int, nb_sse, param_addr;
+    int cls[2];
+    Sym *sym;
+    CType *type;
+
+    sym = func_type->ref;
+    addr = 16;
+    st->loc = 0;
+    nb_int = 0;
+    nb_sse = 0;
+
+    st->ind += FUNC_PROLOG_SIZE;
+    st->func_sub_sp_offset = st->ind;
+    if (sym->c == FUNC_ELLIPSIS) {
+        /* save all the argument registers for va_arg() */
+        st->loc -= REG_SAVE_AREA_SIZE;
+        for(k = 0; k < 6; k++)
+            gen_modrm(st, 0, 1, 0x89, arg_regs[k], VT_LOCAL, NULL,
+                      st->loc + k * 8);
+        for(k = 0; k < 8; k++)
+            gen_modrm(st, 0, 0, 0x290f, k, VT_LOCAL, NULL,
+                      st->loc + 48 + k * 16); /* movaps */
+    }
+    /* if the function returns a structure, then add an
+       implicit pointer parameter, or point it to a local buffer
+       copied to the registers by the epilog */
+    st->func_vt = sym->type;
+    if ((st->func_vt.t & VT_BTYPE) == VT_STRUCT) {
+        if (classify_arg(st, &st->func_vt, cls) == 0) {
+            st->loc -= 8;
+            gen_modrm(st, 0, 1, 0x89, arg_regs[nb_int++], VT_LOCAL, NULL,
+                      st->loc);
+        } else {
+            st->loc = (st->loc - 16) & -16;
+            gen_modrm(st, 0, 1, 0x8d, TREG_RAX, VT_LOCAL, NULL, st->loc);
+            st->loc -= 8;
+            gen_modrm(st, 0, 1, 0x89, TREG_RAX, VT_LOCAL, NULL, st->loc);
+        }
+        st->func_vc = st->loc;
+    }
+    /* define parameters */
+    while ((sym = sym->next) != NULL) {
+        type = &sym->type;
+        size = type_size(st, type, &align);
+        n = classify_arg(st, type, cls);
+        if (n && nb_int + count_class(cls, n, X86_64_INTEGER) <= 6 &&
+            nb_sse + count_class(cls, n, X86_64_SSE) <= 8) {
+            /* save the registers */
+            st->loc = (st->loc - n * 8) & -(n * 8);
+            param_addr = st->loc;
+            for(k = 0; k < n; k++) {
+                if (cls[k] == X86_64_SSE)
+                    gen_modrm(st, 0xf2, 0, 0x110f, nb_sse++, VT_LOCAL, NULL,
+                              param_addr + k * 8); /* movsd */
+                else
+                    gen_modrm(st, 0, 1, 0x89, arg_regs[nb_int++], VT_LOCAL,
+                              NULL, param_addr + k * 8);
+            }
+        } else {
+            if (align > 8)
+                addr = (addr + 15) & -16;
+            param_addr = addr;
+            addr += (size + 7) & -8;
+        }
+        sym_push(st, sym->v & ~SYM_FIELD, type,
+                 VT_LOCAL | VT_LVAL, param_addr);
+    }
+    st->func_va_gp_offset = nb_int * 8;
+    st->func_va_fp_offset = 48 + nb_sse * 16;
+    st->func_va_overflow = addr;
+    st->func_ret_sub = 0;
+    st->func_tail_calls = NULL;
+    st->nb_func_tail_calls = 0;
+}
+
+/* generate function epilog */
+void gfunc_epilog(TCCState *st)
+{
+    int v, saved_ind, n, k, nb_int, nb_sse, i;
+    int cls[2];
+
+    for(i = 0; i < st->nb_func_tail_calls; i++)
+        gtail_call_end(st, &st->func_tail_calls[i]);
+
+    if ((st->func_vt.t & VT_BTYPE) == VT_STRUCT) {
+        n = classify_arg(st, &st->func_vt, cls);
+        if (n == 0) {
+            /* return the address of the structure */
+            gen_modrm(st, 0, 1, 0x8b, TREG_RAX, VT_LOCAL, NULL, st->func_vc);
+        } else {
+            /* load the structure in the return registers */
+            gen_modrm(st, 0, 1, 0x8b, TREG_R11, VT_LOCAL, NULL, st->func_vc);
+            nb_int = 0;
+            nb_sse = 0;
+            for(k = 0; k < n; k++) {
+                if (cls[k] == X86_64_SSE)
+                    gen_modrm(st, 0xf2, 0, 0x100f, TREG_XMM0 + nb_sse++,
+                              TREG_R11, NULL, k * 8); /* movsd */
+                else
+                    gen_modrm(st, 0, 1, 0x8b, nb_int++ ? TREG_RDX : TREG_RAX,
+                              TREG_R11, NULL, k * 8);
+            }
+        }
+    }
+    o(st, 0xc9); /* leave */
+    o(st, 0xc3); /* ret */
+    /* align local size to 16 bytes & save local variables */
+    v = (-st->loc + 15) & -16;
+    saved_ind = st->ind;
+    st->ind = st->func_sub_sp_offset - FUNC_PROLOG_SIZE;
+    o(st, 0xe5894855);  /* push %rbp, mov %rsp, %rbp */
+    o(st, 0xec8148);  /* sub rsp, stacksize */
+    gen_le32(st, v);
+    st->ind = saved_ind;
+}
+
+/* generate a jump to a label */
+int gjmp(TCCState *st, int t)
+{
+    return psym(st, 0xe9, t);
+}
+
+/* generate a jump to a fixed address */
+void gjmp_addr(TCCState *st, int a)
+{
+    int r;
+    r = a - st->ind - 2;
+    if (r == (char)r) {
+        g(st, 0xeb);
+        g(st, r);
+    } else {
+        oad(st, 0xe9, a - st->ind - 5);
+    }
+}
+
+/* generate a test. set 'inv' to invert test. Stack entry is popped */
+int gtst(TCCState *st, int inv, int t)
+{
+    int v, *p;
+
+    v = st->vtop->r & VT_VALMASK;
+    if (v == VT_CMP) {
+        /* fast case : can jump directly since flags are set */
+        g(st, 0x0f);
+        t = psym(st, (st->vtop->c.i - 16) ^ inv, t);
+    } else if (v == VT_JMP || v == VT_JMPI) {
+        /* && or || optimization */
+        if ((v & 1) == inv) {
+            /* insert vtop->c jump list in t */
+            p = &st->vtop->c.i;
+            while (*p != 0)
+                p = (int *)(st->cur_text_section->data + *p);
+            *p = t;
+            t = st->vtop->c.i;
+        } else {
+            t = gjmp(st, t);
+            gsym(st, st->vtop->c.i);
+        }
+    } else {
+        if (is_float(st, st->vtop->type.t)) {
+            /* compare != 0 to get a 32-bit int for testing */
+            vpushi(st, 0);
+            gen_op(st, TOK_NE);
+        }
+        if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+            /* constant jmp optimization */
+            if (is_64bit(st->vtop->type.t))
+                v = st->vtop->c.ll != 0;
+            else
+                v = st->vtop->c.i != 0;
+            if (v != inv)
+                t = gjmp(st,t);
+        } else {
+            v = gv(st, RC_INT);
+            orex(st, is_64bit(st->vtop->type.t), v, v, 0x85);
+            o(st, 0xc0 + (v & 7) * 9);
+            g(st, 0x0f);
+            t = psym(st, 0x85 ^ inv, t);
+        }
+    }
+    st->vtop--;
+    return t;
+}
+
+/* generate the division or modulo of vtop[-1] by the constant on top
+   of the stack as a multiplication by its magic number, for 32 bit
+   operands. Return 0 if it must be done by div or idiv. */
+static int gen_divc(TCCState *st, int op)
+{
+    unsigned int d, m;
+    int s, k, is_signed, is_mod;
+
+    d = st->vtop->c.i;
+    is_signed = op != TOK_UDIV && op != TOK_UMOD;
+    is_mod = op == '%' || op == TOK_UMOD;
+    k = div_magic(d, is_signed, &m, &s);
+    if (!k)
+        return 0;
+    st->vtop--;
+    gv(st, RC_RAX);
+    save_reg(st, TREG_RDX);
+    /* the dividend is kept in %ecx if needed again */
+    if (is_mod || k == 2 || (is_signed && ((int)m ^ (int)d) < 0)) {
+        save_reg(st, TREG_RCX);
+        o(st, 0xc189); /* mov %eax, %ecx */
+    }
+    o(st, 0xba); /* mov $m, %edx */
+    gen_le32(st, m);
+    if (is_signed) {
+        o(st, 0xeaf7); /* imul %edx */
+        if (((int)m ^ (int)d) < 0)
+            o(st, (int)d < 0 ? 0xca29 : 0xca01); /* sub/add %ecx, %edx */
+        if (s) {
+            o(st, 0xfac1); /* sar $s, %edx */
+            g(st, s);
+        }
+        o(st, 0xd089); /* mov %edx, %eax */
+        o(st, 0x1fe8c1); /* shr $31, %eax */
+        o(st, 0xc201); /* add %eax, %edx */
+    } else {
+        o(st, 0xe2f7); /* mul %edx */
+        if (k == 2) {
+            o(st, 0xc889); /* mov %ecx, %eax */
+            o(st, 0xd029); /* sub %edx, %eax */
+            o(st, 0xe8d1); /* shr %eax */
+            o(st, 0xc201); /* add %eax, %edx */
+            s--;
+        }
+        if (s) {
+            o(st, 0xeac1); /* shr $s, %edx */
+            g(st, s);
+        }
+    }
+    if (is_mod) {
+        if (d == (char)d) {
+            o(st, 0xd26b); /* imul $d, %edx, %edx */
+            g(st, d);
+        } else {
+            o(st, 0xd269);
+            gen_le32(st, d);
+        }
+        o(st, 0xd129); /* sub %edx, %ecx */
+        st->vtop->r = TREG_RCX;
+    } else {
+        st->vtop->r = TREG_RDX;
+    }
+    return 1;
+}
+
+/* generate an integer binary operation */
+void gen_opi(TCCState *st, int op)
+{
+    int r, fr, opc, ll;
+    long long c;
+
+    ll = is_64bit(st->vtop[-1].type.t);
+    switch(op) {
+    case '+':
+    case TOK_ADDC1: /* add with carry generation */
+        opc = 0;
+    gen_op8:
+        ll |= is_64bit(st->vtop->type.t);
+        c = is_64bit(st->vtop->type.t) ? st->vtop->c.ll : st->vtop->c.i;
+        if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST &&
+            c == (int)c) {
+            /* constant case */
+            vswap(st);
+            r = gv(st, RC_INT);
+            vswap(st);
+            if (c == (char)c) {
+                /* XXX: generate inc and dec for smaller code ? */
+                orex(st, ll, 0, r, 0x83);
+                o(st, 0xc0 | (opc << 3) | (r & 7));
+                g(st, c);
+            } else {
+                orex(st, ll, 0, r, 0x81);
+                oad(st, 0xc0 | (opc << 3) | (r & 7), c);
+            }
+        } else {
+            gv2(st, RC_INT, RC_INT);
+            r = st->vtop[-1].r;
+            fr = st->vtop[0].r;
+            orex(st, ll, fr, r, (opc << 3) | 0x01);
+            o(st, 0xc0 + (r & 7) + (fr & 7) * 8);
+        }
+        st->vtop--;
+        if (op >= TOK_ULT && op <= TOK_GT) {
+            st->vtop->r = VT_CMP;
+            st->vtop->c.i = op;
+        }
+        break;
+    case '-':
+    case TOK_SUBC1: /* sub with carry generation */
+        opc = 5;
+        goto gen_op8;
+    case TOK_ADDC2: /* add with carry use */
+        opc = 2;
+        goto gen_op8;
+    case TOK_SUBC2: /* sub with carry use */
+        opc = 3;
+        goto gen_op8;
+    case '&':
+        opc = 4;
+        goto gen_op8;
+    case '^':
+        opc = 6;
+        goto gen_op8;
+    case '|':
+        opc = 1;
+        goto gen_op8;
+    case '*':
+        ll |= is_64bit(st->vtop->type.t);
+        gv2(st, RC_INT, RC_INT);
+        r = st->vtop[-1].r;
+        fr = st->vtop[0].r;
+        st->vtop--;
+        orex(st, ll, r, fr, 0xaf0f); /* imul fr, r */
+        o(st, 0xc0 + (fr & 7) + (r & 7) * 8);
+        break;
+    case TOK_SHL:
+        opc = 4;
+        goto gen_shift;
+    case TOK_SHR:
+        opc = 5;
+        goto gen_shift;
+    case TOK_SAR:
+        opc = 7;
+    gen_shift:
+        opc = 0xc0 | (opc << 3);
+        if ((st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST) {
+            /* constant case */
+            vswap(st);
+            r = gv(st, RC_INT);
+            vswap(st);
+            orex(st, ll, 0, r, 0xc1); /* shl/shr/sar $xxx, r */
+            o(st, opc | (r & 7));
+            g(st, st->vtop->c.i & (ll ? 0x3f : 0x1f));
+        } else {
+            /* we generate the shift in rcx */
+            gv2(st, RC_INT, RC_RCX);
+            r = st->vtop[-1].r;
+            orex(st, ll, 0, r, 0xd3); /* shl/shr/sar %cl, r */
+            o(st, opc | (r & 7));
+        }
+        st->vtop--;
+        break;
+    case '/':
+    case TOK_UDIV:
+    case TOK_PDIV:
+    case '%':
+    case TOK_UMOD:
+        ll |= is_64bit(st->vtop->type.t);
+        if (!ll && (st->vtop->r & (VT_VALMASK | VT_LVAL | VT_SYM)) == VT_CONST &&
+            gen_divc(st, op))
+            break;
+        /* first operand must be in rax */
+        /* XXX: need better constraint for second operand */
+        gv2(st, RC_RAX, RC_RCX);
+        r = st->vtop[-1].r;
+        fr = st->vtop[0].r;
+        st->vtop--;
+        save_reg(st, TREG_RDX);
+        if (op == TOK_UDIV || op == TOK_UMOD) {
+            o(st, 0xd231); /* xor %edx, %edx */
+            orex(st, ll, 0, fr, 0xf7); /* div fr, %rax */
+            o(st, 0xf0 + (fr & 7));
+        } else {
+            if (ll)
+                o(st, 0x9948); /* cqto */
+            else
+                o(st, 0x99); /* cltd */
+            orex(st, ll, 0, fr, 0xf7); /* idiv fr, %rax */
+            o(st, 0xf8 + (fr & 7));
+        }
+        if (op == '%' || op == TOK_UMOD)
+            r = TREG_RDX;
+        else
+            r = TREG_RAX;
+        st->vtop->r = r;
+        break;
+    default:
+        opc = 7;
+        goto gen_op8;
+    }
+}
+
+/* generate a long double operation with the x87 'v = t1 op t2' */
+static void gen_opf_x87(TCCState *st, int op)
+{
+    int a, swapped;
+
+    /* convert constants to memory references */
+    if ((st->vtop[-1].r & (VT_VALMASK | VT_LVAL)) == VT_CONST) {
+        vswap(st);
+        gv(st, RC_ST0);
+        vswap(st);
+    }
+    if ((st->vtop[0].r & (VT_VALMASK | VT_LVAL)) == VT_CONST)
+        gv(st, RC_ST0);
+
+    /* must put at least one value in the floating point register */
+    if ((st->vtop[-1].r & VT_LVAL) &&
+        (st->vtop[0].r & VT_LVAL)) {
+        vswap(st);
+        gv(st, RC_ST0);
+        vswap(st);
+    }
+    swapped = 0;
+    /* swap the stack if needed so that t1 is the register and t2 is
+       the memory reference */
+    if (st->vtop[-1].r & VT_LVAL) {
+        vswap(st);
+        swapped = 1;
+    }
+    /* load on stack second operand */
+    load(st, TREG_ST0, st->vtop);
+    if (op >= TOK_ULT && op <= TOK_GT) {
+        save_reg(st, TREG_RAX); /* eax is used by FP comparison code */
+        if (op == TOK_GE || op == TOK_GT)
+            swapped = !swapped;
+        else if (op == TOK_EQ || op == TOK_NE)
+            swapped = 0;
+        if (swapped)
+            o(st, 0xc9d9); /* fxch %st(1) */
+        o(st, 0xe9da); /* fucompp */
+        o(st, 0xe0df); /* fnstsw %ax */
+        if (op == TOK_EQ) {
+            o(st, 0x45e480); /* and $0x45, %ah */
+            o(st, 0x40fC80); /* cmp $0x40, %ah */
+        } else if (op == TOK_NE) {
+            o(st, 0x45e480); /* and $0x45, %ah */
+            o(st, 0x40f480); /* xor $0x40, %ah */
+            op = TOK_NE;
+        } else if (op == TOK_GE || op == TOK_LE) {
+            o(st, 0x05c4f6); /* test $0x05, %ah */
+            op = TOK_EQ;
+        } else {
+            o(st, 0x45c4f6); /* test $0x45, %ah */
+            op = TOK_EQ;
+        }
+        st->vtop--;
+        st->vtop->r = VT_CMP;
+        st->vtop->c.i = op;
+    } else {
+        swapped = !swapped;
+        switch(op) {
+        default:
+        case '+':
+            a = 0;
+            break;
+        case '-':
+            a = 4;
+            if (swapped)
+                a++;
+            break;
+        case '*':
+            a = 1;
+            break;
+        case '/':
+            a = 6;
+            if (swapped)
+                a++;
+            break;
+        }
+        o(st, 0xde); /* fxxxp %st, %st(1) */
+        o(st, 0xc1 + (a << 3));
+        st->vtop--;
+    }
+}
+
+/* generate a floating point operation 'v = t1 op t2' instruction. The
+   two operands are guaranted to have the same floating point type */
+void gen_opf(TCCState *st, int op)
+{
+    int a, r, fr, pfx, bt;
+
+    bt = st->vtop->type.t & VT_BTYPE;
+    if (bt == VT_LDOUBLE) {
+        gen_opf_x87(st, op);
+        return;
+    }
+    pfx = bt == VT_FLOAT ? 0xf3 : 0xf2;
+    gv2(st, RC_FLOAT, RC_FLOAT);
+    r = st->vtop[-1].r;
+    fr = st->vtop[0].r;
+    if (op >= TOK_ULT && op <= TOK_GT) {
+        if (op == TOK_EQ || op == TOK_NE) {
+            /* cmpeq/cmpneq give a mask which is false when unordered
+               for TOK_EQ and true for TOK_NE */
+            g(st, pfx);
+            o(st, 0xc20f); /* cmps[sd] $xx, fr, r */
+            o(st, 0xc0 + (fr & 7) + (r & 7) * 8);
+            g(st, op == TOK_EQ ? 0 : 4);
+            if (bt == VT_DOUBLE) {
+                o(st, 0x7e0f4966); /* movq r, %r11 */
+                o(st, 0xc3 + (r & 7) * 8);
+                o(st, 0xdb854d); /* test %r11, %r11 */
+            } else {
+                o(st, 0x7e0f4166); /* movd r, %r11d */
+                o(st, 0xc3 + (r & 7) * 8);
+                o(st, 0xdb8545); /* test %r11d, %r11d */
+            }
+            op = TOK_NE;
+        } else {
+            /* 'above' conditions are false when unordered */
+            if (op == TOK_LT || op == TOK_LE) {
+                a = r;
+                r = fr;
+                fr = a;
+            }
+            if (bt == VT_DOUBLE)
+                g(st, 0x66);
+            o(st, 0x2e0f); /* ucomis[sd] fr, r */
+            o(st, 0xc0 + (fr & 7) + (r & 7) * 8);
+            if (op == TOK_LT || op == TOK_GT)
+                op = TOK_UGT;
+            else
+                op = TOK_UGE;
+        }
+        st->vtop--;
+        st->vtop->r = VT_CMP;
+        st->vtop->c.i = op;
+    } else {
+        switch(op) {
+        default:
+        case '+':
+            a = 0x58;
+            break;
+        case '-':
+            a = 0x5c;
+            break;
+        case '*':
+            a = 0x59;
+            break;
+        case '/':
+            a = 0x5e;
+            break;
+        }
+        g(st, pfx);
+        o(st, 0x0f | (a << 8)); /* adds[sd] fr, r (or sub, mul, div) */
+        o(st, 0xc0 + (fr & 7) + (r & 7) * 8);
+        st->vtop--;
+    }
+}
+
+/* convert integers to fp 't' type. Must handle 'int', 'unsigned int'
+   and 'long long' cases. */
+void gen_cvt_itof(TCCState *st, int t)
+{
+    int r, rr, bt, ll, pfx, p, p2;
+
+    bt = st->vtop->type.t & (VT_BTYPE | VT_UNSIGNED);
+    r = gv(st, RC_INT);
+    if (bt == (VT_INT | VT_UNSIGNED)) {
+        orex(st, 0, r, r, 0x89); /* mov r, r (zero extends) */
+        o(st, 0xc0 + (r & 7) * 9);
+        bt = VT_LLONG;
+    }
+    ll = (bt & VT_BTYPE) == VT_LLONG;
+    if ((t & VT_BTYPE) == VT_LDOUBLE) {
+        save_reg(st, TREG_ST0);
+        if (!ll) {
+            orex(st, 1, r, r, 0x63); /* movslq r, r */
+            o(st, 0xc0 + (r & 7) * 9);
+        }
+        orex(st, 0, 0, r, 0x50 + (r & 7)); /* push r */
+        o(st, 0x242cdf); /* fildll (%rsp) */
+        if (bt == (VT_LLONG | VT_UNSIGNED)) {
+            /* add 2^64 if the sign bit was set */
+            orex(st, 1, r, r, 0x85); /* test r, r */
+            o(st, 0xc0 + (r & 7) * 9);
+            o(st, 0x0a79); /* jns after */
+            oad(st, 0x68, 0x5f800000); /* push $2^64 (float) */
+            o(st, 0x2404d8); /* fadds (%rsp) */
+            o(st, 0x5b41); /* pop %r11 */
+        }
+        o(st, 0x5b41); /* pop %r11 */
+        st->vtop->r = TREG_ST0;
+        return;
+    }
+    rr = get_reg(st, RC_FLOAT);
+    pfx = (t & VT_BTYPE) == VT_FLOAT ? 0xf3 : 0xf2;
+    if (bt == (VT_LLONG | VT_UNSIGNED)) {
+        /* halve the values with the sign bit set, keeping the low bit
+           for the rounding, and double the result */
+        orex(st, 1, r, r, 0x85); /* test r, r */
+        o(st, 0xc0 + (r & 7) * 9);
+        g(st, 0x78); /* js 1f */
+        p = st->ind;
+        g(st, 0);
+        g(st, pfx);
+        orex(st, 1, rr, r, 0x2a0f); /* cvtsi2s[sd]q r, rr */
+        o(st, 0xc0 + (r & 7) + (rr & 7) * 8);
+        g(st, 0xeb); /* jmp 2f */
+        p2 = st->ind;
+        g(st, 0);
+        gsym_rel8(st, p);
+        orex(st, 1, r, TREG_R11, 0x89); /* 1: mov r, %r11 */
+        o(st, 0xc3 + (r & 7) * 8);
+        o(st, 0xebd149); /* shr %r11 */
+        orex(st, 1, 0, r, 0x83); /* and $1, r */
+        o(st, 0xe0 + (r & 7));
+        g(st, 1);
+        orex(st, 1, r, TREG_R11, 0x09); /* or r, %r11 */
+        o(st, 0xc3 + (r & 7) * 8);
+        g(st, pfx);
+        orex(st, 1, rr, TREG_R11, 0x2a0f); /* cvtsi2s[sd]q %r11, rr */
+        o(st, 0xc3 + (rr & 7) * 8);
+        g(st, pfx);
+        o(st, 0x580f); /* adds[sd] rr, rr */
+        o(st, 0xc0 + (rr & 7) * 9);
+        gsym_rel8(st, p2);
+    } else {
+        g(st, pfx);
+        orex(st, ll, rr, r, 0x2a0f); /* cvtsi2s[sd] r, rr */
+        o(st, 0xc0 + (r & 7) + (rr & 7) * 8);
+    }
+    st->vtop->r = rr;
+}
+
+/* convert fp to int 't' type */
+/* store %st(0) as an integer at 8(%rsp) and load it in 'r'. The control
+   word saved at (%rsp) is restored. */
+static void gen_fistpll(TCCState *st, int r)
+{
+    o(st, 0x08247cdf); /* fistpll 8(%rsp) */
+    o(st, 0x242cd9); /* fldcw (%rsp) */
+    orex(st, 1, r, 0, 0x8b); /* mov 8(%rsp), r */
+    o(st, 0x2444 + ((r & 7) << 3));
+    g(st, 8);
+}
+
+void gen_cvt_ftoi(TCCState *st, int t)
+{
+    int r, xr, bt, ll, pfx, p, p2;
+
+    bt = st->vtop->type.t & VT_BTYPE;
+    if (bt == VT_LDOUBLE) {
+        gv(st, RC_ST0);
+        r = get_reg(st, RC_INT);
+        /* truncate with the rounding mode of the control word set to
+           chop */
+        o(st, 0x10ec8348); /* sub $16, %rsp */
+        o(st, 0x243cd9); /* fnstcw (%rsp) */
+        o(st, 0x1cb70f44); /* movzwl (%rsp), %r11d */
+        g(st, 0x24);
+        o(st, 0xcb8141); /* or $0xc00, %r11d */
+        gen_le32(st, 0xc00);
+        o(st, 0x5c894466); /* mov %r11w, 2(%rsp) */
+        o(st, 0x0224);
+        o(st, 0x02246cd9); /* fldcw 2(%rsp) */
+        if (t == (VT_LLONG | VT_UNSIGNED)) {
+            /* convert the values above 2^63 after subtracting 2^63 */
+            o(st, 0xbb49); /* movabs $2^63, %r11 */
+            gen_le64(st, 0x43e0000000000000LL);
+            o(st, 0x245c894c); /* mov %r11, 8(%rsp) */
+            g(st, 8);
+            o(st, 0x082444dd); /* fldl 8(%rsp) */
+            o(st, 0xe9df); /* fucomip %st(1), %st */
+            g(st, 0x76); /* jbe 1f */
+            p = st->ind;
+            g(st, 0);
+            gen_fistpll(st, r);
+            g(st, 0xeb); /* jmp 2f */
+            p2 = st->ind;
+            g(st, 0);
+            gsym_rel8(st, p);
+            o(st, 0x082464dc); /* 1: fsubl 8(%rsp) */
+            gen_fistpll(st, r);
+            orex(st, 1, 0, r, 0xba0f); /* btc $63, r */
+            o(st, 0xf8 + (r & 7));
+            g(st, 63);
+            gsym_rel8(st, p2);
+        } else {
+            gen_fistpll(st, r);
+        }
+        o(st, 0x10c48348); /* add $16, %rsp */
+        st->vtop->r = r;
+        return;
+    }
+    pfx = bt == VT_FLOAT ? 0xf3 : 0xf2;
+    ll = (t & VT_BTYPE) == VT_LLONG || t == (VT_INT | VT_UNSIGNED);
+    xr = gv(st, RC_FLOAT);
+    r = get_reg(st, RC_INT);
+    if (t == (VT_LLONG | VT_UNSIGNED)) {
+        /* convert the values above 2^63 after subtracting 2^63 */
+        if (bt == VT_FLOAT) {
+            o(st, 0xbb41); /* mov $2^63, %r11d */
+            gen_le32(st, 0x5f000000);
+        } else {
+            o(st, 0xbb49); /* movabs $2^63, %r11 */
+            gen_le64(st, 0x43e0000000000000LL);
+        }
+        o(st, 0x5341); /* push %r11 */
+        if (bt == VT_DOUBLE)
+            g(st, 0x66);
+        o(st, 0x2e0f); /* ucomis[sd] (%rsp), xr */
+        o(st, 0x2404 + ((xr & 7) << 3));
+        g(st, 0x73); /* jae 1f */
+        p = st->ind;
+        g(st, 0);
+        g(st, pfx);
+        orex(st, 1, r, xr, 0x2c0f); /* cvtts[sd]2si xr, r */
+        o(st, 0xc0 + (xr & 7) + (r & 7) * 8);
+        g(st, 0xeb); /* jmp 2f */
+        p2 = st->ind;
+        g(st, 0);
+        gsym_rel8(st, p);
+        g(st, pfx);
+        o(st, 0x5c0f); /* 1: subs[sd] (%rsp), xr */
+        o(st, 0x2404 + ((xr & 7) << 3));
+        g(st, pfx);
+        orex(st, 1, r, xr, 0x2c0f); /* cvtts[sd]2si xr, r */
+        o(st, 0xc0 + (xr & 7) + (r & 7) * 8);
+        orex(st, 1, 0, r, 0xba0f); /* btc $63, r */
+        o(st, 0xf8 + (r & 7));
+        g(st, 63);
+        gsym_rel8(st, p2);
+        o(st, 0x5b41); /* pop %r11 */
+    } else {
+        g(st, pfx);
+        orex(st, ll, r, xr, 0x2c0f); /* cvtts[sd]2si xr, r */
+        o(st, 0xc0 + (xr & 7) + (r & 7) * 8);
+    }
+    st->vtop->r = r;
+}
+
+/* convert from one floating point type to another */
+void gen_cvt_ftof(TCCState *st, int t)
+{
+    int r, bt, pfx;
+
+    bt = st->vtop->type.t & VT_BTYPE;
+    t &= VT_BTYPE;
+    if (bt == VT_LDOUBLE) {
+        /* through memory to the SSE registers */
+        gv(st, RC_ST0);
+        r = get_reg(st, RC_FLOAT);
+        o(st, 0x08ec8348); /* sub $8, %rsp */
+        if (t == VT_FLOAT)
+            o(st, 0x241cd9); /* fstps (%rsp) */
+        else
+            o(st, 0x241cdd); /* fstpl (%rsp) */
+        g(st, t == VT_FLOAT ? 0xf3 : 0xf2);
+        o(st, 0x100f); /* movs[sd] (%rsp), r */
+        o(st, 0x2404 + ((r & 7) << 3));
+        o(st, 0x08c48348); /* add $8, %rsp */
+        st->vtop->r = r;
+    } else if (t == VT_LDOUBLE) {
+        r = gv(st, RC_FLOAT);
+        save_reg(st, TREG_ST0);
+        o(st, 0x08ec8348); /* sub $8, %rsp */
+        g(st, bt == VT_FLOAT ? 0xf3 : 0xf2);
+        o(st, 0x110f); /* movs[sd] r, (%rsp) */
+        o(st, 0x2404 + ((r & 7) << 3));
+        if (bt == VT_FLOAT)
+            o(st, 0x2404d9); /* flds (%rsp) */
+        else
+            o(st, 0x2404dd); /* fldl (%rsp) */
+        o(st, 0x08c48348); /* add $8, %rsp */
+        st->vtop->r = TREG_ST0;
+    } else {
+        r = gv(st, RC_FLOAT);
+        pfx = bt == VT_FLOAT ? 0xf3 : 0xf2;
+        g(st, pfx);
+        o(st, 0x5a0f); /* cvtss2sd or cvtsd2ss */
+        o(st, 0xc0 + (r & 7) * 9);
+    }
+}
+
+/* sign or zero extend the integer in vtop to 64 bits */
+void gen_cvt_itoll(TCCState *st)
+{
+    int r;
+
+    r = gv(st, RC_INT);
+    if (st->vtop->type.t & VT_UNSIGNED) {
+        orex(st, 0, r, r, 0x89); /* mov r, r (zero extends) */
+    } else {
+        orex(st, 1, r, r, 0x63); /* movslq r, r */
+    }
+    o(st, 0xc0 + (r & 7) * 9);
+}
+
+/* generate va_start(): initialize the va_list pointed by vtop */
+void gen_va_start(TCCState *st)
+{
+    int r;
+
+    /* the va_list points in the frame */
+    st->func_addr_taken = 1;
+    r = gv(st, RC_INT);
+    orex(st, 0, 0, r, 0xc7); /* movl $xxx, (r) */
+    g(st, 0x00 | (r & 7));
+    gen_le32(st, st->func_va_gp_offset);
+    orex(st, 0, 0, r, 0xc7); /* movl $xxx, 4(r) */
+    g(st, 0x40 | (r & 7));
+    g(st, 4);
+    gen_le32(st, st->func_va_fp_offset);
+    gen_modrm(st, 0, 1, 0x8d, TREG_R11, VT_LOCAL, NULL, st->func_va_overflow);
+    gen_modrm(st, 0, 1, 0x89, TREG_R11, r, NULL, 8);
+    gen_modrm(st, 0, 1, 0x8d, TREG_R11, VT_LOCAL, NULL, -REG_SAVE_AREA_SIZE);
+    gen_modrm(st, 0, 1, 0x89, TREG_R11, r, NULL, 16);
+    st->vtop--;
+}
+
+/* emit 'opc' with the register 'r' and the memory at offset 'c' of the
+   address 'sv', which is a local or a register */
+static void gen_mem_op(TCCState *st, int pfx, int ll, int opc, int r,
+                       SValue *sv, int c)
+{
+    if ((sv->r & VT_VALMASK) == VT_LOCAL)
+        gen_modrm(st, pfx, ll, opc, r, VT_LOCAL, NULL, sv->c.i + c);
+    else
+        gen_modrm(st, pfx, ll, opc, r, sv->r, NULL, c);
+}
+
+/* return true if the address 'sv' can be used by gen_mem_op as is */
+static int gen_mem_direct(SValue *sv)
+{
+    return (sv->r & (VT_VALMASK | VT_LVAL)) == VT_LOCAL;
+}
+
+/* move 'n' bytes, at most 16, between the register 'r', or the xmm
+   register 'x' for 16 bytes, and offset 'c' of the address 'sv' */
+static int gen_mem_move(TCCState *st, int store, int r, int x,
+                        SValue *sv, int c, int n)
+{
+    if (n >= 16) {
+        n = 16;
+        gen_mem_op(st, 0, 0, store ? 0x110f : 0x100f, x, sv, c); /* movups */
+    } else if (n >= 8) {
+        n = 8;
+        gen_mem_op(st, 0, 1, store ? 0x89 : 0x8b, r, sv, c);
+    } else if (n >= 4) {
+        n = 4;
+        gen_mem_op(st, 0, 0, store ? 0x89 : 0x8b, r, sv, c);
+    } else if (n >= 2) {
+        n = 2;
+        gen_mem_op(st, 0x66, 0, store ? 0x89 : 0x8b, r, sv, c);
+    } else {
+        n = 1;
+        gen_mem_op(st, 0, 0, store ? 0x88 : 0x8a, r, sv, c);
+    }
+    return n;
+}
+
+/* copy 'size' bytes from the address on top of the value stack to the
+   address below it with moves through r11 and an xmm register, and pop
+   both */
+void gen_memcpy(TCCState *st, int size)
+{
+    int x, n, c;
+    SValue *d, *s;
+
+    d = st->vtop - 1;
+    s = st->vtop;
+    if (!gen_mem_direct(d) && !gen_mem_direct(s)) {
+        gv2(st, RC_INT, RC_INT);
+    } else if (!gen_mem_direct(d)) {
+        vswap(st);
+        gv(st, RC_INT);
+        vswap(st);
+    } else if (!gen_mem_direct(s)) {
+        gv(st, RC_INT);
+    }
+    x = 0;
+    if (size >= 16)
+        x = get_reg(st, RC_FLOAT) - TREG_XMM0;
+    for(c = 0; c < size; c += n) {
+        n = gen_mem_move(st, 0, TREG_R11, x, s, c, size - c);
+        gen_mem_move(st, 1, TREG_R11, x, d, c, n);
+    }
+    st->vtop -= 2;
+}
+
+/* clear 'size' bytes at the address on top of the value stack with
+   stores of r11 and an xmm register set to zero, and pop it */
+void gen_memzero(TCCState *st, int size)
+{
+    int x, n, c;
+
+    if (!gen_mem_direct(st->vtop))
+        gv(st, RC_INT);
+    orex(st, 0, TREG_R11, TREG_R11, 0x31); /* xor %r11d, %r11d */
+    g(st, 0xc0 + (TREG_R11 & 7) * 9);
+    x = 0;
+    if (size >= 16) {
+        x = get_reg(st, RC_FLOAT) - TREG_XMM0;
+        o(st, 0x570f); /* xorps x, x */
+        g(st, 0xc0 + x * 9);
+    }
+    for(c = 0; c < size; c += n)
+        n = gen_mem_move(st, 1, TREG_R11, x, st->vtop, c, size - c);
+    st->vtop--;
+}
+
+/* computed goto support */
+void ggoto(TCCState *st)
+{
+    gcall_or_jmp(st, 1);
+    st->vtop--;
+}
+
+/* end of x86-64 code generator */
+/*************************************************************/
@@ -1,6 +1,51 @@
 #ifndef _STDARG_H
 #define _STDARG_H
 
+#ifdef __x86_64__
+
+/* SysV AMD64 va_list: the register save area is built by the prolog
+   of variadic functions */
+typedef struct {
+    unsigned int gp_offset;
+    unsigned int fp_offset;
+    void *overflow_arg_area;
+    void *reg_save_area;
+} __va_list_struct;
+typedef __va_list_struct va_list[1];
+
+/* 'cls' is the register class given by __builtin_va_arg_types():
+   0 for integer registers, 1 for sse registers, 2 for memory */
+static inline void *__va_arg(__va_list_struct *ap, int cls, int size, int align)
+{
+    void *p;
+
+    size = (size + 7) & ~7;
+    if (cls == 0 && ap->gp_offset + size <= 48) {
+        p = (char *)ap->reg_save_area + ap->gp_offset;
+        ap->gp_offset += size;
+        return p;
+    }
+    if (cls == 1 && ap->fp_offset + 16 <= 176) {
+        p = (char *)ap->reg_save_area + ap->fp_offset;
+        ap->fp_offset += 16;
+        return p;
+    }
+    if (align > 8)
+        ap->overflow_arg_area = (void *)
+            (((unsigned long)ap->overflow_arg_area + 15) & ~15UL);
+    p = ap->overflow_arg_area;
+    ap->overflow_arg_area = (char *)ap->overflow_arg_area + size;
+    return p;
+}
+
+#define va_start(ap,last) __builtin_va_start(ap)
+#define va_arg(ap,type) (*(type *)__va_arg(ap, __builtin_va_arg_types(type), \
+                                           sizeof(type), __alignof__(type)))
+#define va_copy(dest,src) (*(dest) = *(src))
+#define va_end(ap)
+
+#else
+
 typedef char *va_list;
 
 /* only correct for i386 */
@@ -8,6 +53,8 @@ typedef char *va_list;
 #define va_arg(ap,type) (ap += (sizeof(type)+3)&~3, *(type *)(ap - ((sizeof(type)+3)&~3)))
 #define va_end(ap)
 
+#endif
+
 /* fix a buggy dependency on GCC in libio.h */
 typedef va_list __gnuc_va_list;
 #define _VA_LIST_DEFINED
@@ -7,6 +7,7 @@ namespace eval tcc {
    variable count
    variable command_count
    variable commands
+   variable cachedir
 
    set dir [file dirname [info script]]
    switch -exact -- $::tcl_platform(platform) {
@@ -19,6 +20,7 @@ namespace eval tcc {
    set count 0
    set command_count 0
    array set commands {}
+   set cachedir ""
    proc new {} {
        variable dir
        variable count
@@ -98,7 +100,56 @@ proc ::tcc::cc {code} {
       $tcc(cc) add_library tcl8.5
   }
   Log code:$code
-  $tcc(cc) compile $code
+  variable cachedir
+  if {$cachedir eq ""} {
+      $tcc(cc) compile $code
+      return
+  }
+  # Compile to an object file named after the digest of the code, or
+  # reuse the one left by an earlier run
+  set obj [file join $cachedir [$tcc(cc) digest $code].o]
+  if {![file exists $obj]} {
+      Log "CACHE MISS $obj"
+      variable count
+      set h ::tcc::cache_[incr count]
+      tcc $tcc::dir obj $h
+      foreach opt [$tcc(cc) options] {
+          eval [list $h] $opt
+      }
+      if {[catch {$h compile $code} msg]} {
+          rename $h {}
+          return -code error $msg
+      }
+      # Write to a file no other thread or process writes to, then move
+      # it in place
+      set n 0
+      while {[catch {open $obj.[pid].$n {WRONLY CREAT EXCL}} f]} {
+          if {![file exists $obj.[pid].$n]} {
+              rename $h {}
+              return -code error $f
+          }
+          incr n
+      }
+      close $f
+      set tmp $obj.[pid].$n
+      if {[catch {$h output_file $tmp} msg]} {
+          rename $h {}
+          file delete $tmp
+          return -code error $msg
+      }
+      rename $h {}
+      file rename -force $tmp $obj
+  }
+  $tcc(cc) add_file $obj
+}
+# Set the directory holding the cache of compiled code, "" turns caching off
+proc ::tcc::cache {{dir ""}} {
+  variable cachedir
+  if {$dir ne ""} {
+      file mkdir $dir
+      set dir [file normalize $dir]
+  }
+  set cachedir $dir
 }
 #----------------------------------------------------------- New DLL API
 proc ::tcc::dll {{name ""}} {
@@ -165,7 +216,7 @@ proc ::tcc::wrap {name adefs rtype {body "#"}} {
     append code "\#include <tk.h>" "\n"
   }
   if {$body ne "#"} {
-    append code "static $rtype2" "\n"
+    append code "static inline $rtype2" "\n"
     append code "${cname}([join $cargs {, }]) \{\n"
     append code $body
     append code "\}" "\n"